@@ -0,0 +1,579 @@
+/*
+ * Copyright (C) 2014 David Milligan
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the
+ * Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include "raw.h"
+#include "mlv.h"
+#include "mlvfs.h"
+#include "wav.h"
+#include "clip.h"
+#include "catalog.h"
+
+#define CREATE_MUTEX(x) static pthread_mutex_t x = PTHREAD_MUTEX_INITIALIZER;
+#define RELOCK(x) pthread_mutex_lock(&(x));
+#define UNLOCK(x) pthread_mutex_unlock(&(x));
+
+#define CATALOG_MAGIC "MLVFSCAT"
+#define CATALOG_VERSION 2
+
+//dirty catalogs are written at most this often (in seconds), and when unmounting
+#define CATALOG_SAVE_INTERVAL 5
+
+//an entry is compared with the files on disk again once it is older than this (in seconds), like the index
+#define CATALOG_CHECK_INTERVAL 1
+
+struct catalog_entry
+{
+    char * name;
+    struct clip_info info;
+    //when the entry was last compared with the files (not saved)
+    time_t checked;
+};
+
+//the catalog of one directory
+struct clip_catalog
+{
+    struct clip_catalog * next;
+    char * dir_path;
+    uint32_t count;
+    uint32_t allocated;
+    struct catalog_entry * entries;
+    int dirty;
+    time_t saved;
+};
+
+//a catalog file as it is written: built under catalog_mutex, written without it
+struct catalog_image
+{
+    struct catalog_image * next;
+    char * dir_path;
+    uint8_t * data;
+    size_t size;
+};
+
+CREATE_MUTEX(catalog_mutex)
+//held while catalogs are written (taken before catalog_mutex), so the files are written in the order their images were made
+CREATE_MUTEX(catalog_save_mutex)
+
+static struct clip_catalog * catalogs = NULL;
+
+//Make sure you free() the result!!!
+static char * catalog_get_filename(const char * dir_path)
+{
+    char * filename = malloc(strlen(dir_path) + strlen(DIR_SEP_STR) + strlen(CATALOG_FILENAME) + 1);
+    if(filename)
+    {
+        sprintf(filename, "%s%s%s", dir_path, DIR_SEP_STR, CATALOG_FILENAME);
+    }
+    return filename;
+}
+
+static struct catalog_entry * catalog_find(struct clip_catalog * catalog, const char * name)
+{
+    for(uint32_t i = 0; i < catalog->count; i++)
+    {
+        if(!filename_strcmp(catalog->entries[i].name, name)) return &catalog->entries[i];
+    }
+    return NULL;
+}
+
+static struct catalog_entry * catalog_add(struct clip_catalog * catalog, const char * name, size_t name_length)
+{
+    if(catalog->count >= catalog->allocated)
+    {
+        uint32_t new_allocated = catalog->allocated ? catalog->allocated * 2 : 16;
+        struct catalog_entry * entries = realloc(catalog->entries, new_allocated * sizeof(struct catalog_entry));
+        if(!entries) return NULL;
+        catalog->entries = entries;
+        catalog->allocated = new_allocated;
+    }
+    char * entry_name = malloc(name_length + 1);
+    if(!entry_name) return NULL;
+    memcpy(entry_name, name, name_length);
+    entry_name[name_length] = 0;
+
+    struct catalog_entry * entry = &catalog->entries[catalog->count++];
+    memset(entry, 0, sizeof(struct catalog_entry));
+    entry->name = entry_name;
+    return entry;
+}
+
+/**
+ * Reads the catalog file of a directory, a missing or unreadable file just leaves the catalog empty
+ */
+static void catalog_load(struct clip_catalog * catalog)
+{
+    char * filename = catalog_get_filename(catalog->dir_path);
+    if(!filename) return;
+
+    FILE * in_file = fopen(filename, "rb");
+    free(filename);
+    if(!in_file) return;
+
+    char magic[8];
+    uint32_t version = 0;
+    uint32_t count = 0;
+    if(fread(magic, sizeof(magic), 1, in_file) == 1 && !memcmp(magic, CATALOG_MAGIC, sizeof(magic)) &&
+       fread(&version, sizeof(uint32_t), 1, in_file) == 1 && version == CATALOG_VERSION &&
+       fread(&count, sizeof(uint32_t), 1, in_file) == 1)
+    {
+        char name[1024];
+        for(uint32_t i = 0; i < count; i++)
+        {
+            uint16_t name_length = 0;
+            struct clip_info info;
+            if(fread(&name_length, sizeof(uint16_t), 1, in_file) != 1 || name_length == 0 || name_length >= sizeof(name) ||
+               fread(name, name_length, 1, in_file) != 1 ||
+               fread(&info, sizeof(struct clip_info), 1, in_file) != 1)
+            {
+                err_printf("%s: catalog is truncated\n", catalog->dir_path);
+                break;
+            }
+            struct catalog_entry * entry = catalog_add(catalog, name, name_length);
+            if(!entry) break;
+            entry->info = info;
+        }
+    }
+    fclose(in_file);
+}
+
+static void free_catalog_image(struct catalog_image * image)
+{
+    if(!image) return;
+    free(image->dir_path);
+    free(image->data);
+    free(image);
+}
+
+/**
+ * Makes a copy of a catalog in the form of its file (catalog_mutex has to be held)
+ * @return the image, NULL if out of memory
+ */
+static struct catalog_image * catalog_make_image(struct clip_catalog * catalog)
+{
+    size_t size = 8 + 2 * sizeof(uint32_t);
+    for(uint32_t i = 0; i < catalog->count; i++)
+    {
+        size += sizeof(uint16_t) + strlen(catalog->entries[i].name) + sizeof(struct clip_info);
+    }
+
+    struct catalog_image * image = calloc(1, sizeof(struct catalog_image));
+    if(!image) return NULL;
+    image->dir_path = malloc(strlen(catalog->dir_path) + 1);
+    image->data = malloc(size);
+    if(!image->dir_path || !image->data)
+    {
+        err_printf("malloc error (requested size %zu)\n", size);
+        free_catalog_image(image);
+        return NULL;
+    }
+    strcpy(image->dir_path, catalog->dir_path);
+    image->size = size;
+
+    uint32_t version = CATALOG_VERSION;
+    uint8_t * position = image->data;
+    memcpy(position, CATALOG_MAGIC, 8);
+    position += 8;
+    memcpy(position, &version, sizeof(uint32_t));
+    position += sizeof(uint32_t);
+    memcpy(position, &catalog->count, sizeof(uint32_t));
+    position += sizeof(uint32_t);
+    for(uint32_t i = 0; i < catalog->count; i++)
+    {
+        uint16_t name_length = (uint16_t)strlen(catalog->entries[i].name);
+        memcpy(position, &name_length, sizeof(uint16_t));
+        position += sizeof(uint16_t);
+        memcpy(position, catalog->entries[i].name, name_length);
+        position += name_length;
+        memcpy(position, &catalog->entries[i].info, sizeof(struct clip_info));
+        position += sizeof(struct clip_info);
+    }
+    return image;
+}
+
+/**
+ * Writes the catalog file of a directory (to a temporary file that is then renamed over the old one)
+ * @return 1 if successful, 0 otherwise
+ */
+static int catalog_save(struct catalog_image * image)
+{
+    char * filename = catalog_get_filename(image->dir_path);
+    if(!filename) return 0;
+    char * temp_filename = malloc(strlen(filename) + 5);
+    if(!temp_filename)
+    {
+        free(filename);
+        return 0;
+    }
+    sprintf(temp_filename, "%s.tmp", filename);
+
+    FILE * out_file = fopen(temp_filename, "wb");
+    if(!out_file)
+    {
+        //probably read-only media, keep the catalog in memory only
+        free(temp_filename);
+        free(filename);
+        return 0;
+    }
+
+    int written = fwrite(image->data, image->size, 1, out_file) == 1;
+    written &= fclose(out_file) == 0;
+
+#if defined(_WIN32)
+    //rename doesn't replace existing files here
+    if(written) remove(filename);
+#endif
+    if(!written || rename(temp_filename, filename))
+    {
+        int err = errno;
+        err_printf("could not write '%s': %s\n", filename, strerror(err));
+        remove(temp_filename);
+        written = 0;
+    }
+
+    free(temp_filename);
+    free(filename);
+    return written;
+}
+
+static struct clip_catalog * get_or_create_catalog(const char * dir_path)
+{
+    for(struct clip_catalog * current = catalogs; current != NULL; current = current->next)
+    {
+        if(!filename_strcmp(current->dir_path, dir_path)) return current;
+    }
+
+    struct clip_catalog * catalog = malloc(sizeof(struct clip_catalog));
+    if(!catalog) return NULL;
+    memset(catalog, 0, sizeof(struct clip_catalog));
+    catalog->dir_path = malloc(strlen(dir_path) + 1);
+    if(!catalog->dir_path)
+    {
+        free(catalog);
+        return NULL;
+    }
+    strcpy(catalog->dir_path, dir_path);
+    catalog_load(catalog);
+
+    catalog->next = catalogs;
+    catalogs = catalog;
+    return catalog;
+}
+
+/**
+ * Gets what the entry of a MLV is keyed on: the size and modification time of the MLV and of all its chunk files,
+ * and the GUID of the recording (so a different clip with the same sizes and times is not mistaken for it)
+ * @return 1 if successful, 0 if the MLV can't be read
+ */
+static int catalog_stat_chunks(const char * mlv_filename, struct clip_info * info)
+{
+    size_t filename_size = strlen(mlv_filename) + 1;
+    char * filename = malloc(filename_size);
+    if(!filename) return 0;
+    memcpy(filename, mlv_filename, filename_size);
+
+    //FNV-1a over the sizes and times, in chunk order
+    uint64_t key = 0xcbf29ce484222325ULL;
+    uint32_t chunk = 0;
+    for(; chunk < 100; chunk++)
+    {
+        if(chunk > 0)
+        {
+            //same naming as load_chunks
+            snprintf(&filename[filename_size - 3], 3, "%02u", chunk - 1);
+        }
+        struct STAT64 file_stat;
+        if(STAT64(filename, &file_stat)) break;
+
+        uint64_t values[2] = { (uint64_t)file_stat.st_size, (uint64_t)file_stat.st_mtime };
+        const uint8_t * bytes = (const uint8_t *)values;
+        for(size_t i = 0; i < sizeof(values); i++)
+        {
+            key = (key ^ bytes[i]) * 0x100000001b3ULL;
+        }
+        if(chunk == 0)
+        {
+            info->file_size = (uint64_t)file_stat.st_size;
+            info->file_time = (int64_t)file_stat.st_mtime;
+        }
+    }
+    free(filename);
+    if(chunk == 0) return 0;
+    info->chunk_count = chunk;
+    info->chunks_key = key;
+
+    mlv_file_hdr_t file_hdr;
+    FILE * mlv_file = fopen(mlv_filename, "rb");
+    if(!mlv_file) return 0;
+    int result = fread(&file_hdr, sizeof(mlv_file_hdr_t), 1, mlv_file) == 1 && !memcmp(file_hdr.fileMagic, "MLVI", 4);
+    fclose(mlv_file);
+    info->file_guid = result ? file_hdr.fileGuid : 0;
+    return result;
+}
+
+static int catalog_same_chunks(const struct clip_info * a, const struct clip_info * b)
+{
+    return a->file_size == b->file_size && a->file_time == b->file_time && a->chunk_count == b->chunk_count &&
+        a->chunks_key == b->chunks_key && a->file_guid == b->file_guid;
+}
+
+/**
+ * Gathers the summary of a MLV from its frame directory (this is the expensive part the catalog saves)
+ */
+static int catalog_build_info(const char * mlv_filename, struct clip_info * info)
+{
+    struct mlv_clip * clip = get_or_create_clip(mlv_filename);
+    if(!clip) return 0;
+
+    pthread_mutex_lock(&clip->mutex);
+    info->frame_count = clip->frame_count;
+    pthread_mutex_unlock(&clip->mutex);
+    info->has_audio = has_audio(mlv_filename) ? 1 : 0;
+
+    struct frame_headers frame_headers;
+    if(clip_get_frame_headers(clip, 0, &frame_headers))
+    {
+        info->has_headers = 1;
+        info->xres = frame_headers.rawi_hdr.xRes;
+        info->yres = frame_headers.rawi_hdr.yRes;
+        info->fps_nom = frame_headers.file_hdr.sourceFpsNom;
+        info->fps_denom = frame_headers.file_hdr.sourceFpsDenom;
+        memcpy(info->camera_name, frame_headers.idnt_hdr.cameraName, sizeof(info->camera_name));
+        memcpy(info->camera_serial, frame_headers.idnt_hdr.cameraSerial, sizeof(info->camera_serial));
+        memcpy(info->lens_name, frame_headers.lens_hdr.lensName, sizeof(info->lens_name));
+        info->camera_name[sizeof(info->camera_name) - 1] = 0;
+        info->camera_serial[sizeof(info->camera_serial) - 1] = 0;
+        info->lens_name[sizeof(info->lens_name) - 1] = 0;
+        info->rtc_year = frame_headers.rtci_hdr.tm_year;
+        info->rtc_mon = frame_headers.rtci_hdr.tm_mon;
+        info->rtc_mday = frame_headers.rtci_hdr.tm_mday;
+        info->rtc_hour = frame_headers.rtci_hdr.tm_hour;
+        info->rtc_min = frame_headers.rtci_hdr.tm_min;
+        info->rtc_sec = frame_headers.rtci_hdr.tm_sec;
+        info->iso = frame_headers.expo_hdr.isoValue;
+        info->shutter = frame_headers.expo_hdr.shutterValue;
+        info->aperture = frame_headers.lens_hdr.aperture;
+    }
+    return 1;
+}
+
+/**
+ * Looks up the summary of a MLV in the catalog of its directory, only parsing the MLV if it is not in there
+ * or has changed since (a different size or modification time of any of its chunk files, or a different GUID)
+ * @param mlv_filename The real path of the MLV
+ * @param info [out] The summary
+ * @return 1 if successful, 0 otherwise
+ */
+int catalog_get_clip_info(const char * mlv_filename, struct clip_info * info)
+{
+    const char * separator = find_last_separator(mlv_filename);
+    if(!separator) return 0;
+    const char * name = separator + 1;
+    size_t dir_length = separator - mlv_filename;
+    char * dir_path = malloc(dir_length + 1);
+    if(!dir_path) return 0;
+    memcpy(dir_path, mlv_filename, dir_length);
+    dir_path[dir_length] = 0;
+
+    //an entry that was compared with the files recently is used as it is
+    int found = 0;
+    time_t now = time(NULL);
+    RELOCK(catalog_mutex)
+    {
+        struct clip_catalog * catalog = get_or_create_catalog(dir_path);
+        struct catalog_entry * entry = catalog ? catalog_find(catalog, name) : NULL;
+        if(entry && entry->checked && now - entry->checked < CATALOG_CHECK_INTERVAL)
+        {
+            *info = entry->info;
+            found = 1;
+        }
+    }
+    UNLOCK(catalog_mutex)
+
+    if(found)
+    {
+        free(dir_path);
+        return 1;
+    }
+
+    //the files are checked without the lock held
+    struct clip_info current;
+    memset(&current, 0, sizeof(struct clip_info));
+    if(!catalog_stat_chunks(mlv_filename, &current))
+    {
+        free(dir_path);
+        return 0;
+    }
+
+    RELOCK(catalog_mutex)
+    {
+        struct clip_catalog * catalog = get_or_create_catalog(dir_path);
+        struct catalog_entry * entry = catalog ? catalog_find(catalog, name) : NULL;
+        if(entry && catalog_same_chunks(&entry->info, &current))
+        {
+            entry->checked = now;
+            *info = entry->info;
+            found = 1;
+        }
+    }
+    UNLOCK(catalog_mutex)
+
+    if(found)
+    {
+        free(dir_path);
+        return 1;
+    }
+
+    *info = current;
+    if(!catalog_build_info(mlv_filename, info))
+    {
+        free(dir_path);
+        return 0;
+    }
+
+    RELOCK(catalog_mutex)
+    {
+        struct clip_catalog * catalog = get_or_create_catalog(dir_path);
+        if(catalog)
+        {
+            struct catalog_entry * entry = catalog_find(catalog, name);
+            if(!entry) entry = catalog_add(catalog, name, strlen(name));
+            if(entry)
+            {
+                entry->info = *info;
+                entry->checked = now;
+                catalog->dirty = 1;
+            }
+        }
+    }
+    UNLOCK(catalog_mutex)
+
+    free(dir_path);
+    return 1;
+}
+
+/**
+ * Forgets the summary of a MLV (e.g. because it was replaced by a file with the same size and time), it is rebuilt on the next access
+ * @param mlv_filename The real path of the MLV
+ */
+void catalog_invalidate(const char * mlv_filename)
+{
+    const char * separator = find_last_separator(mlv_filename);
+    if(!separator) return;
+    size_t dir_length = separator - mlv_filename;
+    char * dir_path = malloc(dir_length + 1);
+    if(!dir_path) return;
+    memcpy(dir_path, mlv_filename, dir_length);
+    dir_path[dir_length] = 0;
+
+    RELOCK(catalog_mutex)
+    {
+        for(struct clip_catalog * current = catalogs; current != NULL; current = current->next)
+        {
+            if(filename_strcmp(current->dir_path, dir_path)) continue;
+            struct catalog_entry * entry = catalog_find(current, separator + 1);
+            if(entry)
+            {
+                //a size that can't match any file, so the entry is replaced next time
+                entry->info.file_size = UINT64_MAX;
+                entry->checked = 0;
+                current->dirty = 1;
+            }
+            break;
+        }
+    }
+    UNLOCK(catalog_mutex)
+
+    free(dir_path);
+}
+
+/**
+ * Writes the catalogs that have changed, the lookups don't wait for the files to be written
+ * @param force Write them even if they were written recently
+ */
+void catalog_save_all(int force)
+{
+    struct catalog_image * images = NULL;
+    time_t now = time(NULL);
+
+    RELOCK(catalog_save_mutex)
+    {
+        RELOCK(catalog_mutex)
+        {
+            for(struct clip_catalog * current = catalogs; current != NULL; current = current->next)
+            {
+                if(current->dirty && (force || now - current->saved >= CATALOG_SAVE_INTERVAL))
+                {
+                    struct catalog_image * image = catalog_make_image(current);
+                    if(image)
+                    {
+                        image->next = images;
+                        images = image;
+                    }
+                    //don't retry on every call if it can't be written
+                    current->dirty = 0;
+                    current->saved = now;
+                }
+            }
+        }
+        UNLOCK(catalog_mutex)
+
+        while(images)
+        {
+            struct catalog_image * next = images->next;
+            catalog_save(images);
+            free_catalog_image(images);
+            images = next;
+        }
+    }
+    UNLOCK(catalog_save_mutex)
+}
+
+void free_all_catalogs()
+{
+    catalog_save_all(1);
+    RELOCK(catalog_mutex)
+    {
+        struct clip_catalog * next = NULL;
+        struct clip_catalog * current = catalogs;
+        while(current != NULL)
+        {
+            next = current->next;
+            for(uint32_t i = 0; i < current->count; i++)
+            {
+                free(current->entries[i].name);
+            }
+            free(current->entries);
+            free(current->dir_path);
+            free(current);
+            current = next;
+        }
+        catalogs = NULL;
+    }
+    UNLOCK(catalog_mutex)
+}
@@ -0,0 +1,68 @@
+/*
+ * Copyright (C) 2014 David Milligan
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the
+ * Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ */
+
+#ifndef mlvfs_catalog_h
+#define mlvfs_catalog_h
+
+#include <stdint.h>
+#include "mlv.h"
+
+//name of the catalog file kept in every directory containing MLVs
+#define CATALOG_FILENAME ".MLVFS.CAT"
+
+#pragma pack(push,1)
+
+//summary of a MLV as stored in the catalog, valid as long as the MLV and its chunk files (.M00 etc) have the same sizes and modification times, and the same GUID
+struct clip_info
+{
+    uint64_t file_size;
+    int64_t file_time;
+    uint32_t chunk_count;    /* the .MLV included */
+    uint64_t chunks_key;    /* hash of the size and modification time of every chunk file */
+    uint64_t file_guid;
+    uint32_t frame_count;
+    uint8_t has_headers;    /* the headers of the first frame were found, the fields below are only valid if set */
+    uint8_t has_audio;
+    uint16_t xres;
+    uint16_t yres;
+    uint32_t fps_nom;
+    uint32_t fps_denom;
+    uint8_t camera_name[32];
+    uint8_t camera_serial[32];
+    uint8_t lens_name[32];
+    uint16_t rtc_year;    /* year since 1900 */
+    uint16_t rtc_mon;    /* month (0-11) */
+    uint16_t rtc_mday;
+    uint16_t rtc_hour;
+    uint16_t rtc_min;
+    uint16_t rtc_sec;
+    uint32_t iso;
+    uint64_t shutter;    /* exposure time in microseconds */
+    uint16_t aperture;    /* f-number * 100 */
+};
+
+#pragma pack(pop)
+
+int catalog_get_clip_info(const char * mlv_filename, struct clip_info * info);
+void catalog_invalidate(const char * mlv_filename);
+void catalog_save_all(int force);
+void free_all_catalogs();
+
+#endif
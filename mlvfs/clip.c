@@ -0,0 +1,638 @@
+/*
+ * Copyright (C) 2014 David Milligan
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the
+ * Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include "raw.h"
+#include "mlv.h"
+#include "mlvfs.h"
+#include "index.h"
+#include "resource_manager.h"
+#include "clip.h"
+#include "pathcache.h"
+
+#define CREATE_MUTEX(x) static pthread_mutex_t x = PTHREAD_MUTEX_INITIALIZER;
+#define RELOCK(x) pthread_mutex_lock(&(x));
+#define UNLOCK(x) pthread_mutex_unlock(&(x));
+
+CREATE_MUTEX(clip_mutex)
+//mktime() (re)loads the time zone it shares between all callers
+CREATE_MUTEX(mktime_mutex)
+
+static struct mlv_clip * clips = NULL;
+
+/**
+ * Reads a block header at the given position, limiting the size to either our local type size or the written block size
+ * @return 1 if successful, 0 otherwise
+ */
+static int clip_read_block(FILE * in_file, uint64_t position, void * block, size_t block_size, mlv_hdr_t * mlv_hdr)
+{
+    file_set_pos(in_file, position, SEEK_SET);
+    if(!fread(mlv_hdr, sizeof(mlv_hdr_t), 1, in_file)) return 0;
+    file_set_pos(in_file, position, SEEK_SET);
+    if(block == NULL) return 1;
+    return fread(block, MIN(block_size, mlv_hdr->blockSize), 1, in_file) == 1;
+}
+
+//block type and payload size of each enum clip_metadata
+static const char * clip_metadata_types[CLIP_METADATA_COUNT] = { "MLVI", "RTCI", "IDNT", "RAWI", "EXPO", "LENS", "WBAL" };
+static const size_t clip_metadata_sizes[CLIP_METADATA_COUNT] =
+{
+    sizeof(mlv_file_hdr_t),
+    sizeof(mlv_rtci_hdr_t),
+    sizeof(mlv_idnt_hdr_t),
+    sizeof(mlv_rawi_hdr_t),
+    sizeof(mlv_expo_hdr_t),
+    sizeof(mlv_lens_hdr_t),
+    sizeof(mlv_wbal_hdr_t),
+};
+
+/**
+ * Reads a metadata block into the timeline of its type as the version that applies from first_frame on
+ * Several blocks of the same type before the same frame: the last one wins
+ * @return 1 if successful, 0 if the block could not be read, -1 if out of memory
+ */
+static int clip_timeline_read(struct clip_timeline * timeline, size_t payload_size, uint32_t first_frame, FILE * in_file, uint64_t position)
+{
+    mlv_hdr_t mlv_hdr;
+
+    if(timeline->count > 0 && timeline->first_frames[timeline->count - 1] == first_frame)
+    {
+        return clip_read_block(in_file, position, &timeline->payloads[(timeline->count - 1) * payload_size], payload_size, &mlv_hdr);
+    }
+
+    if(timeline->count >= timeline->allocated)
+    {
+        uint32_t new_allocated = timeline->allocated ? timeline->allocated * 2 : 4;
+        uint32_t * first_frames = realloc(timeline->first_frames, new_allocated * sizeof(uint32_t));
+        if(!first_frames)
+        {
+            err_printf("malloc error (requested size %zu)\n", new_allocated * sizeof(uint32_t));
+            return -1;
+        }
+        timeline->first_frames = first_frames;
+        uint8_t * payloads = realloc(timeline->payloads, new_allocated * payload_size);
+        if(!payloads)
+        {
+            err_printf("malloc error (requested size %zu)\n", new_allocated * payload_size);
+            return -1;
+        }
+        timeline->payloads = payloads;
+        timeline->allocated = new_allocated;
+    }
+
+    //a block shorter than our type only replaces the start of the previous version
+    uint8_t * payload = &timeline->payloads[timeline->count * payload_size];
+    if(timeline->count > 0)
+    {
+        memcpy(payload, payload - payload_size, payload_size);
+    }
+    else
+    {
+        memset(payload, 0, payload_size);
+    }
+
+    if(!clip_read_block(in_file, position, payload, payload_size, &mlv_hdr)) return 0;
+    timeline->first_frames[timeline->count++] = first_frame;
+    return 1;
+}
+
+/**
+ * Finds the version of a metadata block that applies to a frame (the last one starting at or before it)
+ * @return the position of the version in the timeline, -1 if there is none
+ */
+static int clip_timeline_find(const struct clip_timeline * timeline, uint32_t frame)
+{
+    int low = 0;
+    int high = (int)timeline->count - 1;
+    int result = -1;
+    while(low <= high)
+    {
+        int middle = low + (high - low) / 2;
+        if(timeline->first_frames[middle] <= frame)
+        {
+            result = middle;
+            low = middle + 1;
+        }
+        else
+        {
+            high = middle - 1;
+        }
+    }
+    return result;
+}
+
+/**
+ * Copies the version of a metadata block that applies to a frame (zeros if there is none)
+ * @return 1 if there was one, 0 otherwise
+ */
+static int clip_timeline_get(const struct clip_timeline * timeline, size_t payload_size, uint32_t frame, void * block)
+{
+    int version = clip_timeline_find(timeline, frame);
+    if(version < 0)
+    {
+        memset(block, 0, payload_size);
+        return 0;
+    }
+    memcpy(block, &timeline->payloads[version * payload_size], payload_size);
+    return 1;
+}
+
+static void clip_reset_directory(struct mlv_clip * clip)
+{
+    free(clip->frames);
+    clip->frames = NULL;
+    clip->frame_count = 0;
+    clip->frames_allocated = 0;
+    for(int type = 0; type < CLIP_METADATA_COUNT; type++)
+    {
+        free(clip->timelines[type].first_frames);
+        free(clip->timelines[type].payloads);
+        memset(&clip->timelines[type], 0, sizeof(struct clip_timeline));
+    }
+    clip->xref_count = 0;
+    clip->loaded = 0;
+}
+
+/**
+ * Walks the index entries that were not seen yet and records, for every video frame, where it is stored, and for
+ * every metadata block, the first frame it applies to (the next VIDF in the index)
+ * @return 1 if successful, 0 otherwise, -1 if the frames in the index are not in the order of their timestamps
+ */
+static int clip_update_directory(struct mlv_clip * clip, struct mlv_index * index)
+{
+    FILE **chunk_files = NULL;
+    uint32_t chunk_count = 0;
+
+    chunk_files = mlvfs_load_chunks(clip->mlv_filename, &chunk_count);
+    if(!chunk_files || !chunk_count)
+    {
+        return 0;
+    }
+
+    mlv_xref_hdr_t *block_xref = index->xref;
+    mlv_xref_t *xrefs = index->xrefs;
+    uint32_t vidf_count = clip->frame_count;
+
+    for(uint32_t block_xref_pos = clip->xref_count; block_xref_pos < block_xref->entryCount; block_xref_pos++)
+    {
+        if(xrefs[block_xref_pos].frameType == MLV_FRAME_VIDF) vidf_count++;
+    }
+
+    if(vidf_count > clip->frames_allocated)
+    {
+        struct clip_frame * frames = realloc(clip->frames, vidf_count * sizeof(struct clip_frame));
+        if(!frames)
+        {
+            err_printf("malloc error (requested size %zu)\n", vidf_count * sizeof(struct clip_frame));
+            mlvfs_close_chunks(chunk_files, chunk_count);
+            return 0;
+        }
+        clip->frames = frames;
+        clip->frames_allocated = vidf_count;
+    }
+
+    int result = 1;
+    mlv_hdr_t mlv_hdr;
+
+    for(uint32_t block_xref_pos = clip->xref_count; block_xref_pos < block_xref->entryCount && result > 0; block_xref_pos++)
+    {
+        /* get the file and position of the next block */
+        uint32_t in_file_num = xrefs[block_xref_pos].fileNumber;
+        uint64_t position = xrefs[block_xref_pos].frameOffset;
+
+        if(in_file_num >= chunk_count) continue;
+
+        /* select file */
+        FILE *in_file = chunk_files[in_file_num];
+
+        switch(xrefs[block_xref_pos].frameType)
+        {
+            case MLV_FRAME_VIDF:
+            {
+                struct clip_frame * frame = &(clip->frames[clip->frame_count++]);
+                memset(frame, 0, sizeof(struct clip_frame));
+                frame->fileNumber = in_file_num;
+                frame->position = position;
+                clip_read_block(in_file, position, &frame->vidf_hdr, sizeof(mlv_vidf_hdr_t), &mlv_hdr);
+                //the index only guessed the timestamps of the frames it skipped over, make sure it guessed right
+                if(clip->frame_count > 1 && frame->vidf_hdr.timestamp < clip->frames[clip->frame_count - 2].vidf_hdr.timestamp)
+                {
+                    result = -1;
+                }
+                break;
+            }
+
+            case MLV_FRAME_AUDF:
+                break;
+
+            case MLV_FRAME_UNSPECIFIED:
+            default:
+                if(clip_read_block(in_file, position, NULL, 0, &mlv_hdr))
+                {
+                    for(int type = 0; type < CLIP_METADATA_COUNT; type++)
+                    {
+                        if(!memcmp(mlv_hdr.blockType, clip_metadata_types[type], 4))
+                        {
+                            //a missing version would hand the following frames the wrong metadata, so don't keep the directory
+                            if(clip_timeline_read(&clip->timelines[type], clip_metadata_sizes[type], clip->frame_count, in_file, position) < 0)
+                            {
+                                result = 0;
+                            }
+                            break;
+                        }
+                    }
+                }
+        }
+
+        if(ferror(in_file))
+        {
+            int err = errno;
+            err_printf("%s: fread error: %s\n", clip->mlv_filename, strerror(err));
+            clearerr(in_file);
+        }
+    }
+
+    mlvfs_close_chunks(chunk_files, chunk_count);
+
+    if(result > 0)
+    {
+        clip->xref_count = block_xref->entryCount;
+    }
+    return result;
+}
+
+static struct mlv_clip * get_clip(const char * mlv_filename)
+{
+    for(struct mlv_clip * current = clips; current != NULL; current = current->next)
+    {
+        if(!filename_strcmp(current->mlv_filename, mlv_filename)) return current;
+    }
+    return NULL;
+}
+
+static struct mlv_clip * new_clip(const char * mlv_filename)
+{
+    struct mlv_clip * new_buffer = malloc(sizeof(struct mlv_clip));
+    if(new_buffer == NULL) return NULL;
+
+    memset(new_buffer, 0, sizeof(struct mlv_clip));
+    new_buffer->mlv_filename = malloc((sizeof(char) * (strlen(mlv_filename) + 1)));
+    if (!new_buffer->mlv_filename)
+    {
+        free(new_buffer);
+        return NULL;
+    }
+    strcpy(new_buffer->mlv_filename, mlv_filename);
+    pthread_mutex_init(&new_buffer->mutex, NULL);
+
+    new_buffer->next = clips;
+    clips = new_buffer;
+    return new_buffer;
+}
+
+/**
+ * Looks up the resident state for a MLV, building its frame directory on first use
+ * and extending it when the index has grown since (e.g. the MLV is still being copied)
+ * @return the clip, or NULL if the MLV could not be indexed
+ */
+struct mlv_clip * get_or_create_clip(const char * mlv_filename)
+{
+    struct mlv_clip * clip = NULL;
+
+    RELOCK(clip_mutex)
+    {
+        clip = get_clip(mlv_filename);
+        if(!clip)
+        {
+            clip = new_clip(mlv_filename);
+        }
+    }
+    UNLOCK(clip_mutex)
+
+    if(!clip) return NULL;
+
+    struct mlv_index * index = acquire_index(mlv_filename);
+    if(!index) return NULL;
+
+    int loaded = 0;
+    RELOCK(clip->mutex)
+    {
+        //a rebuilt index may list the blocks differently, so start over
+        if(clip->loaded && clip->index_serial != index->serial)
+        {
+            clip_reset_directory(clip);
+        }
+        if(!clip->loaded || clip->xref_count < index->xref->entryCount)
+        {
+            clip->loaded = clip_update_directory(clip, index);
+            if(clip->loaded < 0)
+            {
+                //frames aren't stored in order, that takes an index that was built reading every block
+                clip_reset_directory(clip);
+                index = rebuild_index(index);
+                clip->loaded = index ? clip_update_directory(clip, index) > 0 : 0;
+            }
+            clip->index_serial = index ? index->serial : 0;
+            if(!clip->loaded)
+            {
+                //don't keep a partial directory around, the next access will try again
+                clip_reset_directory(clip);
+            }
+        }
+        //every DNG of the clip gets a path cache entry when the directory is listed or stat'ed
+        if(clip->frame_count > clip->path_cache_frames)
+        {
+            path_cache_reserve(clip->frame_count - clip->path_cache_frames);
+            clip->path_cache_frames = clip->frame_count;
+        }
+        loaded = clip->loaded;
+    }
+    UNLOCK(clip->mutex)
+
+    release_index(index);
+
+    return loaded ? clip : NULL;
+}
+
+/**
+ * Retrieves all the mlv headers associated a particular video frame from the frame directory
+ * @param clip The clip containing the video frame
+ * @param index The index of the video frame
+ * @param frame_headers [out] All of the MLV blocks associated with the frame
+ * @return 1 if successful, 0 otherwise
+ */
+int clip_get_frame_headers(struct mlv_clip * clip, int index, struct frame_headers * frame_headers)
+{
+    memset(frame_headers, 0, sizeof(struct frame_headers));
+
+    //the directory may be extended (and reallocated) by another thread
+    RELOCK(clip->mutex)
+    if(index < 0 || (uint32_t)index >= clip->frame_count)
+    {
+        UNLOCK(clip->mutex)
+        err_printf("%s: Error reading frame headers: vidf block for frame %d was not found\n", clip->mlv_filename, index);
+        return 0;
+    }
+
+    struct clip_frame * frame = &(clip->frames[index]);
+    struct clip_timeline * timelines = clip->timelines;
+
+    frame_headers->fileNumber = frame->fileNumber;
+    frame_headers->position = frame->position;
+    frame_headers->vidf_hdr = frame->vidf_hdr;
+    clip_timeline_get(&timelines[CLIP_MLVI], sizeof(mlv_file_hdr_t), index, &frame_headers->file_hdr);
+    clip_timeline_get(&timelines[CLIP_RTCI], sizeof(mlv_rtci_hdr_t), index, &frame_headers->rtci_hdr);
+    clip_timeline_get(&timelines[CLIP_IDNT], sizeof(mlv_idnt_hdr_t), index, &frame_headers->idnt_hdr);
+    int rawi_found = clip_timeline_get(&timelines[CLIP_RAWI], sizeof(mlv_rawi_hdr_t), index, &frame_headers->rawi_hdr);
+    clip_timeline_get(&timelines[CLIP_EXPO], sizeof(mlv_expo_hdr_t), index, &frame_headers->expo_hdr);
+    clip_timeline_get(&timelines[CLIP_LENS], sizeof(mlv_lens_hdr_t), index, &frame_headers->lens_hdr);
+    clip_timeline_get(&timelines[CLIP_WBAL], sizeof(mlv_wbal_hdr_t), index, &frame_headers->wbal_hdr);
+    UNLOCK(clip->mutex)
+
+    if(!rawi_found)
+    {
+        err_printf("%s: Error reading frame headers: no rawi block was found\n", clip->mlv_filename);
+    }
+
+    return rawi_found;
+}
+
+/**
+ * Tells if the kernel may keep what it has cached of a DNG or the WAV from the last time it was opened, and records
+ * that it is opened now: only if it was opened before, with the same settings, and the clip hasn't changed since
+ * @param generation The generation of the current settings
+ * @param frame The frame number of the DNG, -1 for the WAV
+ * @return 1 if the cached contents are still valid, 0 otherwise
+ */
+int clip_keep_cache(struct mlv_clip * clip, uint32_t generation, int frame)
+{
+    int keep = 0;
+    RELOCK(clip->mutex)
+    {
+        if(clip->cached_generation != generation)
+        {
+            //rendered with other settings, none of it is valid anymore
+            if(clip->cached_frames) memset(clip->cached_frames, 0, clip->cached_frames_allocated);
+            clip->cached_wav = 0;
+            clip->cached_generation = generation;
+        }
+        if(frame < 0)
+        {
+            keep = clip->cached_wav;
+            clip->cached_wav = 1;
+        }
+        else
+        {
+            uint32_t byte = (uint32_t)frame / 8;
+            uint8_t bit = (uint8_t)(1 << (frame % 8));
+            if(byte >= clip->cached_frames_allocated)
+            {
+                uint32_t new_allocated = MAX(byte + 1, clip->cached_frames_allocated * 2);
+                uint8_t * cached_frames = realloc(clip->cached_frames, new_allocated);
+                if(cached_frames)
+                {
+                    memset(cached_frames + clip->cached_frames_allocated, 0, new_allocated - clip->cached_frames_allocated);
+                    clip->cached_frames = cached_frames;
+                    clip->cached_frames_allocated = new_allocated;
+                }
+            }
+            if(byte < clip->cached_frames_allocated)
+            {
+                keep = (clip->cached_frames[byte] & bit) != 0;
+                clip->cached_frames[byte] |= bit;
+            }
+        }
+    }
+    UNLOCK(clip->mutex)
+    return keep;
+}
+
+/**
+ * Makes the kernel drop what it has cached of the DNGs and the WAV of a MLV the next time they are opened
+ * @param mlv_filename The MLV, or NULL for all of them
+ */
+void invalidate_clip_cache(const char * mlv_filename)
+{
+    RELOCK(clip_mutex)
+    {
+        for(struct mlv_clip * current = clips; current != NULL; current = current->next)
+        {
+            if(mlv_filename && filename_strcmp(current->mlv_filename, mlv_filename)) continue;
+            RELOCK(current->mutex)
+            {
+                if(current->cached_frames) memset(current->cached_frames, 0, current->cached_frames_allocated);
+                current->cached_wav = 0;
+            }
+            UNLOCK(current->mutex)
+        }
+    }
+    UNLOCK(clip_mutex)
+}
+
+/**
+ * Throws away the frame directory of a MLV (e.g. because the MLV was replaced), it is rebuilt on the next access
+ * The clip itself is kept, since other threads may still be holding on to it
+ * @return the GUID of the recording the directory was built from, 0 if there was none
+ */
+uint64_t invalidate_clip(const char * mlv_filename)
+{
+    uint64_t file_guid = 0;
+    struct mlv_clip * clip = NULL;
+
+    RELOCK(clip_mutex)
+    {
+        clip = get_clip(mlv_filename);
+    }
+    UNLOCK(clip_mutex)
+
+    if(!clip) return 0;
+
+    RELOCK(clip->mutex)
+    {
+        if(clip->timelines[CLIP_MLVI].count > 0)
+        {
+            file_guid = ((mlv_file_hdr_t *)clip->timelines[CLIP_MLVI].payloads)->fileGuid;
+        }
+        clip_reset_directory(clip);
+    }
+    UNLOCK(clip->mutex)
+
+    return file_guid;
+}
+
+static time_t clip_rtci_time(const mlv_rtci_hdr_t * rtci_hdr)
+{
+    struct tm tm_str;
+    memset(&tm_str, 0, sizeof(struct tm));
+    tm_str.tm_sec = rtci_hdr->tm_sec;
+    tm_str.tm_min = rtci_hdr->tm_min;
+    tm_str.tm_hour = rtci_hdr->tm_hour;
+    tm_str.tm_mday = rtci_hdr->tm_mday;
+    tm_str.tm_mon = rtci_hdr->tm_mon;
+    tm_str.tm_year = rtci_hdr->tm_year;
+    tm_str.tm_isdst = rtci_hdr->tm_isdst;
+    time_t result;
+    RELOCK(mktime_mutex)
+    {
+        result = mktime(&tm_str);
+    }
+    UNLOCK(mktime_mutex)
+    return result;
+}
+
+static void clip_offset_time(time_t rtci_time, const mlv_rtci_hdr_t * rtci_hdr, uint64_t timestamp, struct timespec * time)
+{
+    //the timestamps are in microseconds
+    int64_t offset = (int64_t)(timestamp - rtci_hdr->timestamp);
+    int64_t seconds = offset / 1000000;
+    int64_t microseconds = offset % 1000000;
+    if(microseconds < 0)
+    {
+        microseconds += 1000000;
+        seconds--;
+    }
+    time->tv_sec = rtci_time + (time_t)seconds;
+    time->tv_nsec = (long)(microseconds * 1000);
+}
+
+/**
+ * The wall clock time a frame was recorded at, from the RTCI block and the VIDF timestamp
+ */
+void mlv_get_frame_time(const struct frame_headers * frame_headers, struct timespec * time)
+{
+    clip_offset_time(clip_rtci_time(&frame_headers->rtci_hdr), &frame_headers->rtci_hdr, frame_headers->vidf_hdr.timestamp, time);
+}
+
+/**
+ * The wall clock times of all of the clip's frames (see mlv_get_frame_time)
+ * Make sure you free() the result!!!
+ * @param frame_count [out] The number of frames
+ * @return the times indexed by frame number, NULL if there are no frames
+ */
+struct timespec * clip_get_frame_times(struct mlv_clip * clip, uint32_t * frame_count)
+{
+    struct timespec * times = NULL;
+    *frame_count = 0;
+
+    RELOCK(clip->mutex)
+    if(clip->frame_count && (times = malloc(clip->frame_count * sizeof(struct timespec))) != NULL)
+    {
+        const struct clip_timeline * timeline = &clip->timelines[CLIP_RTCI];
+        mlv_rtci_hdr_t rtci_hdr;
+        memset(&rtci_hdr, 0, sizeof(mlv_rtci_hdr_t));
+        time_t rtci_time = clip_rtci_time(&rtci_hdr);
+        int current = -1;
+
+        for(uint32_t i = 0; i < clip->frame_count; i++)
+        {
+            //frames go up, so the RTCI versions do too, mktime() only runs once per version
+            int version = clip_timeline_find(timeline, i);
+            if(version != current && version >= 0)
+            {
+                memcpy(&rtci_hdr, &timeline->payloads[version * sizeof(mlv_rtci_hdr_t)], sizeof(mlv_rtci_hdr_t));
+                rtci_time = clip_rtci_time(&rtci_hdr);
+                current = version;
+            }
+            clip_offset_time(rtci_time, &rtci_hdr, clip->frames[i].vidf_hdr.timestamp, &times[i]);
+        }
+        *frame_count = clip->frame_count;
+    }
+    UNLOCK(clip->mutex)
+
+    return times;
+}
+
+int mlv_get_frame_count(const char *real_path)
+{
+    struct mlv_clip * clip = get_or_create_clip(real_path);
+    if(!clip) return 0;
+
+    RELOCK(clip->mutex)
+    uint32_t frame_count = clip->frame_count;
+    UNLOCK(clip->mutex)
+
+    return frame_count;
+}
+
+void free_all_clips()
+{
+    RELOCK(clip_mutex)
+    {
+        struct mlv_clip * next = NULL;
+        struct mlv_clip * current = clips;
+        while(current != NULL)
+        {
+            next = current->next;
+            pthread_mutex_destroy(&current->mutex);
+            free(current->mlv_filename);
+            clip_reset_directory(current);
+            free(current->cached_frames);
+            free(current);
+            current = next;
+        }
+        clips = NULL;
+    }
+    UNLOCK(clip_mutex)
+}
@@ -0,0 +1,95 @@
+/*
+ * Copyright (C) 2014 David Milligan
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the
+ * Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ */
+
+#ifndef mlvfs_clip_h
+#define mlvfs_clip_h
+
+#include <stdio.h>
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+#include "raw.h"
+#include "mlv.h"
+#include "mlvfs.h"
+
+//the metadata block types that are tracked per frame
+enum clip_metadata
+{
+    CLIP_MLVI,
+    CLIP_RTCI,
+    CLIP_IDNT,
+    CLIP_RAWI,
+    CLIP_EXPO,
+    CLIP_LENS,
+    CLIP_WBAL,
+    CLIP_METADATA_COUNT
+};
+
+//every version of one type of metadata block in a clip, sorted by the first frame it applies to (it applies up to the next version)
+struct clip_timeline
+{
+    uint32_t count;
+    uint32_t allocated;
+    uint32_t * first_frames;
+    uint8_t * payloads;
+};
+
+//one entry of the frame directory, indexed by the frame's sequence number (same as the DNG number)
+struct clip_frame
+{
+    uint32_t fileNumber;
+    uint64_t position;
+    mlv_vidf_hdr_t vidf_hdr;
+};
+
+//resident per-MLV state, built from the index the first time the clip is accessed and extended as the index grows
+struct mlv_clip
+{
+    struct mlv_clip * next;
+    char * mlv_filename;
+    int loaded;
+    uint32_t frame_count;
+    uint32_t frames_allocated;
+    struct clip_frame * frames;
+    struct clip_timeline timelines[CLIP_METADATA_COUNT];
+    //how far into the index the directory goes
+    uint32_t index_serial;
+    uint32_t xref_count;
+    //the DNGs (a bit per frame) and the WAV the kernel may still have cached, and the settings generation they were opened with
+    uint32_t cached_generation;
+    uint32_t cached_frames_allocated;
+    uint8_t * cached_frames;
+    int cached_wav;
+    //the frames the path cache has made room for
+    uint32_t path_cache_frames;
+    pthread_mutex_t mutex;
+};
+
+struct mlv_clip * get_or_create_clip(const char * mlv_filename);
+int clip_get_frame_headers(struct mlv_clip * clip, int index, struct frame_headers * frame_headers);
+struct timespec * clip_get_frame_times(struct mlv_clip * clip, uint32_t * frame_count);
+void mlv_get_frame_time(const struct frame_headers * frame_headers, struct timespec * time);
+int mlv_get_frame_count(const char *real_path);
+int clip_keep_cache(struct mlv_clip * clip, uint32_t generation, int frame);
+void invalidate_clip_cache(const char * mlv_filename);
+uint64_t invalidate_clip(const char * mlv_filename);
+void free_all_clips();
+
+#endif
@@ -31,6 +31,7 @@
 #include "mlvfs.h"
 #include "opt_med.h"
 #include "wirth.h"
+#include "framepool.h"
 #include "cs.h"
 
 
@@ -57,7 +58,8 @@ void chroma_smooth(struct frame_headers * frame_headers, uint16_t * image_data,
     
     if(raw2ev == NULL) return;
     
-    uint16_t * buf = (uint16_t *)malloc(w*h*sizeof(uint16_t));
+    //a frame sized copy at every frame, so it comes from the pool
+    uint16_t * buf = (uint16_t *)framepool_alloc(w*h*sizeof(uint16_t));
     if (!buf)
     {
         return;
@@ -80,7 +82,7 @@ void chroma_smooth(struct frame_headers * frame_headers, uint16_t * image_data,
             break;
     }
     
-    free(buf);
+    framepool_free(buf);
 }
 
 
@@ -187,6 +189,8 @@ struct bad_pixel_map
 {
     uint64_t file_guid;
     int aggressive;
+    //the generation of the settings it was searched with (the image it is searched in depends on them)
+    uint32_t generation;
     size_t count;
     size_t capacity;
     struct focus_pixel * pixels;
@@ -217,7 +221,7 @@ static struct bad_pixel_map bad_pixel_maps[BAD_PIXEL_MAP_COUNT] = { 0 };
 static int current_bad_pixel_map = 0;
 
 //adapted from cr2hdr and optimized for performance
-void fix_bad_pixels(struct frame_headers * frame_headers, uint16_t * image_data, int aggressive, int dual_iso)
+void fix_bad_pixels(struct frame_headers * frame_headers, uint16_t * image_data, int aggressive, int dual_iso, uint32_t generation)
 {
     int w = frame_headers->rawi_hdr.xRes;
     int h = frame_headers->rawi_hdr.yRes;
@@ -233,7 +237,7 @@ void fix_bad_pixels(struct frame_headers * frame_headers, uint16_t * image_data,
     struct bad_pixel_map * map = NULL;
     for(int i = 0; i < BAD_PIXEL_MAP_COUNT; i++)
     {
-        if(frame_headers->file_hdr.fileGuid && frame_headers->file_hdr.fileGuid == bad_pixel_maps[i].file_guid && aggressive == bad_pixel_maps[i].aggressive)
+        if(frame_headers->file_hdr.fileGuid && frame_headers->file_hdr.fileGuid == bad_pixel_maps[i].file_guid && aggressive == bad_pixel_maps[i].aggressive && generation == bad_pixel_maps[i].generation)
         {
             map = &(bad_pixel_maps[i]);
         }
@@ -248,6 +252,7 @@ void fix_bad_pixels(struct frame_headers * frame_headers, uint16_t * image_data,
         }
         map->file_guid = frame_headers->file_hdr.fileGuid;
         map->aggressive = aggressive;
+        map->generation = generation;
         map->count = 0;
         map->capacity = 32;
         map->pixels = malloc(sizeof(struct focus_pixel) * map->capacity);
@@ -401,6 +406,21 @@ static struct focus_pixel_map * load_focus_pixel_map(uint32_t camera_id, int wid
     return NULL;
 }
 
+/**
+ * Forgets the bad pixels found for a recording (e.g. because its MLV was replaced), they are searched again on the next frame
+ */
+void invalidate_bad_pixel_map(uint64_t file_guid)
+{
+    if(!file_guid) return;
+    for(int i = 0; i < BAD_PIXEL_MAP_COUNT; i++)
+    {
+        if(bad_pixel_maps[i].file_guid == file_guid)
+        {
+            bad_pixel_maps[i].file_guid = 0;
+        }
+    }
+}
+
 void free_focus_pixel_maps()
 {
     if(focus_pixel_maps)
@@ -411,10 +431,12 @@ void free_focus_pixel_maps()
         }
         free(focus_pixel_maps);
         focus_pixel_maps = NULL;
+        focus_pixel_map_count = 0;
     }
     for(size_t i = 0; i < BAD_PIXEL_MAP_COUNT; i++)
     {
         if(bad_pixel_maps[i].pixels) free(bad_pixel_maps[i].pixels);
+        memset(&bad_pixel_maps[i], 0, sizeof(bad_pixel_maps[i]));
     }
 }
 
@@ -25,8 +25,9 @@
 #include "dng.h"
 
 void chroma_smooth(struct frame_headers * frame_headers, uint16_t * image_data, int method);
-void fix_bad_pixels(struct frame_headers * frame_headers, uint16_t * image_data, int aggressive, int dual_iso);
+void fix_bad_pixels(struct frame_headers * frame_headers, uint16_t * image_data, int aggressive, int dual_iso, uint32_t generation);
 void fix_focus_pixels(struct frame_headers * frame_headers, uint16_t * image_data, int dual_iso);
 void free_focus_pixel_maps();
+void invalidate_bad_pixel_map(uint64_t file_guid);
 
 #endif
@@ -0,0 +1,476 @@
+/*
+ * Copyright (C) 2014 David Milligan
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the
+ * Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#if defined(_WIN32)
+#include <sys/utime.h>
+#else
+#include <utime.h>
+#endif
+#include "raw.h"
+#include "mlv.h"
+#include "mlvfs.h"
+#include "resource_manager.h"
+#include "settings.h"
+#include "framepool.h"
+#include "LZMA/LzmaLib.h"
+#include "diskcache.h"
+
+#define CREATE_MUTEX(x) static pthread_mutex_t x = PTHREAD_MUTEX_INITIALIZER;
+#define RELOCK(x) pthread_mutex_lock(&(x));
+#define UNLOCK(x) pthread_mutex_unlock(&(x));
+
+/*
+ * Keeps rendered DNGs in --cache-dir, so the expensive ones (e.g. Dual ISO or pattern noise fixes) survive
+ * eviction and remounts. A file is named after the clip's GUID, the frame and a hash of everything the render
+ * depends on (the processing settings and the DNG's name), so changing a setting simply misses. The header and
+ * the image data are LZMA compressed like the frames of compressed MLVs, on a background thread, and the least
+ * recently used files are deleted once the directory grows beyond --cache-dir-size
+ */
+
+#define DISKCACHE_MAGIC "MLVFSDC1"
+#define DISKCACHE_EXT ".dngz"
+#define DISKCACHE_MAX_PENDING 4
+//fast settings, the point is to beat rendering, not to save every byte
+#define DISKCACHE_LZMA_LEVEL 1
+#define DISKCACHE_LZMA_DICT_SIZE (1 << 20)
+
+struct diskcache_file_header
+{
+    char magic[8];
+    uint32_t header_size;
+    uint32_t size;
+    uint32_t header_compressed_size;
+    uint32_t data_compressed_size;
+    uint8_t header_props[LZMA_PROPS_SIZE];
+    uint8_t data_props[LZMA_PROPS_SIZE];
+};
+
+//a rendered DNG waiting to be written
+struct diskcache_job
+{
+    struct diskcache_job * next;
+    char * filename;
+    size_t header_size;
+    size_t size;
+    uint8_t * header;
+    uint8_t * data;
+};
+
+CREATE_MUTEX(diskcache_mutex)
+static pthread_cond_t diskcache_cond = PTHREAD_COND_INITIALIZER;
+
+static struct mlvfs * mlvfs_config = NULL;
+static struct diskcache_job * diskcache_jobs = NULL;
+static int diskcache_pending = 0;
+static uint64_t diskcache_limit = 0;
+//what the files take, from a scan of the directory plus the ones written since
+static uint64_t diskcache_bytes = 0;
+static volatile int halt_diskcache = 0;
+
+static pthread_t diskcache_thread;
+static int diskcache_running = 0;
+
+static uint32_t diskcache_hash(uint32_t hash, const void * data, size_t size)
+{
+    //FNV-1a
+    for(const unsigned char * c = (const unsigned char *)data; size--; c++)
+    {
+        hash = (hash ^ *c) * 16777619u;
+    }
+    return hash;
+}
+
+//Make sure you free() the result!!!
+static char * diskcache_filename(const struct frame_headers * frame_headers, int frame, const char * mlv_basename, const struct mlvfs_settings * settings)
+{
+    //everything process_frame() takes into account, but not the generation: the same values give the same DNG
+    int values[] =
+    {
+        settings->name_scheme, settings->chroma_smooth, settings->fix_bad_pixels, settings->fix_stripes,
+        settings->dual_iso, settings->hdr_interpolation_method, settings->hdr_no_fullres,
+        settings->hdr_no_alias_map, settings->deflicker, settings->fix_pattern_noise
+    };
+    uint32_t hash = 2166136261u;
+    hash = diskcache_hash(hash, values, sizeof(values));
+    hash = diskcache_hash(hash, &settings->fps, sizeof(settings->fps));
+    hash = diskcache_hash(hash, VERSION, strlen(VERSION));
+    if(mlv_basename) hash = diskcache_hash(hash, mlv_basename, strlen(mlv_basename));
+
+    char * filename = malloc(strlen(mlvfs_config->cache_dir) + strlen(DIR_SEP_STR) + 64);
+    if(filename)
+    {
+        int has_separator = string_ends_with(mlvfs_config->cache_dir, "/") || string_ends_with(mlvfs_config->cache_dir, "\\");
+        sprintf(filename, "%s%s%016llx_%06d_%08x" DISKCACHE_EXT, mlvfs_config->cache_dir, has_separator ? "" : DIR_SEP_STR,
+                (unsigned long long)frame_headers->file_hdr.fileGuid, frame, hash);
+    }
+    return filename;
+}
+
+/**
+ * Loads a rendered DNG from the cache directory into an image buffer (already allocated by the caller)
+ * @param frame_headers The frame's headers
+ * @param frame The frame number
+ * @param mlv_basename The name written into the DNG header
+ * @param image_buffer The image buffer
+ * @return 1 if the DNG was cached, 0 if it has to be rendered
+ */
+int diskcache_load(const struct frame_headers * frame_headers, int frame, const char * mlv_basename, struct image_buffer * image_buffer)
+{
+    if(!mlvfs_config || !mlvfs_config->cache_dir || !image_buffer->settings || !image_buffer->header || !image_buffer->data) return 0;
+
+    char * filename = diskcache_filename(frame_headers, frame, mlv_basename, image_buffer->settings);
+    if(!filename) return 0;
+
+    int result = 0;
+    FILE * in_file = fopen(filename, "rb");
+    if(in_file)
+    {
+        struct diskcache_file_header file_header;
+        uint8_t * compressed = NULL;
+        if(fread(&file_header, sizeof(struct diskcache_file_header), 1, in_file) == 1 &&
+           !memcmp(file_header.magic, DISKCACHE_MAGIC, sizeof(file_header.magic)) &&
+           file_header.header_size == image_buffer->header_size && file_header.size == image_buffer->size &&
+           (compressed = malloc(MAX(file_header.header_compressed_size, file_header.data_compressed_size) + 1)) != NULL)
+        {
+            size_t header_size = image_buffer->header_size;
+            size_t data_size = image_buffer->size;
+            SizeT header_compressed_size = file_header.header_compressed_size;
+            SizeT data_compressed_size = file_header.data_compressed_size;
+
+            result = fread(compressed, 1, header_compressed_size, in_file) == header_compressed_size &&
+                     LzmaUncompress(image_buffer->header, &header_size, compressed, &header_compressed_size, file_header.header_props, LZMA_PROPS_SIZE) == SZ_OK &&
+                     header_size == image_buffer->header_size;
+            result = result &&
+                     fread(compressed, 1, data_compressed_size, in_file) == data_compressed_size &&
+                     LzmaUncompress((uint8_t *)image_buffer->data, &data_size, compressed, &data_compressed_size, file_header.data_props, LZMA_PROPS_SIZE) == SZ_OK &&
+                     data_size == image_buffer->size;
+        }
+        free(compressed);
+        fclose(in_file);
+
+        if(result)
+        {
+            //the least recently used files are the ones deleted first
+            utime(filename, NULL);
+        }
+        else
+        {
+            err_printf("'%s' is damaged, deleting it\n", filename);
+            remove(filename);
+        }
+    }
+    dbg_printf("'%s' %s\n", filename, result ? "hit" : "miss");
+    free(filename);
+    return result;
+}
+
+/**
+ * Queues a rendered DNG to be written to the cache directory, it is dropped if the writer can't keep up
+ * @param frame_headers The frame's headers
+ * @param frame The frame number
+ * @param mlv_basename The name written into the DNG header
+ * @param image_buffer The rendered DNG, it is copied
+ */
+void diskcache_store(const struct frame_headers * frame_headers, int frame, const char * mlv_basename, const struct image_buffer * image_buffer)
+{
+    if(!diskcache_running || !image_buffer->settings || !image_buffer->header || !image_buffer->data) return;
+
+    int full = 0;
+    RELOCK(diskcache_mutex)
+    {
+        full = diskcache_pending >= DISKCACHE_MAX_PENDING;
+        if(!full) diskcache_pending++;
+    }
+    UNLOCK(diskcache_mutex)
+    if(full) return;
+
+    struct diskcache_job * job = calloc(1, sizeof(struct diskcache_job));
+    if(job)
+    {
+        job->filename = diskcache_filename(frame_headers, frame, mlv_basename, image_buffer->settings);
+        job->header_size = image_buffer->header_size;
+        job->size = image_buffer->size;
+        //copies of a whole frame, the pool has them from the previous ones
+        job->header = framepool_alloc(job->header_size);
+        job->data = framepool_alloc(job->size);
+    }
+    if(!job || !job->filename || !job->header || !job->data)
+    {
+        if(job)
+        {
+            free(job->filename);
+            framepool_free(job->header);
+            framepool_free(job->data);
+            free(job);
+        }
+        RELOCK(diskcache_mutex)
+        {
+            diskcache_pending--;
+        }
+        UNLOCK(diskcache_mutex)
+        return;
+    }
+    memcpy(job->header, image_buffer->header, job->header_size);
+    memcpy(job->data, image_buffer->data, job->size);
+
+    RELOCK(diskcache_mutex)
+    {
+        job->next = diskcache_jobs;
+        diskcache_jobs = job;
+        pthread_cond_signal(&diskcache_cond);
+    }
+    UNLOCK(diskcache_mutex)
+}
+
+static int diskcache_compress(const uint8_t * src, size_t size, uint8_t ** dest, uint32_t * dest_size, uint8_t * props)
+{
+    //incompressible data grows a little
+    size_t out_size = size + size / 3 + 128;
+    size_t props_size = LZMA_PROPS_SIZE;
+    *dest = malloc(out_size);
+    if(!*dest) return 0;
+    if(LzmaCompress(*dest, &out_size, src, size, props, &props_size, DISKCACHE_LZMA_LEVEL, DISKCACHE_LZMA_DICT_SIZE, 3, 0, 2, 32, 1) != SZ_OK)
+    {
+        free(*dest);
+        *dest = NULL;
+        return 0;
+    }
+    *dest_size = (uint32_t)out_size;
+    return 1;
+}
+
+static void diskcache_write(struct diskcache_job * job)
+{
+    struct diskcache_file_header file_header;
+    memset(&file_header, 0, sizeof(struct diskcache_file_header));
+    memcpy(file_header.magic, DISKCACHE_MAGIC, sizeof(file_header.magic));
+    file_header.header_size = (uint32_t)job->header_size;
+    file_header.size = (uint32_t)job->size;
+
+    uint8_t * header = NULL;
+    uint8_t * data = NULL;
+    if(!diskcache_compress(job->header, job->header_size, &header, &file_header.header_compressed_size, file_header.header_props) ||
+       !diskcache_compress(job->data, job->size, &data, &file_header.data_compressed_size, file_header.data_props))
+    {
+        err_printf("could not compress '%s'\n", job->filename);
+        free(header);
+        return;
+    }
+
+    char * temp_filename = malloc(strlen(job->filename) + 5);
+    if(temp_filename)
+    {
+        sprintf(temp_filename, "%s.tmp", job->filename);
+        FILE * out_file = fopen(temp_filename, "wb");
+        int written = out_file != NULL;
+        if(out_file)
+        {
+            written &= fwrite(&file_header, sizeof(struct diskcache_file_header), 1, out_file) == 1;
+            written &= fwrite(header, file_header.header_compressed_size, 1, out_file) == 1;
+            written &= fwrite(data, file_header.data_compressed_size, 1, out_file) == 1;
+            written &= fclose(out_file) == 0;
+        }
+#if defined(_WIN32)
+        //rename doesn't replace existing files here
+        if(written) remove(job->filename);
+#endif
+        if(!written || rename(temp_filename, job->filename))
+        {
+            int err = errno;
+            err_printf("could not write '%s': %s\n", job->filename, strerror(err));
+            remove(temp_filename);
+        }
+        else
+        {
+            diskcache_bytes += sizeof(struct diskcache_file_header) + file_header.header_compressed_size + file_header.data_compressed_size;
+            dbg_printf("'%s' %u -> %u bytes\n", job->filename, (uint32_t)(job->header_size + job->size), file_header.header_compressed_size + file_header.data_compressed_size);
+        }
+        free(temp_filename);
+    }
+    free(header);
+    free(data);
+}
+
+struct diskcache_entry
+{
+    char * filename;
+    time_t used;
+    uint64_t size;
+};
+
+static int diskcache_entry_compare(const void * a, const void * b)
+{
+    const struct diskcache_entry * entry_a = a;
+    const struct diskcache_entry * entry_b = b;
+    return entry_a->used < entry_b->used ? -1 : entry_a->used > entry_b->used;
+}
+
+/**
+ * Adds up what the files in the cache directory take, and deletes the least recently used ones down to evict_to bytes
+ */
+static void diskcache_scan(uint64_t evict_to)
+{
+    DIR * dir = opendir(mlvfs_config->cache_dir);
+    if(!dir) return;
+
+    struct diskcache_entry * entries = NULL;
+    uint32_t count = 0;
+    uint32_t allocated = 0;
+    uint64_t total = 0;
+    struct dirent * child;
+    while((child = readdir(dir)) != NULL)
+    {
+        if(!string_ends_with(child->d_name, DISKCACHE_EXT)) continue;
+        if(count >= allocated)
+        {
+            uint32_t new_allocated = allocated ? allocated * 2 : 256;
+            struct diskcache_entry * new_entries = realloc(entries, new_allocated * sizeof(struct diskcache_entry));
+            if(!new_entries) break;
+            entries = new_entries;
+            allocated = new_allocated;
+        }
+        struct diskcache_entry * entry = &entries[count];
+        entry->filename = malloc(strlen(mlvfs_config->cache_dir) + strlen(DIR_SEP_STR) + strlen(child->d_name) + 1);
+        if(!entry->filename) break;
+        int has_separator = string_ends_with(mlvfs_config->cache_dir, "/") || string_ends_with(mlvfs_config->cache_dir, "\\");
+        sprintf(entry->filename, "%s%s%s", mlvfs_config->cache_dir, has_separator ? "" : DIR_SEP_STR, child->d_name);
+        struct stat file_stat;
+        if(stat(entry->filename, &file_stat))
+        {
+            free(entry->filename);
+            continue;
+        }
+        entry->used = file_stat.st_mtime;
+        entry->size = (uint64_t)file_stat.st_size;
+        total += entry->size;
+        count++;
+    }
+    closedir(dir);
+
+    if(total > evict_to)
+    {
+        qsort(entries, count, sizeof(struct diskcache_entry), diskcache_entry_compare);
+        for(uint32_t i = 0; i < count && total > evict_to; i++)
+        {
+            if(!remove(entries[i].filename)) total -= entries[i].size;
+        }
+    }
+    for(uint32_t i = 0; i < count; i++)
+    {
+        free(entries[i].filename);
+    }
+    free(entries);
+    diskcache_bytes = total;
+}
+
+static void *diskcache_run(void *unused)
+{
+    diskcache_scan(diskcache_limit);
+    fprintf(stderr, "cache: %s holds %llu MB\n", mlvfs_config->cache_dir, (unsigned long long)(diskcache_bytes / 1024 / 1024));
+
+    while(1)
+    {
+        struct diskcache_job * job = NULL;
+        RELOCK(diskcache_mutex)
+        {
+            while(!halt_diskcache && !diskcache_jobs)
+            {
+                pthread_cond_wait(&diskcache_cond, &diskcache_mutex);
+            }
+            job = diskcache_jobs;
+            if(job) diskcache_jobs = job->next;
+        }
+        UNLOCK(diskcache_mutex)
+
+        //the queued ones are still written when stopping, there are only a few of them
+        if(!job) break;
+
+        diskcache_write(job);
+        //deleting in bulk (down to 90%), so the directory isn't scanned for every file
+        if(diskcache_bytes > diskcache_limit)
+        {
+            diskcache_scan(diskcache_limit / 10 * 9);
+        }
+
+        free(job->filename);
+        framepool_free(job->header);
+        framepool_free(job->data);
+        free(job);
+        RELOCK(diskcache_mutex)
+        {
+            diskcache_pending--;
+        }
+        UNLOCK(diskcache_mutex)
+    }
+    return NULL;
+}
+
+/**
+ * Starts the thread that writes rendered DNGs to mlvfs->cache_dir (creating it if needed)
+ */
+void diskcache_start(struct mlvfs * mlvfs)
+{
+    mlvfs_config = mlvfs;
+    if(!mlvfs_config->cache_dir) return;
+
+    struct stat dir_stat;
+    if(stat(mlvfs_config->cache_dir, &dir_stat))
+    {
+#ifdef _WIN32
+        mkdir(mlvfs_config->cache_dir);
+#else
+        mkdir(mlvfs_config->cache_dir, 0777);
+#endif
+    }
+
+    int size = mlvfs_config->cache_dir_size > 0 ? mlvfs_config->cache_dir_size : MLVFS_DEFAULT_CACHE_DIR_SIZE;
+    diskcache_limit = (uint64_t)size * 1024 * 1024;
+    halt_diskcache = 0;
+    diskcache_running = !pthread_create(&diskcache_thread, NULL, diskcache_run, NULL);
+}
+
+/**
+ * Writes the DNGs still queued, then stops the writer
+ */
+void diskcache_stop(void)
+{
+    RELOCK(diskcache_mutex)
+    {
+        halt_diskcache = 1;
+        pthread_cond_broadcast(&diskcache_cond);
+    }
+    UNLOCK(diskcache_mutex)
+
+    if(diskcache_running)
+    {
+        pthread_join(diskcache_thread, NULL);
+        diskcache_running = 0;
+    }
+}
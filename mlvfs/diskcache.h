@@ -0,0 +1,32 @@
+/*
+ * Copyright (C) 2014 David Milligan
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the
+ * Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ */
+
+#ifndef mlvfs_diskcache_h
+#define mlvfs_diskcache_h
+
+#include "mlvfs.h"
+#include "resource_manager.h"
+
+void diskcache_start(struct mlvfs * mlvfs);
+void diskcache_stop(void);
+int diskcache_load(const struct frame_headers * frame_headers, int frame, const char * mlv_basename, struct image_buffer * image_buffer);
+void diskcache_store(const struct frame_headers * frame_headers, int frame, const char * mlv_basename, const struct image_buffer * image_buffer);
+
+#endif
@@ -0,0 +1,336 @@
+/*
+ * Copyright (C) 2014 David Milligan
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the
+ * Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#if defined(_WIN32)
+#include <windows.h>
+#include <psapi.h>
+#else
+#include <sys/time.h>
+#include <sys/resource.h>
+#endif
+#if defined(__linux__)
+#include <sys/mman.h>
+#endif
+#include "raw.h"
+#include "mlv.h"
+#include "mlvfs.h"
+#include "framepool.h"
+
+#define CREATE_MUTEX(x) static pthread_mutex_t x = PTHREAD_MUTEX_INITIALIZER;
+#define RELOCK(x) pthread_mutex_lock(&(x));
+#define UNLOCK(x) pthread_mutex_unlock(&(x));
+
+/*
+ * Rendering a frame takes several frame sized working buffers (the compressed or packed frame, the Dual ISO planes,
+ * a copy for chroma smoothing...) that are freed again right after. Rather than going through malloc() for them
+ * at every frame, freed buffers are kept here and handed out again for the next frame. They are grouped by their
+ * size rounded up to FRAMEPOOL_GRANULE, so all the frames of a clip (which have the same geometry) share a few
+ * classes; the idle buffers are capped by --pool-size, the least recently used classes give theirs up first.
+ */
+
+#define FRAMEPOOL_GRANULE (64 * 1024)
+#define FRAMEPOOL_CLASSES 32
+//room for struct framepool_block, keeping what follows aligned
+#define FRAMEPOOL_HEADER_SIZE 64
+#define FRAMEPOOL_HUGEPAGE_SIZE (2 * 1024 * 1024)
+
+//precedes every buffer
+struct framepool_block
+{
+    //the next idle block of the same class
+    struct framepool_block * next;
+    //header included, a multiple of the granule
+    size_t size;
+    //mmap()ed for huge pages rather than malloc()ed
+    int mapped;
+};
+
+struct framepool_class
+{
+    size_t size;
+    struct framepool_block * idle;
+    uint64_t last_used;
+};
+
+CREATE_MUTEX(framepool_mutex)
+static struct framepool_class framepool_classes[FRAMEPOOL_CLASSES];
+static uint64_t framepool_clock = 0;
+static size_t framepool_limit = (size_t)MLVFS_DEFAULT_POOL_SIZE * 1024 * 1024;
+static int framepool_hugepages = 0;
+static size_t framepool_idle_bytes = 0;
+static size_t framepool_used_bytes = 0;
+static size_t framepool_peak_bytes = 0;
+static uint64_t framepool_hits = 0;
+static uint64_t framepool_misses = 0;
+
+/**
+ * Applies --pool-size and --hugepages
+ */
+void framepool_start(struct mlvfs * mlvfs)
+{
+    RELOCK(framepool_mutex)
+    {
+        if(mlvfs->pool_size > 0) framepool_limit = (size_t)mlvfs->pool_size * 1024 * 1024;
+        framepool_hugepages = mlvfs->hugepages;
+    }
+    UNLOCK(framepool_mutex)
+}
+
+static size_t framepool_block_size(size_t size)
+{
+    size_t granule = framepool_hugepages && size >= FRAMEPOOL_HUGEPAGE_SIZE ? FRAMEPOOL_HUGEPAGE_SIZE : FRAMEPOOL_GRANULE;
+    return (size + FRAMEPOOL_HEADER_SIZE + granule - 1) / granule * granule;
+}
+
+static struct framepool_block * framepool_block_alloc(size_t size)
+{
+    struct framepool_block * block = NULL;
+#if defined(__linux__)
+    if(framepool_hugepages && size >= FRAMEPOOL_HUGEPAGE_SIZE)
+    {
+        void * mapping = MAP_FAILED;
+#ifdef MAP_HUGETLB
+        mapping = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+#endif
+        if(mapping == MAP_FAILED)
+        {
+            //no huge pages reserved (vm.nr_hugepages), ask for transparent ones instead
+            mapping = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+#ifdef MADV_HUGEPAGE
+            if(mapping != MAP_FAILED) madvise(mapping, size, MADV_HUGEPAGE);
+#endif
+        }
+        if(mapping != MAP_FAILED)
+        {
+            block = (struct framepool_block *)mapping;
+            block->mapped = 1;
+        }
+    }
+#endif
+    if(!block)
+    {
+        block = (struct framepool_block *)malloc(size);
+        if(!block) return NULL;
+        block->mapped = 0;
+    }
+    block->next = NULL;
+    block->size = size;
+    return block;
+}
+
+static void framepool_block_free(struct framepool_block * block)
+{
+    while(block)
+    {
+        struct framepool_block * next = block->next;
+#if defined(__linux__)
+        if(block->mapped)
+        {
+            munmap(block, block->size);
+            block = next;
+            continue;
+        }
+#endif
+        free(block);
+        block = next;
+    }
+}
+
+//takes all the idle blocks of a class, and puts them on a list (the pool must be locked)
+static void framepool_release_class(struct framepool_class * pool_class, struct framepool_block ** released)
+{
+    while(pool_class->idle)
+    {
+        struct framepool_block * block = pool_class->idle;
+        pool_class->idle = block->next;
+        framepool_idle_bytes -= block->size;
+        block->next = *released;
+        *released = block;
+    }
+}
+
+//the class of a size, a new one replaces the least recently used class if there is no room (the pool must be locked)
+static struct framepool_class * framepool_find_class(size_t size, struct framepool_block ** released)
+{
+    struct framepool_class * oldest = &framepool_classes[0];
+    for(int i = 0; i < FRAMEPOOL_CLASSES; i++)
+    {
+        struct framepool_class * pool_class = &framepool_classes[i];
+        if(pool_class->size == size) return pool_class;
+        if(pool_class->last_used < oldest->last_used) oldest = pool_class;
+    }
+    //unused classes have never been used, so they are the oldest
+    framepool_release_class(oldest, released);
+    oldest->size = size;
+    return oldest;
+}
+
+/**
+ * Gets a working buffer, an idle one of the same size class if there is one
+ * Make sure you framepool_free() the result (not free())!!!
+ * @param size The size in bytes
+ * @return the buffer (uninitialized), or NULL if out of memory
+ */
+void * framepool_alloc(size_t size)
+{
+    struct framepool_block * block = NULL;
+    struct framepool_block * released = NULL;
+    size_t block_size = 0;
+    RELOCK(framepool_mutex)
+    {
+        block_size = framepool_block_size(size);
+        struct framepool_class * pool_class = framepool_find_class(block_size, &released);
+        pool_class->last_used = ++framepool_clock;
+        if(pool_class->idle)
+        {
+            block = pool_class->idle;
+            pool_class->idle = block->next;
+            block->next = NULL;
+            framepool_idle_bytes -= block->size;
+            framepool_hits++;
+        }
+        else
+        {
+            framepool_misses++;
+        }
+        framepool_used_bytes += block_size;
+        framepool_peak_bytes = MAX(framepool_peak_bytes, framepool_used_bytes + framepool_idle_bytes);
+    }
+    UNLOCK(framepool_mutex)
+    framepool_block_free(released);
+
+    if(!block)
+    {
+        block = framepool_block_alloc(block_size);
+        if(!block)
+        {
+            err_printf("malloc error\n");
+            RELOCK(framepool_mutex)
+            {
+                framepool_used_bytes -= block_size;
+            }
+            UNLOCK(framepool_mutex)
+            return NULL;
+        }
+    }
+    return (uint8_t *)block + FRAMEPOOL_HEADER_SIZE;
+}
+
+/**
+ * Gives a buffer from framepool_alloc() back, it is kept for reuse unless that would exceed --pool-size
+ */
+void framepool_free(void * buffer)
+{
+    if(!buffer) return;
+
+    struct framepool_block * block = (struct framepool_block *)((uint8_t *)buffer - FRAMEPOOL_HEADER_SIZE);
+    struct framepool_block * released = NULL;
+    RELOCK(framepool_mutex)
+    {
+        framepool_used_bytes -= block->size;
+        if(block->size <= framepool_limit)
+        {
+            struct framepool_class * pool_class = framepool_find_class(block->size, &released);
+            pool_class->last_used = ++framepool_clock;
+
+            //make room by dropping the idle blocks of the classes that haven't been used for the longest time
+            while(framepool_idle_bytes + block->size > framepool_limit)
+            {
+                struct framepool_class * oldest = NULL;
+                for(int i = 0; i < FRAMEPOOL_CLASSES; i++)
+                {
+                    struct framepool_class * current = &framepool_classes[i];
+                    if(current->idle && (!oldest || current->last_used < oldest->last_used)) oldest = current;
+                }
+                if(!oldest) break;
+                //one at a time, a class that is still in use keeps the rest
+                struct framepool_block * dropped = oldest->idle;
+                oldest->idle = dropped->next;
+                framepool_idle_bytes -= dropped->size;
+                dropped->next = released;
+                released = dropped;
+            }
+
+            block->next = pool_class->idle;
+            pool_class->idle = block;
+            framepool_idle_bytes += block->size;
+            block = NULL;
+        }
+    }
+    UNLOCK(framepool_mutex)
+    framepool_block_free(released);
+    framepool_block_free(block);
+}
+
+static size_t framepool_peak_rss()
+{
+#if defined(_WIN32)
+    PROCESS_MEMORY_COUNTERS counters;
+    if(GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters))) return counters.PeakWorkingSetSize;
+    return 0;
+#else
+    struct rusage usage;
+    if(getrusage(RUSAGE_SELF, &usage)) return 0;
+#if defined(__APPLE__)
+    //bytes on OSX, KB everywhere else
+    return (size_t)usage.ru_maxrss;
+#else
+    return (size_t)usage.ru_maxrss * 1024;
+#endif
+#endif
+}
+
+void framepool_get_stats(struct framepool_stats * stats)
+{
+    RELOCK(framepool_mutex)
+    {
+        stats->limit = framepool_limit;
+        stats->idle_bytes = framepool_idle_bytes;
+        stats->used_bytes = framepool_used_bytes;
+        stats->peak_bytes = framepool_peak_bytes;
+        stats->hits = framepool_hits;
+        stats->misses = framepool_misses;
+    }
+    UNLOCK(framepool_mutex)
+    stats->peak_rss = framepool_peak_rss();
+}
+
+/**
+ * Frees the idle buffers, the ones still in use are freed as they are given back
+ */
+void framepool_free_all(void)
+{
+    struct framepool_block * released = NULL;
+    RELOCK(framepool_mutex)
+    {
+        for(int i = 0; i < FRAMEPOOL_CLASSES; i++)
+        {
+            framepool_release_class(&framepool_classes[i], &released);
+        }
+        framepool_limit = 0;
+    }
+    UNLOCK(framepool_mutex)
+    framepool_block_free(released);
+}
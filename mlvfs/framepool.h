@@ -0,0 +1,48 @@
+/*
+ * Copyright (C) 2014 David Milligan
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the
+ * Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ */
+
+#ifndef mlvfs_framepool_h
+#define mlvfs_framepool_h
+
+#include <stdio.h>
+#include <stdint.h>
+#include "mlvfs.h"
+
+struct framepool_stats
+{
+    //how much idle memory is kept for reuse
+    size_t limit;
+    size_t idle_bytes;
+    size_t used_bytes;
+    //the most the pool has held (idle and in use) at once
+    size_t peak_bytes;
+    uint64_t hits;
+    uint64_t misses;
+    //the peak resident memory of the whole process, 0 if unknown
+    size_t peak_rss;
+};
+
+void framepool_start(struct mlvfs * mlvfs);
+void * framepool_alloc(size_t size);
+void framepool_free(void * buffer);
+void framepool_get_stats(struct framepool_stats * stats);
+void framepool_free_all(void);
+
+#endif
@@ -20,6 +20,7 @@
 
 #include "gif.h"
 #include "index.h"
+#include "clip.h"
 
 #include <string.h>
 #include <stdio.h>
@@ -82,9 +83,12 @@ static uint8_t gif_animation_graphics_block[] = {0x21, 0xF9, 0x04, 0x00, 0x32, 0
 size_t gif_get_data(const char * path, uint8_t * output_buffer, off_t offset, size_t max_size)
 {
     struct frame_headers frame_headers;
-    if(mlv_get_frame_headers(path, 0, &frame_headers))
+    struct mlv_clip * clip = get_or_create_clip(path);
+    if(clip && clip_get_frame_headers(clip, 0, &frame_headers))
     {
-        int frame_count = mlv_get_frame_count(path);
+        pthread_mutex_lock(&clip->mutex);
+        int frame_count = clip->frame_count;
+        pthread_mutex_unlock(&clip->mutex);
         FILE **chunk_files = NULL;
         uint32_t chunk_count = 0;
         chunk_files = load_chunks(path, &chunk_count);
@@ -156,7 +160,7 @@ size_t gif_get_data(const char * path, uint8_t * output_buffer, off_t offset, si
             {
                 int mlv_frame_number = gif_frame * frame_count / FRAME_COUNT;
                 
-                if(!mlv_get_frame_headers(path, mlv_frame_number, &frame_headers))
+                if(!clip_get_frame_headers(clip, mlv_frame_number, &frame_headers))
                 {
                     err_printf("GIF Error: could not get MLV frame headers\n");
                     continue;
@@ -30,6 +30,7 @@
 #include "hdr.h"
 #include "opt_med.h"
 #include "wirth.h"
+#include "framepool.h"
 #include "cs.h"
 #include <pthread.h>
 
@@ -827,7 +828,8 @@ static inline uint32_t * convert_to_20bit(struct raw_info raw_info, uint16_t * i
     int w = raw_info.width;
     int h = raw_info.height;
     /* promote from 14 to 20 bits (original raw buffer holds 14-bit values stored as uint16_t) */
-    uint32_t * raw_buffer_32 = malloc(w * h * sizeof(raw_buffer_32[0]));
+    uint32_t * raw_buffer_32 = framepool_alloc(w * h * sizeof(raw_buffer_32[0]));
+    if (!raw_buffer_32) return NULL;
     
     for (int y = 0; y < h; y ++)
         for (int x = 0; x < w; x ++)
@@ -1815,6 +1817,7 @@ static int hdr_interpolate(struct raw_info raw_info, uint16_t * image_data, int
     
     /* promote from 14 to 20 bits (original raw buffer holds 14-bit values stored as uint16_t) */
     uint32_t * raw_buffer_32 = convert_to_20bit(raw_info, image_data);
+    if (!raw_buffer_32) return 0;
     
     /* we have now switched to 20-bit, update noise numbers */
     dark_noise *= 64;
@@ -1822,19 +1825,21 @@ static int hdr_interpolate(struct raw_info raw_info, uint16_t * image_data, int
     dark_noise_ev += 6;
     bright_noise_ev += 6;
     
+    /* the full frame planes below are needed again for the next frame, so they come from the pool */
+    
     /* dark and bright exposures, interpolated */
-    uint32_t* dark   = malloc(w * h * sizeof(uint32_t));
-    uint32_t* bright = malloc(w * h * sizeof(uint32_t));
+    uint32_t* dark   = framepool_alloc(w * h * sizeof(uint32_t));
+    uint32_t* bright = framepool_alloc(w * h * sizeof(uint32_t));
     memset(dark, 0, w * h * sizeof(uint32_t));
     memset(bright, 0, w * h * sizeof(uint32_t));
     
     /* fullres image (minimizes aliasing) */
-    uint32_t* fullres = malloc(w * h * sizeof(uint32_t));
+    uint32_t* fullres = framepool_alloc(w * h * sizeof(uint32_t));
     memset(fullres, 0, w * h * sizeof(uint32_t));
     uint32_t* fullres_smooth = fullres;
     
     /* halfres image (minimizes noise and banding) */
-    uint32_t* halfres = malloc(w * h * sizeof(uint32_t));
+    uint32_t* halfres = framepool_alloc(w * h * sizeof(uint32_t));
     memset(halfres, 0, w * h * sizeof(uint32_t));
     uint32_t* halfres_smooth = halfres;
     
@@ -1842,19 +1847,19 @@ static int hdr_interpolate(struct raw_info raw_info, uint16_t * image_data, int
     {
         if (use_fullres)
         {
-            fullres_smooth = malloc(w * h * sizeof(uint32_t));
+            fullres_smooth = framepool_alloc(w * h * sizeof(uint32_t));
         }
-        halfres_smooth = malloc(w * h * sizeof(uint32_t));
+        halfres_smooth = framepool_alloc(w * h * sizeof(uint32_t));
     }
     
     /* overexposure map */
-    uint16_t * overexposed = malloc(w * h * sizeof(uint16_t));
+    uint16_t * overexposed = framepool_alloc(w * h * sizeof(uint16_t));
     memset(overexposed, 0, w * h * sizeof(uint16_t));
     
     uint16_t* alias_map = NULL;
     if(use_alias_map)
     {
-        alias_map = malloc(w * h * sizeof(uint16_t));
+        alias_map = framepool_alloc(w * h * sizeof(uint16_t));
         memset(alias_map, 0, w * h * sizeof(uint16_t));
     }
     
@@ -1918,18 +1923,19 @@ static int hdr_interpolate(struct raw_info raw_info, uint16_t * image_data, int
         h++;
     }
     
-    free(dark);
-    free(bright);
-    free(fullres);
-    free(halfres);
-    free(overexposed);
-    free(raw_buffer_32);
-    if (fullres_smooth && fullres_smooth != fullres) free(fullres_smooth);
-    if (halfres_smooth && halfres_smooth != halfres) free(halfres_smooth);
+    framepool_free(dark);
+    framepool_free(bright);
+    framepool_free(fullres);
+    framepool_free(halfres);
+    framepool_free(overexposed);
+    framepool_free(alias_map);
+    framepool_free(raw_buffer_32);
+    if (fullres_smooth && fullres_smooth != fullres) framepool_free(fullres_smooth);
+    if (halfres_smooth && halfres_smooth != halfres) framepool_free(halfres_smooth);
     return ret;
 }
 
-int cr2hdr20_convert_data(struct frame_headers * frame_headers, uint16_t * image_data, int interp_method, int fullres, int use_alias_map, int chroma_smooth_method, int fix_bad_pixels_mode)
+int cr2hdr20_convert_data(struct frame_headers * frame_headers, uint16_t * image_data, int interp_method, int fullres, int use_alias_map, int chroma_smooth_method, int fix_bad_pixels_mode, uint32_t settings_generation)
 {
     struct raw_info raw_info = frame_headers->rawi_hdr.raw_info;
     raw_info.width = frame_headers->rawi_hdr.xRes;
@@ -1944,7 +1950,7 @@ int cr2hdr20_convert_data(struct frame_headers * frame_headers, uint16_t * image
         fix_focus_pixels(frame_headers, image_data, 1);
         if(fix_bad_pixels_mode)
         {
-            fix_bad_pixels(frame_headers, image_data, fix_bad_pixels_mode == 2, 1);
+            fix_bad_pixels(frame_headers, image_data, fix_bad_pixels_mode == 2, 1, settings_generation);
         }
         if(hdr_interpolate(raw_info, image_data, interp_method, fullres, use_alias_map, chroma_smooth_method))
         {
@@ -25,6 +25,6 @@
 #include "dng.h"
 
 int hdr_convert_data(struct frame_headers * frame_headers, uint16_t * image_data, off_t offset, size_t max_size);
-int cr2hdr20_convert_data(struct frame_headers * frame_headers, uint16_t * image_data, int interp_method, int fullres, int use_alias_map, int chroma_smooth, int fix_bad_pixels_mode);
+int cr2hdr20_convert_data(struct frame_headers * frame_headers, uint16_t * image_data, int interp_method, int fullres, int use_alias_map, int chroma_smooth, int fix_bad_pixels_mode, uint32_t settings_generation);
 
 #endif
@@ -23,13 +23,54 @@
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#if defined(_WIN32)
+#include <windows.h>
+#else
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#endif
 
 #include "raw.h"
 #include "mlv.h"
 #include "mlvfs.h"
+#include "index.h"
 
 /* helper macros */
 #define MIN(a,b) (((a)<(b))?(a):(b))
+#define MAX(a,b) (((a)>(b))?(a):(b))
+
+/* how many frames the fast path for equally sized VIDF blocks jumps ahead at once (it doubles after every hit) */
+#define INDEX_STRIDE_MIN_SKIP 8
+#define INDEX_STRIDE_MAX_SKIP 1024
+
+/* how often (in seconds) a cached index is compared with the chunk files, to pick up recordings that are still being copied */
+#define INDEX_CHECK_INTERVAL 1.0
+
+/* guards the list of cached indexes and their reference counts, the indexes themselves are checked and built without it */
+static pthread_mutex_t index_mutex = PTHREAD_MUTEX_INITIALIZER;
+/* signalled whenever an entry stops building */
+static pthread_cond_t index_built = PTHREAD_COND_INITIALIZER;
+static struct mlv_index *indexes = NULL;
+static volatile long index_serial = 0;
+
+/* the IDX files renamed into place here, so the watcher can tell them from the ones other tools write */
+#define INDEX_OWN_WRITES 32
+struct index_own_write
+{
+    char *filename;
+    uint64_t ino;
+};
+static pthread_mutex_t index_own_write_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct index_own_write index_own_writes[INDEX_OWN_WRITES];
+static uint32_t index_own_write_next = 0;
+
+static pthread_mutex_t index_stats_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct index_stats index_stats;
 
 /* platform/target specific fseek/ftell functions go here */
 uint64_t file_get_pos(FILE *stream)
@@ -50,6 +91,18 @@ uint32_t file_set_pos(FILE *stream, uint64_t offset, int whence)
 #endif
 }
 
+/* wall clock time in seconds, used for reporting index build times */
+static double index_get_time()
+{
+#if defined(_WIN32)
+    return (double)GetTickCount64() / 1000.0;
+#else
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (double)now.tv_sec + (double)now.tv_nsec / 1000000000.0;
+#endif
+}
+
 /* this structure is used to build the mlv_xref_t table */
 typedef struct
 {
@@ -59,7 +112,8 @@ typedef struct
     uint16_t    frameType;
 } frame_xref_t;
 
-void xref_resize(frame_xref_t **table, uint32_t entries, uint32_t *allocated)
+/* returns 0 if out of memory, the table is left as it was then */
+int xref_resize(frame_xref_t **table, uint32_t entries, uint32_t *allocated)
 {
     /* make sure there is no crappy pointer before using */
     if(*allocated == 0)
@@ -70,131 +124,289 @@ void xref_resize(frame_xref_t **table, uint32_t entries, uint32_t *allocated)
     /* only resize if the buffer is too small */
     if(entries * sizeof(frame_xref_t) > *allocated)
     {
-        *allocated += (entries + 1) * sizeof(frame_xref_t);
-        *table = (frame_xref_t *)realloc(*table, *allocated);
+        uint32_t new_allocated = *allocated + (entries + 1) * sizeof(frame_xref_t);
+        frame_xref_t *new_table = (frame_xref_t *)realloc(*table, new_allocated);
+        if(!new_table)
+        {
+            return 0;
+        }
+        *table = new_table;
+        *allocated = new_allocated;
+    }
+    return 1;
+}
+
+/* blocks with the same timestamp (e.g. the MLVI headers) keep their file order */
+static int xref_compare(const frame_xref_t *a, const frame_xref_t *b)
+{
+    if(a->frameTime != b->frameTime) return a->frameTime < b->frameTime ? -1 : 1;
+    if(a->fileNumber != b->fileNumber) return a->fileNumber < b->fileNumber ? -1 : 1;
+    if(a->frameOffset != b->frameOffset) return a->frameOffset < b->frameOffset ? -1 : 1;
+    return 0;
+}
+
+static int xref_qsort_compare(const void *a, const void *b)
+{
+    return xref_compare((const frame_xref_t *)a, (const frame_xref_t *)b);
+}
+
+/* min-heap of run heads, keyed by the current entry of each run */
+static void xref_heap_down(frame_xref_t *table, uint32_t *heap, uint32_t *pos, uint32_t heap_size, uint32_t node)
+{
+    while(1)
+    {
+        uint32_t smallest = node;
+        uint32_t left = 2 * node + 1;
+        uint32_t right = 2 * node + 2;
+
+        if(left < heap_size && xref_compare(&table[pos[heap[left]]], &table[pos[heap[smallest]]]) < 0) smallest = left;
+        if(right < heap_size && xref_compare(&table[pos[heap[right]]], &table[pos[heap[smallest]]]) < 0) smallest = right;
+        if(smallest == node) break;
+
+        uint32_t tmp = heap[node];
+        heap[node] = heap[smallest];
+        heap[smallest] = tmp;
+        node = smallest;
     }
 }
 
-void xref_sort(frame_xref_t *table, uint32_t entries)
+/**
+ * Sorts the xref table by timestamp. The table consists of run_count runs (one per chunk file), run i
+ * spanning [run_starts[i], run_starts[i + 1]). Each chunk is normally already in timestamp order, so the
+ * runs are merged in O(n log k); a run that is out of order is sorted on its own first.
+ * @return the sorted table (the input table is freed), or NULL on malloc error
+ */
+frame_xref_t *xref_sort(frame_xref_t *table, uint32_t entries, const uint32_t *run_starts, uint32_t run_count)
 {
-    if (!entries) return;
-    
-    uint32_t n = entries;
-    do
+    if (entries < 2) return table;
+
+    for(uint32_t run = 0; run < run_count; run++)
     {
-        uint32_t newn = 1;
-        for (uint32_t i = 0; i < n-1; ++i)
+        uint32_t start = run_starts[run];
+        uint32_t end = run_starts[run + 1];
+        for(uint32_t i = start + 1; i < end; i++)
         {
-            if (table[i].frameTime > table[i+1].frameTime)
+            if(xref_compare(&table[i - 1], &table[i]) > 0)
             {
-                frame_xref_t tmp = table[i+1];
-                table[i+1] = table[i];
-                table[i] = tmp;
-                newn = i + 1;
+                dbg_printf("file #%d is out of order, sorting %d entries\n", run, end - start);
+                qsort(&table[start], end - start, sizeof(frame_xref_t), xref_qsort_compare);
+                break;
             }
         }
-        n = newn;
-    } while (n > 1);
+    }
+
+    if(run_count < 2) return table;
+
+    frame_xref_t *sorted = (frame_xref_t *)malloc(entries * sizeof(frame_xref_t));
+    uint32_t *heap = (uint32_t *)malloc(run_count * sizeof(uint32_t));
+    uint32_t *pos = (uint32_t *)malloc(run_count * sizeof(uint32_t));
+    if(!sorted || !heap || !pos)
+    {
+        err_printf("malloc error (requested size %zu)\n", entries * sizeof(frame_xref_t));
+        free(sorted);
+        free(heap);
+        free(pos);
+        free(table);
+        return NULL;
+    }
+
+    uint32_t heap_size = 0;
+    for(uint32_t run = 0; run < run_count; run++)
+    {
+        pos[run] = run_starts[run];
+        if(run_starts[run] < run_starts[run + 1])
+        {
+            heap[heap_size++] = run;
+        }
+    }
+    for(uint32_t node = heap_size / 2; node-- > 0; )
+    {
+        xref_heap_down(table, heap, pos, heap_size, node);
+    }
+
+    for(uint32_t entry = 0; entry < entries && heap_size > 0; entry++)
+    {
+        uint32_t run = heap[0];
+        sorted[entry] = table[pos[run]++];
+
+        /* drop exhausted runs from the heap */
+        if(pos[run] == run_starts[run + 1])
+        {
+            heap[0] = heap[--heap_size];
+        }
+        xref_heap_down(table, heap, pos, heap_size, 0);
+    }
+
+    free(heap);
+    free(pos);
+    free(table);
+
+    return sorted;
 }
 
-mlv_xref_hdr_t *load_index(const char *base_filename)
+/* name of the IDX (ext "IDX") or another file that belongs to a MLV, make sure you free() the result */
+static char *index_get_filename(const char *base_filename, const char *ext)
 {
-    size_t filename_size = (strlen(base_filename) + 1) * sizeof(char);
+    size_t length = strlen(base_filename);
+    size_t filename_size = (length + strlen(ext) + 1) * sizeof(char);
     char * filename = (char*)malloc(filename_size);
-    
+
     if(!filename)
     {
         err_printf("malloc error (requested size %zu)\n", filename_size);
         return NULL;
     }
     strncpy(filename, base_filename, filename_size);
-    
-    mlv_xref_hdr_t *block_hdr = NULL;
-    FILE *in_file = NULL;
+    strcpy(&filename[length - 3], ext);
 
-    strcpy(&filename[strlen(filename) - 3], "IDX");
+    return filename;
+}
 
-    in_file = fopen(filename, "rb");
-    
-    free(filename);
+/* size and modification time of a file that isn't open */
+static int index_path_stat(const char *filename, uint64_t *size, int64_t *time)
+{
+#if defined(_WIN32)
+    struct _stat64 file_stat;
+    if(_stat64(filename, &file_stat)) return 0;
+#else
+    struct stat file_stat;
+    if(stat(filename, &file_stat)) return 0;
+#endif
+    *size = (uint64_t)file_stat.st_size;
+    *time = (int64_t)file_stat.st_mtime;
+    return 1;
+}
 
-    if (!in_file)
+/**
+ * Opens a new file to be put in place of filename by index_file_commit
+ * The IDX may be mapped by other threads, so it is never truncated in place: a temp file is written and renamed over it
+ * @param temp_filename [out] The name of the temp file, pass it on to index_file_commit
+ */
+static FILE *index_file_create(const char *filename, char **temp_filename)
+{
+#if defined(_WIN32)
+    *temp_filename = NULL;
+    return fopen(filename, "wb+");
+#else
+    /* X.IDX is written as X.tmp.IDX */
+    const char * ext = strrchr(filename, '.');
+    size_t stem_length = ext ? (size_t)(ext - filename) : strlen(filename);
+    size_t temp_filename_size = strlen(filename) + 5;
+    *temp_filename = (char*)malloc(temp_filename_size);
+    if(!*temp_filename)
     {
+        err_printf("malloc error (requested size %zu)\n", temp_filename_size);
         return NULL;
     }
+    memcpy(*temp_filename, filename, stem_length);
+    strcpy(&(*temp_filename)[stem_length], ".tmp");
+    strcat(*temp_filename, ext ? ext : "");
 
-    do
+    FILE *out_file = fopen(*temp_filename, "wb+");
+    if(!out_file)
     {
-        mlv_hdr_t buf;
-        int64_t position = 0;
+        free(*temp_filename);
+        *temp_filename = NULL;
+    }
+    return out_file;
+#endif
+}
 
-        position = file_get_pos(in_file);
+#if !defined(_WIN32)
+/**
+ * Remembers an IDX that is about to be renamed into place, the oldest record goes if nobody asks about them (e.g. there is no watcher)
+ */
+static void index_own_write_add(const char *filename, uint64_t ino)
+{
+    char *copy = (char*)malloc(strlen(filename) + 1);
+    if(!copy)
+    {
+        return;
+    }
+    strcpy(copy, filename);
+
+    pthread_mutex_lock(&index_own_write_mutex);
+    struct index_own_write *own_write = &index_own_writes[index_own_write_next];
+    index_own_write_next = (index_own_write_next + 1) % INDEX_OWN_WRITES;
+    free(own_write->filename);
+    own_write->filename = copy;
+    own_write->ino = ino;
+    pthread_mutex_unlock(&index_own_write_mutex);
+}
 
-        if(fread(&buf, sizeof(mlv_hdr_t), 1, in_file) != 1)
+/**
+ * Forgets an IDX renamed into place here
+ * @return 1 if there was a record of it, 0 otherwise
+ */
+static int index_own_write_take(const char *filename, uint64_t ino)
+{
+    int result = 0;
+    pthread_mutex_lock(&index_own_write_mutex);
+    for(uint32_t i = 0; i < INDEX_OWN_WRITES && !result; i++)
+    {
+        struct index_own_write *own_write = &index_own_writes[i];
+        if(own_write->filename && own_write->ino == ino && !strcmp(own_write->filename, filename))
         {
-            break;
+            free(own_write->filename);
+            own_write->filename = NULL;
+            result = 1;
         }
+    }
+    pthread_mutex_unlock(&index_own_write_mutex);
+    return result;
+}
+#endif
 
-        /* jump back to the beginning of the block just read */
-        file_set_pos(in_file, position, SEEK_SET);
-
-        /* we should check the MLVI header for matching UID value to make sure its the right index... */
-        if(!memcmp(buf.blockType, "XREF", 4))
-        {
-            block_hdr = (mlv_xref_hdr_t *)malloc(buf.blockSize);
-            if (!block_hdr)
-            {
-                fclose(in_file);
-                return NULL;
-            }
-
-            if(fread(block_hdr, buf.blockSize, 1, in_file) != 1)
-            {
-                free(block_hdr);
-                block_hdr = NULL;
-            }
-        }
-        else
-        {
-            file_set_pos(in_file, position + buf.blockSize, SEEK_SET);
-        }
+/**
+ * Closes a file opened with index_file_create and moves it into place
+ * @param written Nonzero if everything was written, the temp file is thrown away otherwise
+ * @return 1 if successful, 0 otherwise
+ */
+static int index_file_commit(FILE *out_file, const char *filename, char *temp_filename, int written)
+{
+    written &= fclose(out_file) == 0;
 
-        /* we are at the same position as before, so abort */
-        if(position == file_get_pos(in_file))
+#if !defined(_WIN32)
+    /* recorded before the rename, the watcher may see it before rename() even returns (the inode stays the same) */
+    struct stat temp_stat;
+    int own_write = written && string_ends_with(filename, ".IDX") && !stat(temp_filename, &temp_stat);
+    if(own_write)
+    {
+        index_own_write_add(filename, (uint64_t)temp_stat.st_ino);
+    }
+    if(!written || rename(temp_filename, filename))
+    {
+        int err = errno;
+        err_printf("could not write '%s': %s\n", filename, strerror(err));
+        remove(temp_filename);
+        if(own_write)
         {
-            break;
+            index_own_write_take(filename, (uint64_t)temp_stat.st_ino);
         }
+        written = 0;
     }
-    while(!feof(in_file));
-
-    fclose(in_file);
+    free(temp_filename);
+#endif
 
-    return block_hdr;
+    return written;
 }
 
-void save_index(const char *base_filename, mlv_file_hdr_t *ref_file_hdr, int fileCount, mlv_xref_hdr_t *index)
+int save_index(const char *base_filename, mlv_file_hdr_t *ref_file_hdr, int fileCount, mlv_xref_hdr_t *index)
 {
-    size_t filename_size = (strlen(base_filename) + 1) * sizeof(char);
-    char * filename = (char*)malloc(filename_size);
-    
+    char * filename = index_get_filename(base_filename, "IDX");
+    char * temp_filename = NULL;
+    FILE *out_file = NULL;
+
     if(!filename)
     {
-        err_printf("malloc error (requested size %zu)\n", filename_size);
-        return;
+        return 0;
     }
-    strncpy(filename, base_filename, filename_size);
-    
-    FILE *out_file = NULL;
-
-    strcpy(&filename[strlen(filename) - 3], "IDX");
-
-    out_file = fopen(filename, "wb+");
-    
-    free(filename);
 
+    out_file = index_file_create(filename, &temp_filename);
     if (!out_file)
     {
-        return;
+        free(filename);
+        return 0;
     }
 
     /* first write MLVI header */
@@ -206,322 +418,1334 @@ void save_index(const char *base_filename, mlv_file_hdr_t *ref_file_hdr, int fil
     file_hdr.audioFrameCount = 0;
     file_hdr.fileNum = fileCount + 1;
 
-    fwrite(&file_hdr, sizeof(mlv_file_hdr_t), 1, out_file);
+    int written = fwrite(&file_hdr, sizeof(mlv_file_hdr_t), 1, out_file) == 1;
+
+    written &= fwrite(index, index->blockSize, 1, out_file) == 1;
 
-    fwrite(index, index->blockSize, 1, out_file);
+    written = index_file_commit(out_file, filename, temp_filename, written);
+    free(filename);
 
-    fclose(out_file);
+    return written;
 }
 
-mlv_xref_hdr_t *make_index(FILE **chunk_files, uint32_t chunk_count)
+/**
+ * Writes the state of the chunk files for the IDX that was just saved into the .XCHK file next to it
+ * The IDX itself is left as other MLV tools know it, this file is only read by MLVFS (see index_load_chunks)
+ * @return 1 if successful, 0 otherwise
+ */
+static int save_index_chunks(const char *base_filename, mlv_xchk_hdr_t *chunk_hdr)
 {
-    mlv_xref_hdr_t *index = NULL;
-    frame_xref_t *frame_xref_table = NULL;
-    uint32_t frame_xref_entries = 0;
-    uint32_t frame_xref_allocated = 0;
-    mlv_file_hdr_t main_header;
-    memset(&main_header, 0, sizeof(mlv_file_hdr_t));
-
-    for(uint32_t chunk = 0; chunk < chunk_count; chunk++)
-    {
-        int64_t position = 0;
-
-        file_set_pos(chunk_files[chunk], 0, SEEK_SET);
-
-        while(1)
-        {
-            mlv_hdr_t buf;
-            uint64_t timestamp = 0;
-            size_t read;
-
-            if((read = fread(&buf, sizeof(mlv_hdr_t), 1, chunk_files[chunk])) != 1)
-            {
-                if(ferror(chunk_files[chunk]))
-                {
-                    int err = errno;
-                    err_printf("File #%d, %zu bytes read, fread error: %s\n", chunk, read, strerror(err));
-                }
-                break;
-            }
-
-            /* unexpected block header size? */
-            if(buf.blockSize < sizeof(mlv_hdr_t) || buf.blockSize > 1024 * 1024 * 1024)
-            {
-                err_printf("Invalid header size: %d bytes at 0x%08llX\n", buf.blockSize, position);
-                break;
-            }
-
-            /* file header */
-            if(!memcmp(buf.blockType, "MLVI", 4))
-            {
-                mlv_file_hdr_t file_hdr;
-                size_t hdr_size = MIN(sizeof(mlv_file_hdr_t), buf.blockSize);
-
-                file_set_pos(chunk_files[chunk], position, SEEK_SET);
-
-                /* read the whole header block, but limit size to either our local type size or the written block size */
-                if(fread(&file_hdr, hdr_size, 1, chunk_files[chunk]) != 1)
-                {
-                    //bmp_printf(FONT_MED, 30, 190, "File ends prematurely during MLVI");
-                    break;
-                }
-
-                /* is this the first file? */
-                if(file_hdr.fileNum == 0)
-                {
-                    memcpy(&main_header, &file_hdr, sizeof(mlv_file_hdr_t));
-                }
-                else
-                {
-                    /* no, its another chunk */
-                    if(main_header.fileGuid != file_hdr.fileGuid)
-                    {
-                        //bmp_printf(FONT_MED, 30, 190, "Error: GUID within the file chunks mismatch!");
-                        break;
-                    }
-                }
-
-                /* emulate timestamp zero (will overwrite version string) */
-                timestamp = 0;
-            }
-            else
-            {
-                /* all other blocks have a timestamp */
-                timestamp = buf.timestamp;
-            }
-
-            /* dont index NULL blocks */
-            if(memcmp(buf.blockType, "NULL", 4))
-            {
-                xref_resize(&frame_xref_table, frame_xref_entries + 1, &frame_xref_allocated);
-
-                /* add xref data */
-                frame_xref_table[frame_xref_entries].frameTime = timestamp;
-                frame_xref_table[frame_xref_entries].frameOffset = position;
-                frame_xref_table[frame_xref_entries].fileNumber = chunk;
-                frame_xref_table[frame_xref_entries].frameType =
-                    !memcmp(buf.blockType, "VIDF", 4) ? MLV_FRAME_VIDF :
-                    !memcmp(buf.blockType, "AUDF", 4) ? MLV_FRAME_AUDF :
-                    MLV_FRAME_UNSPECIFIED;
-
-                frame_xref_entries++;
-            }
-
-            position += buf.blockSize;
-            file_set_pos(chunk_files[chunk], position, SEEK_SET);
-        }
-    }
-
-    xref_sort(frame_xref_table, frame_xref_entries);
+    char * filename = index_get_filename(base_filename, "IDX");
+    char * chunks_filename = index_get_filename(base_filename, "XCHK");
+    char * temp_filename = NULL;
+    FILE *out_file = NULL;
+    int written = 0;
 
-    size_t size = sizeof(mlv_xref_hdr_t) + frame_xref_entries * sizeof(mlv_xref_t);
-    index = (mlv_xref_hdr_t *)malloc(size);
-    if (!index)
+    /* tie it to the IDX, if something else rewrites that one the chunk state no longer applies */
+    if(filename && chunks_filename && index_path_stat(filename, &chunk_hdr->indexSize, &chunk_hdr->indexTime))
     {
-        free(frame_xref_table);
-        return NULL;
+        out_file = index_file_create(chunks_filename, &temp_filename);
     }
-    mlv_xref_t *xrefs = (mlv_xref_t *)&(((uint8_t*)index)[sizeof(mlv_xref_hdr_t)]);
-
-    memset(index, 0, size);
-    memcpy(index->blockType, "XREF", 4);
-    index->blockSize = (uint32_t)size;
-    index->entryCount = frame_xref_entries;
-
-    for(uint32_t entry = 0; entry < frame_xref_entries; entry++)
+    if(out_file)
     {
-        xrefs[entry].frameOffset = frame_xref_table[entry].frameOffset;
-        xrefs[entry].fileNumber = frame_xref_table[entry].fileNumber;
-        xrefs[entry].frameType = frame_xref_table[entry].frameType;
+        written = fwrite(chunk_hdr, chunk_hdr->blockSize, 1, out_file) == 1;
+        written = index_file_commit(out_file, chunks_filename, temp_filename, written);
     }
 
-    free(frame_xref_table);
-
-    return index;
+    free(filename);
+    free(chunks_filename);
+    return written;
 }
 
-void build_index(const char *base_filename, FILE **chunk_files, uint32_t chunk_count)
+/* reads from an absolute position without touching the FILE position, so chunks can be scanned concurrently */
+static int index_read_at(FILE *stream, void *buffer, size_t size, uint64_t offset)
 {
-    // read the MLVI header from the first file
-    // TODO: add some error checking
-    mlv_file_hdr_t main_header;
-    file_set_pos(chunk_files[0], 0, SEEK_SET);
-    if(!fread(&main_header, sizeof(mlv_file_hdr_t), 1, chunk_files[0]))
-    {
-        if(ferror(chunk_files[0]))
-        {
-            int err = errno;
-            err_printf("fread error: %s\n", strerror(err));
-        }
-        else
-        {
-            err_printf("could not read main header\n");
-        }
-    }
-
-    mlv_xref_hdr_t *index = make_index(chunk_files, chunk_count);
-    save_index(base_filename, &main_header, chunk_count, index);
+#if defined(_WIN32)
+    /* every scan thread owns its chunk FILE, so seeking is safe here */
+    file_set_pos(stream, offset, SEEK_SET);
+    return fread(buffer, size, 1, stream) == 1 ? 1 : (ferror(stream) ? -1 : 0);
+#else
+    ssize_t result = pread(fileno(stream), buffer, size, (off_t)offset);
+    return result == (ssize_t)size ? 1 : (result < 0 ? -1 : 0);
+#endif
+}
 
-    free(index);
+/* size and modification time of an open chunk file */
+static int index_file_stat(FILE *stream, uint64_t *size, int64_t *time)
+{
+#if defined(_WIN32)
+    struct _stat64 file_stat;
+    if(_fstat64(_fileno(stream), &file_stat)) return 0;
+#else
+    struct stat file_stat;
+    if(fstat(fileno(stream), &file_stat)) return 0;
+#endif
+    *size = (uint64_t)file_stat.st_size;
+    *time = (int64_t)file_stat.st_mtime;
+    return 1;
 }
 
-FILE **load_chunks(const char *base_filename, uint32_t *entries)
+/* same as index_file_stat, but for chunk number n (0 is the .MLV, 1 the .M00 and so on) that isn't open */
+static int index_chunk_stat(const char *base_filename, uint32_t chunk, uint64_t *size, int64_t *time)
 {
-    uint32_t seq_number = 0;
     size_t filename_size = (strlen(base_filename) + 1) * sizeof(char);
     char * filename = (char*)malloc(filename_size);
 
     if(!filename)
     {
         err_printf("malloc error (requested size %zu)\n", filename_size);
-        return NULL;
+        return 0;
     }
-    *entries = 0;
-
     strncpy(filename, base_filename, filename_size);
-    FILE **files = (FILE **)malloc(sizeof(FILE*));
-
-    files[0] = fopen(filename, "rb");
-    if (!files[0])
-    {
-        int err = errno;
-        err_printf("fopen('%s') error: %s\n", filename, strerror(err));
-        return NULL;
-    }
 
-    (*entries)++;
-    while(seq_number < 99)
+    if(chunk > 0)
     {
-        files = (FILE **)realloc(files, (*entries + 1) * sizeof(FILE*));
-
-        /* check for the next file M00, M01 etc */
+        /* same naming as load_chunks */
         char seq_name[3];
 
         #if defined(_WIN32)
-        _snprintf(seq_name, 3, "%02d", seq_number);
+        _snprintf(seq_name, 3, "%02d", chunk - 1);
         #else
-        snprintf(seq_name, 3, "%02d", seq_number);
+        snprintf(seq_name, 3, "%02d", chunk - 1);
         #endif
-        seq_number++;
 
         strcpy(&filename[strlen(filename) - 2], seq_name);
+    }
 
-        files[*entries] = fopen(filename, "rb");
+    int result = index_path_stat(filename, size, time);
 
-        /* when succeeded, check for next chunk, else abort */
-        if (files[*entries])
-        {
-            (*entries)++;
-        }
-        else
-        {
-            break;
-        }
-    }
     free(filename);
-    return files;
+    return result;
 }
 
-void close_chunks(FILE **chunk_files, uint32_t chunk_count)
+/* the blocks of one chunk file, filled in by its own scan thread */
+struct index_scan_job
 {
-    if(!chunk_files || !chunk_count || chunk_count > 100)
+    FILE *file;
+    uint32_t chunk;
+    frame_xref_t *table;
+    uint32_t entries;
+    uint32_t allocated;
+    /* the part of the file to scan, and where the scan actually stopped */
+    uint64_t start;
+    uint64_t end;
+    uint64_t scan_end;
+    /* range of the block timestamps found, MLVI headers left out */
+    uint64_t first_time;
+    uint64_t last_time;
+    /* number of block headers actually read, and the state of the fast path (see index_scan_stride) */
+    uint32_t headers_read;
+    uint32_t stride_skip;
+    uint32_t stride_wait;
+    uint32_t stride_backoff;
+    /* the fast path is only right if the frames are stored in order, so it's turned off if they turn out not to be */
+    int stride_enabled;
+    int stride_used;
+    int out_of_order;
+    uint64_t vidf_time;
+    /* MLVI header of this chunk and the number of entries that preceded it */
+    mlv_file_hdr_t file_hdr;
+    int file_hdr_found;
+    uint32_t file_hdr_entry;
+    /* the table could not hold all the blocks, so the whole scan fails */
+    int alloc_failed;
+};
+
+static int index_add_entry(struct index_scan_job *job, uint64_t timestamp, uint64_t position, uint16_t frame_type)
+{
+    if(!xref_resize(&job->table, job->entries + 1, &job->allocated))
     {
-        err_printf("faulty parameters\n");
-        return;
+        err_printf("File #%d, malloc error\n", job->chunk);
+        job->alloc_failed = 1;
+        return 0;
     }
 
-    for(uint32_t pos = 0; pos < chunk_count; pos++)
-    {
-        fclose(chunk_files[pos]);
-    }
+    /* add xref data */
+    job->table[job->entries].frameTime = timestamp;
+    job->table[job->entries].frameOffset = position;
+    job->table[job->entries].fileNumber = job->chunk;
+    job->table[job->entries].frameType = frame_type;
 
-    free(chunk_files);
+    job->entries++;
+    return 1;
 }
 
-mlv_xref_hdr_t *force_index(const char *base_filename)
+/**
+ * Fast path for runs of equally sized VIDF blocks (uncompressed video without audio): instead of reading every
+ * header, jump ahead by several frames and check that the block found there is the frame we expect. If it is, all
+ * the blocks in between must be the frames in between, since anything else would have shifted the frame positions.
+ * @param vidf The VIDF block just indexed at position, updated to the last block that was verified
+ * @return the position of the last block indexed
+ */
+static uint64_t index_scan_stride(struct index_scan_job *job, uint64_t position, mlv_vidf_hdr_t *vidf)
 {
-    FILE **chunk_files = NULL;
+    uint64_t stride = vidf->blockSize;
+
+    while(position + stride <= job->end)
+    {
+        uint64_t available = (job->end - position) / stride - 1;
+        uint32_t count = (uint32_t)MIN((uint64_t)job->stride_skip, available);
+        if(count < INDEX_STRIDE_MIN_SKIP)
+        {
+            break;
+        }
+
+        mlv_vidf_hdr_t probe;
+        uint64_t probe_position = position + count * stride;
+        job->headers_read++;
+        if(index_read_at(job->file, &probe, sizeof(mlv_vidf_hdr_t), probe_position) != 1 ||
+           memcmp(probe.blockType, "VIDF", 4) || probe.blockSize != vidf->blockSize ||
+           probe.frameNumber != vidf->frameNumber + count || probe.timestamp < vidf->timestamp)
+        {
+            /* something else is in between (e.g. audio), walk a while before trying again, longer after every miss */
+            job->stride_skip = INDEX_STRIDE_MIN_SKIP;
+            job->stride_backoff = MIN(MAX(job->stride_backoff * 2, INDEX_STRIDE_MIN_SKIP), INDEX_STRIDE_MAX_SKIP);
+            job->stride_wait = job->stride_backoff;
+            break;
+        }
+
+        /* the frames in between weren't read, so their timestamps are interpolated (only used for sorting) */
+        for(uint32_t frame = 1; frame <= count; frame++)
+        {
+            uint64_t timestamp = frame == count ? probe.timestamp : vidf->timestamp + (probe.timestamp - vidf->timestamp) * frame / count;
+            if(!index_add_entry(job, timestamp, position + frame * stride, MLV_FRAME_VIDF))
+            {
+                return position;
+            }
+        }
+        job->last_time = MAX(job->last_time, probe.timestamp);
+        job->vidf_time = probe.timestamp;
+        job->stride_used = 1;
+
+        position = probe_position;
+        *vidf = probe;
+        job->stride_skip = MIN(job->stride_skip * 2, INDEX_STRIDE_MAX_SKIP);
+        job->stride_backoff = 0;
+    }
+
+    return position;
+}
+
+static void index_scan_run(struct index_scan_job *job)
+{
+    uint32_t chunk = job->chunk;
+    uint64_t position = job->start;
+
+    /* size of the previous VIDF block if it came right before this one, 0 otherwise */
+    uint32_t previous_vidf_size = 0;
+    job->stride_skip = INDEX_STRIDE_MIN_SKIP;
+
+    job->first_time = UINT64_MAX;
+    job->last_time = 0;
+
+    while(position + sizeof(mlv_hdr_t) <= job->end)
+    {
+        union
+        {
+            mlv_hdr_t hdr;
+            mlv_vidf_hdr_t vidf;
+        } block;
+        mlv_hdr_t buf;
+        uint64_t timestamp = 0;
+        int read;
+
+        /* read enough for a VIDF header if the file is long enough, so the fast path can use it */
+        size_t hdr_size = (size_t)MIN((uint64_t)sizeof(mlv_vidf_hdr_t), job->end - position);
+        job->headers_read++;
+        if((read = index_read_at(job->file, &block, hdr_size, position)) != 1)
+        {
+            if(read < 0)
+            {
+                int err = errno;
+                err_printf("File #%d, read error at 0x%08llX: %s\n", chunk, (unsigned long long)position, strerror(err));
+            }
+            break;
+        }
+        buf = block.hdr;
+
+        /* unexpected block header size? */
+        if(buf.blockSize < sizeof(mlv_hdr_t) || buf.blockSize > 1024 * 1024 * 1024)
+        {
+            err_printf("Invalid header size: %d bytes at 0x%08llX\n", buf.blockSize, (unsigned long long)position);
+            break;
+        }
+
+        /* the file is still being written, the rest gets indexed once it is complete */
+        if(position + buf.blockSize > job->end)
+        {
+            break;
+        }
+
+        /* file header */
+        if(!memcmp(buf.blockType, "MLVI", 4))
+        {
+            mlv_file_hdr_t file_hdr;
+            size_t hdr_size = MIN(sizeof(mlv_file_hdr_t), buf.blockSize);
+
+            /* read the whole header block, but limit size to either our local type size or the written block size */
+            if(index_read_at(job->file, &file_hdr, hdr_size, position) != 1)
+            {
+                //bmp_printf(FONT_MED, 30, 190, "File ends prematurely during MLVI");
+                break;
+            }
+
+            /* the GUID is checked against the main file once all chunks are scanned */
+            if(!job->file_hdr_found)
+            {
+                memcpy(&job->file_hdr, &file_hdr, sizeof(mlv_file_hdr_t));
+                job->file_hdr_found = 1;
+                job->file_hdr_entry = job->entries;
+            }
+
+            /* emulate timestamp zero (will overwrite version string) */
+            timestamp = 0;
+        }
+        else
+        {
+            /* all other blocks have a timestamp */
+            timestamp = buf.timestamp;
+            job->first_time = MIN(job->first_time, timestamp);
+            job->last_time = MAX(job->last_time, timestamp);
+        }
+
+        /* dont index NULL blocks */
+        if(memcmp(buf.blockType, "NULL", 4))
+        {
+            if(!index_add_entry(job, timestamp, position,
+                !memcmp(buf.blockType, "VIDF", 4) ? MLV_FRAME_VIDF :
+                !memcmp(buf.blockType, "AUDF", 4) ? MLV_FRAME_AUDF :
+                MLV_FRAME_UNSPECIFIED))
+            {
+                break;
+            }
+        }
+
+        if(!memcmp(buf.blockType, "VIDF", 4) && hdr_size == sizeof(mlv_vidf_hdr_t))
+        {
+            if(block.vidf.timestamp < job->vidf_time)
+            {
+                job->out_of_order = 1;
+            }
+            job->vidf_time = block.vidf.timestamp;
+
+            /* two VIDFs of the same size in a row, try to skip ahead */
+            if(job->stride_enabled && previous_vidf_size == buf.blockSize && job->stride_wait == 0)
+            {
+                position = index_scan_stride(job, position, &block.vidf);
+                if(job->alloc_failed)
+                {
+                    break;
+                }
+            }
+            previous_vidf_size = buf.blockSize;
+        }
+        else
+        {
+            previous_vidf_size = 0;
+        }
+
+        if(job->stride_wait > 0)
+        {
+            job->stride_wait--;
+        }
+        position += buf.blockSize;
+    }
+
+    job->scan_end = position;
+}
+
+static void *index_scan_chunk(void *arg)
+{
+    struct index_scan_job *job = (struct index_scan_job *)arg;
+
+    index_scan_run(job);
+
+    /* frames were skipped based on their positions, but they aren't stored in order, so walk all of them */
+    if(job->stride_used && job->out_of_order && !job->alloc_failed)
+    {
+        uint32_t headers_read = job->headers_read;
+        job->entries = 0;
+        job->file_hdr_found = 0;
+        job->stride_enabled = 0;
+        job->stride_used = 0;
+        job->vidf_time = 0;
+        index_scan_run(job);
+        job->headers_read += headers_read;
+    }
+
+    return NULL;
+}
+
+/* what index_scan found: the sorted XREF block and the chunk state to store next to it */
+struct index_scan_result
+{
+    mlv_xref_hdr_t *xref;
+    mlv_xchk_hdr_t *chunk_hdr;
+    /* earliest timestamp of the blocks scanned, MLVI headers left out */
+    uint64_t first_time;
+};
+
+/**
+ * Scans all the chunk files of a recording (each one on its own thread) into a sorted XREF block
+ * @param previous The chunk state of an existing index, chunks listed there are only scanned from where that scan stopped (NULL to scan everything)
+ * @param sparse Nonzero to skip over runs of equally sized VIDF blocks instead of reading every header (see index_scan_stride)
+ * @param result [out] The XREF block and chunk state, free() both when done
+ * @return 1 if successful, 0 otherwise
+ */
+static int index_scan(FILE **chunk_files, uint32_t chunk_count, const mlv_xchk_hdr_t *previous, int sparse, struct index_scan_result *result)
+{
+    mlv_xref_hdr_t *index = NULL;
+    frame_xref_t *frame_xref_table = NULL;
+    uint32_t frame_xref_entries = 0;
+    uint32_t headers_read = 0;
+    const mlv_xchk_t *previous_chunks = previous ? (const mlv_xchk_t *)&(((const uint8_t*)previous)[sizeof(mlv_xchk_hdr_t)]) : NULL;
+    uint32_t previous_count = previous ? previous->chunkCount : 0;
+    uint64_t main_guid = previous_count ? previous_chunks[0].fileGuid : 0;
+    uint64_t last_time = previous ? previous->timestamp : 0;
+
+    memset(result, 0, sizeof(struct index_scan_result));
+    result->first_time = UINT64_MAX;
+
+    uint32_t *run_starts = (uint32_t *)malloc((chunk_count + 1) * sizeof(uint32_t));
+    struct index_scan_job *jobs = (struct index_scan_job *)calloc(chunk_count, sizeof(struct index_scan_job));
+    pthread_t *threads = (pthread_t *)calloc(chunk_count, sizeof(pthread_t));
+    int *threads_started = (int *)calloc(chunk_count, sizeof(int));
+    size_t chunk_hdr_size = sizeof(mlv_xchk_hdr_t) + chunk_count * sizeof(mlv_xchk_t);
+    mlv_xchk_hdr_t *chunk_hdr = (mlv_xchk_hdr_t *)calloc(1, chunk_hdr_size);
+    if (!run_starts || !jobs || !threads || !threads_started || !chunk_hdr)
+    {
+        free(run_starts);
+        free(jobs);
+        free(threads);
+        free(threads_started);
+        free(chunk_hdr);
+        return 0;
+    }
+    mlv_xchk_t *chunks = (mlv_xchk_t *)&(((uint8_t*)chunk_hdr)[sizeof(mlv_xchk_hdr_t)]);
+
+    double scan_start = index_get_time();
+
+    /* scan every chunk on its own thread, the main file is scanned on this one */
+    for(uint32_t chunk = 0; chunk < chunk_count; chunk++)
+    {
+        jobs[chunk].file = chunk_files[chunk];
+        jobs[chunk].chunk = chunk;
+        jobs[chunk].stride_enabled = sparse;
+        index_file_stat(chunk_files[chunk], &chunks[chunk].fileSize, &chunks[chunk].fileTime);
+        jobs[chunk].end = chunks[chunk].fileSize;
+        if(chunk < previous_count)
+        {
+            jobs[chunk].start = MIN(previous_chunks[chunk].scanEnd, jobs[chunk].end);
+            chunks[chunk].fileGuid = previous_chunks[chunk].fileGuid;
+        }
+        if(chunk > 0)
+        {
+            threads_started[chunk] = !pthread_create(&threads[chunk], NULL, index_scan_chunk, &jobs[chunk]);
+        }
+    }
+    for(uint32_t chunk = 0; chunk < chunk_count; chunk++)
+    {
+        if(threads_started[chunk])
+        {
+            pthread_join(threads[chunk], NULL);
+        }
+        else
+        {
+            /* first chunk, or the thread could not be created */
+            index_scan_chunk(&jobs[chunk]);
+        }
+    }
+
+    /* a chunk missing blocks must not end up in an index that looks complete */
+    int alloc_failed = 0;
+    for(uint32_t chunk = 0; chunk < chunk_count; chunk++)
+    {
+        alloc_failed |= jobs[chunk].alloc_failed;
+    }
+    if(alloc_failed)
+    {
+        for(uint32_t chunk = 0; chunk < chunk_count; chunk++)
+        {
+            free(jobs[chunk].table);
+        }
+        free(run_starts);
+        free(jobs);
+        free(threads);
+        free(threads_started);
+        free(chunk_hdr);
+        return 0;
+    }
+
+    /* validate the chunks against the main file and concatenate them, one run per chunk */
+    for(uint32_t chunk = 0; chunk < chunk_count; chunk++)
+    {
+        struct index_scan_job *job = &jobs[chunk];
+
+        if(job->file_hdr_found)
+        {
+            chunks[chunk].fileGuid = job->file_hdr.fileGuid;
+
+            /* is this the first file? */
+            if(job->file_hdr.fileNum == 0)
+            {
+                main_guid = job->file_hdr.fileGuid;
+            }
+            else if(main_guid != job->file_hdr.fileGuid)
+            {
+                /* no, its another chunk, but not from this recording */
+                //bmp_printf(FONT_MED, 30, 190, "Error: GUID within the file chunks mismatch!");
+                err_printf("File #%d: GUID within the file chunks mismatch\n", chunk);
+                job->entries = job->file_hdr_entry;
+            }
+        }
+
+        if(job->entries)
+        {
+            result->first_time = MIN(result->first_time, job->first_time);
+            last_time = MAX(last_time, job->last_time);
+        }
+        chunks[chunk].scanEnd = job->scan_end;
+
+        headers_read += job->headers_read;
+        run_starts[chunk] = frame_xref_entries;
+        frame_xref_entries += job->entries;
+    }
+
+    if(frame_xref_entries)
+    {
+        frame_xref_table = (frame_xref_t *)malloc(frame_xref_entries * sizeof(frame_xref_t));
+    }
+    for(uint32_t chunk = 0; chunk < chunk_count; chunk++)
+    {
+        if(frame_xref_table && jobs[chunk].entries)
+        {
+            memcpy(&frame_xref_table[run_starts[chunk]], jobs[chunk].table, jobs[chunk].entries * sizeof(frame_xref_t));
+        }
+        free(jobs[chunk].table);
+    }
+    free(jobs);
+    free(threads);
+    free(threads_started);
+
+    run_starts[chunk_count] = frame_xref_entries;
+
+    if (frame_xref_entries && !frame_xref_table)
+    {
+        err_printf("malloc error (requested size %zu)\n", frame_xref_entries * sizeof(frame_xref_t));
+        free(run_starts);
+        free(chunk_hdr);
+        return 0;
+    }
+
+    double sort_start = index_get_time();
+    frame_xref_table = xref_sort(frame_xref_table, frame_xref_entries, run_starts, chunk_count);
+    double sort_end = index_get_time();
+    free(run_starts);
+
+    dbg_printf("%u blocks (%u headers read) in %u file(s), scan %.3f s, sort %.3f s\n", frame_xref_entries, headers_read, chunk_count, sort_start - scan_start, sort_end - sort_start);
+    pthread_mutex_lock(&index_stats_mutex);
+    index_stats.scans++;
+    index_stats.blocks += frame_xref_entries;
+    index_stats.headers_read += headers_read;
+    index_stats.scan_seconds += sort_start - scan_start;
+    index_stats.sort_seconds += sort_end - sort_start;
+    index_stats.last_blocks = frame_xref_entries;
+    index_stats.last_files = chunk_count;
+    index_stats.last_scan_seconds = sort_start - scan_start;
+    index_stats.last_sort_seconds = sort_end - sort_start;
+    pthread_mutex_unlock(&index_stats_mutex);
+
+    if (frame_xref_entries && !frame_xref_table)
+    {
+        free(chunk_hdr);
+        return 0;
+    }
+
+    size_t size = sizeof(mlv_xref_hdr_t) + frame_xref_entries * sizeof(mlv_xref_t);
+    index = (mlv_xref_hdr_t *)malloc(size);
+    if (!index)
+    {
+        free(frame_xref_table);
+        free(chunk_hdr);
+        return 0;
+    }
+    mlv_xref_t *xrefs = (mlv_xref_t *)&(((uint8_t*)index)[sizeof(mlv_xref_hdr_t)]);
+
+    memset(index, 0, size);
+    memcpy(index->blockType, "XREF", 4);
+    index->blockSize = (uint32_t)size;
+    index->entryCount = frame_xref_entries;
+
+    for(uint32_t entry = 0; entry < frame_xref_entries; entry++)
+    {
+        xrefs[entry].frameOffset = frame_xref_table[entry].frameOffset;
+        xrefs[entry].fileNumber = frame_xref_table[entry].fileNumber;
+        xrefs[entry].frameType = frame_xref_table[entry].frameType;
+    }
+
+    free(frame_xref_table);
+
+    memcpy(chunk_hdr->blockType, "XCHK", 4);
+    chunk_hdr->blockSize = (uint32_t)chunk_hdr_size;
+    chunk_hdr->timestamp = last_time;
+    chunk_hdr->chunkCount = chunk_count;
+
+    result->xref = index;
+    result->chunk_hdr = chunk_hdr;
+
+    return 1;
+}
+
+int build_index(const char *base_filename, FILE **chunk_files, uint32_t chunk_count, int sparse)
+{
+    // read the MLVI header from the first file
+    // TODO: add some error checking
+    mlv_file_hdr_t main_header;
+    file_set_pos(chunk_files[0], 0, SEEK_SET);
+    if(!fread(&main_header, sizeof(mlv_file_hdr_t), 1, chunk_files[0]))
+    {
+        if(ferror(chunk_files[0]))
+        {
+            int err = errno;
+            err_printf("fread error: %s\n", strerror(err));
+        }
+        else
+        {
+            err_printf("could not read main header\n");
+        }
+    }
+
+    struct index_scan_result result;
+    int saved = 0;
+
+    if(index_scan(chunk_files, chunk_count, NULL, sparse, &result))
+    {
+        saved = save_index(base_filename, &main_header, chunk_count, result.xref) && save_index_chunks(base_filename, result.chunk_hdr);
+        free(result.chunk_hdr);
+        free(result.xref);
+    }
+
+    return saved;
+}
+
+FILE **load_chunks(const char *base_filename, uint32_t *entries)
+{
+    uint32_t seq_number = 0;
+    size_t filename_size = (strlen(base_filename) + 1) * sizeof(char);
+    char * filename = (char*)malloc(filename_size);
+
+    if(!filename)
+    {
+        err_printf("malloc error (requested size %zu)\n", filename_size);
+        return NULL;
+    }
+    *entries = 0;
+
+    strncpy(filename, base_filename, filename_size);
+    FILE **files = (FILE **)malloc(sizeof(FILE*));
+
+    files[0] = fopen(filename, "rb");
+    if (!files[0])
+    {
+        int err = errno;
+        err_printf("fopen('%s') error: %s\n", filename, strerror(err));
+        return NULL;
+    }
+
+    (*entries)++;
+    while(seq_number < 99)
+    {
+        files = (FILE **)realloc(files, (*entries + 1) * sizeof(FILE*));
+
+        /* check for the next file M00, M01 etc */
+        char seq_name[3];
+
+        #if defined(_WIN32)
+        _snprintf(seq_name, 3, "%02d", seq_number);
+        #else
+        snprintf(seq_name, 3, "%02d", seq_number);
+        #endif
+        seq_number++;
+
+        strcpy(&filename[strlen(filename) - 2], seq_name);
+
+        files[*entries] = fopen(filename, "rb");
+
+        /* when succeeded, check for next chunk, else abort */
+        if (files[*entries])
+        {
+            (*entries)++;
+        }
+        else
+        {
+            break;
+        }
+    }
+    free(filename);
+    return files;
+}
+
+void close_chunks(FILE **chunk_files, uint32_t chunk_count)
+{
+    if(!chunk_files || !chunk_count || chunk_count > 100)
+    {
+        err_printf("faulty parameters\n");
+        return;
+    }
+
+    for(uint32_t pos = 0; pos < chunk_count; pos++)
+    {
+        fclose(chunk_files[pos]);
+    }
+
+    free(chunk_files);
+}
+
+static int build_index_file(const char *base_filename, int sparse)
+{
+    FILE **chunk_files = NULL;
     uint32_t chunk_count = 0;
 
     chunk_files = load_chunks(base_filename, &chunk_count);
     if(!chunk_files || !chunk_count)
     {
-        return NULL;
+        return 0;
     }
 
-    build_index(base_filename, chunk_files, chunk_count);
+    int saved = build_index(base_filename, chunk_files, chunk_count, sparse);
     close_chunks(chunk_files, chunk_count);
 
-    return load_index(base_filename);
+    return saved;
+}
+
+static void index_unmap(struct mlv_index *index)
+{
+#if defined(_WIN32)
+    free(index->map);
+#else
+    if(index->map) munmap(index->map, index->map_size);
+#endif
+    free(index->chunk_hdr);
+    index->map = NULL;
+    index->map_size = 0;
+    index->file_hdr = NULL;
+    index->chunk_hdr = NULL;
+    index->chunks = NULL;
+    index->xref = NULL;
+    index->xrefs = NULL;
+}
+
+/**
+ * Reads the .XCHK file written by save_index_chunks, if it belongs to the IDX that is mapped (size and modification time match)
+ * Nothing is loaded otherwise, index_check then has the IDX rebuilt
+ */
+static void index_load_chunks(struct mlv_index *index, uint64_t idx_size, int64_t idx_time)
+{
+    char * filename = index_get_filename(index->base_filename, "XCHK");
+    FILE *in_file = filename ? fopen(filename, "rb") : NULL;
+    free(filename);
+    if(!in_file)
+    {
+        return;
+    }
+
+    mlv_xchk_hdr_t hdr;
+    mlv_xchk_hdr_t *chunk_hdr = NULL;
+    if(fread(&hdr, sizeof(mlv_xchk_hdr_t), 1, in_file) == 1 && !memcmp(hdr.blockType, "XCHK", 4) &&
+       hdr.chunkCount > 0 && hdr.chunkCount <= 100 && hdr.blockSize == sizeof(mlv_xchk_hdr_t) + hdr.chunkCount * sizeof(mlv_xchk_t) &&
+       hdr.indexSize == idx_size && hdr.indexTime == idx_time)
+    {
+        chunk_hdr = (mlv_xchk_hdr_t *)malloc(hdr.blockSize);
+        if(chunk_hdr)
+        {
+            memcpy(chunk_hdr, &hdr, sizeof(mlv_xchk_hdr_t));
+            if(fread(&(((uint8_t*)chunk_hdr)[sizeof(mlv_xchk_hdr_t)]), hdr.blockSize - sizeof(mlv_xchk_hdr_t), 1, in_file) != 1)
+            {
+                free(chunk_hdr);
+                chunk_hdr = NULL;
+            }
+        }
+    }
+    fclose(in_file);
+
+    if(chunk_hdr)
+    {
+        index->chunk_hdr = chunk_hdr;
+        index->chunks = (mlv_xchk_t *)&(((uint8_t*)chunk_hdr)[sizeof(mlv_xchk_hdr_t)]);
+    }
+}
+
+/**
+ * Maps the IDX file read-only and points the handle at the blocks inside the mapping (no copy is made)
+ * @return 1 if successful, 0 otherwise
+ */
+static int index_map(struct mlv_index *index)
+{
+    char * filename = index_get_filename(index->base_filename, "IDX");
+    uint64_t idx_size = 0;
+    int64_t idx_time = 0;
+    if(!filename)
+    {
+        return 0;
+    }
+
+#if defined(_WIN32)
+    /* no mmap here, fall back to a private copy of the file */
+    FILE *in_file = fopen(filename, "rb");
+    free(filename);
+    if(!in_file)
+    {
+        return 0;
+    }
+
+    file_set_pos(in_file, 0, SEEK_END);
+    size_t map_size = (size_t)file_get_pos(in_file);
+    file_set_pos(in_file, 0, SEEK_SET);
+    index_file_stat(in_file, &idx_size, &idx_time);
+
+    void *map = map_size >= sizeof(mlv_hdr_t) ? malloc(map_size) : NULL;
+    if(!map || fread(map, map_size, 1, in_file) != 1)
+    {
+        free(map);
+        fclose(in_file);
+        return 0;
+    }
+    fclose(in_file);
+#else
+    int fd = open(filename, O_RDONLY);
+    free(filename);
+    if(fd < 0)
+    {
+        return 0;
+    }
+
+    struct stat file_stat;
+    if(fstat(fd, &file_stat) || file_stat.st_size < (off_t)sizeof(mlv_hdr_t))
+    {
+        close(fd);
+        return 0;
+    }
+
+    size_t map_size = (size_t)file_stat.st_size;
+    idx_size = (uint64_t)file_stat.st_size;
+    idx_time = (int64_t)file_stat.st_mtime;
+    void *map = mmap(NULL, map_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if(map == MAP_FAILED)
+    {
+        int err = errno;
+        err_printf("%s: mmap error: %s\n", index->base_filename, strerror(err));
+        return 0;
+    }
+#endif
+
+    index->map = map;
+    index->map_size = map_size;
+
+    /* walk the blocks in the mapping and pick out the ones we need */
+    uint64_t position = 0;
+    while(position + sizeof(mlv_hdr_t) <= index->map_size)
+    {
+        mlv_hdr_t *block = (mlv_hdr_t *)((uint8_t *)map + position);
+        if(block->blockSize < sizeof(mlv_hdr_t) || position + block->blockSize > index->map_size)
+        {
+            break;
+        }
+
+        if(!memcmp(block->blockType, "MLVI", 4) && block->blockSize >= sizeof(mlv_file_hdr_t))
+        {
+            index->file_hdr = (mlv_file_hdr_t *)block;
+        }
+        else if(!memcmp(block->blockType, "XREF", 4) && block->blockSize >= sizeof(mlv_xref_hdr_t))
+        {
+            mlv_xref_hdr_t *xref = (mlv_xref_hdr_t *)block;
+            if(xref->entryCount <= (block->blockSize - sizeof(mlv_xref_hdr_t)) / sizeof(mlv_xref_t))
+            {
+                index->xref = xref;
+                index->xrefs = (mlv_xref_t *)&(((uint8_t*)xref)[sizeof(mlv_xref_hdr_t)]);
+            }
+        }
+        position += block->blockSize;
+    }
+
+    if(!index->xref)
+    {
+        index_unmap(index);
+        return 0;
+    }
+
+    index_load_chunks(index, idx_size, idx_time);
+    return 1;
 }
 
-mlv_xref_hdr_t *get_index(const char *base_filename)
+enum index_state
+{
+    INDEX_CURRENT,
+    INDEX_GROWN,
+    INDEX_STALE
+};
+
+/**
+ * Compares the chunk files on disk with the state recorded in the IDX
+ * @return INDEX_GROWN if chunks were appended to or added, INDEX_STALE if the index has to be rebuilt
+ */
+static enum index_state index_check(struct mlv_index *index)
 {
-    mlv_xref_hdr_t *table = NULL;
+    /* IDX files without a matching .XCHK are from an older version (or were written by another tool) and can't be checked */
+    if(!index->chunk_hdr || !index->file_hdr)
+    {
+        return INDEX_STALE;
+    }
 
-    table = load_index(base_filename);
+    enum index_state state = INDEX_CURRENT;
+    uint32_t chunk_count = index->chunk_hdr->chunkCount;
 
-    if(!table)
+    for(uint32_t chunk = 0; chunk < 100; chunk++)
     {
-        table = force_index(base_filename);
+        uint64_t size = 0;
+        int64_t time = 0;
+
+        if(!index_chunk_stat(index->base_filename, chunk, &size, &time))
+        {
+            /* a chunk that was indexed has disappeared */
+            if(chunk < chunk_count) return INDEX_STALE;
+            break;
+        }
+
+        if(chunk >= chunk_count)
+        {
+            state = INDEX_GROWN;
+        }
+        else if(size < index->chunks[chunk].fileSize)
+        {
+            return INDEX_STALE;
+        }
+        else if(size > index->chunks[chunk].fileSize || time != index->chunks[chunk].fileTime)
+        {
+            /* a changed modification time alone is re-checked the same way, the GUID tells if it is still the same recording */
+            state = INDEX_GROWN;
+        }
     }
 
-    return table;
+    return state;
 }
 
-mlv_xref_hdr_t *get_new_index(const char *base_filename)
+/**
+ * Scans only what was added to the chunk files since the IDX was written and saves the IDX with the new blocks appended
+ * @return 1 if successful, 0 if the index has to be rebuilt instead
+ */
+static int index_extend(struct mlv_index *index)
 {
     FILE **chunk_files = NULL;
     uint32_t chunk_count = 0;
+    int result = 0;
 
-    chunk_files = load_chunks(base_filename, &chunk_count);
+    chunk_files = load_chunks(index->base_filename, &chunk_count);
     if(!chunk_files || !chunk_count)
     {
-        return NULL;
+        return 0;
+    }
+
+    /* chunks that were indexed before must still belong to the same recording */
+    if(chunk_count < index->chunk_hdr->chunkCount)
+    {
+        close_chunks(chunk_files, chunk_count);
+        return 0;
+    }
+    for(uint32_t chunk = 0; chunk < index->chunk_hdr->chunkCount; chunk++)
+    {
+        mlv_file_hdr_t file_hdr;
+        if(index_read_at(chunk_files[chunk], &file_hdr, sizeof(mlv_file_hdr_t), 0) != 1 ||
+           memcmp(file_hdr.fileMagic, "MLVI", 4) || file_hdr.fileGuid != index->chunks[chunk].fileGuid)
+        {
+            close_chunks(chunk_files, chunk_count);
+            return 0;
+        }
+    }
+
+    struct index_scan_result scan;
+    if(index_scan(chunk_files, chunk_count, index->chunk_hdr, 1, &scan))
+    {
+        uint32_t old_entries = index->xref->entryCount;
+        uint32_t new_entries = scan.xref->entryCount;
+
+        /* appending is only right if everything new is later than what is indexed already (new MLVI headers aside) */
+        if(scan.first_time >= index->chunk_hdr->timestamp || !new_entries)
+        {
+            size_t size = sizeof(mlv_xref_hdr_t) + (old_entries + new_entries) * sizeof(mlv_xref_t);
+            mlv_xref_hdr_t *xref = (mlv_xref_hdr_t *)malloc(size);
+            if(xref)
+            {
+                mlv_xref_t *xrefs = (mlv_xref_t *)&(((uint8_t*)xref)[sizeof(mlv_xref_hdr_t)]);
+                memcpy(xref, scan.xref, sizeof(mlv_xref_hdr_t));
+                xref->blockSize = (uint32_t)size;
+                xref->entryCount = old_entries + new_entries;
+                memcpy(xrefs, index->xrefs, old_entries * sizeof(mlv_xref_t));
+                memcpy(&xrefs[old_entries], &(((uint8_t*)scan.xref)[sizeof(mlv_xref_hdr_t)]), new_entries * sizeof(mlv_xref_t));
+
+                result = save_index(index->base_filename, index->file_hdr, chunk_count, xref) && save_index_chunks(index->base_filename, scan.chunk_hdr);
+                if(result)
+                {
+                    dbg_printf("%s: appended %u blocks\n", index->base_filename, new_entries);
+                    pthread_mutex_lock(&index_stats_mutex);
+                    index_stats.appends++;
+                    index_stats.appended_blocks += new_entries;
+                    pthread_mutex_unlock(&index_stats_mutex);
+                }
+                free(xref);
+            }
+            else
+            {
+                err_printf("malloc error (requested size %zu)\n", size);
+            }
+        }
+        free(scan.xref);
+        free(scan.chunk_hdr);
     }
 
-    mlv_xref_hdr_t *index = make_index(chunk_files, chunk_count);
     close_chunks(chunk_files, chunk_count);
+    return result;
+}
+
+static struct mlv_index *index_new(const char *base_filename)
+{
+    struct mlv_index *index = (struct mlv_index *)malloc(sizeof(struct mlv_index));
+    if(!index)
+    {
+        return NULL;
+    }
+
+    memset(index, 0, sizeof(struct mlv_index));
+    index->base_filename = (char*)malloc((strlen(base_filename) + 1) * sizeof(char));
+    if(!index->base_filename)
+    {
+        free(index);
+        return NULL;
+    }
+    strcpy(index->base_filename, base_filename);
+
+    return index;
+}
+
+static void index_free(struct mlv_index *index)
+{
+    index_unmap(index);
+    free(index->base_filename);
+    free(index);
+}
+
+/**
+ * Maps the IDX file of a MLV, first extending or rebuilding it if it doesn't match the chunk files anymore
+ * @param current The handle this one is going to replace, NULL if there is none
+ * @param full Nonzero to rebuild the IDX reading every block header, whatever state it is in
+ * @return the new handle, or NULL if the MLV could not be indexed
+ */
+static struct mlv_index *index_open(const char *base_filename, struct mlv_index *current, int full)
+{
+    struct mlv_index *index = index_new(base_filename);
+    if(!index)
+    {
+        return NULL;
+    }
+
+    int appended = 0;
+    enum index_state state = (!full && index_map(index)) ? index_check(index) : INDEX_STALE;
+
+    if(state == INDEX_GROWN && index_extend(index))
+    {
+        index_unmap(index);
+        state = index_map(index) ? INDEX_CURRENT : INDEX_STALE;
+        appended = state == INDEX_CURRENT;
+    }
+
+    if(state != INDEX_CURRENT)
+    {
+        index_unmap(index);
+        if(!build_index_file(base_filename, !full))
+        {
+            /* the IDX can't be written (e.g. read-only media), use whatever is there and don't try again */
+            index->frozen = 1;
+        }
+        if(!index_map(index))
+        {
+            index_free(index);
+            return NULL;
+        }
+    }
+
+    /* only an extension keeps the entries of the previous index in place */
+    index->serial = (appended && current) ? current->serial : (uint32_t)ATOMIC_INCREMENT(index_serial);
+    index->checked = index_get_time();
 
     return index;
 }
 
-int mlv_get_frame_count(const char *real_path)
+/* puts a new handle in place of the cached one at link, current users keep the old mapping until they release it */
+static void index_replace(struct mlv_index **link, struct mlv_index *updated)
+{
+    struct mlv_index *index = *link;
+    updated->next = index->next;
+    updated->ref_count = 1;
+    *link = updated;
+    if(--index->ref_count == 0)
+    {
+        index_free(index);
+    }
+}
+
+/* finds the cached entry of a MLV, waiting for it if it is being built (called with index_mutex held) */
+static struct mlv_index **index_find(const char *base_filename)
+{
+    for(;;)
+    {
+        struct mlv_index **link = NULL;
+        for(link = &indexes; *link != NULL; link = &(*link)->next)
+        {
+            if(!filename_strcmp((*link)->base_filename, base_filename)) break;
+        }
+        if(*link == NULL || !(*link)->building)
+        {
+            return link;
+        }
+        pthread_cond_wait(&index_built, &index_mutex);
+    }
+}
+
+/**
+ * Marks the cached entry of a MLV as being built, so other callers for the same MLV wait until index_build_end
+ * (called with index_mutex held, after index_find)
+ * @param link Where index_find stopped, a placeholder without a mapping is added there if nothing is cached
+ * @return the entry, or NULL if out of memory
+ */
+static struct mlv_index *index_build_begin(struct mlv_index **link, const char *base_filename)
 {
-    uint32_t videoFrameCount = 0;
-    
-    mlv_xref_hdr_t *block_xref = get_index(real_path);
-    if(block_xref == NULL) return 0;
-    
-    mlv_xref_t *xrefs = (mlv_xref_t *)&(((uint8_t*)block_xref)[sizeof(mlv_xref_hdr_t)]);
-    
-    for(uint32_t block_xref_pos = 0; block_xref_pos < block_xref->entryCount; block_xref_pos++)
+    struct mlv_index *index = *link;
+    if(!index)
     {
-        if(xrefs[block_xref_pos].frameType == MLV_FRAME_VIDF)
+        index = index_new(base_filename);
+        if(!index)
         {
-            videoFrameCount++;
+            return NULL;
         }
+        index->ref_count = 1;
+        *link = index;
+    }
+    index->building = 1;
+    return index;
+}
+
+/**
+ * Ends a build started with index_build_begin and wakes up the callers waiting for it (called with index_mutex held)
+ * @param updated The handle that was built, it replaces the cached entry (NULL to keep the entry, a placeholder is dropped)
+ * @return the cached handle, or NULL if there is none
+ */
+static struct mlv_index *index_build_end(struct mlv_index *index, struct mlv_index *updated)
+{
+    struct mlv_index **link = NULL;
+
+    /* nobody else can unlink an entry while it is building */
+    for(link = &indexes; *link != index; link = &(*link)->next);
+
+    index->building = 0;
+    if(updated)
+    {
+        index_replace(link, updated);
+        index = updated;
+    }
+    else if(!index->map)
+    {
+        *link = index->next;
+        index_free(index);
+        index = NULL;
     }
-    
-    // If there are no VIDF frames at all, the IDX file is probably an old format, and needs to be re-built
-    // TODO: clean up the following repetition of code
-    if(videoFrameCount == 0)
+    pthread_cond_broadcast(&index_built);
+
+    return index;
+}
+
+/**
+ * Gets a shared, read-only handle on the index of a MLV, mapping (and if necessary generating) the IDX file on first use
+ * If the chunk files have grown since, the IDX is extended and a new handle is returned
+ * The handle stays valid until it is passed to release_index, the xref table must not be modified
+ * @return the index handle, or NULL if the MLV could not be indexed
+ */
+struct mlv_index *acquire_index(const char *base_filename)
+{
+    struct mlv_index *index = NULL;
+    struct mlv_index *updated = NULL;
+
+    pthread_mutex_lock(&index_mutex);
+    struct mlv_index **link = index_find(base_filename);
+    index = *link;
+
+    if(index)
     {
-        free(block_xref);
-        block_xref = force_index(real_path);
-		if (block_xref == NULL) return 0;
-        xrefs = (mlv_xref_t *)&(((uint8_t*)block_xref)[sizeof(mlv_xref_hdr_t)]);
-        
-        for(uint32_t block_xref_pos = 0; block_xref_pos < block_xref->entryCount; block_xref_pos++)
+        double now = index_get_time();
+        if(index->frozen || now - index->checked < INDEX_CHECK_INTERVAL)
         {
-            if(xrefs[block_xref_pos].frameType == MLV_FRAME_VIDF)
-            {
-                videoFrameCount++;
-            }
+            index->ref_count++;
+            pthread_mutex_unlock(&index_mutex);
+            return index;
         }
+        index->checked = now;
+    }
+
+    index = index_build_begin(link, base_filename);
+    pthread_mutex_unlock(&index_mutex);
+    if(!index)
+    {
+        return NULL;
+    }
+
+    /* the list lock isn't held here, so indexing one MLV doesn't hold up lookups of any other */
+    if(!index->map || index_check(index) != INDEX_CURRENT)
+    {
+        updated = index_open(base_filename, index->map ? index : NULL, 0);
+    }
+
+    pthread_mutex_lock(&index_mutex);
+    index = index_build_end(index, updated);
+    if(index)
+    {
+        index->ref_count++;
+    }
+    pthread_mutex_unlock(&index_mutex);
+
+    return index;
+}
+
+/**
+ * Regenerates the IDX of a MLV reading every block header, for when an index built with the fast path turns out
+ * to be in the wrong order (frames that were skipped over weren't stored in the order of their timestamps)
+ * @param index A reference obtained from acquire_index, it is released
+ * @return a reference to the new index, or NULL if the MLV could not be indexed
+ */
+struct mlv_index *rebuild_index(struct mlv_index *index)
+{
+    struct mlv_index *current = NULL;
+    struct mlv_index *updated = NULL;
+
+    if(!index) return NULL;
+
+    pthread_mutex_lock(&index_mutex);
+    struct mlv_index **link = index_find(index->base_filename);
+
+    /* another caller may have replaced it already */
+    if(*link != NULL && (*link)->serial != index->serial)
+    {
+        updated = *link;
+        updated->ref_count++;
+        pthread_mutex_unlock(&index_mutex);
+
+        release_index(index);
+        return updated;
+    }
+
+    current = index_build_begin(link, index->base_filename);
+    pthread_mutex_unlock(&index_mutex);
+
+    updated = index_open(index->base_filename, index, 1);
+
+    pthread_mutex_lock(&index_mutex);
+    if(current)
+    {
+        index_build_end(current, updated);
+    }
+    if(updated)
+    {
+        updated->ref_count++;
+    }
+    pthread_mutex_unlock(&index_mutex);
+
+    release_index(index);
+    return updated;
+}
+
+/**
+ * Drops the cached index of a MLV (e.g. because the MLV was replaced), the next acquire_index maps the IDX again
+ * and checks it against the chunk files. Handles that are in use stay valid until they are released.
+ */
+void invalidate_index(const char *base_filename)
+{
+    struct mlv_index *index = NULL;
+
+    pthread_mutex_lock(&index_mutex);
+    struct mlv_index **link = index_find(base_filename);
+    if(*link != NULL)
+    {
+        index = *link;
+        *link = index->next;
+    }
+    pthread_mutex_unlock(&index_mutex);
+
+    release_index(index);
+}
+
+/**
+ * Checks whether the IDX file on disk was just renamed into place here, rather than written by another tool
+ * Each rename is only reported once, so the same file written over in place later counts as changed
+ * @return 1 if it was, 0 otherwise
+ */
+int index_file_is_own_write(const char *base_filename)
+{
+    int result = 0;
+#if !defined(_WIN32)
+    char * filename = index_get_filename(base_filename, "IDX");
+    if(!filename)
+    {
+        return 0;
+    }
+
+    struct stat file_stat;
+    if(!stat(filename, &file_stat))
+    {
+        result = index_own_write_take(filename, (uint64_t)file_stat.st_ino);
+    }
+    free(filename);
+#endif
+    return result;
+}
+
+void release_index(struct mlv_index *index)
+{
+    if(!index) return;
+
+    pthread_mutex_lock(&index_mutex);
+    int remaining = --index->ref_count;
+    pthread_mutex_unlock(&index_mutex);
+
+    if(remaining == 0)
+    {
+        index_free(index);
+    }
+}
+
+void index_get_stats(struct index_stats *stats)
+{
+    pthread_mutex_lock(&index_stats_mutex);
+    *stats = index_stats;
+    pthread_mutex_unlock(&index_stats_mutex);
+}
+
+void free_all_indexes()
+{
+    pthread_mutex_lock(&index_mutex);
+    struct mlv_index *current = indexes;
+    indexes = NULL;
+    pthread_mutex_unlock(&index_mutex);
+
+    while(current != NULL)
+    {
+        struct mlv_index *next = current->next;
+        release_index(current);
+        current = next;
+    }
+
+    pthread_mutex_lock(&index_own_write_mutex);
+    for(uint32_t i = 0; i < INDEX_OWN_WRITES; i++)
+    {
+        free(index_own_writes[i].filename);
+        index_own_writes[i].filename = NULL;
     }
-    
-    free(block_xref);
-    
-    return videoFrameCount;
+    pthread_mutex_unlock(&index_own_write_mutex);
 }
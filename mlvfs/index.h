@@ -27,17 +27,89 @@
 #include "raw.h"
 #include "mlv.h"
 
-//Retrieves the index from an IDX file, generating the file if necessary
-mlv_xref_hdr_t *get_index(const char *base_filename);
+#pragma pack(push,1)
 
-//Retrieves the index without using an IDX file
-mlv_xref_hdr_t *get_new_index(const char *base_filename);
+//The state of every chunk file when it was indexed, kept in a .XCHK file next to the IDX (the IDX stays as other tools write it)
+typedef struct {
+    uint8_t     blockType[4];    /* XCHK */
+    uint32_t    blockSize;
+    uint64_t    timestamp;    /* timestamp of the latest block in the index */
+    uint64_t    indexSize;    /* size of the IDX file this was written for */
+    int64_t     indexTime;    /* modification time of that IDX file */
+    uint32_t    chunkCount;    /* number of mlv_xchk_t that follow here */
+} mlv_xchk_hdr_t;
+
+typedef struct {
+    uint64_t    fileSize;    /* size of the chunk file when it was scanned */
+    uint64_t    scanEnd;    /* offset of the first block that was not completely written yet */
+    int64_t     fileTime;    /* modification time of the chunk file */
+    uint64_t    fileGuid;    /* GUID from the MLVI header of the chunk */
+} mlv_xchk_t;
+
+#pragma pack(pop)
+
+//Shared read-only view of an IDX file (memory mapped where available)
+struct mlv_index
+{
+    struct mlv_index *next;
+    char *base_filename;
+    int ref_count;
+    //handles with the same serial list the same blocks in the same order, a later one may have more entries appended
+    uint32_t serial;
+    //when the chunk files were last compared with the IDX, frozen if it can't be rewritten
+    double checked;
+    int frozen;
+    //set while the entry is checked or (re)built without the list lock held, other callers for the same MLV wait for it
+    int building;
+    mlv_file_hdr_t *file_hdr;
+    mlv_xchk_hdr_t *chunk_hdr;
+    mlv_xchk_t *chunks;
+    mlv_xref_hdr_t *xref;
+    mlv_xref_t *xrefs;
+    void *map;
+    size_t map_size;
+};
+
+//what building the indexes took so far, the web GUI serves it at /index_stats
+struct index_stats
+{
+    uint64_t scans;
+    uint64_t blocks;
+    uint64_t headers_read;
+    double scan_seconds;
+    double sort_seconds;
+    //blocks added to existing IDX files because their MLV had grown
+    uint64_t appends;
+    uint64_t appended_blocks;
+    //the most recent scan
+    uint32_t last_blocks;
+    uint32_t last_files;
+    double last_scan_seconds;
+    double last_sort_seconds;
+};
+
+//Gets a reference to the shared index of a MLV, generating the IDX file if necessary and extending it if the MLV has grown
+struct mlv_index *acquire_index(const char *base_filename);
+
+//Regenerates the IDX of a MLV reading every block, releases index and returns a reference to the new one
+struct mlv_index *rebuild_index(struct mlv_index *index);
+
+//Drops a reference obtained from acquire_index
+void release_index(struct mlv_index *index);
+
+//Drops the cached index of a MLV so it is checked against the files again on the next acquire_index
+void invalidate_index(const char *base_filename);
+
+//Checks whether the IDX file on disk was just renamed into place here (i.e. not written by someone else), each rename is only reported once
+int index_file_is_own_write(const char *base_filename);
+
+void index_get_stats(struct index_stats *stats);
+
+void free_all_indexes();
 
 FILE **load_chunks(const char *base_filename, uint32_t *entries);
 void close_chunks(FILE **chunk_files, uint32_t chunk_count);
 
-int mlv_get_frame_count(const char *real_path);
-
 /* platform/target specific fseek/ftell functions go here */
 uint64_t file_get_pos(FILE *stream);
 uint32_t file_set_pos(FILE *stream, uint64_t offset, int whence);
@@ -0,0 +1,1293 @@
+/*
+ * Copyright (C) 2014 David Milligan
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the
+ * Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include "raw.h"
+#include "mlv.h"
+#include "mlvfs.h"
+#include "catalog.h"
+#include "resource_manager.h"
+#include "lowlevel.h"
+
+/*
+ * FUSE 3 low-level frontend: the kernel talks in inode numbers instead of paths. Real files and directories
+ * get an inode when they are looked up, but the files inside a MLV's virtual directory get an inode that
+ * encodes which clip, which kind of file and which frame they are, so the hot DNG getattr/open/read path is
+ * a bit of integer decoding instead of resolving the whole virtual path again (string copies, stat, regex...)
+ */
+
+#define CREATE_MUTEX(x) static pthread_mutex_t x = PTHREAD_MUTEX_INITIALIZER;
+#define RELOCK(x) pthread_mutex_lock(&(x));
+#define UNLOCK(x) pthread_mutex_unlock(&(x));
+
+/* encoded inodes: flag (bit 63) | kind (bits 60-62) | clip id (bits 32-59) | frame (bits 0-31) */
+#define LL_ENCODED        (1ULL << 63)
+#define LL_KIND_SHIFT     60
+#define LL_KIND_MASK      0x7ULL
+#define LL_CLIP_SHIFT     32
+#define LL_CLIP_MASK      0x0FFFFFFFULL
+#define LL_INO(kind, clip, frame) (LL_ENCODED | ((uint64_t)(kind) << LL_KIND_SHIFT) | (((uint64_t)(clip) & LL_CLIP_MASK) << LL_CLIP_SHIFT) | (uint32_t)(frame))
+#define LL_INO_KIND(ino)  ((int)(((ino) >> LL_KIND_SHIFT) & LL_KIND_MASK))
+#define LL_INO_CLIP(ino)  ((uint32_t)(((ino) >> LL_CLIP_SHIFT) & LL_CLIP_MASK))
+#define LL_INO_FRAME(ino) ((uint32_t)(ino))
+
+/* same as the high-level API uses for directory entries without a known inode */
+#define LL_UNKNOWN_INO    0xffffffff
+#define LL_HASH_SIZE      4096
+
+enum ll_kind
+{
+    LL_KIND_NONE = 0,
+    LL_KIND_DNG,
+    LL_KIND_WAV,
+    LL_KIND_LOG,
+    LL_KIND_GIF
+};
+
+//a real file or directory the kernel has looked up
+struct ll_node
+{
+    fuse_ino_t ino;
+    uint64_t nlookup;
+    char * path;
+    int32_t clip;
+    struct ll_node * next_by_ino;
+    struct ll_node * next_by_path;
+};
+
+//a MLV's virtual directory, its files get encoded inodes
+struct ll_clip
+{
+    int32_t id;
+    char * mlv_filename;
+    char * dir_path;
+    char * basename;
+    //the kernel was given the inodes of the DNGs below this frame, they are the ones to invalidate when the MLV changes
+    uint32_t dng_frames;
+    struct ll_clip * next;
+};
+
+//per open file
+struct ll_handle
+{
+    char * path;
+    uint64_t fh;
+};
+
+struct ll_dir_entry
+{
+    char * name;
+    fuse_ino_t ino;
+    mode_t mode;
+    //the attributes the listing came with (the DNGs of a MLV), for readdirplus
+    int has_attr;
+    struct stat attr;
+};
+
+//per open directory, the listing is made once in opendir
+struct ll_dir
+{
+    char * path;
+    const struct ll_clip * clip;
+    struct ll_dir_entry * entries;
+    size_t count;
+    size_t allocated;
+    uint32_t dng_frames;
+};
+
+static const struct mlvfs_path_operations * path_ops = NULL;
+static double ll_timeout = 1.0;
+//set while mounted, for telling the kernel about changed MLVs
+static struct fuse_session * ll_session = NULL;
+
+static struct ll_node * nodes_by_ino[LL_HASH_SIZE];
+static struct ll_node * nodes_by_path[LL_HASH_SIZE];
+static struct ll_clip * clips_by_path[LL_HASH_SIZE];
+static struct ll_clip ** clips = NULL;
+static uint32_t clip_count = 0;
+static uint32_t clip_allocated = 0;
+static fuse_ino_t next_ino = FUSE_ROOT_ID + 1;
+
+CREATE_MUTEX(ll_mutex)
+
+static uint32_t ll_hash_string(const char * string)
+{
+    //FNV-1a
+    uint32_t hash = 2166136261u;
+    for(const unsigned char * c = (const unsigned char *)string; *c; c++)
+    {
+        hash = (hash ^ *c) * 16777619u;
+    }
+    return hash % LL_HASH_SIZE;
+}
+
+static uint32_t ll_hash_ino(fuse_ino_t ino)
+{
+    return (uint32_t)((ino ^ (ino >> 32)) % LL_HASH_SIZE);
+}
+
+//Make sure you free() the result!!!
+static char * ll_copy_string(const char * source)
+{
+    char * result = malloc(strlen(source) + 1);
+    if(result) strcpy(result, source);
+    return result;
+}
+
+//Make sure you free() the result!!!
+static char * ll_child_path(const char * parent_path, const char * name)
+{
+    char * path = malloc(strlen(parent_path) + strlen(name) + 2);
+    if(path)
+    {
+        sprintf(path, "%s%s%s", parent_path, string_ends_with(parent_path, "/") ? "" : "/", name);
+    }
+    return path;
+}
+
+static struct ll_node * ll_find_node(fuse_ino_t ino)
+{
+    for(struct ll_node * node = nodes_by_ino[ll_hash_ino(ino)]; node; node = node->next_by_ino)
+    {
+        if(node->ino == ino) return node;
+    }
+    return NULL;
+}
+
+static struct ll_node * ll_find_node_by_path(const char * path)
+{
+    for(struct ll_node * node = nodes_by_path[ll_hash_string(path)]; node; node = node->next_by_path)
+    {
+        if(!strcmp(node->path, path)) return node;
+    }
+    return NULL;
+}
+
+static void ll_unlink_node_path(struct ll_node * node)
+{
+    struct ll_node ** link = &nodes_by_path[ll_hash_string(node->path)];
+    while(*link && *link != node) link = &(*link)->next_by_path;
+    if(*link) *link = node->next_by_path;
+}
+
+static void ll_link_node_path(struct ll_node * node)
+{
+    uint32_t hash = ll_hash_string(node->path);
+    node->next_by_path = nodes_by_path[hash];
+    nodes_by_path[hash] = node;
+}
+
+static void ll_remove_node(struct ll_node * node)
+{
+    struct ll_node ** link = &nodes_by_ino[ll_hash_ino(node->ino)];
+    while(*link && *link != node) link = &(*link)->next_by_ino;
+    if(*link) *link = node->next_by_ino;
+    ll_unlink_node_path(node);
+    free(node->path);
+    free(node);
+}
+
+/**
+ * Registers a MLV's virtual directory (once), so the files in it can be given encoded inodes
+ * @return the clip id, or -1 if the directory is not a MLV
+ */
+static int32_t ll_register_clip(const char * dir_path)
+{
+    for(struct ll_clip * clip = clips_by_path[ll_hash_string(dir_path)]; clip; clip = clip->next)
+    {
+        if(!strcmp(clip->dir_path, dir_path)) return clip->id;
+    }
+
+    char * mlv_filename = NULL;
+    char * path_in_mlv = NULL;
+    char * basename = NULL;
+    int32_t result = -1;
+    if(path_ops->resolve_path(dir_path, &mlv_filename, &path_in_mlv))
+    {
+        if(path_in_mlv[0] == 0 && clip_count <= LL_CLIP_MASK && path_ops->get_basename(mlv_filename, &basename))
+        {
+            if(clip_count >= clip_allocated)
+            {
+                uint32_t new_allocated = clip_allocated ? clip_allocated * 2 : 64;
+                struct ll_clip ** new_clips = realloc(clips, new_allocated * sizeof(struct ll_clip *));
+                if(new_clips)
+                {
+                    clips = new_clips;
+                    clip_allocated = new_allocated;
+                }
+            }
+            struct ll_clip * clip = clip_count < clip_allocated ? malloc(sizeof(struct ll_clip)) : NULL;
+            if(clip)
+            {
+                clip->id = (int32_t)clip_count;
+                clip->mlv_filename = mlv_filename;
+                clip->dir_path = ll_copy_string(dir_path);
+                clip->basename = basename;
+                clip->dng_frames = 0;
+                uint32_t hash = ll_hash_string(dir_path);
+                clip->next = clips_by_path[hash];
+                clips_by_path[hash] = clip;
+                result = clip->id;
+                clips[clip_count++] = clip;
+                mlv_filename = NULL;
+                basename = NULL;
+            }
+        }
+        free(path_in_mlv);
+    }
+    free(mlv_filename);
+    free(basename);
+    return result;
+}
+
+/**
+ * Looks up (or creates) the node for a path and counts the lookup
+ */
+static struct ll_node * ll_get_node(const char * path, int is_dir)
+{
+    struct ll_node * node = ll_find_node_by_path(path);
+    if(!node)
+    {
+        node = malloc(sizeof(struct ll_node));
+        if(!node) return NULL;
+        node->path = ll_copy_string(path);
+        if(!node->path)
+        {
+            free(node);
+            return NULL;
+        }
+        node->ino = next_ino++;
+        node->nlookup = 0;
+        node->clip = is_dir ? ll_register_clip(path) : -1;
+
+        uint32_t hash = ll_hash_ino(node->ino);
+        node->next_by_ino = nodes_by_ino[hash];
+        nodes_by_ino[hash] = node;
+        ll_link_node_path(node);
+    }
+    node->nlookup++;
+    return node;
+}
+
+/**
+ * Works out which of a MLV's files a name refers to, it has to be exactly the name the directory listing uses
+ * @return the kind of file, or LL_KIND_NONE if it is not one of the virtual files
+ */
+static int ll_decode_name(const struct ll_clip * clip, const char * name, uint32_t * frame)
+{
+    *frame = 0;
+    if(!strcmp(name, "_PREVIEW.gif")) return LL_KIND_GIF;
+
+    size_t length = strlen(clip->basename);
+    if(strncmp(name, clip->basename, length)) return LL_KIND_NONE;
+
+    const char * rest = name + length;
+    if(!strcmp(rest, ".wav")) return LL_KIND_WAV;
+    if(!strcmp(rest, ".log")) return LL_KIND_LOG;
+    if(rest[0] == '_' && rest[1] >= '0' && rest[1] <= '9' && string_ends_with(rest, ".dng"))
+    {
+        char * end = NULL;
+        unsigned long number = strtoul(rest + 1, &end, 10);
+        char expected[32];
+        snprintf(expected, sizeof(expected), "_%06lu.dng", number);
+        if(number <= UINT32_MAX && !strcmp(rest, expected))
+        {
+            *frame = (uint32_t)number;
+            return LL_KIND_DNG;
+        }
+    }
+    return LL_KIND_NONE;
+}
+
+//Make sure you free() the result!!!
+static char * ll_clip_file_path(const struct ll_clip * clip, int kind, uint32_t frame)
+{
+    char * name = malloc(strlen(clip->basename) + 32);
+    if(!name) return NULL;
+    switch(kind)
+    {
+        case LL_KIND_DNG: sprintf(name, "%s_%06u.dng", clip->basename, frame); break;
+        case LL_KIND_WAV: sprintf(name, "%s.wav", clip->basename); break;
+        case LL_KIND_LOG: sprintf(name, "%s.log", clip->basename); break;
+        default: strcpy(name, "_PREVIEW.gif"); break;
+    }
+    char * path = ll_child_path(clip->dir_path, name);
+    free(name);
+    return path;
+}
+
+/**
+ * The virtual path an inode stands for, for calling into the path based operations
+ * Make sure you free() the result!!!
+ */
+static char * ll_get_path(fuse_ino_t ino)
+{
+    char * path = NULL;
+    RELOCK(ll_mutex)
+    {
+        if(ino & LL_ENCODED)
+        {
+            if(LL_INO_CLIP(ino) < clip_count)
+            {
+                path = ll_clip_file_path(clips[LL_INO_CLIP(ino)], LL_INO_KIND(ino), LL_INO_FRAME(ino));
+            }
+        }
+        else if(ino == FUSE_ROOT_ID)
+        {
+            path = ll_copy_string("/");
+        }
+        else
+        {
+            struct ll_node * node = ll_find_node(ino);
+            if(node) path = ll_copy_string(node->path);
+        }
+    }
+    UNLOCK(ll_mutex)
+    return path;
+}
+
+static void ll_note_dng_frames(int32_t clip_id, uint32_t frames)
+{
+    RELOCK(ll_mutex)
+    {
+        if(clips[clip_id]->dng_frames < frames) clips[clip_id]->dng_frames = frames;
+    }
+    UNLOCK(ll_mutex)
+}
+
+static const struct ll_clip * ll_get_clip(fuse_ino_t ino)
+{
+    const struct ll_clip * clip = NULL;
+    RELOCK(ll_mutex)
+    {
+        //clips are never removed while mounted, so the pointer stays valid
+        if(LL_INO_CLIP(ino) < clip_count) clip = clips[LL_INO_CLIP(ino)];
+    }
+    UNLOCK(ll_mutex)
+    return clip;
+}
+
+/**
+ * The attributes of a MLV's DNG, without resolving its path if they are already known
+ */
+static int ll_dng_attr(const struct ll_clip * clip, uint32_t frame, struct stat * stbuf)
+{
+    struct clip_info info;
+    if(catalog_get_clip_info(clip->mlv_filename, &info) && frame >= (uint32_t)info.frame_count) return -ENOENT;
+
+    if(lookup_dng_attr(clip->mlv_filename, frame, stbuf)) return 0;
+
+    int result = -ENOENT;
+    char * path = ll_clip_file_path(clip, LL_KIND_DNG, frame);
+    if(path)
+    {
+        result = path_ops->getattr(path, stbuf);
+        free(path);
+    }
+    return result;
+}
+
+static void ll_init(void * userdata, struct fuse_conn_info * conn)
+{
+    //long timeouts mean the MLVs are not expected to change, so let the kernel read ahead in big requests
+    if(ll_timeout > 1.0)
+    {
+        if(conn->capable & FUSE_CAP_ASYNC_READ) conn->want |= FUSE_CAP_ASYNC_READ;
+        conn->max_readahead = MLVFS_MAX_READAHEAD;
+    }
+    //read_buf's memfds are spliced to the kernel instead of copied
+    if(conn->capable & FUSE_CAP_SPLICE_WRITE) conn->want |= FUSE_CAP_SPLICE_WRITE;
+    //always readdirplus, not just when the kernel guesses the listing will be followed by lookups
+    if(conn->capable & FUSE_CAP_READDIRPLUS) conn->want &= ~FUSE_CAP_READDIRPLUS_AUTO;
+    if(path_ops->init) path_ops->init();
+}
+
+static void ll_destroy(void * userdata)
+{
+    if(path_ops->destroy) path_ops->destroy();
+}
+
+/**
+ * Looks up a real file or directory (or a MLV) and counts the lookup
+ * @return 0 if successful, a negative error code otherwise
+ */
+static int ll_lookup_real(const char * parent_path, const char * name, struct fuse_entry_param * entry)
+{
+    char * path = ll_child_path(parent_path, name);
+    if(!path) return -ENOMEM;
+
+    int result = path_ops->getattr(path, &entry->attr);
+    if(result)
+    {
+        free(path);
+        return result;
+    }
+
+    RELOCK(ll_mutex)
+    {
+        struct ll_node * node = ll_get_node(path, S_ISDIR(entry->attr.st_mode));
+        entry->ino = node ? node->ino : 0;
+    }
+    UNLOCK(ll_mutex)
+    free(path);
+
+    if(!entry->ino) return -ENOMEM;
+    entry->attr.st_ino = entry->ino;
+    return 0;
+}
+
+static void ll_lookup(fuse_req_t req, fuse_ino_t parent, const char * name)
+{
+    if(parent & LL_ENCODED)
+    {
+        fuse_reply_err(req, ENOTDIR);
+        return;
+    }
+
+    struct fuse_entry_param entry;
+    memset(&entry, 0, sizeof(entry));
+    entry.attr_timeout = ll_timeout;
+    entry.entry_timeout = ll_timeout;
+
+    const struct ll_clip * clip = NULL;
+    int32_t clip_id = -1;
+    char * parent_path = NULL;
+    RELOCK(ll_mutex)
+    {
+        struct ll_node * node = parent == FUSE_ROOT_ID ? NULL : ll_find_node(parent);
+        if(parent == FUSE_ROOT_ID || node)
+        {
+            parent_path = ll_copy_string(node ? node->path : "/");
+            if(node && node->clip >= 0)
+            {
+                clip_id = node->clip;
+                clip = clips[clip_id];
+            }
+        }
+    }
+    UNLOCK(ll_mutex)
+
+    if(!parent_path)
+    {
+        fuse_reply_err(req, ENOENT);
+        return;
+    }
+
+    //files inside a MLV's virtual directory: no node needed, the inode says it all
+    uint32_t frame = 0;
+    int kind = clip ? ll_decode_name(clip, name, &frame) : LL_KIND_NONE;
+    if(kind != LL_KIND_NONE)
+    {
+        int result = -ENOENT;
+        if(kind == LL_KIND_DNG)
+        {
+            result = ll_dng_attr(clip, frame, &entry.attr);
+        }
+        else
+        {
+            char * path = ll_clip_file_path(clip, kind, frame);
+            if(path)
+            {
+                result = path_ops->getattr(path, &entry.attr);
+                free(path);
+            }
+        }
+        free(parent_path);
+        if(result)
+        {
+            fuse_reply_err(req, -result);
+            return;
+        }
+        if(kind == LL_KIND_DNG) ll_note_dng_frames(clip_id, frame + 1);
+        entry.ino = LL_INO(kind, clip_id, frame);
+        entry.attr.st_ino = entry.ino;
+        fuse_reply_entry(req, &entry);
+        return;
+    }
+
+    int result = ll_lookup_real(parent_path, name, &entry);
+    free(parent_path);
+    if(result)
+    {
+        fuse_reply_err(req, -result);
+        return;
+    }
+    fuse_reply_entry(req, &entry);
+}
+
+static void ll_forget_node(fuse_ino_t ino, uint64_t nlookup)
+{
+    if(!(ino & LL_ENCODED) && ino != FUSE_ROOT_ID)
+    {
+        RELOCK(ll_mutex)
+        {
+            struct ll_node * node = ll_find_node(ino);
+            if(node)
+            {
+                node->nlookup = nlookup < node->nlookup ? node->nlookup - nlookup : 0;
+                if(!node->nlookup) ll_remove_node(node);
+            }
+        }
+        UNLOCK(ll_mutex)
+    }
+}
+
+static void ll_forget(fuse_req_t req, fuse_ino_t ino, uint64_t nlookup)
+{
+    ll_forget_node(ino, nlookup);
+    fuse_reply_none(req);
+}
+
+static void ll_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info * fi)
+{
+    struct stat stbuf;
+    memset(&stbuf, 0, sizeof(stbuf));
+    int result = -ENOENT;
+
+    if((ino & LL_ENCODED) && LL_INO_KIND(ino) == LL_KIND_DNG)
+    {
+        //the fast path: no path to build or resolve if the attributes of the clip's DNGs are known
+        const struct ll_clip * clip = ll_get_clip(ino);
+        if(clip) result = ll_dng_attr(clip, LL_INO_FRAME(ino), &stbuf);
+    }
+    else
+    {
+        char * path = ll_get_path(ino);
+        if(path)
+        {
+            result = path_ops->getattr(path, &stbuf);
+            free(path);
+        }
+    }
+
+    if(result)
+    {
+        fuse_reply_err(req, -result);
+        return;
+    }
+    stbuf.st_ino = ino;
+    fuse_reply_attr(req, &stbuf, ll_timeout);
+}
+
+static void ll_setattr(fuse_req_t req, fuse_ino_t ino, struct stat * attr, int to_set, struct fuse_file_info * fi)
+{
+    char * path = ll_get_path(ino);
+    if(!path)
+    {
+        fuse_reply_err(req, ENOENT);
+        return;
+    }
+
+    //only the size can be changed, the same as the high-level frontend (which has no chmod/chown/utimens)
+    int result = 0;
+    if(to_set & FUSE_SET_ATTR_SIZE)
+    {
+        result = path_ops->truncate(path, attr->st_size);
+    }
+
+    struct stat stbuf;
+    memset(&stbuf, 0, sizeof(stbuf));
+    if(!result) result = path_ops->getattr(path, &stbuf);
+    free(path);
+
+    if(result)
+    {
+        fuse_reply_err(req, -result);
+        return;
+    }
+    stbuf.st_ino = ino;
+    fuse_reply_attr(req, &stbuf, ll_timeout);
+}
+
+static void ll_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info * fi)
+{
+    struct ll_handle * handle = malloc(sizeof(struct ll_handle));
+    if(!handle)
+    {
+        fuse_reply_err(req, ENOMEM);
+        return;
+    }
+    handle->path = ll_get_path(ino);
+    handle->fh = 0;
+    if(!handle->path)
+    {
+        free(handle);
+        fuse_reply_err(req, ENOENT);
+        return;
+    }
+
+    struct fuse_file_info path_fi = *fi;
+    int result = path_ops->open(handle->path, &path_fi);
+    if(result)
+    {
+        free(handle->path);
+        free(handle);
+        fuse_reply_err(req, -result);
+        return;
+    }
+    handle->fh = path_fi.fh;
+    fi->fh = (uint64_t)handle;
+    fi->direct_io = path_fi.direct_io;
+    fi->keep_cache = path_fi.keep_cache;
+    fuse_reply_open(req, fi);
+}
+
+static void ll_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, struct fuse_file_info * fi)
+{
+    struct ll_handle * handle = (struct ll_handle *)fi->fh;
+    struct fuse_file_info path_fi = *fi;
+    path_fi.fh = handle->fh;
+
+    struct fuse_bufvec * bufvec = NULL;
+    int result = path_ops->read_buf(handle->path, &bufvec, size, off, &path_fi);
+    if(result < 0)
+    {
+        fuse_reply_err(req, -result);
+        return;
+    }
+
+    //the pages of a memfd are spliced to the kernel if it can, but not moved: they are still in the image buffer
+    fuse_reply_data(req, bufvec, 0);
+    for(size_t i = 0; i < bufvec->count; i++)
+    {
+        if(!(bufvec->buf[i].flags & FUSE_BUF_IS_FD)) free(bufvec->buf[i].mem);
+    }
+    free(bufvec);
+}
+
+static void ll_write(fuse_req_t req, fuse_ino_t ino, const char * buf, size_t size, off_t off, struct fuse_file_info * fi)
+{
+    struct ll_handle * handle = (struct ll_handle *)fi->fh;
+    struct fuse_file_info path_fi = *fi;
+    path_fi.fh = handle->fh;
+    int result = path_ops->write(handle->path, buf, size, off, &path_fi);
+    if(result < 0)
+    {
+        fuse_reply_err(req, -result);
+    }
+    else
+    {
+        fuse_reply_write(req, (size_t)result);
+    }
+}
+
+static void ll_release(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info * fi)
+{
+    struct ll_handle * handle = (struct ll_handle *)fi->fh;
+    if(handle)
+    {
+        struct fuse_file_info path_fi = *fi;
+        path_fi.fh = handle->fh;
+        path_ops->release(handle->path, &path_fi);
+        free(handle->path);
+        free(handle);
+    }
+    fuse_reply_err(req, 0);
+}
+
+static void ll_fsync(fuse_req_t req, fuse_ino_t ino, int datasync, struct fuse_file_info * fi)
+{
+    struct ll_handle * handle = (struct ll_handle *)fi->fh;
+    struct fuse_file_info path_fi = *fi;
+    path_fi.fh = handle->fh;
+    fuse_reply_err(req, -path_ops->fsync(handle->path, datasync, &path_fi));
+}
+
+static int ll_fill_dir(void * buf, const char * name, const struct stat * stbuf, off_t off, enum fuse_fill_dir_flags flags)
+{
+    struct ll_dir * dir = (struct ll_dir *)buf;
+    if(dir->count >= dir->allocated)
+    {
+        size_t new_allocated = dir->allocated ? dir->allocated * 2 : 64;
+        struct ll_dir_entry * entries = realloc(dir->entries, new_allocated * sizeof(struct ll_dir_entry));
+        if(!entries) return 1;
+        dir->entries = entries;
+        dir->allocated = new_allocated;
+    }
+
+    struct ll_dir_entry * entry = &dir->entries[dir->count];
+    entry->name = ll_copy_string(name);
+    if(!entry->name) return 1;
+    entry->ino = LL_UNKNOWN_INO;
+    entry->mode = 0;
+    entry->has_attr = 0;
+
+    uint32_t frame = 0;
+    int kind = dir->clip ? ll_decode_name(dir->clip, name, &frame) : LL_KIND_NONE;
+    if(kind != LL_KIND_NONE)
+    {
+        entry->ino = LL_INO(kind, dir->clip->id, frame);
+        entry->mode = S_IFREG;
+        if(kind == LL_KIND_DNG && frame >= dir->dng_frames) dir->dng_frames = frame + 1;
+        if(stbuf && (flags & FUSE_FILL_DIR_PLUS))
+        {
+            entry->has_attr = 1;
+            entry->attr = *stbuf;
+            entry->attr.st_ino = entry->ino;
+        }
+    }
+    dir->count++;
+    return 0;
+}
+
+static void ll_free_dir(struct ll_dir * dir)
+{
+    for(size_t i = 0; i < dir->count; i++)
+    {
+        free(dir->entries[i].name);
+    }
+    free(dir->entries);
+    free(dir->path);
+    free(dir);
+}
+
+static void ll_opendir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info * fi)
+{
+    if(ino & LL_ENCODED)
+    {
+        fuse_reply_err(req, ENOTDIR);
+        return;
+    }
+
+    struct ll_dir * dir = calloc(1, sizeof(struct ll_dir));
+    if(!dir)
+    {
+        fuse_reply_err(req, ENOMEM);
+        return;
+    }
+
+    char * path = NULL;
+    RELOCK(ll_mutex)
+    {
+        struct ll_node * node = ino == FUSE_ROOT_ID ? NULL : ll_find_node(ino);
+        if(ino == FUSE_ROOT_ID || node)
+        {
+            path = ll_copy_string(node ? node->path : "/");
+            if(node && node->clip >= 0) dir->clip = clips[node->clip];
+        }
+    }
+    UNLOCK(ll_mutex)
+
+    if(!path)
+    {
+        free(dir);
+        fuse_reply_err(req, ENOENT);
+        return;
+    }
+
+    struct fuse_file_info path_fi = *fi;
+    path_fi.fh = 0;
+    dir->path = path;
+    int result = path_ops->readdir(path, dir, ll_fill_dir, 0, &path_fi);
+
+    if(result)
+    {
+        ll_free_dir(dir);
+        fuse_reply_err(req, -result);
+        return;
+    }
+    if(dir->clip) ll_note_dng_frames(dir->clip->id, dir->dng_frames);
+    fi->fh = (uint64_t)dir;
+    fuse_reply_open(req, fi);
+}
+
+static void ll_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, struct fuse_file_info * fi)
+{
+    struct ll_dir * dir = (struct ll_dir *)fi->fh;
+    char * buf = malloc(size ? size : 1);
+    if(!buf)
+    {
+        fuse_reply_err(req, ENOMEM);
+        return;
+    }
+
+    size_t used = 0;
+    for(size_t i = (size_t)MAX(off, 0); i < dir->count; i++)
+    {
+        struct stat stbuf;
+        memset(&stbuf, 0, sizeof(stbuf));
+        stbuf.st_ino = dir->entries[i].ino;
+        stbuf.st_mode = dir->entries[i].mode;
+        size_t entry_size = fuse_add_direntry(req, buf + used, size - used, dir->entries[i].name, &stbuf, (off_t)(i + 1));
+        if(entry_size > size - used) break;
+        used += entry_size;
+    }
+    fuse_reply_buf(req, buf, used);
+    free(buf);
+}
+
+/**
+ * Like readdir, but every entry comes with its attributes, so listing a MLV fills the kernel's attribute cache for all of its frames
+ */
+static void ll_readdirplus(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, struct fuse_file_info * fi)
+{
+    struct ll_dir * dir = (struct ll_dir *)fi->fh;
+    char * buf = malloc(size ? size : 1);
+    if(!buf)
+    {
+        fuse_reply_err(req, ENOMEM);
+        return;
+    }
+
+    size_t used = 0;
+    for(size_t i = (size_t)MAX(off, 0); i < dir->count; i++)
+    {
+        const struct ll_dir_entry * dir_entry = &dir->entries[i];
+        const char * name = dir_entry->name;
+        struct fuse_entry_param entry;
+        memset(&entry, 0, sizeof(entry));
+        entry.attr_timeout = ll_timeout;
+        entry.entry_timeout = ll_timeout;
+        entry.attr.st_ino = dir_entry->ino;
+        entry.attr.st_mode = dir_entry->mode;
+
+        //an entry with ino 0 only names the file, the kernel looks it up later (the MLV's WAV, LOG and GIF)
+        int counted = 0;
+        if(dir_entry->has_attr)
+        {
+            entry.ino = dir_entry->ino;
+            entry.attr = dir_entry->attr;
+        }
+        else if(!(dir_entry->ino & LL_ENCODED) && strcmp(name, ".") && strcmp(name, ".."))
+        {
+            counted = !ll_lookup_real(dir->path, name, &entry);
+        }
+
+        size_t entry_size = fuse_add_direntry_plus(req, buf + used, size - used, name, &entry, (off_t)(i + 1));
+        if(entry_size > size - used)
+        {
+            //it didn't make it into the reply, so the kernel won't count the lookup
+            if(counted) ll_forget_node(entry.ino, 1);
+            break;
+        }
+        used += entry_size;
+    }
+    fuse_reply_buf(req, buf, used);
+    free(buf);
+}
+
+static void ll_releasedir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info * fi)
+{
+    ll_free_dir((struct ll_dir *)fi->fh);
+    fuse_reply_err(req, 0);
+}
+
+//Make sure you free() the result!!!
+static char * ll_get_child_path(fuse_ino_t parent, const char * name)
+{
+    if(parent & LL_ENCODED) return NULL;
+    char * parent_path = ll_get_path(parent);
+    if(!parent_path) return NULL;
+    char * path = ll_child_path(parent_path, name);
+    free(parent_path);
+    return path;
+}
+
+/**
+ * Replies with the entry of a file or directory that was just created
+ */
+static void ll_reply_new_entry(fuse_req_t req, const char * path, struct fuse_file_info * fi)
+{
+    struct fuse_entry_param entry;
+    memset(&entry, 0, sizeof(entry));
+    entry.attr_timeout = ll_timeout;
+    entry.entry_timeout = ll_timeout;
+
+    int result = path_ops->getattr(path, &entry.attr);
+    if(!result)
+    {
+        RELOCK(ll_mutex)
+        {
+            struct ll_node * node = ll_get_node(path, S_ISDIR(entry.attr.st_mode));
+            entry.ino = node ? node->ino : 0;
+        }
+        UNLOCK(ll_mutex)
+        if(!entry.ino) result = -ENOMEM;
+    }
+
+    if(result)
+    {
+        if(fi)
+        {
+            struct ll_handle * handle = (struct ll_handle *)fi->fh;
+            free(handle->path);
+            free(handle);
+        }
+        fuse_reply_err(req, -result);
+        return;
+    }
+
+    entry.attr.st_ino = entry.ino;
+    if(fi)
+    {
+        fuse_reply_create(req, &entry, fi);
+    }
+    else
+    {
+        fuse_reply_entry(req, &entry);
+    }
+}
+
+static void ll_create(fuse_req_t req, fuse_ino_t parent, const char * name, mode_t mode, struct fuse_file_info * fi)
+{
+    char * path = ll_get_child_path(parent, name);
+    struct ll_handle * handle = path ? malloc(sizeof(struct ll_handle)) : NULL;
+    if(!handle)
+    {
+        free(path);
+        fuse_reply_err(req, path ? ENOMEM : ENOENT);
+        return;
+    }
+
+    struct fuse_file_info path_fi = *fi;
+    path_fi.fh = 0;
+    int result = path_ops->create(path, mode, &path_fi);
+    if(result)
+    {
+        free(handle);
+        free(path);
+        fuse_reply_err(req, -result);
+        return;
+    }
+
+    handle->path = path;
+    handle->fh = path_fi.fh;
+    fi->fh = (uint64_t)handle;
+    ll_reply_new_entry(req, path, fi);
+}
+
+static void ll_mkdir(fuse_req_t req, fuse_ino_t parent, const char * name, mode_t mode)
+{
+    char * path = ll_get_child_path(parent, name);
+    if(!path)
+    {
+        fuse_reply_err(req, ENOENT);
+        return;
+    }
+
+    int result = path_ops->mkdir(path, mode);
+    if(result)
+    {
+        fuse_reply_err(req, -result);
+    }
+    else
+    {
+        ll_reply_new_entry(req, path, NULL);
+    }
+    free(path);
+}
+
+static void ll_unlink(fuse_req_t req, fuse_ino_t parent, const char * name)
+{
+    char * path = ll_get_child_path(parent, name);
+    fuse_reply_err(req, path ? -path_ops->unlink(path) : ENOENT);
+    free(path);
+}
+
+static void ll_rmdir(fuse_req_t req, fuse_ino_t parent, const char * name)
+{
+    char * path = ll_get_child_path(parent, name);
+    fuse_reply_err(req, path ? -path_ops->rmdir(path) : ENOENT);
+    free(path);
+}
+
+/**
+ * Moves the nodes of a renamed file or directory (and everything below it) to their new paths
+ */
+static void ll_rename_nodes(const char * from, const char * to)
+{
+    size_t from_length = strlen(from);
+    struct ll_node * moved = NULL;
+
+    for(uint32_t i = 0; i < LL_HASH_SIZE; i++)
+    {
+        struct ll_node ** link = &nodes_by_path[i];
+        while(*link)
+        {
+            struct ll_node * node = *link;
+            if(!strncmp(node->path, from, from_length) && (node->path[from_length] == 0 || node->path[from_length] == '/'))
+            {
+                *link = node->next_by_path;
+                node->next_by_path = moved;
+                moved = node;
+            }
+            else
+            {
+                link = &node->next_by_path;
+            }
+        }
+    }
+
+    while(moved)
+    {
+        struct ll_node * node = moved;
+        moved = node->next_by_path;
+
+        char * path = malloc(strlen(to) + strlen(node->path) - from_length + 1);
+        if(path)
+        {
+            sprintf(path, "%s%s", to, node->path + from_length);
+            free(node->path);
+            node->path = path;
+            //a renamed MLV is a different clip
+            if(node->clip >= 0) node->clip = ll_register_clip(path);
+        }
+        ll_link_node_path(node);
+    }
+}
+
+static void ll_rename(fuse_req_t req, fuse_ino_t parent, const char * name, fuse_ino_t newparent, const char * newname, unsigned int flags)
+{
+    if(flags)
+    {
+        fuse_reply_err(req, EINVAL);
+        return;
+    }
+
+    char * from = ll_get_child_path(parent, name);
+    char * to = ll_get_child_path(newparent, newname);
+    int result = -ENOENT;
+    if(from && to)
+    {
+        result = path_ops->rename(from, to);
+        if(!result)
+        {
+            RELOCK(ll_mutex)
+            {
+                //whatever was at the destination is gone now, its inode lives on until it is forgotten
+                struct ll_node * replaced = ll_find_node_by_path(to);
+                if(replaced)
+                {
+                    ll_unlink_node_path(replaced);
+                    replaced->next_by_path = NULL;
+                }
+                ll_rename_nodes(from, to);
+            }
+            UNLOCK(ll_mutex)
+        }
+    }
+    free(from);
+    free(to);
+    fuse_reply_err(req, -result);
+}
+
+static void ll_statfs(fuse_req_t req, fuse_ino_t ino)
+{
+    struct statvfs stbuf;
+    memset(&stbuf, 0, sizeof(stbuf));
+    int result = path_ops->statfs("/", &stbuf);
+    if(result)
+    {
+        fuse_reply_err(req, -result);
+    }
+    else
+    {
+        fuse_reply_statfs(req, &stbuf);
+    }
+}
+
+static const struct fuse_lowlevel_ops ll_operations =
+{
+    .init        = ll_init,
+    .destroy     = ll_destroy,
+    .lookup      = ll_lookup,
+    .forget      = ll_forget,
+    .getattr     = ll_getattr,
+    .setattr     = ll_setattr,
+    .open        = ll_open,
+    .read        = ll_read,
+    .write       = ll_write,
+    .release     = ll_release,
+    .fsync       = ll_fsync,
+    .opendir     = ll_opendir,
+    .readdir     = ll_readdir,
+    .readdirplus = ll_readdirplus,
+    .releasedir  = ll_releasedir,
+    .create      = ll_create,
+    .mkdir       = ll_mkdir,
+    .unlink      = ll_unlink,
+    .rmdir       = ll_rmdir,
+    .rename      = ll_rename,
+    .statfs      = ll_statfs
+};
+
+static void ll_free_all(void)
+{
+    RELOCK(ll_mutex)
+    {
+        for(uint32_t i = 0; i < LL_HASH_SIZE; i++)
+        {
+            struct ll_node * node = nodes_by_ino[i];
+            while(node)
+            {
+                struct ll_node * next = node->next_by_ino;
+                free(node->path);
+                free(node);
+                node = next;
+            }
+            nodes_by_ino[i] = NULL;
+            nodes_by_path[i] = NULL;
+            clips_by_path[i] = NULL;
+        }
+        for(uint32_t i = 0; i < clip_count; i++)
+        {
+            free(clips[i]->mlv_filename);
+            free(clips[i]->dir_path);
+            free(clips[i]->basename);
+            free(clips[i]);
+        }
+        free(clips);
+        clips = NULL;
+        clip_count = 0;
+        clip_allocated = 0;
+    }
+    UNLOCK(ll_mutex)
+}
+
+/**
+ * Tells the kernel to drop what it has cached of a MLV's virtual directory and the files in it (names, attributes
+ * and contents), so a MLV that changed shows up right away even with a long --cache-timeout
+ * @param mlv_filename The MLV that changed
+ */
+void mlvfs_lowlevel_invalidate(const char * mlv_filename)
+{
+    struct fuse_session * session = ATOMIC_LOAD_PTR(ll_session);
+    if(!session) return;
+
+    for(uint32_t i = 0; ; i++)
+    {
+        int32_t clip_id = -1;
+        uint32_t dng_frames = 0;
+        fuse_ino_t dir_ino = 0;
+        fuse_ino_t parent_ino = 0;
+        char * name = NULL;
+        int done = 0;
+        RELOCK(ll_mutex)
+        {
+            //clips are only ever added while mounted
+            done = i >= clip_count;
+            if(!done && !filename_strcmp(clips[i]->mlv_filename, mlv_filename))
+            {
+                const struct ll_clip * clip = clips[i];
+                clip_id = clip->id;
+                dng_frames = clip->dng_frames;
+                struct ll_node * node = ll_find_node_by_path(clip->dir_path);
+                if(node) dir_ino = node->ino;
+
+                char * separator = strrchr(clip->dir_path, '/');
+                char * parent_path = separator ? ll_copy_string(clip->dir_path) : NULL;
+                if(parent_path && separator[1])
+                {
+                    parent_path[separator - clip->dir_path] = 0;
+                    struct ll_node * parent = ll_find_node_by_path(parent_path);
+                    parent_ino = separator == clip->dir_path ? FUSE_ROOT_ID : parent ? parent->ino : 0;
+                    name = ll_copy_string(separator + 1);
+                }
+                free(parent_path);
+            }
+        }
+        UNLOCK(ll_mutex)
+        if(done) break;
+        if(clip_id < 0) continue;
+
+        //not under ll_mutex: the kernel may have to wait for a lookup in the directory to be answered first
+        if(parent_ino && name) fuse_lowlevel_notify_inval_entry(session, parent_ino, name, strlen(name));
+        if(dir_ino) fuse_lowlevel_notify_inval_inode(session, dir_ino, 0, 0);
+        fuse_lowlevel_notify_inval_inode(session, LL_INO(LL_KIND_WAV, clip_id, 0), 0, 0);
+        fuse_lowlevel_notify_inval_inode(session, LL_INO(LL_KIND_LOG, clip_id, 0), 0, 0);
+        fuse_lowlevel_notify_inval_inode(session, LL_INO(LL_KIND_GIF, clip_id, 0), 0, 0);
+        for(uint32_t frame = 0; frame < dng_frames; frame++)
+        {
+            fuse_lowlevel_notify_inval_inode(session, LL_INO(LL_KIND_DNG, clip_id, frame), 0, 0);
+        }
+        free(name);
+    }
+}
+
+/**
+ * Prints the FUSE options understood by the low-level frontend
+ */
+void mlvfs_lowlevel_help(void)
+{
+    printf("usage: mlvfs mountpoint [options]\n\n");
+    fuse_cmdline_help();
+    fuse_lowlevel_help();
+}
+
+/**
+ * Mounts and serves the filesystem through the low-level FUSE 3 API, until it is unmounted
+ * @param args The command line, with the MLVFS options already parsed out
+ * @param ops The path based operations of the filesystem
+ * @param timeout How long (in seconds) the kernel may cache attributes and names
+ * @return the exit code
+ */
+int mlvfs_lowlevel_main(struct fuse_args *args, const struct mlvfs_path_operations *ops, double timeout)
+{
+    struct fuse_cmdline_opts opts;
+    int result = 1;
+    path_ops = ops;
+    ll_timeout = timeout;
+
+    if(fuse_parse_cmdline(args, &opts) != 0) return 1;
+
+    if(opts.show_help)
+    {
+        mlvfs_lowlevel_help();
+        result = 0;
+    }
+    else if(opts.show_version)
+    {
+        fuse_lowlevel_version();
+        result = 0;
+    }
+    else if(!opts.mountpoint)
+    {
+        err_printf("MLVFS: no mountpoint specified\n");
+    }
+    else
+    {
+        struct fuse_session * session = fuse_session_new(args, &ll_operations, sizeof(ll_operations), NULL);
+        if(session)
+        {
+            if(!fuse_set_signal_handlers(session))
+            {
+                if(!fuse_session_mount(session, opts.mountpoint))
+                {
+                    fuse_daemonize(opts.foreground);
+                    ATOMIC_STORE_PTR(ll_session, session);
+                    result = opts.singlethread ? fuse_session_loop(session) : fuse_session_loop_mt(session, opts.clone_fd);
+                    ATOMIC_STORE_PTR(ll_session, NULL);
+                    fuse_session_unmount(session);
+                }
+                fuse_remove_signal_handlers(session);
+            }
+            fuse_session_destroy(session);
+        }
+    }
+
+    free(opts.mountpoint);
+    ll_free_all();
+    return result ? 1 : 0;
+}
@@ -0,0 +1,63 @@
+/*
+ * Copyright (C) 2014 David Milligan
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the
+ * Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ */
+
+#ifndef mlvfs_lowlevel_h
+#define mlvfs_lowlevel_h
+
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <fuse.h>
+#include <fuse_lowlevel.h>
+
+/*
+ * The path based operations of main.c, which the low-level (inode based) FUSE 3 frontend is built on top of
+ */
+struct mlvfs_path_operations
+{
+    void (*init)(void);
+    void (*destroy)(void);
+    int (*getattr)(const char *path, struct stat *stbuf);
+    int (*open)(const char *path, struct fuse_file_info *fi);
+    int (*read)(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi);
+    /* the memory buffers of the result are free()d after the reply, unlike the file descriptors */
+    int (*read_buf)(const char *path, struct fuse_bufvec **bufp, size_t size, off_t offset, struct fuse_file_info *fi);
+    int (*readdir)(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi);
+    int (*release)(const char *path, struct fuse_file_info *fi);
+    int (*create)(const char *path, mode_t mode, struct fuse_file_info *fi);
+    int (*fsync)(const char *path, int isdatasync, struct fuse_file_info *fi);
+    int (*mkdir)(const char *path, mode_t mode);
+    int (*rename)(const char *from, const char *to);
+    int (*rmdir)(const char *path);
+    int (*unlink)(const char *path);
+    int (*truncate)(const char *path, off_t offset);
+    int (*write)(const char *path, const char *buf, size_t size, off_t offset, struct fuse_file_info *fi);
+    int (*statfs)(const char *path, struct statvfs *stat);
+
+    /* 1 if the virtual path is a MLV or inside one, mlv_file and path_in_mlv must be free()d */
+    int (*resolve_path)(const char *path, char **mlv_file, char **path_in_mlv);
+    /* 1 if successful, the virtual name of the MLV's files without the extension, it must be free()d */
+    int (*get_basename)(const char *mlv_filename, char **mlv_basename);
+};
+
+void mlvfs_lowlevel_help(void);
+void mlvfs_lowlevel_invalidate(const char * mlv_filename);
+int mlvfs_lowlevel_main(struct fuse_args *args, const struct mlvfs_path_operations *ops, double timeout);
+
+#endif
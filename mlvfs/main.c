@@ -42,6 +42,15 @@
 #include "hdr.h"
 #include "webgui.h"
 #include "resource_manager.h"
+#include "clip.h"
+#include "catalog.h"
+#include "warm.h"
+#include "prefetch.h"
+#include "diskcache.h"
+#include "framepool.h"
+#include "watch.h"
+#include "pathcache.h"
+#include "settings.h"
 #include "mlvfs.h"
 #include "LZMA/LzmaLib.h"
 #include "lj92.h"
@@ -49,9 +58,26 @@
 #include "histogram.h"
 #include "patternnoise.h"
 #include "slre/slre.h"
+#ifdef MLVFS_LOWLEVEL
+#include "lowlevel.h"
+#endif
 
 static struct mlvfs mlvfs;
 
+/* FUSE 3 added the stat and flags parameters to the readdir filler */
+#if FUSE_USE_VERSION >= 30
+#define FILL_DIR(filler, buf, name) filler(buf, name, NULL, 0, 0)
+#define FILL_DIR_STAT(filler, buf, name, stbuf) filler(buf, name, stbuf, 0, (stbuf) ? FUSE_FILL_DIR_PLUS : 0)
+#else
+#define FILL_DIR(filler, buf, name) filler(buf, name, NULL, 0)
+#define FILL_DIR_STAT(filler, buf, name, stbuf) filler(buf, name, stbuf, 0)
+#endif
+
+/* read_buf came with FUSE 2.9, it lets the rendered files be spliced to the kernel from their memfd */
+#if !defined(_WIN32) && defined(FUSE_VERSION) && FUSE_VERSION >= 29
+#define MLVFS_READ_BUF
+#endif
+
 #ifdef _WIN32
 
 #include <io.h>
@@ -341,13 +367,14 @@ static char * mlv_read_debug_log(const char *mlv_filename)
         return NULL;
     }
     
-    mlv_xref_hdr_t *block_xref = get_index(mlv_filename);
-    if (!block_xref)
+    struct mlv_index *index = acquire_index(mlv_filename);
+    if (!index)
     {
         mlvfs_close_chunks(chunk_files, chunk_count);
         return NULL;
     }
-    mlv_xref_t *xrefs = (mlv_xref_t *)&(((uint8_t*)block_xref)[sizeof(mlv_xref_hdr_t)]);
+    mlv_xref_hdr_t *block_xref = index->xref;
+    mlv_xref_t *xrefs = index->xrefs;
     
     mlv_hdr_t mlv_hdr;
     mlv_debg_hdr_t debg_hdr;
@@ -413,7 +440,7 @@ static char * mlv_read_debug_log(const char *mlv_filename)
         }
     }
 
-    free(block_xref);
+    release_index(index);
     mlvfs_close_chunks(chunk_files, chunk_count);
 
     return result;
@@ -428,133 +455,13 @@ static char * mlv_read_debug_log(const char *mlv_filename)
  */
 int mlv_get_frame_headers(const char *mlv_filename, int index, struct frame_headers * frame_headers)
 {
-    FILE **chunk_files = NULL;
-    uint32_t chunk_count = 0;
-
-    chunk_files = mlvfs_load_chunks(mlv_filename, &chunk_count);
-    if(!chunk_files || !chunk_count)
-    {
-        return 0;
-    }
-
-    memset(frame_headers, 0, sizeof(struct frame_headers));
-
-    mlv_xref_hdr_t *block_xref = get_index(mlv_filename);
-    if (!block_xref)
+    struct mlv_clip * clip = get_or_create_clip(mlv_filename);
+    if(!clip)
     {
-        mlvfs_close_chunks(chunk_files, chunk_count);
+        memset(frame_headers, 0, sizeof(struct frame_headers));
         return 0;
     }
-
-    mlv_xref_t *xrefs = (mlv_xref_t *)&(((uint8_t*)block_xref)[sizeof(mlv_xref_hdr_t)]);
-
-    int found = 0;
-    int rawi_found = 0;
-    uint32_t vidf_counter = 0;
-    mlv_hdr_t mlv_hdr;
-    uint32_t hdr_size;
-
-    for(uint32_t block_xref_pos = 0; (block_xref_pos < block_xref->entryCount) && !found; block_xref_pos++)
-    {
-        /* get the file and position of the next block */
-        uint32_t in_file_num = xrefs[block_xref_pos].fileNumber;
-        int64_t position = xrefs[block_xref_pos].frameOffset;
-
-        /* select file */
-        FILE *in_file = chunk_files[in_file_num];
-
-        switch(xrefs[block_xref_pos].frameType)
-        {
-            case MLV_FRAME_VIDF:
-                //Matches to number in sequence rather than frameNumber in header for consistency with readdir
-                if(index == vidf_counter)
-                {
-                    found = 1;
-                    frame_headers->fileNumber = in_file_num;
-                    frame_headers->position = position;
-                    file_set_pos(in_file, position, SEEK_SET);
-                    fread(&mlv_hdr, sizeof(mlv_hdr_t), 1, in_file);
-                    file_set_pos(in_file, position, SEEK_SET);
-                    hdr_size = MIN(sizeof(mlv_vidf_hdr_t), mlv_hdr.blockSize);
-                    fread(&frame_headers->vidf_hdr, hdr_size, 1, in_file);
-                }
-                else
-                {
-                    vidf_counter++;
-                }
-                break;
-
-            case MLV_FRAME_AUDF:
-                break;
-
-            case MLV_FRAME_UNSPECIFIED:
-            default:
-                file_set_pos(in_file, position, SEEK_SET);
-                if(fread(&mlv_hdr, sizeof(mlv_hdr_t), 1, in_file))
-                {
-                    file_set_pos(in_file, position, SEEK_SET);
-                    if(!memcmp(mlv_hdr.blockType, "MLVI", 4))
-                    {
-                        hdr_size = MIN(sizeof(mlv_file_hdr_t), mlv_hdr.blockSize);
-                        fread(&frame_headers->file_hdr, hdr_size, 1, in_file);
-                    }
-                    else if(!memcmp(mlv_hdr.blockType, "RTCI", 4))
-                    {
-                        hdr_size = MIN(sizeof(mlv_rtci_hdr_t), mlv_hdr.blockSize);
-                        fread(&frame_headers->rtci_hdr, hdr_size, 1, in_file);
-                    }
-                    else if(!memcmp(mlv_hdr.blockType, "IDNT", 4))
-                    {
-                        hdr_size = MIN(sizeof(mlv_idnt_hdr_t), mlv_hdr.blockSize);
-                        fread(&frame_headers->idnt_hdr, hdr_size, 1, in_file);
-                    }
-                    else if(!memcmp(mlv_hdr.blockType, "RAWI", 4))
-                    {
-                        hdr_size = MIN(sizeof(mlv_rawi_hdr_t), mlv_hdr.blockSize);
-                        if(fread(&frame_headers->rawi_hdr, hdr_size, 1, in_file))
-                        {
-                            rawi_found = 1;
-                        }
-                    }
-                    else if(!memcmp(mlv_hdr.blockType, "EXPO", 4))
-                    {
-                        hdr_size = MIN(sizeof(mlv_expo_hdr_t), mlv_hdr.blockSize);
-                        fread(&frame_headers->expo_hdr, hdr_size, 1, in_file);
-                    }
-                    else if(!memcmp(mlv_hdr.blockType, "LENS", 4))
-                    {
-                        hdr_size = MIN(sizeof(mlv_lens_hdr_t), mlv_hdr.blockSize);
-                        fread(&frame_headers->lens_hdr, hdr_size, 1, in_file);
-                    }
-                    else if(!memcmp(mlv_hdr.blockType, "WBAL", 4))
-                    {
-                        hdr_size = MIN(sizeof(mlv_wbal_hdr_t), mlv_hdr.blockSize);
-                        fread(&frame_headers->wbal_hdr, hdr_size, 1, in_file);
-                    }
-                }
-        }
-        
-        if(ferror(in_file))
-        {
-            int err = errno;
-            err_printf("%s: fread error: %s\n", mlv_filename, strerror(err));
-        }
-    }
-    
-    if(found && !rawi_found)
-    {
-        err_printf("%s: Error reading frame headers: no rawi block was found\n", mlv_filename);
-    }
-    
-    if(!found)
-    {
-        err_printf("%s: Error reading frame headers: vidf block for frame %d was not found\n", mlv_filename, index);
-    }
-    
-    free(block_xref);
-    mlvfs_close_chunks(chunk_files, chunk_count);
-
-    return found && rawi_found;
+    return clip_get_frame_headers(clip, index, frame_headers);
 }
 
 /**
@@ -581,7 +488,7 @@ size_t get_image_data(struct frame_headers * frame_headers, FILE * file, uint8_t
     {
         file_set_pos(file, frame_headers->position + frame_headers->vidf_hdr.frameSpace + sizeof(mlv_vidf_hdr_t), SEEK_SET);
         size_t frame_size = frame_headers->vidf_hdr.blockSize - (frame_headers->vidf_hdr.frameSpace + sizeof(mlv_vidf_hdr_t));
-        uint8_t * frame_buffer = malloc(frame_size);
+        uint8_t * frame_buffer = framepool_alloc(frame_size);
         if (!frame_buffer)
         {
             return 0;
@@ -600,18 +507,21 @@ size_t get_image_data(struct frame_headers * frame_headers, FILE * file, uint8_t
                 size_t lzma_out_size = *(uint32_t *)frame_buffer;
                 size_t lzma_in_size = frame_size - LZMA_PROPS_SIZE - 4;
                 size_t lzma_props_size = LZMA_PROPS_SIZE;
-                uint8_t *lzma_out = malloc(lzma_out_size);
-                
-                int ret = LzmaUncompress(lzma_out, &lzma_out_size,
-                                         &frame_buffer[4 + LZMA_PROPS_SIZE], &lzma_in_size,
-                                         &frame_buffer[4], lzma_props_size);
-                if(ret == SZ_OK)
-                {
-                    result = dng_get_image_data(frame_headers, (uint16_t*)lzma_out, output_buffer, offset, max_size);
-                }
-                else
+                uint8_t *lzma_out = framepool_alloc(lzma_out_size);
+                if(lzma_out)
                 {
-                    err_printf("LZMA Failed!\n");
+                    int ret = LzmaUncompress(lzma_out, &lzma_out_size,
+                                             &frame_buffer[4 + LZMA_PROPS_SIZE], &lzma_in_size,
+                                             &frame_buffer[4], lzma_props_size);
+                    if(ret == SZ_OK)
+                    {
+                        result = dng_get_image_data(frame_headers, (uint16_t*)lzma_out, output_buffer, offset, max_size);
+                    }
+                    else
+                    {
+                        err_printf("LZMA Failed!\n");
+                    }
+                    framepool_free(lzma_out);
                 }
             }
             else if(lj92_compressed)
@@ -642,16 +552,18 @@ size_t get_image_data(struct frame_headers * frame_headers, FILE * file, uint8_t
                 }
             }
         }
-        free(frame_buffer);
+        framepool_free(frame_buffer);
     }
     else
     {
-        uint16_t * packed_bits = calloc((size_t)(packed_size * 2), 1);
+        uint16_t * packed_bits = framepool_alloc((size_t)(packed_size * 2));
         if(packed_bits)
         {
             
             file_set_pos(file, frame_headers->position + frame_headers->vidf_hdr.frameSpace + sizeof(mlv_vidf_hdr_t) + pixel_start_address * 2, SEEK_SET);
-            fread(packed_bits, sizeof(uint16_t), (size_t)packed_size, file);
+            size_t packed_read = fread(packed_bits, sizeof(uint16_t), (size_t)packed_size, file);
+            /* the buffer is reused, so zero what the file didn't fill (e.g. a truncated last frame) like calloc would */
+            memset(packed_bits + packed_read, 0, (size_t)(packed_size - packed_read) * sizeof(uint16_t));
             if(ferror(file))
             {
                 int err = errno;
@@ -661,12 +573,23 @@ size_t get_image_data(struct frame_headers * frame_headers, FILE * file, uint8_t
             {
                 result = dng_get_image_data(frame_headers, packed_bits, output_buffer, offset, max_size);
             }
-            free(packed_bits);
+            framepool_free(packed_bits);
         }
     }
     return result;
 }
 
+/**
+ * The current naming scheme of the MLVs, it can be changed from the web GUI
+ */
+static int get_name_scheme()
+{
+    const struct mlvfs_settings * settings = settings_get();
+    int name_scheme = settings ? settings->name_scheme : mlvfs.name_scheme;
+    settings_release(settings);
+    return name_scheme;
+}
+
 /**
  * Generates a customizable virtual name for the MLV file (for the virtual directory)
  * Make sure you free() the result!!!
@@ -682,11 +605,11 @@ static int get_mlv_basename(const char *path, char ** mlv_basename)
     char *dot = strrchr(start, '.');
     if(dot == NULL) { free(temp); return 0; }
     *dot = '\0';
-    struct frame_headers frame_headers;
-    if(mlvfs.name_scheme == 1 && mlv_get_frame_headers(path, 0, &frame_headers))
+    struct clip_info info;
+    if(get_name_scheme() == 1 && catalog_get_clip_info(path, &info) && info.has_headers)
     {
         *mlv_basename =  malloc(sizeof(char) * (strlen(start) + 1024));
-        sprintf(*mlv_basename, "%s%s_1_%d-%02d-%02d_%04d_C%04d", start, dot + 1, 1900 + frame_headers.rtci_hdr.tm_year, frame_headers.rtci_hdr.tm_mon + 1, frame_headers.rtci_hdr.tm_mday, 1, 0);
+        sprintf(*mlv_basename, "%s%s_1_%d-%02d-%02d_%04d_C%04d", start, dot + 1, 1900 + info.rtc_year, info.rtc_mon + 1, info.rtc_mday, 1, 0);
     }
     else
     {
@@ -713,7 +636,7 @@ static char * get_capture(struct slre_cap cap)
  */
 static int get_mlv_name_from_basename(const char *path, char ** mlv_name)
 {
-    if(mlvfs.name_scheme == 1)
+    if(get_name_scheme() == 1)
     {
         struct slre_cap caps[2];
         memset(caps, 0, sizeof(caps));
@@ -740,7 +663,7 @@ static int get_mlv_name_from_basename(const char *path, char ** mlv_name)
 }
 
 
-static int is_mlv_file(char *filename)
+static int is_mlv_file(const char *filename)
 {
     if (string_ends_with(filename, ".MLV") || string_ends_with(filename, ".mlv"))
     {
@@ -759,7 +682,7 @@ static int is_mlv_file(char *filename)
  * Make sure you free() the result
  * @return 1 if the real path is a MLV or inside a MLV, 0 otherwise
  */
-static int mlvfs_resolve_path(const char *path, char **mlv_file, char **path_in_mlv)
+static int mlvfs_resolve_path_uncached(const char *path, char **mlv_file, char **path_in_mlv)
 {
     if(strstr(path,"/._")) return 0;
     int ret = 0;
@@ -780,7 +703,7 @@ static int mlvfs_resolve_path(const char *path, char **mlv_file, char **path_in_
         char *mlv_file_check = path_append(mlvfs.mlv_path, path_slashfix(current_path));
         char *mlv_name = NULL;
         
-        if (mlvfs.name_scheme && get_mlv_name_from_basename(path_slashfix(current_path), &mlv_name))
+        if (get_name_scheme() && get_mlv_name_from_basename(path_slashfix(current_path), &mlv_name))
         {
             *mlv_file = path_append(mlvfs.mlv_path, mlv_name);
             *path_in_mlv = copy_string(current_token);
@@ -833,6 +756,132 @@ static int mlvfs_resolve_path(const char *path, char **mlv_file, char **path_in_
     return ret;
 }
 
+/**
+ * Works out what a virtual path refers to, for the path cache
+ * @return 1 if successful, 0 otherwise
+ */
+static int mlvfs_resolve(const char *path, struct resolved_path *resolved)
+{
+    char *mlv_filename = NULL;
+    char *path_in_mlv = NULL;
+
+    /* is this within a virtual directory? */
+    if (mlvfs_resolve_path_uncached(path, &mlv_filename, &path_in_mlv))
+    {
+        int is_in_mlv_root = (find_first_separator(path_in_mlv) == NULL);
+
+        resolved->in_mlv = 1;
+        resolved->mlv_filename = mlv_filename;
+        resolved->path_in_mlv = path_in_mlv;
+
+        if (is_in_mlv_root && (string_ends_with(path_in_mlv, ".dng") || string_ends_with(path_in_mlv, ".wav") || string_ends_with(path_in_mlv, ".gif") || string_ends_with(path_in_mlv, ".log")))
+        {
+            /* a DNG etc in the MLV root -> virtual */
+            if (string_ends_with(path_in_mlv, ".dng"))
+            {
+                resolved->kind = RESOLVED_DNG;
+                resolved->frame = get_mlv_frame_number(path_in_mlv);
+            }
+            else if (string_ends_with(path_in_mlv, ".wav"))
+            {
+                resolved->kind = RESOLVED_WAV;
+            }
+            else if (string_ends_with(path_in_mlv, ".gif"))
+            {
+                resolved->kind = RESOLVED_GIF;
+            }
+            else
+            {
+                resolved->kind = RESOLVED_LOG;
+            }
+        }
+        else if (strlen(path_in_mlv) == 0)
+        {
+            /* it is the MLV itself */
+            resolved->kind = RESOLVED_MLV;
+            resolved->real_path = copy_string(mlv_filename);
+        }
+        else
+        {
+            char *mld_name = copy_string(mlv_filename);
+            char *dot = strrchr(mld_name, '.');
+
+            if (dot)
+            {
+                strcpy(dot, ".MLD");
+            }
+
+            char *tmp_path = path_slashfix(copy_string(path_in_mlv));
+            resolved->kind = RESOLVED_MLD;
+            resolved->real_path = path_append(mld_name, tmp_path);
+
+            free(tmp_path);
+            free(mld_name);
+        }
+    }
+    else
+    {
+        /* this file is not within a virtual directory, so just get it from the existing one */
+        char *tmp_path = path_slashfix(copy_string(path));
+        resolved->kind = RESOLVED_REAL;
+        resolved->real_path = path_append((const char*)mlvfs.mlv_path, (const char*)tmp_path);
+        free(tmp_path);
+
+        /* AppleDouble files next to the virtual files of a MLV would be inside the MLV file itself */
+        const char *last_separator = find_last_separator(path);
+        if (last_separator && !strncmp(last_separator, "/._", 3))
+        {
+            char *parent = copy_string(path);
+            parent[last_separator - path] = 0;
+            if (mlvfs_resolve_path_uncached(parent, &mlv_filename, &path_in_mlv))
+            {
+                if (strlen(path_in_mlv) == 0) resolved->kind = RESOLVED_MISSING;
+                free(mlv_filename);
+                free(path_in_mlv);
+            }
+            free(parent);
+        }
+    }
+
+    return resolved->real_path || resolved->kind != RESOLVED_REAL;
+}
+
+/**
+ * check if the given path is within a MLV file or a MLV itself
+ * Make sure you free() the result
+ * @return 1 if the real path is a MLV or inside a MLV, 0 otherwise
+ */
+static int mlvfs_resolve_path(const char *path, char **mlv_file, char **path_in_mlv)
+{
+    int result = 0;
+    const struct resolved_path *resolved = path_cache_get(path, &mlvfs_resolve);
+    if (resolved && resolved->in_mlv)
+    {
+        *mlv_file = copy_string(resolved->mlv_filename);
+        *path_in_mlv = copy_string(resolved->path_in_mlv);
+        result = 1;
+    }
+    path_cache_release(resolved);
+    return result;
+}
+
+/**
+ * try to find the real file path from given virtual path
+ * Make sure you free() the result
+ * @return NULL if this is a pure virtual file or a char* with the name of the file on disk
+ */
+static char *mlvfs_resolve_virtual(const char *path)
+{
+    char *resolved_filename = NULL;
+    const struct resolved_path *resolved = path_cache_get(path, &mlvfs_resolve);
+    if (resolved && resolved->real_path)
+    {
+        resolved_filename = copy_string(resolved->real_path);
+    }
+    path_cache_release(resolved);
+    return resolved_filename;
+}
+
 static void check_mld_exists(char * path)
 {
     char *temp = copy_string(path);
@@ -872,9 +921,14 @@ static int process_frame(struct image_buffer * image_buffer)
     char * mlv_filename = NULL;
     char * path_in_mlv = NULL;
     const char * path = image_buffer->dng_filename;
+    /* the whole frame is rendered with these, even if they are changed meanwhile */
+    const struct mlvfs_settings * settings = image_buffer->settings;
     
     if(string_ends_with(path, ".dng") && mlvfs_resolve_path(path, &mlv_filename, &path_in_mlv))
     {
+        /* remembered so the buffer can be discarded when the MLV changes */
+        free(image_buffer->mlv_filename);
+        image_buffer->mlv_filename = copy_string(mlv_filename);
         int frame_number = get_mlv_frame_number(path);
         struct frame_headers frame_headers;
         if(mlv_get_frame_headers(mlv_filename, frame_number, &frame_headers))
@@ -889,10 +943,15 @@ static int process_frame(struct image_buffer * image_buffer)
                 return 0;
             }
             
-            image_buffer->size = dng_get_image_size(&frame_headers);
-            image_buffer->data = (uint16_t*)malloc(image_buffer->size);
-            image_buffer->header_size = dng_get_header_size();
-            image_buffer->header = (uint8_t*)malloc(image_buffer->header_size);
+            if(!image_buffer_alloc(image_buffer, dng_get_header_size(), dng_get_image_size(&frame_headers)))
+            {
+                int err = errno;
+                err_printf("malloc error: %s\n", strerror(err));
+                mlvfs_close_chunks(chunk_files, chunk_count);
+                free(mlv_filename);
+                free(path_in_mlv);
+                return 0;
+            }
             
             char * mlv_basename = copy_string(image_buffer->dng_filename);
             if(mlv_basename != NULL)
@@ -900,54 +959,66 @@ static int process_frame(struct image_buffer * image_buffer)
                 char * dir = find_last_separator(mlv_basename);
                 if(dir != NULL) *dir = 0;
             }
+
+            /* rendered before (maybe in an earlier mount) with the same settings */
+            if(diskcache_load(&frame_headers, frame_number, mlv_basename, image_buffer))
+            {
+                mlvfs_close_chunks(chunk_files, chunk_count);
+                free(mlv_basename);
+                free(mlv_filename);
+                free(path_in_mlv);
+                return 1;
+            }
             
             get_image_data(&frame_headers, chunk_files[frame_headers.fileNumber], (uint8_t*) image_buffer->data, 0, image_buffer->size);
-            if(mlvfs.deflicker) deflicker(&frame_headers, mlvfs.deflicker, image_buffer->data, image_buffer->size);
-            dng_get_header_data(&frame_headers, image_buffer->header, 0, image_buffer->header_size, mlvfs.fps, mlv_basename);
+            if(settings->deflicker) deflicker(&frame_headers, settings->deflicker, image_buffer->data, image_buffer->size);
+            dng_get_header_data(&frame_headers, image_buffer->header, 0, image_buffer->header_size, settings->fps, mlv_basename);
             
-            if(mlvfs.fix_pattern_noise)
+            if(settings->fix_pattern_noise)
             {
                 fix_pattern_noise((int16_t*)image_buffer->data, frame_headers.rawi_hdr.xRes, frame_headers.rawi_hdr.yRes, frame_headers.rawi_hdr.raw_info.white_level, 0);
             }
             
             int is_dual_iso = 0;
-            if(mlvfs.dual_iso == 1)
+            if(settings->dual_iso == 1)
             {
                 is_dual_iso = hdr_convert_data(&frame_headers, image_buffer->data, 0, image_buffer->size);
             }
-            else if(mlvfs.dual_iso == 2)
+            else if(settings->dual_iso == 2)
             {
-                is_dual_iso = cr2hdr20_convert_data(&frame_headers, image_buffer->data, mlvfs.hdr_interpolation_method, !mlvfs.hdr_no_fullres, !mlvfs.hdr_no_alias_map, mlvfs.chroma_smooth, mlvfs.fix_bad_pixels);
+                is_dual_iso = cr2hdr20_convert_data(&frame_headers, image_buffer->data, settings->hdr_interpolation_method, !settings->hdr_no_fullres, !settings->hdr_no_alias_map, settings->chroma_smooth, settings->fix_bad_pixels, settings->generation);
             }
             
             if(is_dual_iso)
             {
                 //redo the dng header b/c white and black levels will be different
-                dng_get_header_data(&frame_headers, image_buffer->header, 0, image_buffer->size, mlvfs.fps, mlv_basename);
+                dng_get_header_data(&frame_headers, image_buffer->header, 0, image_buffer->size, settings->fps, mlv_basename);
             }
             else
             {
                 fix_focus_pixels(&frame_headers, image_buffer->data, 0);
-                if(mlvfs.fix_bad_pixels)
+                if(settings->fix_bad_pixels)
                 {
-                    fix_bad_pixels(&frame_headers, image_buffer->data, mlvfs.fix_bad_pixels == 2, is_dual_iso);
+                    fix_bad_pixels(&frame_headers, image_buffer->data, settings->fix_bad_pixels == 2, is_dual_iso, settings->generation);
                 }
             }
             
-            if(mlvfs.chroma_smooth && mlvfs.dual_iso != 2)
+            if(settings->chroma_smooth && settings->dual_iso != 2)
             {
-                chroma_smooth(&frame_headers, image_buffer->data, mlvfs.chroma_smooth);
+                chroma_smooth(&frame_headers, image_buffer->data, settings->chroma_smooth);
             }
             
-            if(mlvfs.fix_stripes)
+            if(settings->fix_stripes)
             {
-                struct stripes_correction * correction = stripes_get_correction(mlv_filename);
+                struct stripes_correction * correction = stripes_get_correction(mlv_filename, settings->generation);
                 if(correction == NULL)
                 {
-                    correction = stripes_new_correction(mlv_filename);
+                    correction = stripes_new_correction(mlv_filename, settings->generation);
                     if(correction)
                     {
+                        //computed before it is shared, another render of the clip may be doing the same
                         stripes_compute_correction(&frame_headers, correction, image_buffer->data, 0, image_buffer->size / 2);
+                        correction = stripes_publish_correction(correction);
                     }
                     else
                     {
@@ -956,7 +1027,9 @@ static int process_frame(struct image_buffer * image_buffer)
                     }
                 }
                 stripes_apply_correction(&frame_headers, correction, image_buffer->data, 0, image_buffer->size / 2);
+                stripes_release_correction(correction);
             }
+            diskcache_store(&frame_headers, frame_number, mlv_basename, image_buffer);
             mlvfs_close_chunks(chunk_files, chunk_count);
             free(mlv_basename);
         }
@@ -974,73 +1047,21 @@ int create_preview(struct image_buffer * image_buffer)
     
     if(string_ends_with(path, ".gif") && mlvfs_resolve_path(path, &mlv_filename, &path_in_mlv))
     {
+        /* remembered so the buffer can be discarded when the MLV changes */
+        free(image_buffer->mlv_filename);
+        image_buffer->mlv_filename = copy_string(mlv_filename);
         struct frame_headers frame_headers;
         if(mlv_get_frame_headers(mlv_filename, 0, &frame_headers))
         {
-            image_buffer->size = gif_get_size(&frame_headers);
-            image_buffer->data = (uint16_t*)malloc(image_buffer->size);
-            image_buffer->header_size = 0;
-            image_buffer->header = NULL;
-            gif_get_data(mlv_filename, (uint8_t*)image_buffer->data, 0, image_buffer->size);
-        }
-        free(mlv_filename);
-        free(path_in_mlv);
-    }
-    return 1;
-}
-
-/**
- * try to find the real file path from given virtual path
- * Make sure you free() the result
- * @return NULL if this is a pure virtual file or a char* with the name of the file on disk
- */
-static char *mlvfs_resolve_virtual(const char *path)
-{
-    char *mlv_filename = NULL;
-    char *path_in_mlv = NULL;
-    char *resolved_filename = NULL;
-    
-    /* is this within a virtual directory? */
-    if (mlvfs_resolve_path(path, &mlv_filename, &path_in_mlv))
-    {
-        int is_in_mlv_root = (find_first_separator(path_in_mlv) == NULL);
-        
-        if (is_in_mlv_root && !strstr(path,"/._") && (string_ends_with(path_in_mlv, ".dng") || string_ends_with(path_in_mlv, ".wav") || string_ends_with(path_in_mlv, ".gif") || string_ends_with(path_in_mlv, ".log")))
-        {
-            /* a DNG etc in the MLV root -> virtual */
-            resolved_filename = NULL;
-        }
-        else if (strlen(path_in_mlv) == 0)
-        {
-            /* it is the MLV itself */
-            resolved_filename = copy_string(mlv_filename);
-        }
-        else
-        {
-            char *mld_name = copy_string(mlv_filename);
-            char *dot = strrchr(mld_name, '.');
-            
-            if (dot)
+            if(image_buffer_alloc(image_buffer, 0, gif_get_size(&frame_headers)))
             {
-                strcpy(dot, ".MLD");
+                gif_get_data(mlv_filename, (uint8_t*)image_buffer->data, 0, image_buffer->size);
             }
-            
-            resolved_filename = path_append(mld_name, path_slashfix(path_in_mlv));
-            
-            free(mld_name);
         }
         free(mlv_filename);
         free(path_in_mlv);
     }
-    else
-    {
-        /* this file is not within a virtual directory, so just get it from the existing one */
-        char *tmp_path = path_slashfix(copy_string(path));
-        resolved_filename = path_append((const char*)mlvfs.mlv_path, (const char*)tmp_path);
-        free(tmp_path);
-    }
-    
-    return resolved_filename;
+    return 1;
 }
 
 static int mlvfs_getattr(const char *path, struct FUSE_STAT *stbuf)
@@ -1048,12 +1069,18 @@ static int mlvfs_getattr(const char *path, struct FUSE_STAT *stbuf)
     memset(stbuf, 0, sizeof(struct FUSE_STAT));
 
     int result = -ENOENT;
-    char *mlv_filename = NULL;
-    char *path_in_mlv = NULL;
-    char *resolved_filename = NULL;
+
+    /* the cached resolution of the path, nothing to allocate */
+    const struct resolved_path *resolved = path_cache_get(path, &mlvfs_resolve);
+
+    if (!resolved || resolved->kind == RESOLVED_MISSING)
+    {
+        path_cache_release(resolved);
+        return -ENOENT;
+    }
 
     /* try to find the real file on disk */
-    resolved_filename = mlvfs_resolve_virtual(path);
+    const char *resolved_filename = resolved->real_path;
 
     if (resolved_filename)
     {
@@ -1107,114 +1134,342 @@ static int mlvfs_getattr(const char *path, struct FUSE_STAT *stbuf)
             stbuf->st_mtim = file_stat.st_mtim;
 #endif
         }
-        free(resolved_filename);
+        path_cache_release(resolved);
 
         return (stat_code == 0) ? 0 : -ENOENT;
     }
 
-    /* so this must be a virtual file, fetch MLV name and path */
-    if (mlvfs_resolve_path(path, &mlv_filename, &path_in_mlv))
-    {
-        if (string_ends_with(path_in_mlv, ".dng") || string_ends_with(path_in_mlv, ".wav") || string_ends_with(path_in_mlv, ".gif") || string_ends_with(path_in_mlv, ".log"))
-        {
-            /* if it's a file in root, all accesses to DNG, WAV, GIF and LOG are redirected */
-            struct FUSE_STAT * dng_st = NULL;
+    /* so this must be a virtual file, all accesses to DNG, WAV, GIF and LOG in the MLV root are redirected */
+    const char *mlv_filename = resolved->mlv_filename;
 
-            if (string_ends_with(path_in_mlv, ".dng") && (dng_st = lookup_dng_attr(mlv_filename)) != NULL)
-            {
-                memcpy(stbuf, dng_st, sizeof(struct FUSE_STAT));
-                result = 0;
-            }
-            else
-            {
-                int frame_number = string_ends_with(path_in_mlv, ".dng") ? get_mlv_frame_number(path_in_mlv) : 0;
+    if (resolved->kind == RESOLVED_DNG && lookup_dng_attr(mlv_filename, (uint32_t)resolved->frame, stbuf))
+    {
+        result = 0;
+    }
+    else
+    {
+        int frame_number = resolved->kind == RESOLVED_DNG ? resolved->frame : 0;
 
 #ifdef ALLOW_WRITEABLE_DNGS
-                stbuf->st_mode = S_IFREG | 0666;
+        stbuf->st_mode = S_IFREG | 0666;
 #else
-                stbuf->st_mode = S_IFREG | 0444;
+        stbuf->st_mode = S_IFREG | 0444;
 #endif
-                stbuf->st_nlink = 1;
+        stbuf->st_nlink = 1;
 
-                struct frame_headers frame_headers;
-                if (mlv_get_frame_headers(mlv_filename, frame_number, &frame_headers))
-                {
-                    struct tm tm_str;
-                    tm_str.tm_sec = (int)(frame_headers.rtci_hdr.tm_sec + (frame_headers.vidf_hdr.timestamp - frame_headers.rtci_hdr.timestamp) / 1000000);
-                    tm_str.tm_min = frame_headers.rtci_hdr.tm_min;
-                    tm_str.tm_hour = frame_headers.rtci_hdr.tm_hour;
-                    tm_str.tm_mday = frame_headers.rtci_hdr.tm_mday;
-                    tm_str.tm_mon = frame_headers.rtci_hdr.tm_mon;
-                    tm_str.tm_year = frame_headers.rtci_hdr.tm_year;
-                    tm_str.tm_isdst = frame_headers.rtci_hdr.tm_isdst;
-
-                    struct timespec timespec_str;
-                    timespec_str.tv_sec = mktime(&tm_str);
-                    timespec_str.tv_nsec = ((frame_headers.vidf_hdr.timestamp - frame_headers.rtci_hdr.timestamp) % 1000000) * 1000;
-
-                    // OS-specific timestamps
-#if __DARWIN_UNIX03
-                    memcpy(&stbuf->st_atimespec, &timespec_str, sizeof(struct timespec));
-                    memcpy(&stbuf->st_birthtimespec, &timespec_str, sizeof(struct timespec));
-                    memcpy(&stbuf->st_ctimespec, &timespec_str, sizeof(struct timespec));
-                    memcpy(&stbuf->st_mtimespec, &timespec_str, sizeof(struct timespec));
-#else
-                    memcpy(&stbuf->st_atim, &timespec_str, sizeof(struct timespec));
-                    memcpy(&stbuf->st_ctim, &timespec_str, sizeof(struct timespec));
-                    memcpy(&stbuf->st_mtim, &timespec_str, sizeof(struct timespec));
+        struct frame_headers frame_headers;
+        if (mlv_get_frame_headers(mlv_filename, frame_number, &frame_headers))
+        {
+            struct timespec timespec_str;
+            mlv_get_frame_time(&frame_headers, &timespec_str);
+
+            // OS-specific timestamps
+#if __DARWIN_UNIX03
+            memcpy(&stbuf->st_atimespec, &timespec_str, sizeof(struct timespec));
+            memcpy(&stbuf->st_birthtimespec, &timespec_str, sizeof(struct timespec));
+            memcpy(&stbuf->st_ctimespec, &timespec_str, sizeof(struct timespec));
+            memcpy(&stbuf->st_mtimespec, &timespec_str, sizeof(struct timespec));
+#else
+            memcpy(&stbuf->st_atim, &timespec_str, sizeof(struct timespec));
+            memcpy(&stbuf->st_ctim, &timespec_str, sizeof(struct timespec));
+            memcpy(&stbuf->st_mtim, &timespec_str, sizeof(struct timespec));
 #endif
 
-                    if (string_ends_with(path_in_mlv, ".dng"))
-                    {
-                        stbuf->st_size = dng_get_size(&frame_headers);
-                        register_dng_attr(mlv_filename, stbuf);
-                    }
-                    else if (string_ends_with(path_in_mlv, ".gif"))
-                    {
-                        stbuf->st_size = gif_get_size(&frame_headers);
-                    }
-                    else if (string_ends_with(path_in_mlv, ".log"))
-                    {
-                        char * log = mlv_read_debug_log(mlv_filename);
-                        if (log)
-                        {
-                            stbuf->st_size = strlen(log);
-                            free(log);
-                        }
-                    }
-                    else
-                    {
-                        stbuf->st_size = wav_get_size(mlv_filename);
-                    }
-                    result = 0; // DNG frame found
+            if (resolved->kind == RESOLVED_DNG)
+            {
+                /* the size is computed once per clip, every frame gets its own time from the table */
+                stbuf->st_size = dng_get_size(&frame_headers);
+                register_dng_attr(mlv_filename, stbuf);
+            }
+            else if (resolved->kind == RESOLVED_GIF)
+            {
+                stbuf->st_size = gif_get_size(&frame_headers);
+            }
+            else if (resolved->kind == RESOLVED_LOG)
+            {
+                char * log = mlv_read_debug_log(mlv_filename);
+                if (log)
+                {
+                    stbuf->st_size = strlen(log);
+                    free(log);
                 }
             }
+            else
+            {
+                stbuf->st_size = wav_get_size(mlv_filename);
+            }
+            result = 0; // DNG frame found
         }
-        free(mlv_filename);
-        free(path_in_mlv);
     }
+    path_cache_release(resolved);
 
     return result;
 }
 
+/**
+ * What fi->fh points to for an open virtual file, real files are opened on every read instead
+ */
+struct mlvfs_handle
+{
+    enum resolved_kind kind;
+    char * path;
+    char * mlv_filename;
+    int frame;
+    /* the settings when the file was opened, all its reads are served with them */
+    const struct mlvfs_settings * settings;
+    /* DNG and GIF: acquired by the first read, and kept until the file is released */
+    struct image_buffer * image_buffer;
+    /* DNG: the header alone, for reads that don't touch the image data */
+    uint8_t * header;
+    /* WAV: its chunk files and index stay open */
+    struct wav_file * wav;
+    /* LOG: read once */
+    char * log;
+    size_t log_size;
+    pthread_mutex_t mutex;
+};
+
+static struct mlvfs_handle * mlvfs_handle_new(const char *path, const struct resolved_path *resolved)
+{
+    struct mlvfs_handle * handle = calloc(1, sizeof(struct mlvfs_handle));
+    if (!handle)
+    {
+        return NULL;
+    }
+
+    handle->kind = resolved->kind;
+    handle->path = copy_string(path);
+    handle->mlv_filename = copy_string(resolved->mlv_filename);
+    handle->frame = resolved->frame;
+    handle->settings = settings_get();
+    pthread_mutex_init(&handle->mutex, NULL);
+
+    if (handle->kind == RESOLVED_WAV)
+    {
+        handle->wav = wav_open(handle->mlv_filename);
+    }
+    else if (handle->kind == RESOLVED_LOG)
+    {
+        handle->log = mlv_read_debug_log(handle->mlv_filename);
+        handle->log_size = handle->log ? strlen(handle->log) : 0;
+    }
+    return handle;
+}
+
+static void mlvfs_handle_free(struct mlvfs_handle * handle)
+{
+    if (!handle)
+    {
+        return;
+    }
+
+    /* it may have been invalidated since, so it can't be looked up by path anymore */
+    if (handle->image_buffer)
+    {
+        release_image_buffer(handle->image_buffer);
+    }
+    settings_release(handle->settings);
+    wav_close(handle->wav);
+    free(handle->header);
+    free(handle->log);
+    free(handle->mlv_filename);
+    free(handle->path);
+    pthread_mutex_destroy(&handle->mutex);
+    free(handle);
+}
+
+/**
+ * Gets the rendered DNG or GIF of a handle, the buffer is only looked up (or rendered) once per handle
+ */
+static struct image_buffer * mlvfs_handle_image(struct mlvfs_handle * handle)
+{
+    struct image_buffer * image_buffer = NULL;
+    pthread_mutex_lock(&handle->mutex);
+    if (!handle->image_buffer)
+    {
+        int was_created = 0;
+        if (handle->kind == RESOLVED_DNG)
+        {
+            /* before rendering this one, so the frames after it are rendered at the same time */
+            prefetch_frame_requested(handle->mlv_filename, handle->path, handle->frame);
+        }
+        handle->image_buffer = get_or_create_image_buffer(handle->path, handle->kind == RESOLVED_GIF ? NULL : handle->settings, handle->kind == RESOLVED_GIF ? &create_preview : &process_frame, RENDER_FOREGROUND, &was_created);
+    }
+    image_buffer = handle->image_buffer;
+    pthread_mutex_unlock(&handle->mutex);
+    return image_buffer;
+}
+
+/**
+ * Whether a read of a DNG can be served by its header alone, without rendering the frame
+ * Deflicker and Dual ISO change the header according to the image data, so then the frame is always rendered
+ */
+static int mlvfs_handle_header_only(struct mlvfs_handle * handle, size_t size, FUSE_OFF_T offset)
+{
+    return handle->kind == RESOLVED_DNG && !handle->image_buffer && !handle->settings->deflicker && !handle->settings->dual_iso && offset >= 0 && offset + size <= dng_get_header_size();
+}
+
+/**
+ * Gets the header of a handle's DNG, made from the frame's MLV headers only (once per handle)
+ */
+static uint8_t * mlvfs_handle_header(struct mlvfs_handle * handle)
+{
+    uint8_t * header = NULL;
+    pthread_mutex_lock(&handle->mutex);
+    if (!handle->header)
+    {
+        struct frame_headers frame_headers;
+        if (mlv_get_frame_headers(handle->mlv_filename, handle->frame, &frame_headers))
+        {
+            size_t header_size = dng_get_header_size();
+            handle->header = (uint8_t*)malloc(header_size);
+            char * mlv_basename = copy_string(handle->path);
+            if (handle->header && mlv_basename)
+            {
+                /* the same as process_frame, so the header is identical to the rendered DNG's */
+                char * dir = find_last_separator(mlv_basename);
+                if (dir != NULL) *dir = 0;
+                dng_get_header_data(&frame_headers, handle->header, 0, header_size, handle->settings->fps, mlv_basename);
+            }
+            else
+            {
+                free(handle->header);
+                handle->header = NULL;
+            }
+            free(mlv_basename);
+        }
+    }
+    header = handle->header;
+    pthread_mutex_unlock(&handle->mutex);
+    return header;
+}
+
+static int mlvfs_handle_read(struct mlvfs_handle * handle, char *buf, size_t size, FUSE_OFF_T offset)
+{
+    if (mlvfs_handle_header_only(handle, size, offset))
+    {
+        /* e.g. a file browser reading the tags, the frame is only rendered once the image data is read */
+        uint8_t * header = mlvfs_handle_header(handle);
+        if (header)
+        {
+            memcpy(buf, header + offset, size);
+            return (int)size;
+        }
+    }
+
+    if (handle->kind == RESOLVED_DNG)
+    {
+        size_t header_size = dng_get_header_size();
+        size_t remaining = 0;
+        off_t image_offset = 0;
+
+        struct image_buffer * image_buffer = mlvfs_handle_image(handle);
+        if (!image_buffer)
+        {
+            err_printf("DNG image_buffer is NULL\n");
+            return 0;
+        }
+        if (!image_buffer->header)
+        {
+            err_printf("DNG image_buffer->header is NULL\n");
+            return 0;
+        }
+        if (!image_buffer->data)
+        {
+            err_printf("DNG image_buffer->data is NULL\n");
+            return 0;
+        }
+
+        /* sanitize parameters to prevent errors by accesses beyond end */
+        long file_size = image_buffer->header_size + image_buffer->size;
+        long read_offset = MAX(0, MIN(offset, file_size));
+        long read_size = MAX(0, MIN(size, file_size - read_offset));
+
+        if (read_offset + read_size > file_size)
+        {
+            read_size = (size_t)(file_size - read_offset);
+        }
+
+        if (read_offset < header_size && image_buffer->header_size > 0)
+        {
+            remaining = MIN(read_size, header_size - read_offset);
+            memcpy(buf, image_buffer->header + read_offset, remaining);
+        }
+        else
+        {
+            image_offset = read_offset - header_size;
+        }
+
+        if (remaining < read_size && image_buffer->size > 0)
+        {
+            uint8_t* image_output_buf = (uint8_t*)buf + remaining;
+            memcpy(image_output_buf, ((uint8_t*)image_buffer->data) + image_offset, MIN(read_size - remaining, image_buffer->size - image_offset));
+        }
+
+        return (int)read_size;
+    }
+    else if (handle->kind == RESOLVED_WAV)
+    {
+        return handle->wav ? (int)wav_read(handle->wav, (uint8_t*)buf, offset, size) : 0;
+    }
+    else if (handle->kind == RESOLVED_GIF)
+    {
+        struct image_buffer * image_buffer = mlvfs_handle_image(handle);
+        if (!image_buffer)
+        {
+            err_printf("GIF image_buffer is NULL\n");
+            return 0;
+        }
+        if (!image_buffer->data)
+        {
+            err_printf("GIF image_buffer->data is NULL\n");
+            return 0;
+        }
+
+        /* ensure that reads with offset beyond end will not cause negative memcpy sizes */
+        long read_offset = MAX(0, MIN(offset, image_buffer->size));
+        long read_size = MAX(0, MIN(size, image_buffer->size - read_offset));
+
+        memcpy(buf, ((uint8_t*)image_buffer->data) + read_offset, read_size);
+        return (int)read_size;
+    }
+    else if (handle->kind == RESOLVED_LOG)
+    {
+        size_t read_bytes = 0;
+        if (handle->log && offset < handle->log_size)
+        {
+            read_bytes = MIN(size, handle->log_size - offset);
+            memcpy(buf, handle->log + offset, read_bytes);
+        }
+        return (int)read_bytes;
+    }
+    return -ENOENT;
+}
+
+/* the virtual files that get a handle */
+static int mlvfs_has_handle(const struct resolved_path *resolved)
+{
+    return resolved && resolved->in_mlv && (resolved->kind == RESOLVED_DNG || resolved->kind == RESOLVED_WAV || resolved->kind == RESOLVED_GIF || resolved->kind == RESOLVED_LOG);
+}
+
 static int mlvfs_open(const char *path, struct fuse_file_info *fi)
 {
     int result = 0;
 
-    /* reset the cached image buffer, if any */
     fi->fh = 0;
 
     /* try to find the real file on disk */
-    char *resolved_filename = mlvfs_resolve_virtual(path);
+    const struct resolved_path *resolved = path_cache_get(path, &mlvfs_resolve);
 
-    if (resolved_filename)
+    if (resolved && resolved->real_path)
     {
-        int fd = open(resolved_filename, O_RDONLY | O_BINARY);
-        free(resolved_filename);
+        int fd = open(resolved->real_path, O_RDONLY | O_BINARY);
+        int err = errno;
+        path_cache_release(resolved);
 
         if (fd < 0)
         {
-            return -errno;
+            return -err;
         }
 
         /* always close file after read/write operations. else deleting etc will fail on windows */
@@ -1225,8 +1480,33 @@ static int mlvfs_open(const char *path, struct fuse_file_info *fi)
     
     #ifndef ALLOW_WRITEABLE_DNGS
     if ((fi->flags & O_ACCMODE) != O_RDONLY) /* Only reading allowed. */
-        result = -EACCES;
+    {
+        path_cache_release(resolved);
+        return -EACCES;
+    }
     #endif
+
+    if (mlvfs_has_handle(resolved))
+    {
+        struct mlvfs_handle * handle = mlvfs_handle_new(path, resolved);
+        if (!handle)
+        {
+            path_cache_release(resolved);
+            return -ENOMEM;
+        }
+        fi->fh = (uint64_t)handle;
+
+        if (mlvfs.immutable && (resolved->kind == RESOLVED_DNG || resolved->kind == RESOLVED_WAV))
+        {
+            /* the kernel may keep the pages it read last time, unless the settings this handle renders with (or the MLV) have changed since then */
+            struct mlv_clip * clip = get_or_create_clip(resolved->mlv_filename);
+            if (clip)
+            {
+                fi->keep_cache = clip_keep_cache(clip, handle->settings->generation, resolved->kind == RESOLVED_DNG ? resolved->frame : -1);
+            }
+        }
+    }
+    path_cache_release(resolved);
     
     return result;
 }
@@ -1255,31 +1535,47 @@ static int mlvfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler, FU
         else
         {
             /* it refers to the MLV itself */
-            filler(buf, ".", NULL, 0);
-            filler(buf, "..", NULL, 0);
+            FILL_DIR(filler, buf, ".");
+            FILL_DIR(filler, buf, "..");
             is_mld_dir = 1;
 
             char * mlv_basename = NULL;
             if(get_mlv_basename(mlv_filename, &mlv_basename))
             {
-                char *filename = malloc(sizeof(char) * (strlen(mlv_basename) + 1024));
+                char *filename = malloc(sizeof(char) * (strlen(path) + strlen(mlv_basename) + 1024));
                 if (filename)
                 {
-                    if (has_audio(mlv_filename))
+                    struct clip_info info;
+                    if (!catalog_get_clip_info(mlv_filename, &info))
+                    {
+                        memset(&info, 0, sizeof(struct clip_info));
+                    }
+                    if (info.has_audio)
                     {
                         sprintf(filename, "%s.wav", mlv_basename);
-                        filler(buf, filename, NULL, 0);
+                        FILL_DIR(filler, buf, filename);
                     }
                     sprintf(filename, "%s.log", mlv_basename);
-                    filler(buf, filename, NULL, 0);
-                    int frame_count = mlv_get_frame_count(mlv_filename);
+                    FILL_DIR(filler, buf, filename);
+                    int frame_count = info.frame_count;
+
+                    /* the attributes of every DNG come with the listing, so it isn't followed by a getattr per frame */
+                    struct FUSE_STAT dng_stat;
+                    int has_dng_stat = frame_count > 0 && lookup_dng_attr(mlv_filename, 0, &dng_stat);
+                    if (frame_count > 0 && !has_dng_stat)
+                    {
+                        /* the first DNG's getattr fills the table for the whole clip */
+                        sprintf(filename, "%s/%s_%06d.dng", path, mlv_basename, 0);
+                        has_dng_stat = !mlvfs_getattr(filename, &dng_stat);
+                    }
                     for (int i = 0; i < frame_count; i++)
                     {
+                        struct FUSE_STAT * stbuf = has_dng_stat && lookup_dng_attr(mlv_filename, (uint32_t)i, &dng_stat) ? &dng_stat : NULL;
                         sprintf(filename, "%s_%06d.dng", mlv_basename, i);
-                        filler(buf, filename, NULL, 0);
+                        FILL_DIR_STAT(filler, buf, filename, stbuf);
                     }
                     sprintf(filename, "_PREVIEW.gif");
-                    filler(buf, filename, NULL, 0);
+                    FILL_DIR(filler, buf, filename);
                     result = 0;
                     
                     /* now pass over the MLD dir to the "real" directory listing code */
@@ -1325,15 +1621,15 @@ static int mlvfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler, FU
         {
             if (!is_mld_dir)
             {
-                filler(buf, ".", NULL, 0);
-                filler(buf, "..", NULL, 0);
+                FILL_DIR(filler, buf, ".");
+                FILL_DIR(filler, buf, "..");
             }
             struct dirent * child;
 
             while ((child = readdir(dir)) != NULL)
             {
                 /* ignore MLD directories and ./.. as we already put them */
-                if (string_ends_with(child->d_name, ".MLD") || string_ends_with(child->d_name, ".IDX") || !strcmp(child->d_name, "..") || !strcmp(child->d_name, "."))
+                if (string_ends_with(child->d_name, ".MLD") || string_ends_with(child->d_name, ".IDX") || string_ends_with(child->d_name, ".XCHK") || !strcmp(child->d_name, CATALOG_FILENAME) || !strcmp(child->d_name, "..") || !strcmp(child->d_name, "."))
                 {
                     continue;
                 }
@@ -1341,21 +1637,21 @@ static int mlvfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler, FU
                 char * real_file_path = path_append(real_path, child->d_name);
                 char * mlv_basename = NULL;
 
-                if (mlvfs.name_scheme && get_mlv_basename(real_file_path, &mlv_basename))
+                if (get_name_scheme() && get_mlv_basename(real_file_path, &mlv_basename))
                 {
-                    filler(buf, mlv_basename, NULL, 0);
+                    FILL_DIR(filler, buf, mlv_basename);
                     free(mlv_basename);
                 }
                 else if (string_ends_with(child->d_name, ".MLV") || string_ends_with(child->d_name, ".mlv") || child->d_type == DT_DIR || is_mld_dir)
                 {
-                    filler(buf, child->d_name, NULL, 0);
+                    FILL_DIR(filler, buf, child->d_name);
                 }
                 else if (child->d_type == DT_UNKNOWN) // If d_type is not supported on this filesystem
                 {
                     struct stat file_stat;
                     if ((stat(real_file_path, &file_stat) == 0) && S_ISDIR(file_stat.st_mode))
                     {
-                        filler(buf, child->d_name, NULL, 0);
+                        FILL_DIR(filler, buf, child->d_name);
                     }
                 }
                 free(real_file_path);
@@ -1366,176 +1662,112 @@ static int mlvfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler, FU
         free(real_path);
     }
 
+    /* write out what the listing has added to the catalogs */
+    catalog_save_all(0);
+
     return result;
 }
 
 static int mlvfs_read(const char *path, char *buf, size_t size, FUSE_OFF_T offset, struct fuse_file_info *fi)
 {
-    /* if we already had a read on that handle and it was a .dng, it's info will be cached */
-    if (fi->fh == 0)
+    /* virtual files have everything they need on their handle */
+    if (fi->fh)
+    {
+        return mlvfs_handle_read((struct mlvfs_handle *)fi->fh, buf, size, offset);
+    }
+
+    /* files are always opened/closed before/after any file operation */
+    const struct resolved_path *resolved = path_cache_get(path, &mlvfs_resolve);
+    int result = -ENOENT;
+
+    if (resolved && resolved->real_path)
     {
-        /* files are always opened/closed before/after any file operation */
-        char *resolved_filename = mlvfs_resolve_virtual(path);
-        int fd = -1;
+        int fd = open(resolved->real_path, O_RDONLY | O_BINARY);
+        int err = errno;
+        path_cache_release(resolved);
 
-        if (resolved_filename)
+        if (fd < 0)
         {
-            fd = open(resolved_filename, O_RDONLY | O_BINARY);
-            free(resolved_filename);
+            return -err;
+        }
 
-            if (fd < 0)
-            {
-                return -errno;
-            }
+        result = (int)pread(fd, buf, size, offset);
+        if (result < 0)
+        {
+            result = -errno;
+        }
 
-            int res = (int)pread(fd, buf, size, offset);
-            if (res < 0)
-            {
-                res = -errno;
-            }
+        /* always close file after read/write operations. else deleting etc will fail on windows */
+        close(fd);
 
-            /* always close file after read/write operations. else deleting etc will fail on windows */
-            close(fd);
+        return result;
+    }
 
-            return res;
+    /* a virtual file read without being opened first, it gets a handle just for this read */
+    if (mlvfs_has_handle(resolved))
+    {
+        struct mlvfs_handle * handle = mlvfs_handle_new(path, resolved);
+        if (handle)
+        {
+            result = mlvfs_handle_read(handle, buf, size, offset);
+            mlvfs_handle_free(handle);
         }
     }
+    path_cache_release(resolved);
+    
+    return result;
+}
 
-    char *mlv_filename = NULL;
-    char *path_in_mlv = NULL;
+#ifdef MLVFS_READ_BUF
+static int mlvfs_read_buf(const char *path, struct fuse_bufvec **bufp, size_t size, FUSE_OFF_T offset, struct fuse_file_info *fi)
+{
+    struct fuse_bufvec *bufvec = malloc(sizeof(struct fuse_bufvec));
+    if (!bufvec)
+    {
+        return -ENOMEM;
+    }
 
-    /* if there is no handle, it must be a virtual file, or it is an already opened .dng */
-    if (fi->fh || mlvfs_resolve_path(path, &mlv_filename, &path_in_mlv))
+    /* a rendered DNG or GIF in a memfd: no copy, its pages go from the memfd to the kernel */
+    struct mlvfs_handle *handle = (struct mlvfs_handle *)fi->fh;
+    if (handle && (handle->kind == RESOLVED_DNG || handle->kind == RESOLVED_GIF) && !mlvfs_handle_header_only(handle, size, offset))
     {
-        if (fi->fh || string_ends_with(path_in_mlv, ".dng"))
+        /* the handle keeps the buffer (and so the memfd) until it is released, which is after all of its reads */
+        struct image_buffer * image_buffer = mlvfs_handle_image(handle);
+        if (image_buffer && image_buffer->fd >= 0 && image_buffer->data && (image_buffer->header || handle->kind == RESOLVED_GIF))
         {
-            size_t header_size = dng_get_header_size();
-            size_t remaining = 0;
-            off_t image_offset = 0;
-            int was_created = 0;
-
-            struct image_buffer * image_buffer = (struct image_buffer *)fi->fh;
-            
-            /* was the image buffer already cached? */
-            if (!image_buffer)
-            {
-                image_buffer = get_or_create_image_buffer(path, &process_frame, &was_created);
-            }
-
-            if (!image_buffer)
-            {
-                err_printf("DNG image_buffer is NULL\n");
-                free(mlv_filename);
-                free(path_in_mlv);
-                return 0;
-            }
-            if (!image_buffer->header)
-            {
-                err_printf("DNG image_buffer->header is NULL\n");
-                free(mlv_filename);
-                free(path_in_mlv);
-                return 0;
-            }
-            if (!image_buffer->data)
-            {
-                err_printf("DNG image_buffer->data is NULL\n");
-                free(mlv_filename);
-                free(path_in_mlv);
-                return 0;
-            }
-
-            /* cache the expensive locking/lookup for a potential next read */
-            fi->fh = (uint64_t)image_buffer;
-
-            /* sanitize parameters to prevent errors by accesses beyond end */
             long file_size = image_buffer->header_size + image_buffer->size;
             long read_offset = MAX(0, MIN(offset, file_size));
             long read_size = MAX(0, MIN(size, file_size - read_offset));
 
-            if (read_offset + read_size > file_size)
-            {
-                read_size = (size_t)(file_size - read_offset);
-            }
-
-            if (read_offset < header_size && image_buffer->header_size > 0)
-            {
-                remaining = MIN(read_size, header_size - read_offset);
-                memcpy(buf, image_buffer->header + read_offset, remaining);
-            }
-            else
-            {
-                image_offset = read_offset - header_size;
-            }
-
-            if (remaining < read_size && image_buffer->size > 0)
-            {
-                uint8_t* image_output_buf = (uint8_t*)buf + remaining;
-                memcpy(image_output_buf, ((uint8_t*)image_buffer->data) + image_offset, MIN(read_size - remaining, image_buffer->size - image_offset));
-            }
-            
-            free(mlv_filename);
-            free(path_in_mlv);
-            return (int)read_size;
-        }
-        else if (string_ends_with(path_in_mlv, ".wav"))
-        {
-            int result = (int)wav_get_data(mlv_filename, (uint8_t*)buf, offset, size);
-            free(mlv_filename);
-            free(path_in_mlv);
-            return result;
-        }
-        else if (string_ends_with(path_in_mlv, ".gif"))
-        {
-            int was_created;
-            struct image_buffer * image_buffer = get_or_create_image_buffer(path, &create_preview, &was_created);
-            if (!image_buffer)
-            {
-                err_printf("GIF image_buffer is NULL\n");
-                free(mlv_filename);
-                free(path_in_mlv);
-                return 0;
-            }
-            if (!image_buffer->data)
-            {
-                err_printf("GIF image_buffer->data is NULL\n");
-                free(mlv_filename);
-                free(path_in_mlv);
-                return 0;
-            }
-
-            /* ensure that reads with offset beyond end will not cause negative memcpy sizes */
-            long read_offset = MAX(0, MIN(offset, image_buffer->size));
-            long read_size = MAX(0, MIN(size, image_buffer->size - read_offset));
-
-            memcpy(buf, ((uint8_t*)image_buffer->data) + read_offset, read_size);
-            free(mlv_filename);
-            free(path_in_mlv);
-            return (int)read_size;
+            *bufvec = FUSE_BUFVEC_INIT(read_size);
+            bufvec->buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+            bufvec->buf[0].fd = image_buffer->fd;
+            bufvec->buf[0].pos = read_offset;
+            *bufp = bufvec;
+            return 0;
         }
-        else if (string_ends_with(path_in_mlv, ".log"))
-        {
-            char * log = mlv_read_debug_log(mlv_filename);
-            size_t read_bytes = 0;
+    }
 
-            if (log)
-            {
-                if (offset < strlen(log))
-                {
-                    read_bytes = MIN(size, strlen(log) - offset);
-                    memcpy(buf, log + offset, read_bytes);
-                }
-                free(log);
-            }
-            free(mlv_filename);
-            free(path_in_mlv);
-            return (int)read_bytes;
-        }
-        free(mlv_filename);
-        free(path_in_mlv);
+    /* everything else is read into memory, which FUSE frees after the reply */
+    char *mem = malloc(size ? size : 1);
+    if (!mem)
+    {
+        free(bufvec);
+        return -ENOMEM;
     }
-    
-    return -ENOENT;
+    int result = mlvfs_read(path, mem, size, offset, fi);
+    if (result < 0)
+    {
+        free(mem);
+        free(bufvec);
+        return result;
+    }
+    *bufvec = FUSE_BUFVEC_INIT(result);
+    bufvec->buf[0].mem = mem;
+    *bufp = bufvec;
+    return 0;
 }
+#endif
 
 static int mlvfs_create(const char *path, mode_t mode, struct fuse_file_info *fi)
 {
@@ -1595,13 +1827,8 @@ static int mlvfs_mkdir(const char *path, mode_t mode)
 
 static int mlvfs_release(const char *path, struct fuse_file_info *fi)
 {
-    /* reset the cached image buffer pointer, if any */
+    mlvfs_handle_free((struct mlvfs_handle *)fi->fh);
     fi->fh = 0;
-
-    if (string_ends_with(path, ".dng") || string_ends_with(path, ".gif"))
-    {
-        release_image_buffer_by_path(path);
-    }
     return 0;
 }
 
@@ -1733,6 +1960,14 @@ static int mlvfs_wrap_read(const char *path, char *buf, size_t size, FUSE_OFF_T
     dbg_printf("'%s' 0x%08X 0x%08X 0x%08X 0x%08X\n", path, (uint32_t)buf, (uint32_t)size, (uint32_t)offset, (uint32_t)fi);
     TRY_WRAP(return mlvfs_read(path, buf, size, offset, fi); )
 }
+
+#ifdef MLVFS_READ_BUF
+static int mlvfs_wrap_read_buf(const char *path, struct fuse_bufvec **bufp, size_t size, FUSE_OFF_T offset, struct fuse_file_info *fi)
+{
+    dbg_printf("'%s' 0x%08X 0x%08X 0x%08X\n", path, (uint32_t)size, (uint32_t)offset, (uint32_t)fi);
+    TRY_WRAP(return mlvfs_read_buf(path, bufp, size, offset, fi); )
+}
+#endif
 static int mlvfs_wrap_create(const char *path, mode_t mode, struct fuse_file_info *fi)
 {
     dbg_printf("'%s' 0x%08X 0x%08X\n", path, (uint32_t)mode, (uint32_t)fi);
@@ -1784,11 +2019,107 @@ static int mlvfs_wrap_unlink(const char *path)
     TRY_WRAP(return mlvfs_unlink(path); )
 }
 
+static void mlvfs_start(void)
+{
+    if (mlvfs.cache_size > 0)
+    {
+        image_buffer_set_budget((size_t)mlvfs.cache_size * 1024 * 1024);
+    }
+
+    framepool_start(&mlvfs);
+
+    /* started here rather than in main(), so the threads survive the daemonizing */
+    diskcache_start(&mlvfs);
+    warm_start(&mlvfs);
+    watch_start(&mlvfs);
+    prefetch_start(&mlvfs, &process_frame);
+}
+
+static void mlvfs_stop(void)
+{
+    prefetch_stop();
+    watch_stop();
+    warm_stop();
+    diskcache_stop();
+
+    struct image_buffer_stats stats;
+    image_buffer_get_stats(&stats);
+    fprintf(stderr, "cache: %llu hit(s), %llu miss(es), %llu eviction(s)\n", (unsigned long long)stats.hits, (unsigned long long)stats.misses, (unsigned long long)stats.evictions);
+
+    struct framepool_stats pool_stats;
+    framepool_get_stats(&pool_stats);
+    fprintf(stderr, "pool: %llu hit(s), %llu miss(es), peak %llu MB, peak RSS %llu MB\n", (unsigned long long)pool_stats.hits, (unsigned long long)pool_stats.misses,
+            (unsigned long long)(pool_stats.peak_bytes >> 20), (unsigned long long)(pool_stats.peak_rss >> 20));
+
+    struct index_stats index_stats;
+    index_get_stats(&index_stats);
+    fprintf(stderr, "index: %llu scan(s), %llu block(s), scan %.3f s, sort %.3f s, %llu block(s) appended\n", (unsigned long long)index_stats.scans, (unsigned long long)index_stats.blocks,
+            index_stats.scan_seconds, index_stats.sort_seconds, (unsigned long long)index_stats.appended_blocks);
+}
+
+#ifdef MLVFS_LOWLEVEL
+
+static struct mlvfs_path_operations mlvfs_path_operations =
+{
+    .init         = mlvfs_start,
+    .destroy      = mlvfs_stop,
+    .getattr      = mlvfs_wrap_getattr,
+    .open         = mlvfs_wrap_open,
+    .read         = mlvfs_wrap_read,
+    .read_buf     = mlvfs_wrap_read_buf,
+    .readdir      = mlvfs_wrap_readdir,
+    .create       = mlvfs_wrap_create,
+    .fsync        = mlvfs_wrap_fsync,
+    .mkdir        = mlvfs_wrap_mkdir,
+    .release      = mlvfs_wrap_release,
+    .rename       = mlvfs_wrap_rename,
+    .rmdir        = mlvfs_wrap_rmdir,
+    .truncate     = mlvfs_wrap_truncate,
+    .write        = mlvfs_wrap_write,
+    .statfs       = mlvfs_wrap_statfs,
+    .unlink       = mlvfs_wrap_unlink,
+    .resolve_path = mlvfs_resolve_path,
+    .get_basename = get_mlv_basename
+};
+
+#else
+
+static void *mlvfs_init(struct fuse_conn_info *conn)
+{
+#ifndef _WIN32
+    if (mlvfs.immutable)
+    {
+        /* let the kernel read ahead in big requests, the DNGs are read from start to end */
+        conn->async_read = 1;
+        conn->max_readahead = MLVFS_MAX_READAHEAD;
+    }
+#endif
+#ifdef MLVFS_READ_BUF
+    /* let read_buf's memfds be spliced (but not moved, the pages stay in the memfd) */
+    if (conn->capable & FUSE_CAP_SPLICE_WRITE)
+    {
+        conn->want |= FUSE_CAP_SPLICE_WRITE;
+    }
+#endif
+    mlvfs_start();
+    return NULL;
+}
+
+static void mlvfs_destroy(void *private_data)
+{
+    mlvfs_stop();
+}
+
 static struct fuse_operations mlvfs_filesystem_operations =
 {
+    .init        = mlvfs_init,
+    .destroy     = mlvfs_destroy,
     .getattr     = mlvfs_wrap_getattr,
     .open        = mlvfs_wrap_open,
     .read        = mlvfs_wrap_read,
+#ifdef MLVFS_READ_BUF
+    .read_buf    = mlvfs_wrap_read_buf,
+#endif
     .readdir     = mlvfs_wrap_readdir,
     .create      = mlvfs_wrap_create,
     .fsync       = mlvfs_wrap_fsync,
@@ -1802,6 +2133,8 @@ static struct fuse_operations mlvfs_filesystem_operations =
     .unlink      = mlvfs_wrap_unlink
 };
 
+#endif
+
 struct fuse_opt_ex
 {
     struct fuse_opt opt;            /* Fuse-compatible option */
@@ -1838,6 +2171,20 @@ static const struct fuse_opt_ex mlvfs_opts_ex[] =
 "Web GUI options"),
     MLVFS_OPTION("--port=%s",           port,                     0, "Port used for web GUI (default: 8000)", 0),
     MLVFS_OPTION("--fps=%f",            fps,                      0, "FPS used for playback in web GUI",
+"Indexing options"),
+    MLVFS_OPTION("--warm-index=%d",     warm_threads,             0, "Index all clips in the background after mounting, using this many threads\n"
+                                          "                           (a clip is only started while reads and prefetching leave a CPU idle)",
+"Caching options"),
+    MLVFS_OPTION("--immutable",         immutable,                1, "The MLVs won't change while mounted, let the kernel cache attributes and file contents\n"
+                                          "                           (changed MLVs are only watched for on Linux)", 0),
+    MLVFS_OPTION("--cache-timeout=%d",  cache_timeout,            0, "With --immutable: seconds the kernel keeps attributes and names (default: 3600)\n"
+                                          "                           (on Linux only with FUSE 3)", 0),
+    MLVFS_OPTION("--cache-size=%d",     cache_size,               0, "MB of memory for rendered DNGs, the least recently used ones are evicted (default: 256)", 0),
+    MLVFS_OPTION("--cache-dir=%s",      cache_dir,                0, "Also keep rendered DNGs (compressed) in this directory, across remounts", 0),
+    MLVFS_OPTION("--cache-dir-size=%d", cache_dir_size,           0, "MB the --cache-dir may take, the least recently used DNGs are deleted (default: 4096)", 0),
+    MLVFS_OPTION("--prefetch=%d",       prefetch,                 0, "When a clip is read frame after frame, render this many frames ahead in other threads", 0),
+    MLVFS_OPTION("--pool-size=%d",      pool_size,                0, "MB of idle working buffers kept for rendering the next frames (default: 128)", 0),
+    MLVFS_OPTION("--hugepages",         hugepages,                1, "Back large working buffers with huge pages (Linux)",
 "Diagnostic options"),
     MLVFS_OPTION("--version",           version,                  1, "Display MLVFS version", 0),
     { FUSE_OPT_END }
@@ -1860,8 +2207,10 @@ static void display_help()
     printf("\n");
 
     /* display FUSE options */
+#if defined(MLVFS_LOWLEVEL)
+    mlvfs_lowlevel_help();
+#elif !defined(_WIN32)
     char * help_opts[] = {"mlvfs", "-h"};
-#ifndef _WIN32
     fuse_main(2, help_opts, NULL, NULL);
 #endif
 
@@ -1955,9 +2304,34 @@ int main(int argc, char **argv)
 
         if(!res)
         {
+#if defined(__linux__) && !defined(MLVFS_LOWLEVEL)
+            //the high-level API has no way for the watcher to make the kernel forget a changed MLV's names and attributes, so they keep FUSE's default timeout
+            if (mlvfs.immutable && mlvfs.cache_timeout > 0)
+            {
+                err_printf("MLVFS: --cache-timeout takes the FUSE 3 build on Linux, ignored\n");
+            }
+#else
+            double timeout = 1.0;
+            if (mlvfs.immutable)
+            {
+                timeout = mlvfs.cache_timeout > 0 ? mlvfs.cache_timeout : 3600;
+#if !defined(MLVFS_LOWLEVEL) && !defined(_WIN32)
+                char timeout_opts[64];
+                sprintf(timeout_opts, "-oattr_timeout=%d,entry_timeout=%d", (int)timeout, (int)timeout);
+                fuse_opt_add_arg(&args, timeout_opts);
+#endif
+            }
+#endif
+
+            /* the processing settings can be changed from the web GUI from here on */
+            settings_init(&mlvfs);
             webgui_start(&mlvfs);
             umask(0);
+#ifdef MLVFS_LOWLEVEL
+            res = mlvfs_lowlevel_main(&args, &mlvfs_path_operations, timeout);
+#else
             res = fuse_main(args.argc, args.argv, &mlvfs_filesystem_operations, NULL);
+#endif
         }
 
         free(expanded_path);
@@ -1972,8 +2346,14 @@ int main(int argc, char **argv)
     webgui_stop();
     stripes_free_corrections();
     free_all_image_buffers();
+    settings_free();
+    framepool_free_all();
     close_all_chunks();
     free_dng_attr_mappings();
     free_focus_pixel_maps();
+    free_all_catalogs();
+    free_all_clips();
+    free_all_indexes();
+    free_path_cache();
     return res;
 }
@@ -44,6 +44,15 @@ struct mlvfs
     double fps;
     int deflicker;
     int fix_pattern_noise;
+    int prefetch;
+    int cache_size;
+    char * cache_dir;
+    int cache_dir_size;
+    int pool_size;
+    int hugepages;
+    int warm_threads;
+    int immutable;
+    int cache_timeout;
     int version;
 };
 
@@ -87,6 +96,16 @@ size_t get_image_data(struct frame_headers * frame_headers, FILE * file, uint8_t
 #define EV_RESOLUTION 32768
 #define MAX_BLACK 16384
 
+//readahead asked of the kernel with --immutable (about one full size DNG)
+#define MLVFS_MAX_READAHEAD (8 * 1024 * 1024)
+
+//memory for the rendered files in MB, unless --cache-size says otherwise
+#define MLVFS_DEFAULT_CACHE_SIZE 256
+//same for --cache-dir, unless --cache-dir-size says otherwise
+#define MLVFS_DEFAULT_CACHE_DIR_SIZE 4096
+//idle working buffers kept for the next frames in MB, unless --pool-size says otherwise
+#define MLVFS_DEFAULT_POOL_SIZE 128
+
 double * get_raw2evf(int black);
 int * get_raw2ev(int black);
 int * get_ev2raw();
@@ -112,6 +131,21 @@ static void *find_first_separator(const char *path)
 #define ROR(v,a) _rotr(v,a)
 #define STAT64 _stat64 /* this wraps the function and the struct name */
 
+/* pointers published to readers that don't take a lock */
+#include <intrin.h>
+#define ATOMIC_LOAD_PTR(x) _InterlockedCompareExchangePointer((void * volatile *)&(x), NULL, NULL)
+#define ATOMIC_STORE_PTR(x, value) _InterlockedExchangePointer((void * volatile *)&(x), (value))
+/* reference counts (long), these return the new count */
+#define ATOMIC_INCREMENT(x) _InterlockedIncrement(&(x))
+#define ATOMIC_DECREMENT(x) _InterlockedDecrement(&(x))
+#define ATOMIC_LOAD(x) _InterlockedCompareExchange(&(x), 0, 0)
+/* orders a store before a later load (the Interlocked functions are full barriers already) */
+#define ATOMIC_FENCE() _ReadWriteBarrier()
+/* byte counts (long long), ATOMIC_ADD64 returns the new value */
+#define ATOMIC_ADD64(x, value) (_InterlockedExchangeAdd64(&(x), (value)) + (value))
+#define ATOMIC_LOAD64(x) _InterlockedCompareExchange64(&(x), 0, 0)
+#define ATOMIC_STORE64(x, value) _InterlockedExchange64(&(x), (value))
+
 
 #define STRINGIFY2(x) #x
 #define STRINGIFY(x) STRINGIFY2(x)
@@ -135,6 +169,20 @@ static void *find_first_separator(const char *path)
 #define ROR(v,a) ((v) >> (a) | (v) << (32-(a)))  /* is there an intrinsic for? */
 #define STAT64 stat /* this wraps the function and the struct name */
 
+/* pointers published to readers that don't take a lock */
+#define ATOMIC_LOAD_PTR(x) __atomic_load_n(&(x), __ATOMIC_ACQUIRE)
+#define ATOMIC_STORE_PTR(x, value) __atomic_store_n(&(x), (value), __ATOMIC_RELEASE)
+/* reference counts (long), these return the new count */
+#define ATOMIC_INCREMENT(x) __atomic_add_fetch(&(x), 1, __ATOMIC_ACQ_REL)
+#define ATOMIC_DECREMENT(x) __atomic_sub_fetch(&(x), 1, __ATOMIC_ACQ_REL)
+#define ATOMIC_LOAD(x) __atomic_load_n(&(x), __ATOMIC_ACQUIRE)
+/* orders a store before a later load */
+#define ATOMIC_FENCE() __atomic_thread_fence(__ATOMIC_SEQ_CST)
+/* byte counts (long long), ATOMIC_ADD64 returns the new value */
+#define ATOMIC_ADD64(x, value) __atomic_add_fetch(&(x), (value), __ATOMIC_ACQ_REL)
+#define ATOMIC_LOAD64(x) __atomic_load_n(&(x), __ATOMIC_ACQUIRE)
+#define ATOMIC_STORE64(x, value) __atomic_store_n(&(x), (value), __ATOMIC_RELEASE)
+
 
 #if DEBUG
 #define dbg_printf(fmt, args...) fprintf(stderr, "%s:%d:%s(): " fmt, __FILE__, __LINE__, __func__, ##args)
@@ -0,0 +1,295 @@
+/*
+ * Copyright (C) 2014 David Milligan
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the
+ * Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include "raw.h"
+#include "mlv.h"
+#include "mlvfs.h"
+#include "pathcache.h"
+
+/*
+ * Memoizes the resolution of virtual paths (which MLV, which file inside it, which frame...), getattr and read
+ * are called thousands of times per second with the same few paths. Resolving only depends on the path and
+ * the options, not on the files, so entries never go stale, the cache just has to be bounded. Misses are
+ * cached as well: paths outside of any MLV, and the AppleDouble "._" probes that can't exist.
+ * The bound grows with the frames of the clips that have been indexed, so every DNG of a card fits.
+ */
+
+#define CREATE_MUTEX(x) static pthread_mutex_t x = PTHREAD_MUTEX_INITIALIZER;
+#define RELOCK(x) pthread_mutex_lock(&(x));
+#define UNLOCK(x) pthread_mutex_unlock(&(x));
+
+//the table is split into shards with a lock each, so concurrent lookups rarely wait on each other
+#define PATH_CACHE_SHARDS 16
+#define PATH_CACHE_BUCKETS 1024
+#define PATH_CACHE_MIN_ENTRIES 32768
+#define PATH_CACHE_MAX_ENTRIES (1 << 20)
+
+struct path_cache_shard
+{
+    pthread_mutex_t mutex;
+    struct resolved_path * buckets[PATH_CACHE_BUCKETS];
+    uint32_t count;
+    //the bucket the eviction sweep goes on from
+    uint32_t clock_hand;
+};
+
+static struct path_cache_shard shards[PATH_CACHE_SHARDS];
+static pthread_once_t shards_once = PTHREAD_ONCE_INIT;
+//entries reserved with path_cache_reserve(), on top of PATH_CACHE_MIN_ENTRIES
+static volatile long long path_cache_reserved = 0;
+//bumped by path_cache_clear(), what was resolved before doesn't go in the cache anymore
+static volatile long path_cache_epoch = 0;
+
+static uint32_t path_cache_hash(const char * path)
+{
+    //FNV-1a
+    uint32_t hash = 2166136261u;
+    for(const unsigned char * c = (const unsigned char *)path; *c; c++)
+    {
+        hash = (hash ^ *c) * 16777619u;
+    }
+    return hash;
+}
+
+static void path_cache_init_shards()
+{
+    for(int i = 0; i < PATH_CACHE_SHARDS; i++)
+    {
+        pthread_mutex_init(&shards[i].mutex, NULL);
+    }
+}
+
+static struct path_cache_shard * path_cache_shard(uint32_t hash)
+{
+    pthread_once(&shards_once, path_cache_init_shards);
+    return &shards[hash % PATH_CACHE_SHARDS];
+}
+
+static void free_resolved_path(struct resolved_path * resolved)
+{
+    free(resolved->path);
+    free(resolved->mlv_filename);
+    free(resolved->path_in_mlv);
+    free(resolved->real_path);
+    free(resolved);
+}
+
+//an entry taken out of the table, it is freed when it is released if it is still in use
+static void path_cache_drop(struct resolved_path * resolved)
+{
+    if(resolved->use_count)
+    {
+        resolved->detached = 1;
+    }
+    else
+    {
+        free_resolved_path(resolved);
+    }
+}
+
+/**
+ * Takes all of a shard's entries out of the table
+ */
+static void path_cache_clear_shard(struct path_cache_shard * shard)
+{
+    for(int i = 0; i < PATH_CACHE_BUCKETS; i++)
+    {
+        struct resolved_path * current = shard->buckets[i];
+        while(current)
+        {
+            struct resolved_path * next = current->next;
+            path_cache_drop(current);
+            current = next;
+        }
+        shard->buckets[i] = NULL;
+    }
+    shard->count = 0;
+}
+
+/**
+ * Takes one entry out of a full shard (CLOCK): the sweep goes round the buckets and takes the first entry
+ * that wasn't looked up since the sweep last came by, so the paths in use stay cached
+ */
+static void path_cache_evict(struct path_cache_shard * shard)
+{
+    //the first round may only clear the referenced flags
+    for(int i = 0; i <= 2 * PATH_CACHE_BUCKETS; i++)
+    {
+        struct resolved_path ** link = &shard->buckets[shard->clock_hand];
+        while(*link)
+        {
+            struct resolved_path * current = *link;
+            if(current->referenced)
+            {
+                current->referenced = 0;
+                link = &current->next;
+            }
+            else
+            {
+                *link = current->next;
+                path_cache_drop(current);
+                shard->count--;
+                return;
+            }
+        }
+        shard->clock_hand = (shard->clock_hand + 1) % PATH_CACHE_BUCKETS;
+    }
+}
+
+static uint32_t path_cache_shard_limit()
+{
+    long long entries = PATH_CACHE_MIN_ENTRIES + ATOMIC_LOAD64(path_cache_reserved);
+    return (uint32_t)(MIN(entries, PATH_CACHE_MAX_ENTRIES) / PATH_CACHE_SHARDS);
+}
+
+/**
+ * Makes room for more entries, e.g. one for every DNG of a clip that was just indexed
+ */
+void path_cache_reserve(uint32_t entries)
+{
+    ATOMIC_ADD64(path_cache_reserved, entries);
+}
+
+/**
+ * Looks up what a virtual path refers to, resolving it (once) if it isn't cached yet
+ * Make sure you path_cache_release() the result!!!
+ * @param path The virtual path
+ * @param resolve Resolves the path if it isn't cached
+ * @return the resolved path, NULL if it could not be resolved
+ */
+const struct resolved_path * path_cache_get(const char * path, path_resolver resolve)
+{
+    uint32_t hash = path_cache_hash(path);
+    struct path_cache_shard * shard = path_cache_shard(hash);
+    struct resolved_path ** bucket = &shard->buckets[(hash / PATH_CACHE_SHARDS) % PATH_CACHE_BUCKETS];
+
+    for(;;)
+    {
+        uint32_t epoch = (uint32_t)ATOMIC_LOAD(path_cache_epoch);
+        RELOCK(shard->mutex)
+        {
+            for(struct resolved_path * current = *bucket; current; current = current->next)
+            {
+                if(current->hash == hash && current->epoch == epoch && !strcmp(current->path, path))
+                {
+                    current->use_count++;
+                    current->referenced = 1;
+                    UNLOCK(shard->mutex)
+                    return current;
+                }
+            }
+        }
+        UNLOCK(shard->mutex)
+
+        //resolve without holding the lock, if another thread did the same meanwhile, its result is used
+        struct resolved_path * resolved = calloc(1, sizeof(struct resolved_path));
+        if(!resolved) return NULL;
+        resolved->path = malloc(strlen(path) + 1);
+        if(!resolved->path || !resolve(path, resolved))
+        {
+            free_resolved_path(resolved);
+            return NULL;
+        }
+        strcpy(resolved->path, path);
+        resolved->hash = hash;
+        resolved->use_count = 1;
+        resolved->epoch = epoch;
+
+        int stale = 0;
+        RELOCK(shard->mutex)
+        {
+            //the cache was cleared while resolving (e.g. the naming scheme changed), so this may have the old meaning
+            stale = (uint32_t)ATOMIC_LOAD(path_cache_epoch) != epoch;
+            if(!stale)
+            {
+                for(struct resolved_path * current = *bucket; current; current = current->next)
+                {
+                    if(current->hash == hash && current->epoch == epoch && !strcmp(current->path, path))
+                    {
+                        current->use_count++;
+                        current->referenced = 1;
+                        UNLOCK(shard->mutex)
+                        free_resolved_path(resolved);
+                        return current;
+                    }
+                }
+
+                if(shard->count >= path_cache_shard_limit())
+                {
+                    path_cache_evict(shard);
+                }
+                resolved->next = *bucket;
+                *bucket = resolved;
+                shard->count++;
+            }
+        }
+        UNLOCK(shard->mutex)
+
+        if(!stale) return resolved;
+        free_resolved_path(resolved);
+    }
+}
+
+/**
+ * Releases a resolved path returned by path_cache_get()
+ */
+void path_cache_release(const struct resolved_path * resolved)
+{
+    if(!resolved) return;
+    struct path_cache_shard * shard = path_cache_shard(resolved->hash);
+    struct resolved_path * entry = (struct resolved_path *)resolved;
+    int free_entry = 0;
+    RELOCK(shard->mutex)
+    {
+        entry->use_count--;
+        free_entry = entry->detached && !entry->use_count;
+    }
+    UNLOCK(shard->mutex)
+    if(free_entry) free_resolved_path(entry);
+}
+
+/**
+ * Forgets all resolved paths, e.g. because the naming scheme was changed, including those being resolved right now
+ */
+void path_cache_clear()
+{
+    ATOMIC_INCREMENT(path_cache_epoch);
+    for(int i = 0; i < PATH_CACHE_SHARDS; i++)
+    {
+        struct path_cache_shard * shard = path_cache_shard(i);
+        RELOCK(shard->mutex)
+        {
+            path_cache_clear_shard(shard);
+        }
+        UNLOCK(shard->mutex)
+    }
+}
+
+void free_path_cache()
+{
+    path_cache_clear();
+    ATOMIC_STORE64(path_cache_reserved, 0);
+}
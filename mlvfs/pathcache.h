@@ -0,0 +1,69 @@
+/*
+ * Copyright (C) 2014 David Milligan
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the
+ * Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ */
+
+#ifndef mlvfs_pathcache_h
+#define mlvfs_pathcache_h
+
+#include <stdint.h>
+
+enum resolved_kind
+{
+    RESOLVED_REAL = 0,  /* a real file or directory, outside of any MLV */
+    RESOLVED_MISSING,   /* can't exist (e.g. AppleDouble "._" files next to the virtual files of a MLV) */
+    RESOLVED_MLV,       /* the virtual directory of a MLV */
+    RESOLVED_MLD,       /* a real file or directory inside a MLV's .MLD directory */
+    RESOLVED_DNG,
+    RESOLVED_WAV,
+    RESOLVED_GIF,
+    RESOLVED_LOG
+};
+
+//what a virtual path refers to, shared and read-only once it is in the cache
+struct resolved_path
+{
+    char * path;
+    int in_mlv;             /* the path is a MLV or inside one, mlv_filename and path_in_mlv are only set if it is */
+    char * mlv_filename;
+    char * path_in_mlv;
+    char * real_path;       /* the file on disk, NULL for the virtual files of a MLV */
+    enum resolved_kind kind;
+    int frame;              /* the frame number of a DNG */
+
+    uint32_t hash;
+    uint32_t use_count;
+    int detached;
+    int referenced;         /* looked up since the eviction sweep last came by */
+    uint32_t epoch;         /* the path_cache_clear() it was resolved after */
+    struct resolved_path * next;
+};
+
+/**
+ * Fills in everything but the path and the cache's own fields, the strings must be malloc()ed
+ * @return 1 if successful, 0 otherwise
+ */
+typedef int (*path_resolver)(const char * path, struct resolved_path * resolved);
+
+const struct resolved_path * path_cache_get(const char * path, path_resolver resolve);
+void path_cache_release(const struct resolved_path * resolved);
+void path_cache_clear();
+void path_cache_reserve(uint32_t entries);
+void free_path_cache();
+
+#endif
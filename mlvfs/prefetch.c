@@ -0,0 +1,284 @@
+/*
+ * Copyright (C) 2014 David Milligan
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the
+ * Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include "raw.h"
+#include "mlv.h"
+#include "mlvfs.h"
+#include "catalog.h"
+#include "resource_manager.h"
+#include "settings.h"
+#include "prefetch.h"
+
+#define CREATE_MUTEX(x) static pthread_mutex_t x = PTHREAD_MUTEX_INITIALIZER;
+#define RELOCK(x) pthread_mutex_lock(&(x));
+#define UNLOCK(x) pthread_mutex_unlock(&(x));
+
+#define MAX_PREFETCH_THREADS 8
+#define PREFETCH_QUEUE_SIZE 256
+
+/*
+ * Renders the next --prefetch frames of a clip on background threads while it is being read frame after frame
+ * (e.g. an editor playing it back), so by the time the reader opens a DNG it is already in the image buffers
+ */
+
+//the playhead of a clip
+struct prefetch_clip
+{
+    struct prefetch_clip * next;
+    char * mlv_filename;
+    //the virtual path of the clip's DNGs up to the frame number
+    char * path_prefix;
+    int last_frame;
+    //frames up to this one have been queued already
+    int queued_until;
+    //bumped when the playhead jumps, the frames queued before that are dropped
+    uint32_t generation;
+};
+
+struct prefetch_job
+{
+    struct prefetch_clip * clip;
+    int frame;
+    uint32_t generation;
+};
+
+CREATE_MUTEX(prefetch_mutex)
+static pthread_cond_t prefetch_cond = PTHREAD_COND_INITIALIZER;
+
+static struct mlvfs * mlvfs_config = NULL;
+static int(*prefetch_render)(struct image_buffer *) = NULL;
+static struct prefetch_clip * prefetch_clips = NULL;
+static struct prefetch_job prefetch_queue[PREFETCH_QUEUE_SIZE];
+static uint32_t prefetch_head = 0;
+static uint32_t prefetch_count = 0;
+static volatile long halt_prefetch = 0;
+
+static pthread_t prefetch_threads[MAX_PREFETCH_THREADS];
+static int prefetch_thread_count = 0;
+
+static struct prefetch_clip * prefetch_find_clip(const char * mlv_filename)
+{
+    for(struct prefetch_clip * clip = prefetch_clips; clip; clip = clip->next)
+    {
+        if(!filename_strcmp(clip->mlv_filename, mlv_filename)) return clip;
+    }
+
+    struct prefetch_clip * clip = calloc(1, sizeof(struct prefetch_clip));
+    if(!clip) return NULL;
+    clip->mlv_filename = malloc(strlen(mlv_filename) + 1);
+    if(!clip->mlv_filename)
+    {
+        free(clip);
+        return NULL;
+    }
+    strcpy(clip->mlv_filename, mlv_filename);
+    clip->last_frame = -1;
+    clip->next = prefetch_clips;
+    prefetch_clips = clip;
+    return clip;
+}
+
+/**
+ * Keeps the part of a DNG's path before the frame number ("<dir>/<basename>_"), it changes with --resolve-naming
+ */
+static int prefetch_set_prefix(struct prefetch_clip * clip, const char * dng_path)
+{
+    const char * separator = strrchr(dng_path, '_');
+    if(!separator) return 0;
+    size_t length = separator + 1 - dng_path;
+    if(clip->path_prefix && strlen(clip->path_prefix) == length && !strncmp(clip->path_prefix, dng_path, length)) return 1;
+
+    char * prefix = malloc(length + 1);
+    if(!prefix) return 0;
+    strncpy(prefix, dng_path, length);
+    prefix[length] = 0;
+    free(clip->path_prefix);
+    clip->path_prefix = prefix;
+    return 1;
+}
+
+static void *prefetch_run(void *unused)
+{
+    while(!ATOMIC_LOAD(halt_prefetch))
+    {
+        char * path = NULL;
+        char * mlv_filename = NULL;
+        int frame = 0;
+
+        RELOCK(prefetch_mutex)
+        {
+            while(!halt_prefetch && !prefetch_count)
+            {
+                pthread_cond_wait(&prefetch_cond, &prefetch_mutex);
+            }
+            while(!halt_prefetch && prefetch_count && !path)
+            {
+                struct prefetch_job job = prefetch_queue[prefetch_head];
+                prefetch_head = (prefetch_head + 1) % PREFETCH_QUEUE_SIZE;
+                prefetch_count--;
+
+                //cancelled by a jump, or the reader got there first
+                if(job.generation != job.clip->generation || job.frame <= job.clip->last_frame) continue;
+
+                path = malloc(strlen(job.clip->path_prefix) + 16);
+                mlv_filename = malloc(strlen(job.clip->mlv_filename) + 1);
+                if(path && mlv_filename)
+                {
+                    sprintf(path, "%s%06d.dng", job.clip->path_prefix, job.frame);
+                    strcpy(mlv_filename, job.clip->mlv_filename);
+                    frame = job.frame;
+                }
+                else
+                {
+                    free(path);
+                    free(mlv_filename);
+                    path = NULL;
+                    mlv_filename = NULL;
+                }
+            }
+        }
+        UNLOCK(prefetch_mutex)
+
+        if(!path) continue;
+
+        struct clip_info info;
+        if(catalog_get_clip_info(mlv_filename, &info) && frame < (int)info.frame_count)
+        {
+            int was_created = 0;
+            //rendered with the current settings, like the reads that will come
+            const struct mlvfs_settings * settings = settings_get();
+            struct image_buffer * image_buffer = get_or_create_image_buffer(path, settings, prefetch_render, RENDER_PREFETCH, &was_created);
+            settings_release(settings);
+            if(image_buffer)
+            {
+                //unused from here on, so it stays cached until the reader gets to it
+                release_image_buffer(image_buffer);
+            }
+            if(was_created) dbg_printf("prefetch: %s\n", path);
+        }
+        free(path);
+        free(mlv_filename);
+    }
+    return NULL;
+}
+
+/**
+ * Tells prefetch a frame of a clip is being read, if it comes right after the previous one, the next
+ * mlvfs->prefetch frames are queued for rendering, otherwise the playhead jumped and the queued frames are dropped
+ * @param mlv_filename The clip
+ * @param dng_path The virtual path of the frame's DNG
+ * @param frame The frame number
+ */
+void prefetch_frame_requested(const char * mlv_filename, const char * dng_path, int frame)
+{
+    if(!prefetch_thread_count) return;
+
+    RELOCK(prefetch_mutex)
+    {
+        struct prefetch_clip * clip = prefetch_find_clip(mlv_filename);
+        if(clip && prefetch_set_prefix(clip, dng_path))
+        {
+            int sequential = clip->last_frame >= 0 && frame == clip->last_frame + 1;
+            if(!sequential && frame != clip->last_frame)
+            {
+                clip->generation++;
+                clip->queued_until = frame;
+            }
+            clip->last_frame = frame;
+
+            if(sequential)
+            {
+                int queue_from = MAX(clip->queued_until, frame) + 1;
+                int queue_to = frame + mlvfs_config->prefetch;
+                for(int i = queue_from; i <= queue_to && prefetch_count < PREFETCH_QUEUE_SIZE; i++)
+                {
+                    struct prefetch_job * job = &prefetch_queue[(prefetch_head + prefetch_count++) % PREFETCH_QUEUE_SIZE];
+                    job->clip = clip;
+                    job->frame = i;
+                    job->generation = clip->generation;
+                    clip->queued_until = i;
+                }
+                pthread_cond_broadcast(&prefetch_cond);
+            }
+        }
+    }
+    UNLOCK(prefetch_mutex)
+}
+
+/**
+ * Starts the threads that render frames ahead of sequential reads (see --prefetch)
+ * @param mlvfs The settings
+ * @param render Renders a DNG into an image buffer
+ */
+void prefetch_start(struct mlvfs * mlvfs, int(*render)(struct image_buffer *))
+{
+    mlvfs_config = mlvfs;
+    prefetch_render = render;
+    if(mlvfs_config->prefetch <= 0) return;
+
+    halt_prefetch = 0;
+    int max_threads = MIN(mlvfs_config->prefetch, MAX_PREFETCH_THREADS);
+    for(int i = 0; i < max_threads; i++)
+    {
+        if(pthread_create(&prefetch_threads[prefetch_thread_count], NULL, prefetch_run, NULL))
+        {
+            int err = errno;
+            err_printf("pthread_create error: %s\n", strerror(err));
+            break;
+        }
+        prefetch_thread_count++;
+    }
+}
+
+/**
+ * Stops prefetching (the frames being rendered right now are finished first)
+ */
+void prefetch_stop(void)
+{
+    RELOCK(prefetch_mutex)
+    {
+        ATOMIC_INCREMENT(halt_prefetch);
+        pthread_cond_broadcast(&prefetch_cond);
+    }
+    UNLOCK(prefetch_mutex)
+
+    for(int i = 0; i < prefetch_thread_count; i++)
+    {
+        pthread_join(prefetch_threads[i], NULL);
+    }
+    prefetch_thread_count = 0;
+    prefetch_head = 0;
+    prefetch_count = 0;
+
+    while(prefetch_clips)
+    {
+        struct prefetch_clip * next = prefetch_clips->next;
+        free(prefetch_clips->mlv_filename);
+        free(prefetch_clips->path_prefix);
+        free(prefetch_clips);
+        prefetch_clips = next;
+    }
+}
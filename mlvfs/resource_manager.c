@@ -21,11 +21,19 @@
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <ctype.h>
 #include <fuse.h>
 #include "index.h"
 #include "mlvfs.h"
 #include "resource_manager.h"
+#include "framepool.h"
+#include "clip.h"
 #include "sys/stat.h"
+#if defined(__linux__)
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
 
 //some macros for simple thread synchronization
 #define CREATE_MUTEX(x) static pthread_mutex_t x = PTHREAD_MUTEX_INITIALIZER;
@@ -36,48 +44,113 @@
 #define INIT_LOCK(x) pthread_mutex_init(&(x), NULL)
 #define DESTROY_LOCK(x) pthread_mutex_destroy(&(x))
 
-#define MAX_UNUSED_IMAGE_BUFFER_COUNT 4
-#define MAX_TOTAL_IMAGE_BUFFER_COUNT 16
+//the table is split into shards with a lock each (like the path cache), so concurrent lookups rarely wait on each other
+#define IMAGE_BUFFER_SHARDS 16
+#define IMAGE_BUFFER_BUCKETS 64
 
-CREATE_MUTEX(image_buffer_mutex)
+struct image_buffer_shard
+{
+    pthread_mutex_t mutex;
+    struct image_buffer * buckets[IMAGE_BUFFER_BUCKETS];
+    //least recently used first
+    struct image_buffer * lru_first;
+    struct image_buffer * lru_last;
+    //the shard's share of the counters, added up by image_buffer_get_stats()
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+};
 
-static void image_buffer_cleanup();
+static struct image_buffer_shard image_buffer_shards[IMAGE_BUFFER_SHARDS];
+static pthread_once_t image_buffer_shards_once = PTHREAD_ONCE_INIT;
 
-static struct image_buffer * image_buffers = NULL;
+//the budget and the totals, atomic so that no lock is shared between the shards
+static volatile long long image_buffer_budget = (long long)MLVFS_DEFAULT_CACHE_SIZE * 1024 * 1024;
+static volatile long long image_buffer_bytes = 0;
+static volatile long image_buffer_count = 0;
+//orders the buffers by their last use, across shards
+static volatile long long image_buffer_clock = 0;
 
-static int image_buffer_count = 0;
+static uint32_t image_buffer_hash(const char * path)
+{
+    //FNV-1a
+    uint32_t hash = 2166136261u;
+    for(const unsigned char * c = (const unsigned char *)path; *c; c++)
+    {
+        hash = (hash ^ *c) * 16777619u;
+    }
+    return hash;
+}
 
-static struct image_buffer * get_image_buffer(const char * dng_filename)
+static void image_buffer_init_shards()
 {
-    for(struct image_buffer * current = image_buffers; current != NULL; current = current->next)
+    for(int i = 0; i < IMAGE_BUFFER_SHARDS; i++)
     {
-        if(!strcmp(current->dng_filename, dng_filename)) return current;
+        INIT_LOCK(image_buffer_shards[i].mutex);
     }
-    return NULL;
 }
 
-static struct image_buffer * new_image_buffer(const char * dng_filename)
+static struct image_buffer_shard * image_buffer_shard(uint32_t hash)
 {
-    image_buffer_cleanup();
-    struct image_buffer * new_buffer = malloc(sizeof(struct image_buffer));
-    if(new_buffer == NULL) return NULL;
-    
-    image_buffer_count++;
-    memset(new_buffer, 0, sizeof(struct image_buffer));
-    
-    if(image_buffers == NULL)
+    pthread_once(&image_buffer_shards_once, image_buffer_init_shards);
+    return &image_buffer_shards[hash % IMAGE_BUFFER_SHARDS];
+}
+
+static struct image_buffer ** image_buffer_bucket(struct image_buffer_shard * shard, uint32_t hash)
+{
+    return &shard->buckets[(hash / IMAGE_BUFFER_SHARDS) % IMAGE_BUFFER_BUCKETS];
+}
+
+//stamps a buffer as the most recently used one, and counts the lookup (the shard must be locked)
+static void image_buffer_touch(struct image_buffer_shard * shard, struct image_buffer * image_buffer, int hit)
+{
+    if(image_buffer != shard->lru_last)
     {
-        image_buffers = new_buffer;
+        if(image_buffer->lru_prev) image_buffer->lru_prev->lru_next = image_buffer->lru_next;
+        else if(shard->lru_first == image_buffer) shard->lru_first = image_buffer->lru_next;
+        if(image_buffer->lru_next) image_buffer->lru_next->lru_prev = image_buffer->lru_prev;
+
+        image_buffer->lru_prev = shard->lru_last;
+        image_buffer->lru_next = NULL;
+        if(shard->lru_last) shard->lru_last->lru_next = image_buffer;
+        shard->lru_last = image_buffer;
+        if(!shard->lru_first) shard->lru_first = image_buffer;
     }
-    else
+
+    image_buffer->last_used = (uint64_t)ATOMIC_ADD64(image_buffer_clock, 1);
+    if(hit) shard->hits++;
+    else shard->misses++;
+}
+
+//takes a buffer out of the table (the shard must be locked), nobody can look it up anymore
+static void image_buffer_detach(struct image_buffer_shard * shard, struct image_buffer * image_buffer)
+{
+    for(struct image_buffer ** link = image_buffer_bucket(shard, image_buffer->hash); *link; link = &(*link)->next)
     {
-        struct image_buffer * current = image_buffers;
-        while(current->next != NULL)
+        if(*link == image_buffer)
         {
-            current = current->next;
+            *link = image_buffer->next;
+            break;
         }
-        current->next = new_buffer;
     }
+    if(image_buffer->lru_prev) image_buffer->lru_prev->lru_next = image_buffer->lru_next;
+    else shard->lru_first = image_buffer->lru_next;
+    if(image_buffer->lru_next) image_buffer->lru_next->lru_prev = image_buffer->lru_prev;
+    else shard->lru_last = image_buffer->lru_prev;
+    image_buffer->next = image_buffer->lru_prev = image_buffer->lru_next = NULL;
+    image_buffer->stale = 1;
+}
+
+static uint32_t image_buffer_generation(const struct mlvfs_settings * settings)
+{
+    return settings ? settings->generation : 0;
+}
+
+static struct image_buffer * new_image_buffer(const char * dng_filename, const struct mlvfs_settings * settings, uint32_t hash)
+{
+    struct image_buffer * new_buffer = calloc(1, sizeof(struct image_buffer));
+    if(new_buffer == NULL) return NULL;
+    
     new_buffer->dng_filename = malloc((sizeof(char) * (strlen(dng_filename) + 2)));
     if (!new_buffer->dng_filename)
     {
@@ -85,37 +158,179 @@ static struct image_buffer * new_image_buffer(const char * dng_filename)
         return NULL;
     }
     strcpy(new_buffer->dng_filename, dng_filename);
+    new_buffer->hash = hash;
+    new_buffer->settings = settings_retain(settings);
+    new_buffer->fd = -1;
     INIT_LOCK(new_buffer->mutex);
+
+    ATOMIC_INCREMENT(image_buffer_count);
     return new_buffer;
 }
 
-struct image_buffer * get_or_create_image_buffer(const char * path, int(*new_buffer_cbr)(struct image_buffer *), int * was_created)
+static void image_buffer_evict();
+static void image_buffer_unref(struct image_buffer * image_buffer);
+
+/**
+ * Allocates the header and the data of an image buffer (called by the callback that renders it)
+ * On Linux they are put in a memfd, header first, so they can be spliced to the kernel instead of being copied by read
+ * @param image_buffer The image buffer
+ * @param header_size The size of the header, 0 if there is none
+ * @param size The size of the data
+ * @return 1 if successful, 0 otherwise
+ */
+int image_buffer_alloc(struct image_buffer * image_buffer, size_t header_size, size_t size)
+{
+    image_buffer->header_size = header_size;
+    image_buffer->size = size;
+    image_buffer->header = NULL;
+    image_buffer->data = NULL;
+    image_buffer->fd = -1;
+
+#if defined(__linux__) && defined(SYS_memfd_create)
+    //MFD_CLOEXEC
+    int fd = (int)syscall(SYS_memfd_create, "mlvfs", 1U);
+    if(fd >= 0)
+    {
+        void * mapping = MAP_FAILED;
+        if(!ftruncate(fd, (off_t)(header_size + size)))
+        {
+            mapping = mmap(NULL, header_size + size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        }
+        if(mapping != MAP_FAILED)
+        {
+            image_buffer->fd = fd;
+            image_buffer->header = header_size ? (uint8_t *)mapping : NULL;
+            image_buffer->data = (uint16_t *)((uint8_t *)mapping + header_size);
+            return 1;
+        }
+        close(fd);
+    }
+#endif
+
+    //no memfd, plain memory then (from the pool, evicted frames make room for new ones of the same size)
+    image_buffer->data = (uint16_t *)framepool_alloc(size);
+    image_buffer->header = header_size ? (uint8_t *)framepool_alloc(header_size) : NULL;
+    if(!image_buffer->data || (header_size && !image_buffer->header))
+    {
+        framepool_free(image_buffer->data);
+        framepool_free(image_buffer->header);
+        image_buffer->header = NULL;
+        image_buffer->data = NULL;
+        return 0;
+    }
+    return 1;
+}
+
+static void image_buffer_free_data(struct image_buffer * image_buffer)
+{
+#if defined(__linux__)
+    if(image_buffer->fd >= 0)
+    {
+        munmap((uint8_t *)image_buffer->data - image_buffer->header_size, image_buffer->header_size + image_buffer->size);
+        close(image_buffer->fd);
+        image_buffer->fd = -1;
+        image_buffer->header = NULL;
+        image_buffer->data = NULL;
+        return;
+    }
+#endif
+    framepool_free(image_buffer->data);
+    framepool_free(image_buffer->header);
+    image_buffer->header = NULL;
+    image_buffer->data = NULL;
+}
+
+/**
+ * Gets the image buffer of a virtual file, rendering it if it isn't cached yet
+ * Make sure you release_image_buffer() the result!!!
+ * @param path The virtual path
+ * @param settings The processing settings to render it with, what was rendered with other settings isn't used
+ *                 (NULL if the file doesn't depend on them, e.g. the preview GIFs)
+ * @param new_buffer_cbr Renders the file into the buffer
+ * @param priority What the caller needs it for, the render may wait for more urgent ones
+ * @param was_created Set to 1 if the buffer wasn't cached
+ * @return the image buffer, its data is NULL if the render failed
+ */
+struct image_buffer * get_or_create_image_buffer(const char * path, const struct mlvfs_settings * settings, int(*new_buffer_cbr)(struct image_buffer *), enum render_priority priority, int * was_created)
 {
     struct image_buffer * image_buffer = NULL;
     *was_created = 0;
+
+    uint32_t hash = image_buffer_hash(path);
+    uint32_t generation = image_buffer_generation(settings);
+    struct image_buffer_shard * shard = image_buffer_shard(hash);
+    struct image_buffer ** bucket = image_buffer_bucket(shard, hash);
     
-    RELOCK(image_buffer_mutex)
+    RELOCK(shard->mutex)
     {
-        image_buffer = get_image_buffer(path);
-        if(!image_buffer)
+        struct image_buffer * current = *bucket;
+        while(current != NULL)
         {
-            image_buffer = new_image_buffer(path);
-            image_buffer->in_use = 1;
-            *was_created = 1;
+            struct image_buffer * next = current->next;
+            if(current->hash == hash && !strcmp(current->dng_filename, path))
+            {
+                if(image_buffer_generation(current->settings) == generation)
+                {
+                    image_buffer = current;
+                    break;
+                }
+                if(image_buffer_generation(current->settings) < generation)
+                {
+                    //rendered with settings that have been replaced since, nobody will ask for it again
+                    image_buffer_detach(shard, current);
+                    image_buffer_unref(current);
+                }
+            }
+            current = next;
+        }
+        if(image_buffer)
+        {
+            //e.g. a frame rendered ahead by prefetch, it mustn't be evicted while this caller has it
+            ATOMIC_INCREMENT(image_buffer->ref_count);
+            image_buffer_touch(shard, image_buffer, 1);
+        }
+        else
+        {
+            image_buffer = new_image_buffer(path, settings, hash);
+            if(image_buffer)
+            {
+                //the table's reference and the caller's
+                image_buffer->ref_count = 2;
+                image_buffer->priority = priority;
+                image_buffer->next = *bucket;
+                *bucket = image_buffer;
+                image_buffer_touch(shard, image_buffer, 0);
+                *was_created = 1;
+            }
         }
     }
-    UNLOCK(image_buffer_mutex)
+    UNLOCK(shard->mutex)
     
     if(!image_buffer) return NULL;
+
+    //it may still be waiting for its turn to render, this caller can't wait longer than its own priority allows
+    if(!*was_created) scheduler_promote(image_buffer, priority);
     
+    int rendered = 0;
     RELOCK(image_buffer->mutex)
     {
         if(!image_buffer->data)
         {
+            scheduler_begin(image_buffer);
             new_buffer_cbr(image_buffer);
+            scheduler_end();
+
+            if(image_buffer->data)
+            {
+                image_buffer->bytes = image_buffer->header_size + image_buffer->size;
+                ATOMIC_ADD64(image_buffer_bytes, (long long)image_buffer->bytes);
+                rendered = 1;
+            }
         }
     }
     UNLOCK(image_buffer->mutex)
+
+    if(rendered) image_buffer_evict();
     
     return image_buffer;
 }
@@ -123,106 +338,254 @@ struct image_buffer * get_or_create_image_buffer(const char * path, int(*new_buf
 static void free_image_buffer(struct image_buffer * image_buffer)
 {
     if(!image_buffer) return;
-    
-    if(image_buffer == image_buffers)
-    {
-        image_buffers = image_buffer->next;
-    }
-    else
-    {
-        struct image_buffer * current = image_buffers;
-        while(current->next != NULL)
-        {
-            if(current->next == image_buffer) break;
-            current = current->next;
-        }
-        current->next = image_buffer->next;
-    }
+
+    ATOMIC_ADD64(image_buffer_bytes, -(long long)image_buffer->bytes);
+    ATOMIC_DECREMENT(image_buffer_count);
     
     DESTROY_LOCK(image_buffer->mutex);
     free(image_buffer->dng_filename);
-    free(image_buffer->data);
-    free(image_buffer->header);
+    free(image_buffer->mlv_filename);
+    settings_release(image_buffer->settings);
+    image_buffer_free_data(image_buffer);
     free(image_buffer);
-    image_buffer_count--;
 }
 
+//drops a reference without evicting anything, for the callers that hold a shard's mutex (or are evicting)
+static void image_buffer_unref(struct image_buffer * image_buffer)
+{
+    if(ATOMIC_DECREMENT(image_buffer->ref_count) == 0)
+    {
+        free_image_buffer(image_buffer);
+    }
+}
+
+/**
+ * Drops a reference to an image buffer returned by get_or_create_image_buffer(), it doesn't take any lock unless it evicts
+ * The buffer stays cached (until it is evicted), unless it was taken out of the table meanwhile, then the last release frees it
+ */
 void release_image_buffer(struct image_buffer * image_buffer)
 {
-    RELOCK(image_buffer->mutex)
+    long ref_count = ATOMIC_DECREMENT(image_buffer->ref_count);
+    if(ref_count == 0)
     {
-        image_buffer->in_use = 0;
+        free_image_buffer(image_buffer);
+    }
+    else if(ref_count == 1 && ATOMIC_LOAD64(image_buffer_bytes) > ATOMIC_LOAD64(image_buffer_budget))
+    {
+        //it couldn't be evicted while it was in use, but now it (or another one) can
+        image_buffer_evict();
     }
-    UNLOCK(image_buffer->mutex)
 }
 
-void release_image_buffer_by_path(const char * path)
+void free_all_image_buffers()
 {
-    RELOCK(image_buffer_mutex)
+    for(int i = 0; i < IMAGE_BUFFER_SHARDS; i++)
     {
-        struct image_buffer * image_buffer = get_image_buffer(path);
-        if(image_buffer)
+        struct image_buffer_shard * shard = image_buffer_shard(i);
+        RELOCK(shard->mutex)
         {
-            image_buffer->in_use = 0;
+            while(shard->lru_first)
+            {
+                struct image_buffer * current = shard->lru_first;
+                image_buffer_detach(shard, current);
+                image_buffer_unref(current);
+            }
         }
+        UNLOCK(shard->mutex)
     }
-    UNLOCK(image_buffer_mutex)
 }
 
-void free_all_image_buffers()
+int get_image_buffer_count()
 {
-    struct image_buffer * next = NULL;
-    struct image_buffer * current = image_buffers;
-    while(current != NULL)
+    return (int)ATOMIC_LOAD(image_buffer_count);
+}
+
+/**
+ * Sets how much memory the rendered files may take, the least recently used ones are evicted beyond that
+ * Buffers that are in use are never evicted, so the budget may be exceeded while they are open
+ * @param bytes The budget in bytes
+ */
+void image_buffer_set_budget(size_t bytes)
+{
+    ATOMIC_STORE64(image_buffer_budget, (long long)bytes);
+    image_buffer_evict();
+}
+
+void image_buffer_get_stats(struct image_buffer_stats * stats)
+{
+    stats->budget = (size_t)ATOMIC_LOAD64(image_buffer_budget);
+    stats->bytes = (size_t)ATOMIC_LOAD64(image_buffer_bytes);
+    stats->count = (int)ATOMIC_LOAD(image_buffer_count);
+    stats->hits = 0;
+    stats->misses = 0;
+    stats->evictions = 0;
+    for(int i = 0; i < IMAGE_BUFFER_SHARDS; i++)
     {
-        next = current->next;
-        free(current->dng_filename);
-        free(current->data);
-        free(current->header);
-        free(current);
-        current = next;
+        struct image_buffer_shard * shard = image_buffer_shard(i);
+        RELOCK(shard->mutex)
+        {
+            stats->hits += shard->hits;
+            stats->misses += shard->misses;
+            stats->evictions += shard->evictions;
+        }
+        UNLOCK(shard->mutex)
     }
 }
 
-int get_image_buffer_count()
+//whether a buffer was rendered from a MLV (the buffer must be locked, mlv_filename is set by the render)
+static int image_buffer_from_mlv(struct image_buffer * image_buffer, const char * mlv_filename)
 {
-    return image_buffer_count;
+    return image_buffer->mlv_filename && !filename_strcmp(image_buffer->mlv_filename, mlv_filename);
 }
 
-/*
- * Try and cleanup any potentially unused image_buffers
+/**
+ * Discards the rendered frames of a MLV (e.g. because the MLV was replaced)
+ * Buffers that are still open are only taken out of the table, they are freed once they are released
  */
-static void image_buffer_cleanup()
+void invalidate_image_buffers(const char * mlv_filename)
 {
-    while (get_image_buffer_count() > MAX_UNUSED_IMAGE_BUFFER_COUNT)
+    struct image_buffer ** rendering = NULL;
+    size_t rendering_allocated = 0;
+
+    for(int i = 0; i < IMAGE_BUFFER_SHARDS; i++)
     {
-        //cleanup no longer in use image buffers starting with the oldest (appearing first in the linked list)
-        int any_in_use = 0;
-        for(struct image_buffer * current = image_buffers; current != NULL; current = current->next)
+        struct image_buffer_shard * shard = image_buffer_shard(i);
+        size_t rendering_count = 0;
+        RELOCK(shard->mutex)
         {
-            int in_use = 0;
+            struct image_buffer * current = shard->lru_first;
+            while(current != NULL)
+            {
+                struct image_buffer * next = current->lru_next;
+                int stale = 0;
+                if(!pthread_mutex_trylock(&current->mutex))
+                {
+                    stale = image_buffer_from_mlv(current, mlv_filename);
+                    UNLOCK(current->mutex)
+                }
+                else
+                {
+                    //still rendering (which can take seconds), it is waited for below without holding up the shard
+                    if(rendering_count >= rendering_allocated)
+                    {
+                        size_t new_allocated = rendering_allocated ? rendering_allocated * 2 : 16;
+                        struct image_buffer ** new_rendering = realloc(rendering, new_allocated * sizeof(struct image_buffer *));
+                        if(new_rendering)
+                        {
+                            rendering = new_rendering;
+                            rendering_allocated = new_allocated;
+                        }
+                    }
+                    if(rendering_count < rendering_allocated)
+                    {
+                        ATOMIC_INCREMENT(current->ref_count);
+                        rendering[rendering_count++] = current;
+                    }
+                    else
+                    {
+                        //out of memory, wait right here
+                        RELOCK(current->mutex)
+                        {
+                            stale = image_buffer_from_mlv(current, mlv_filename);
+                        }
+                        UNLOCK(current->mutex)
+                    }
+                }
+                if(stale)
+                {
+                    image_buffer_detach(shard, current);
+                    //only frees it if nobody else has it
+                    image_buffer_unref(current);
+                }
+                current = next;
+            }
+        }
+        UNLOCK(shard->mutex)
+
+        for(size_t j = 0; j < rendering_count; j++)
+        {
+            struct image_buffer * current = rendering[j];
+            int stale = 0;
             RELOCK(current->mutex)
             {
-                in_use = current->in_use;
+                stale = image_buffer_from_mlv(current, mlv_filename);
             }
             UNLOCK(current->mutex)
-            if(!in_use)
+            if(stale)
             {
-                any_in_use = 1;
-                free_image_buffer(current);
-                //freeing the buffer modifies our linked list, so we better exit the loop or screwy things could happen
-                //TODO: figure out how to cleanup everything in one pass
-                break;
+                RELOCK(shard->mutex)
+                {
+                    //it may have been evicted meanwhile
+                    if(!current->stale)
+                    {
+                        image_buffer_detach(shard, current);
+                        image_buffer_unref(current);
+                    }
+                }
+                UNLOCK(shard->mutex)
             }
+            //the reference taken above, a render that ended meanwhile couldn't evict it, this does if needed
+            release_image_buffer(current);
         }
-        if (!any_in_use) break;
     }
-    
-    //just in case programs don't close a file, limit the total number of buffers we can have
-    while (get_image_buffer_count() > MAX_TOTAL_IMAGE_BUFFER_COUNT)
+    free(rendering);
+}
+
+//the least recently used buffer of a shard that nobody has (the shard must be locked)
+static struct image_buffer * image_buffer_oldest_unused(struct image_buffer_shard * shard)
+{
+    for(struct image_buffer * current = shard->lru_first; current != NULL; current = current->lru_next)
     {
-        if(!image_buffers) break;
-        free_image_buffer(image_buffers);
+        //the ones still rendering are referenced by the caller that renders them
+        //nobody can take a reference without the shard's mutex, so one that is unreferenced now stays so
+        if(ATOMIC_LOAD(current->ref_count) == 1) return current;
+    }
+    return NULL;
+}
+
+/*
+ * Evicts the least recently used buffers (across all shards) until the rendered files fit in the budget
+ */
+static void image_buffer_evict()
+{
+    while(1)
+    {
+        if(ATOMIC_LOAD64(image_buffer_bytes) <= ATOMIC_LOAD64(image_buffer_budget)) break;
+
+        //only one shard is locked at a time, so the oldest one may be gone by the time its shard is locked again
+        int oldest_shard = -1;
+        uint64_t oldest = 0;
+        for(int i = 0; i < IMAGE_BUFFER_SHARDS; i++)
+        {
+            struct image_buffer_shard * shard = image_buffer_shard(i);
+            RELOCK(shard->mutex)
+            {
+                struct image_buffer * candidate = image_buffer_oldest_unused(shard);
+                if(candidate && (oldest_shard < 0 || candidate->last_used < oldest))
+                {
+                    oldest_shard = i;
+                    oldest = candidate->last_used;
+                }
+            }
+            UNLOCK(shard->mutex)
+        }
+        //everything left is in use
+        if(oldest_shard < 0) break;
+
+        struct image_buffer_shard * shard = image_buffer_shard(oldest_shard);
+        struct image_buffer * victim = NULL;
+        RELOCK(shard->mutex)
+        {
+            victim = image_buffer_oldest_unused(shard);
+            if(victim)
+            {
+                image_buffer_detach(shard, victim);
+                shard->evictions++;
+            }
+        }
+        UNLOCK(shard->mutex)
+
+        if(victim) image_buffer_unref(victim);
     }
 }
 
@@ -316,56 +679,217 @@ void mlvfs_close_chunks(FILE **chunk_files, uint32_t chunk_count)
 #endif
 }
 
+#define DNG_ATTR_BUCKETS 256
+
+//the attributes of all the DNGs of a MLV, they only differ in their times
+struct dng_attr_table
+{
+    struct dng_attr_table * next;
+    //list of replaced tables, kept until no lookup can still be on them
+    struct dng_attr_table * retired_next;
+    char *path;
+    struct FUSE_STAT attr;
+    uint32_t frame_count;
+    struct timespec * frame_times;
+};
+
 CREATE_MUTEX(dng_attr_mapping_mutex)
 
-static struct dng_attr_mapping * dng_attr_mappings = NULL;
+//the tables are looked up without locking: they are read-only once published, and the ones that are replaced
+//or invalidated are only freed once there are no lookups going on (a lookup that starts after a table was
+//unlinked can't find it anymore, so only those that were already running have to be waited for)
+static struct dng_attr_table * dng_attr_tables[DNG_ATTR_BUCKETS];
+static struct dng_attr_table * retired_dng_attr_tables = NULL;
+static volatile long dng_attr_readers = 0;
+
+static uint32_t dng_attr_hash(const char * path)
+{
+    //case insensitive, for filename_strcmp on windows
+    uint32_t hash = 2166136261u;
+    for(const unsigned char * c = (const unsigned char *)path; *c; c++)
+    {
+        hash = (hash ^ (uint32_t)tolower(*c)) * 16777619u;
+    }
+    return hash % DNG_ATTR_BUCKETS;
+}
+
+static void free_dng_attr_table(struct dng_attr_table * table)
+{
+    free(table->path);
+    free(table->frame_times);
+    free(table);
+}
+
+//frees the retired tables if no lookup is running (dng_attr_mapping_mutex must be locked)
+static void free_retired_dng_attr_tables()
+{
+    //the tables were unlinked before this, a lookup that wasn't counted here yet won't see them
+    ATOMIC_FENCE();
+    if(ATOMIC_LOAD(dng_attr_readers)) return;
+
+    struct dng_attr_table * current = ATOMIC_LOAD_PTR(retired_dng_attr_tables);
+    ATOMIC_STORE_PTR(retired_dng_attr_tables, NULL);
+    while(current != NULL)
+    {
+        struct dng_attr_table * next = current->retired_next;
+        free_dng_attr_table(current);
+        current = next;
+    }
+}
 
-static struct FUSE_STAT * lookup_dng_attr_internal(const char * path)
+//a table that is no longer in dng_attr_tables (dng_attr_mapping_mutex must be locked)
+static void retire_dng_attr_table(struct dng_attr_table * table)
 {
-    for(struct dng_attr_mapping * current = dng_attr_mappings; current != NULL; current = current->next)
+    table->retired_next = retired_dng_attr_tables;
+    ATOMIC_STORE_PTR(retired_dng_attr_tables, table);
+}
+
+//the tables found between these two stay valid
+static void dng_attr_read_begin()
+{
+    ATOMIC_INCREMENT(dng_attr_readers);
+    ATOMIC_FENCE();
+}
+
+static void dng_attr_read_end()
+{
+    //the last lookup out frees what was retired while it ran
+    if(ATOMIC_DECREMENT(dng_attr_readers) == 0 && ATOMIC_LOAD_PTR(retired_dng_attr_tables) != NULL)
     {
-        if(!filename_strcmp(current->path, path)) return current->attr;
+        RELOCK(dng_attr_mapping_mutex)
+        {
+            free_retired_dng_attr_tables();
+        }
+        UNLOCK(dng_attr_mapping_mutex)
+    }
+}
+
+static struct dng_attr_table * find_dng_attr_table(const char * path)
+{
+    for(struct dng_attr_table * current = ATOMIC_LOAD_PTR(dng_attr_tables[dng_attr_hash(path)]); current != NULL; current = ATOMIC_LOAD_PTR(current->next))
+    {
+        if(!filename_strcmp(current->path, path)) return current;
     }
     return NULL;
 }
 
-struct FUSE_STAT * lookup_dng_attr(const char * path)
+static void dng_attr_set_time(struct FUSE_STAT * attr, const struct timespec * time)
 {
-    struct FUSE_STAT * result = NULL;
-    RELOCK(dng_attr_mapping_mutex)
+#if __DARWIN_UNIX03
+    memcpy(&attr->st_atimespec, time, sizeof(struct timespec));
+    memcpy(&attr->st_birthtimespec, time, sizeof(struct timespec));
+    memcpy(&attr->st_ctimespec, time, sizeof(struct timespec));
+    memcpy(&attr->st_mtimespec, time, sizeof(struct timespec));
+#else
+    memcpy(&attr->st_atim, time, sizeof(struct timespec));
+    memcpy(&attr->st_ctim, time, sizeof(struct timespec));
+    memcpy(&attr->st_mtim, time, sizeof(struct timespec));
+#endif
+}
+
+/**
+ * Looks up the attributes of one of a MLV's DNGs, without locking
+ * @param path The MLV filename
+ * @param frame The frame number of the DNG
+ * @param attr [out] The attributes
+ * @return 1 if the attributes are known, 0 otherwise (not registered yet, or the frame is newer than the table)
+ */
+int lookup_dng_attr(const char * path, uint32_t frame, struct FUSE_STAT *attr)
+{
+    int result = 0;
+    dng_attr_read_begin();
+    struct dng_attr_table * table = find_dng_attr_table(path);
+    if(table && frame < table->frame_count)
     {
-        result = lookup_dng_attr_internal(path);
+        memcpy(attr, &table->attr, sizeof(struct FUSE_STAT));
+        dng_attr_set_time(attr, &table->frame_times[frame]);
+        result = 1;
     }
-    UNLOCK(dng_attr_mapping_mutex)
+    dng_attr_read_end();
     return result;
 }
 
+/**
+ * Registers the attributes of a MLV's DNGs, the size is the same for all of them and the times of each frame come from its VIDF timestamp
+ * @param path The MLV filename
+ * @param attr The attributes of one of the DNGs
+ */
 void register_dng_attr(const char * path, struct FUSE_STAT *attr)
 {
+    struct mlv_clip * clip = get_or_create_clip(path);
+    if(!clip) return;
+    dng_attr_read_begin();
+    struct dng_attr_table * existing = find_dng_attr_table(path);
+    uint32_t existing_count = existing ? existing->frame_count : 0;
+    dng_attr_read_end();
+    RELOCK(clip->mutex)
+    uint32_t clip_frame_count = clip->frame_count;
+    UNLOCK(clip->mutex)
+    if(existing && existing_count >= clip_frame_count) return;
+
+    struct dng_attr_table * table = (struct dng_attr_table *)calloc(1, sizeof(struct dng_attr_table));
+    if(!table) return;
+    table->frame_times = clip_get_frame_times(clip, &table->frame_count);
+    table->path = (char*)malloc(strlen(path) + 1);
+    if(!table->frame_times || !table->path)
+    {
+        free(table->frame_times);
+        free(table->path);
+        free(table);
+        return;
+    }
+    strcpy(table->path, path);
+    memcpy(&table->attr, attr, sizeof(struct FUSE_STAT));
+
     RELOCK(dng_attr_mapping_mutex)
     {
-        if(!lookup_dng_attr_internal(path))
+        //the clip may have grown since the existing table was made, the one with more frames wins
+        existing = find_dng_attr_table(path);
+        if(existing && existing->frame_count >= table->frame_count)
+        {
+            //never published
+            free_dng_attr_table(table);
+        }
+        else
         {
-            struct dng_attr_mapping * new_buffer = (struct dng_attr_mapping *)malloc(sizeof(struct dng_attr_mapping));
-            if(new_buffer)
+            uint32_t hash = dng_attr_hash(path);
+            table->next = dng_attr_tables[hash];
+            ATOMIC_STORE_PTR(dng_attr_tables[hash], table);
+            if(existing)
             {
-                new_buffer->path = (char*)malloc((sizeof(char) * (strlen(path) + 2)));
-                if (!new_buffer->path)
-                {
-                    UNLOCK(dng_attr_mapping_mutex)
-                    return;
-                }
-                strcpy(new_buffer->path, path);
-                new_buffer->attr = (struct FUSE_STAT*)malloc(sizeof(struct FUSE_STAT));
-                if (!new_buffer->attr)
+                //readers may still be on it, so its own next pointer is left alone
+                for(struct dng_attr_table ** link = &table->next; *link != NULL; link = &(*link)->next)
                 {
-                    free(new_buffer->path);
-                    UNLOCK(dng_attr_mapping_mutex)
-                    return;
+                    if(*link == existing)
+                    {
+                        ATOMIC_STORE_PTR(*link, existing->next);
+                        break;
+                    }
                 }
-                memcpy(new_buffer->attr, attr, sizeof(struct FUSE_STAT));
-                new_buffer->next = dng_attr_mappings;
-                dng_attr_mappings = new_buffer;
+                retire_dng_attr_table(existing);
+                free_retired_dng_attr_tables();
+            }
+        }
+    }
+    UNLOCK(dng_attr_mapping_mutex)
+}
+
+/**
+ * Drops the DNG attributes registered for a MLV (e.g. because the MLV was replaced), they are registered again on the next getattr
+ */
+void invalidate_dng_attr(const char * path)
+{
+    RELOCK(dng_attr_mapping_mutex)
+    {
+        for(struct dng_attr_table ** link = &dng_attr_tables[dng_attr_hash(path)]; *link != NULL; link = &(*link)->next)
+        {
+            if(!filename_strcmp((*link)->path, path))
+            {
+                struct dng_attr_table * table = *link;
+                ATOMIC_STORE_PTR(*link, table->next);
+                retire_dng_attr_table(table);
+                free_retired_dng_attr_tables();
+                break;
             }
         }
     }
@@ -376,16 +900,25 @@ void free_dng_attr_mappings()
 {
     RELOCK(dng_attr_mapping_mutex)
     {
-        struct dng_attr_mapping * next = NULL;
-        struct dng_attr_mapping * current = dng_attr_mappings;
+        for(int i = 0; i < DNG_ATTR_BUCKETS; i++)
+        {
+            struct dng_attr_table * current = dng_attr_tables[i];
+            while(current != NULL)
+            {
+                struct dng_attr_table * next = current->next;
+                free_dng_attr_table(current);
+                current = next;
+            }
+            dng_attr_tables[i] = NULL;
+        }
+        struct dng_attr_table * current = retired_dng_attr_tables;
         while(current != NULL)
         {
-            next = current->next;
-            free(current->path);
-            free(current->attr);
-            free(current);
+            struct dng_attr_table * next = current->retired_next;
+            free_dng_attr_table(current);
             current = next;
         }
+        retired_dng_attr_tables = NULL;
     }
     UNLOCK(dng_attr_mapping_mutex)
-}
\ No newline at end of file
+}
@@ -25,30 +25,68 @@
 //#define KEEP_FILES_OPEN
 
 #include <stdio.h>
+#include <stdint.h>
 #include <pthread.h>
+#include <sys/stat.h>
+#include "scheduler.h"
+#include "settings.h"
 
 #define THREAD_T pthread_t
 #define LOCK_T pthread_mutex_t
 
 struct image_buffer
 {
+    //the next one in the same bucket
     struct image_buffer * next;
+    //the neighbours in the least recently used order of the shard
+    struct image_buffer * lru_prev;
+    struct image_buffer * lru_next;
+    uint32_t hash;
+    uint64_t last_used;
+    //the memory it takes, counted against the budget once it is rendered
+    size_t bytes;
     char * dng_filename;
+    //the MLV the image was rendered from (set by the callback that renders it), NULL if unknown
+    char * mlv_filename;
+    //the processing settings it is rendered with, part of the key (a reference is held), NULL if it doesn't depend on them
+    const struct mlvfs_settings * settings;
     size_t header_size;
     size_t size;
     uint8_t * header;
     uint16_t * data;
+    //the memfd holding the header and the data (in that order, like the file), -1 if they are in plain memory
+    int fd;
+    //held while the buffer is rendered
     LOCK_T mutex;
-    int in_use;
+    //one for being in the table, plus one per caller that got the buffer and hasn't released it yet (atomic)
+    //whoever drops the last reference frees the buffer, references are only taken under the shard's mutex
+    volatile long ref_count;
+    //taken out of the table (evicted, or the MLV changed since), guarded by the shard's mutex
+    int stale;
+    //the most urgent caller waiting for the render (guarded by the scheduler)
+    enum render_priority priority;
+};
+
+struct image_buffer_stats
+{
+    size_t budget;
+    size_t bytes;
+    int count;
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
 };
 
 int create_preview(struct image_buffer * image_buffer);
 
-struct image_buffer * get_or_create_image_buffer(const char * path, int(*new_buffer_cbr)(struct image_buffer *), int * was_created);
-void release_image_buffer_by_path(const char * path);
+int image_buffer_alloc(struct image_buffer * image_buffer, size_t header_size, size_t size);
+struct image_buffer * get_or_create_image_buffer(const char * path, const struct mlvfs_settings * settings, int(*new_buffer_cbr)(struct image_buffer *), enum render_priority priority, int * was_created);
 void free_all_image_buffers();
 void release_image_buffer(struct image_buffer * image_buffer);
 int get_image_buffer_count();
+void image_buffer_set_budget(size_t bytes);
+void image_buffer_get_stats(struct image_buffer_stats * stats);
+void invalidate_image_buffers(const char * mlv_filename);
 
 struct mlv_chunks
 {
@@ -64,15 +102,9 @@ void mlvfs_close_chunks(FILE **chunk_files, uint32_t chunk_count);
 void close_all_chunks();
 
 
-struct dng_attr_mapping
-{
-    struct dng_attr_mapping * next;
-    char *path;
-    struct stat *attr;
-};
-
-struct FUSE_STAT * lookup_dng_attr(const char * path);
+int lookup_dng_attr(const char * path, uint32_t frame, struct FUSE_STAT *attr);
 void register_dng_attr(const char * path, struct FUSE_STAT *attr);
+void invalidate_dng_attr(const char * path);
 void free_dng_attr_mappings();
 
 #endif
@@ -0,0 +1,155 @@
+/*
+ * Copyright (C) 2014 David Milligan
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the
+ * Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <pthread.h>
+#if defined(_WIN32)
+#include <windows.h>
+#else
+#include <unistd.h>
+#endif
+#include "raw.h"
+#include "mlv.h"
+#include "mlvfs.h"
+#include "resource_manager.h"
+#include "scheduler.h"
+
+#define CREATE_MUTEX(x) static pthread_mutex_t x = PTHREAD_MUTEX_INITIALIZER;
+#define RELOCK(x) pthread_mutex_lock(&(x));
+#define UNLOCK(x) pthread_mutex_unlock(&(x));
+
+/*
+ * Decides when the renders of get_or_create_image_buffer() may start, so background work (prefetch, preview GIFs,
+ * --warm-index) only uses the CPUs that foreground reads leave idle. A render that started can't be interrupted, so foreground
+ * renders always start right away, and the others wait for a free slot while nothing more urgent is waiting.
+ * The priority of a render is the one of the most urgent caller waiting for its image buffer, so a foreground
+ * read of a frame that is queued for prefetch promotes it instead of waiting behind it
+ */
+
+CREATE_MUTEX(scheduler_mutex)
+static pthread_cond_t scheduler_cond = PTHREAD_COND_INITIALIZER;
+
+//one per CPU
+static int render_slots = 0;
+static int render_running = 0;
+static int render_waiting[RENDER_PRIORITY_COUNT] = { 0 };
+
+static int scheduler_get_cpu_count()
+{
+#if defined(_WIN32)
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return (int)info.dwNumberOfProcessors;
+#else
+    return (int)sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+}
+
+static int scheduler_admits(enum render_priority priority)
+{
+    if(priority == RENDER_FOREGROUND) return 1;
+    if(render_running >= render_slots) return 0;
+    for(int i = 0; i < priority; i++)
+    {
+        if(render_waiting[i]) return 0;
+    }
+    return 1;
+}
+
+/**
+ * Waits until the render of an image buffer may start (call scheduler_end() once it's done)
+ * @param image_buffer The image buffer about to be rendered, its priority may be raised while it waits
+ */
+void scheduler_begin(struct image_buffer * image_buffer)
+{
+    RELOCK(scheduler_mutex)
+    {
+        if(!render_slots) render_slots = MAX(scheduler_get_cpu_count(), 1);
+
+        enum render_priority counted = image_buffer->priority;
+        render_waiting[counted]++;
+        while(!scheduler_admits(image_buffer->priority))
+        {
+            pthread_cond_wait(&scheduler_cond, &scheduler_mutex);
+            if(image_buffer->priority != counted)
+            {
+                render_waiting[counted]--;
+                counted = image_buffer->priority;
+                render_waiting[counted]++;
+            }
+        }
+        render_waiting[counted]--;
+        render_running++;
+    }
+    UNLOCK(scheduler_mutex)
+}
+
+/**
+ * Waits until a render of the given priority would be let in, without taking a slot: for work that mostly waits
+ * on the disk (e.g. indexing a clip in the background), so a read that hangs can't keep the renders from a CPU
+ * @param priority What the work is for
+ */
+void scheduler_wait_idle(enum render_priority priority)
+{
+    RELOCK(scheduler_mutex)
+    {
+        if(!render_slots) render_slots = MAX(scheduler_get_cpu_count(), 1);
+
+        while(!scheduler_admits(priority))
+        {
+            pthread_cond_wait(&scheduler_cond, &scheduler_mutex);
+        }
+    }
+    UNLOCK(scheduler_mutex)
+}
+
+/**
+ * Frees the slot taken by scheduler_begin()
+ */
+void scheduler_end(void)
+{
+    RELOCK(scheduler_mutex)
+    {
+        render_running--;
+        pthread_cond_broadcast(&scheduler_cond);
+    }
+    UNLOCK(scheduler_mutex)
+}
+
+/**
+ * Raises the priority of an image buffer (e.g. a foreground read wants a frame that was queued for prefetch)
+ * @param image_buffer The image buffer, it may be waiting in scheduler_begin()
+ * @param priority The priority of the new caller
+ */
+void scheduler_promote(struct image_buffer * image_buffer, enum render_priority priority)
+{
+    RELOCK(scheduler_mutex)
+    {
+        if(priority < image_buffer->priority)
+        {
+            dbg_printf("'%s' %d -> %d\n", image_buffer->dng_filename, image_buffer->priority, priority);
+            image_buffer->priority = priority;
+            pthread_cond_broadcast(&scheduler_cond);
+        }
+    }
+    UNLOCK(scheduler_mutex)
+}
@@ -0,0 +1,43 @@
+/*
+ * Copyright (C) 2014 David Milligan
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the
+ * Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ */
+
+#ifndef mlvfs_scheduler_h
+#define mlvfs_scheduler_h
+
+//what a render is for, most urgent first
+enum render_priority
+{
+    //a read that something (e.g. a NLE) is blocked on right now
+    RENDER_FOREGROUND,
+    //frames just ahead of the playhead (see --prefetch)
+    RENDER_PREFETCH,
+    //speculative work, e.g. the preview GIFs of the web GUI
+    RENDER_BACKGROUND,
+    RENDER_PRIORITY_COUNT
+};
+
+struct image_buffer;
+
+void scheduler_begin(struct image_buffer * image_buffer);
+void scheduler_wait_idle(enum render_priority priority);
+void scheduler_end(void);
+void scheduler_promote(struct image_buffer * image_buffer, enum render_priority priority);
+
+#endif
@@ -0,0 +1,164 @@
+/*
+ * Copyright (C) 2014 David Milligan
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the
+ * Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "raw.h"
+#include "mlv.h"
+#include "mlvfs.h"
+#include "settings.h"
+
+#define CREATE_MUTEX(x) static pthread_mutex_t x = PTHREAD_MUTEX_INITIALIZER;
+#define RELOCK(x) pthread_mutex_lock(&(x));
+#define UNLOCK(x) pthread_mutex_unlock(&(x));
+
+/*
+ * The processing settings can be changed from the web GUI while frames are being rendered. Rather than changing
+ * them in place, every change publishes a new snapshot: a render takes a reference to the current one and uses
+ * it from start to end, so it is consistent even if the settings change meanwhile, and a snapshot is only freed
+ * once nothing uses it anymore. The generation of the snapshot goes into the keys of what is cached, so what was
+ * rendered with older settings simply isn't found anymore.
+ */
+
+//the reference count is kept apart from the settings, so they can be copied while others take and drop references
+struct settings_snapshot
+{
+    struct mlvfs_settings settings;
+    volatile long ref_count;
+};
+
+CREATE_MUTEX(settings_mutex)
+static struct settings_snapshot * current_settings = NULL;
+
+/**
+ * Publishes the first snapshot, from the command line options
+ */
+void settings_init(const struct mlvfs * mlvfs)
+{
+    struct mlvfs_settings settings;
+    memset(&settings, 0, sizeof(struct mlvfs_settings));
+    settings.name_scheme = mlvfs->name_scheme;
+    settings.chroma_smooth = mlvfs->chroma_smooth;
+    settings.fix_bad_pixels = mlvfs->fix_bad_pixels;
+    settings.fix_stripes = mlvfs->fix_stripes;
+    settings.dual_iso = mlvfs->dual_iso;
+    settings.hdr_interpolation_method = mlvfs->hdr_interpolation_method;
+    settings.hdr_no_fullres = mlvfs->hdr_no_fullres;
+    settings.hdr_no_alias_map = mlvfs->hdr_no_alias_map;
+    settings.fps = mlvfs->fps;
+    settings.deflicker = mlvfs->deflicker;
+    settings.fix_pattern_noise = mlvfs->fix_pattern_noise;
+    settings_publish(&settings);
+}
+
+/**
+ * Gets the current settings, make sure you settings_release() the result!!!
+ */
+const struct mlvfs_settings * settings_get(void)
+{
+    struct settings_snapshot * snapshot = NULL;
+    //the lock keeps the snapshot from being replaced and freed between reading the pointer and taking the reference
+    RELOCK(settings_mutex)
+    {
+        snapshot = current_settings;
+        if(snapshot) ATOMIC_INCREMENT(snapshot->ref_count);
+    }
+    UNLOCK(settings_mutex)
+    return snapshot ? &snapshot->settings : NULL;
+}
+
+/**
+ * Takes another reference to a snapshot (e.g. to keep it with what is rendered from it)
+ */
+const struct mlvfs_settings * settings_retain(const struct mlvfs_settings * settings)
+{
+    if(settings) ATOMIC_INCREMENT(((struct settings_snapshot *)settings)->ref_count);
+    return settings;
+}
+
+void settings_release(const struct mlvfs_settings * settings)
+{
+    if(settings && ATOMIC_DECREMENT(((struct settings_snapshot *)settings)->ref_count) == 0)
+    {
+        free((struct settings_snapshot *)settings);
+    }
+}
+
+/**
+ * Compares everything a frame is rendered with, the name scheme only changes the file names (which the caches are keyed on anyway)
+ * @return 1 if frames rendered with either settings come out the same, 0 otherwise
+ */
+int settings_same_render(const struct mlvfs_settings * a, const struct mlvfs_settings * b)
+{
+    return a->chroma_smooth == b->chroma_smooth &&
+           a->fix_bad_pixels == b->fix_bad_pixels &&
+           a->fix_stripes == b->fix_stripes &&
+           a->dual_iso == b->dual_iso &&
+           a->hdr_interpolation_method == b->hdr_interpolation_method &&
+           a->hdr_no_fullres == b->hdr_no_fullres &&
+           a->hdr_no_alias_map == b->hdr_no_alias_map &&
+           a->fps == b->fps &&
+           a->deflicker == b->deflicker &&
+           a->fix_pattern_noise == b->fix_pattern_noise;
+}
+
+/**
+ * Replaces the current settings with a copy of these, with the next generation if they render differently
+ * (keeping the generation keeps everything cached valid, e.g. when only the name scheme changed)
+ * @param settings The new settings (their generation is ignored)
+ */
+void settings_publish(const struct mlvfs_settings * settings)
+{
+    struct settings_snapshot * new_settings = malloc(sizeof(struct settings_snapshot));
+    if(!new_settings)
+    {
+        err_printf("malloc error\n");
+        return;
+    }
+    memcpy(&new_settings->settings, settings, sizeof(struct mlvfs_settings));
+    //the reference of current_settings
+    new_settings->ref_count = 1;
+
+    struct settings_snapshot * old_settings = NULL;
+    RELOCK(settings_mutex)
+    {
+        old_settings = current_settings;
+        new_settings->settings.generation = !old_settings ? 0 :
+            old_settings->settings.generation + (settings_same_render(&old_settings->settings, settings) ? 0 : 1);
+        current_settings = new_settings;
+    }
+    UNLOCK(settings_mutex)
+    if(old_settings) settings_release(&old_settings->settings);
+}
+
+void settings_free(void)
+{
+    struct settings_snapshot * old_settings = NULL;
+    RELOCK(settings_mutex)
+    {
+        old_settings = current_settings;
+        current_settings = NULL;
+    }
+    UNLOCK(settings_mutex)
+    if(old_settings) settings_release(&old_settings->settings);
+}
@@ -0,0 +1,53 @@
+/*
+ * Copyright (C) 2014 David Milligan
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the
+ * Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ */
+
+#ifndef mlvfs_settings_h
+#define mlvfs_settings_h
+
+#include <stdint.h>
+#include "mlvfs.h"
+
+//the processing settings, published as a snapshot that never changes (see settings_get())
+struct mlvfs_settings
+{
+    //bumped by every settings_publish(), the caches key what they render with it
+    uint32_t generation;
+    int name_scheme;
+    int chroma_smooth;
+    int fix_bad_pixels;
+    int fix_stripes;
+    int dual_iso;
+    int hdr_interpolation_method;
+    int hdr_no_fullres;
+    int hdr_no_alias_map;
+    double fps;
+    int deflicker;
+    int fix_pattern_noise;
+};
+
+void settings_init(const struct mlvfs * mlvfs);
+const struct mlvfs_settings * settings_get(void);
+const struct mlvfs_settings * settings_retain(const struct mlvfs_settings * settings);
+void settings_release(const struct mlvfs_settings * settings);
+void settings_publish(const struct mlvfs_settings * settings);
+int settings_same_render(const struct mlvfs_settings * a, const struct mlvfs_settings * b);
+void settings_free(void);
+
+#endif
@@ -22,39 +22,113 @@
 #include <stdio.h>
 #include <string.h>
 #include <math.h>
+#include <pthread.h>
 
 #include "mlvfs.h"
 #include "stripes.h"
 
+static pthread_mutex_t corrections_mutex = PTHREAD_MUTEX_INITIALIZER;
+//the list holds a reference to each of these, a frame being rendered holds another to the one it uses
 static struct stripes_correction * corrections = NULL;
 
-struct stripes_correction * stripes_get_correction(const char * mlv_filename)
+static void stripes_free_correction(struct stripes_correction * correction)
 {
-    for(struct stripes_correction * current = corrections; current != NULL; current = current->next)
+    free(correction->mlv_filename);
+    free(correction);
+}
+
+/**
+ * Drops a reference obtained from stripes_get_correction, stripes_new_correction or stripes_publish_correction
+ */
+void stripes_release_correction(struct stripes_correction * correction)
+{
+    if(correction && ATOMIC_DECREMENT(correction->ref_count) == 0)
     {
-        if(!filename_strcmp(current->mlv_filename, mlv_filename)) return current;
+        stripes_free_correction(correction);
     }
-    return NULL;
 }
 
-struct stripes_correction * stripes_new_correction(const char * mlv_filename)
+/**
+ * Takes out the list's corrections for a MLV that match, their reference goes to *retired (call with corrections_mutex held)
+ * @param older_than Only those computed with earlier generations of the settings, or all of them if 0
+ */
+static void stripes_retire(const char * mlv_filename, uint32_t older_than, struct stripes_correction ** retired)
 {
-    struct stripes_correction * new_correction = (struct stripes_correction *)malloc(sizeof(struct stripes_correction));
-    if(new_correction == NULL) return NULL;
-    
-    if(corrections == NULL)
+    struct stripes_correction ** link = &corrections;
+    while(*link != NULL)
     {
-        corrections = new_correction;
+        struct stripes_correction * current = *link;
+        if((!older_than || current->generation < older_than) && !filename_strcmp(current->mlv_filename, mlv_filename))
+        {
+            *link = current->next;
+            current->next = *retired;
+            *retired = current;
+        }
+        else
+        {
+            link = &current->next;
+        }
     }
-    else
+}
+
+//releases the list's references of what stripes_retire took out, a frame may still be using one
+static void stripes_release_retired(struct stripes_correction * retired)
+{
+    while(retired != NULL)
+    {
+        struct stripes_correction * next = retired->next;
+        stripes_release_correction(retired);
+        retired = next;
+    }
+}
+
+static struct stripes_correction * stripes_find(const char * mlv_filename, uint32_t generation)
+{
+    for(struct stripes_correction * current = corrections; current != NULL; current = current->next)
     {
-        struct stripes_correction * current = corrections;
-        while(current->next != NULL)
+        if(current->generation == generation && !filename_strcmp(current->mlv_filename, mlv_filename))
         {
-            current = current->next;
+            return current;
         }
-        current->next = new_correction;
     }
+    return NULL;
+}
+
+/**
+ * Finds the correction computed for a MLV with the given generation of the settings
+ * (it is computed from the processed image, so it depends on them)
+ * Make sure you stripes_release_correction() the result!!!
+ */
+struct stripes_correction * stripes_get_correction(const char * mlv_filename, uint32_t generation)
+{
+    pthread_mutex_lock(&corrections_mutex);
+    struct stripes_correction * result = stripes_find(mlv_filename, generation);
+    if(result) ATOMIC_INCREMENT(result->ref_count);
+    pthread_mutex_unlock(&corrections_mutex);
+    return result;
+}
+
+/**
+ * Drops the correction computed for a MLV (e.g. because the MLV was replaced), it is computed again for the next frame
+ */
+void stripes_invalidate_correction(const char * mlv_filename)
+{
+    struct stripes_correction * retired = NULL;
+    pthread_mutex_lock(&corrections_mutex);
+    //there may be one per generation of the settings
+    stripes_retire(mlv_filename, 0, &retired);
+    pthread_mutex_unlock(&corrections_mutex);
+    stripes_release_retired(retired);
+}
+
+/**
+ * Creates a correction that nobody else sees until it is computed and handed to stripes_publish_correction
+ */
+struct stripes_correction * stripes_new_correction(const char * mlv_filename, uint32_t generation)
+{
+    struct stripes_correction * new_correction = (struct stripes_correction *)calloc(1, sizeof(struct stripes_correction));
+    if(new_correction == NULL) return NULL;
+    
     new_correction->mlv_filename = (char *)malloc((sizeof(char) * (strlen(mlv_filename) + 2)));
     if (!new_correction->mlv_filename)
     {
@@ -62,24 +136,53 @@ struct stripes_correction * stripes_new_correction(const char * mlv_filename)
         return NULL;
     }
     strcpy(new_correction->mlv_filename, mlv_filename);
-    new_correction->correction_needed = 0;
-    new_correction->next = NULL;
+    new_correction->generation = generation;
+    new_correction->ref_count = 1;
     
     return new_correction;
 }
 
-void stripes_free_corrections()
+/**
+ * Shares a computed correction with the other frames of the MLV, unless another render got there first
+ * @param correction From stripes_new_correction, its reference is taken over
+ * @return the correction to use (this one or the one published first), make sure you stripes_release_correction() it!!!
+ */
+struct stripes_correction * stripes_publish_correction(struct stripes_correction * correction)
 {
-    struct stripes_correction * next = NULL;
-    struct stripes_correction * current = corrections;
-    while(current != NULL)
+    struct stripes_correction * retired = NULL;
+    pthread_mutex_lock(&corrections_mutex);
+    struct stripes_correction * existing = stripes_find(correction->mlv_filename, correction->generation);
+    if(existing)
     {
-        next = current->next;
-        free(current->mlv_filename);
-        free(current);
-        current = next;
+        ATOMIC_INCREMENT(existing->ref_count);
     }
-    
+    else
+    {
+        //computed with settings that have been replaced since
+        stripes_retire(correction->mlv_filename, correction->generation, &retired);
+        //the list's reference
+        ATOMIC_INCREMENT(correction->ref_count);
+        correction->next = corrections;
+        corrections = correction;
+    }
+    pthread_mutex_unlock(&corrections_mutex);
+    stripes_release_retired(retired);
+
+    if(existing)
+    {
+        stripes_release_correction(correction);
+        return existing;
+    }
+    return correction;
+}
+
+void stripes_free_corrections()
+{
+    pthread_mutex_lock(&corrections_mutex);
+    struct stripes_correction * retired = corrections;
+    corrections = NULL;
+    pthread_mutex_unlock(&corrections_mutex);
+    stripes_release_retired(retired);
 }
 
 /* Vertical stripes correction code from raw2dng, credits: a1ex */
@@ -31,12 +31,18 @@ struct stripes_correction
 {
     struct stripes_correction * next;
     char * mlv_filename;
+    //the generation of the settings it was computed with (see settings.h)
+    uint32_t generation;
+    volatile long ref_count;
     int correction_needed;
     int coeffficients[8];
 };
 
-struct stripes_correction * stripes_get_correction(const char * mlv_filename);
-struct stripes_correction * stripes_new_correction(const char * mlv_filename);
+struct stripes_correction * stripes_get_correction(const char * mlv_filename, uint32_t generation);
+struct stripes_correction * stripes_new_correction(const char * mlv_filename, uint32_t generation);
+struct stripes_correction * stripes_publish_correction(struct stripes_correction * correction);
+void stripes_release_correction(struct stripes_correction * correction);
+void stripes_invalidate_correction(const char * mlv_filename);
 void stripes_free_corrections();
 
 void stripes_compute_correction(struct frame_headers * frame_headers, struct stripes_correction * correction, uint16_t * image_data, off_t offset, size_t size);
@@ -0,0 +1,154 @@
+/*
+ * Copyright (C) 2014 David Milligan
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the
+ * Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ */
+
+/*
+ * Frame pool harness: allocates and frees the working buffers of a clip the way rendering does (two frame sized
+ * buffers and a small one per frame), then from several threads at once, and checks that the buffers get reused,
+ * that no buffer is handed out twice, that --pool-size bounds the idle memory and that framepool_free_all() lets
+ * everything go. Run once with malloc()ed blocks and once with --hugepages.
+ */
+
+#include "test.h"
+#include "../framepool.h"
+
+#define POOL_SIZE 8
+#define POOL_FRAMES 20
+#define POOL_THREADS 4
+#define POOL_ROUNDS 200
+
+/* fills a buffer with a pattern, so a buffer given to two callers at once shows up in check_buffer() */
+static void fill_buffer(uint8_t * buffer, size_t size, uint8_t pattern)
+{
+    memset(buffer, pattern, size);
+}
+
+static int check_buffer(const uint8_t * buffer, size_t size, uint8_t pattern)
+{
+    for (size_t i = 0; i < size; i += 4093)
+    {
+        if (buffer[i] != pattern) return 0;
+    }
+    return buffer[size - 1] == pattern;
+}
+
+/* the buffers of one frame, held at once */
+static int render_frame(size_t frame_size, size_t small_size, uint8_t pattern)
+{
+    uint8_t * packed = framepool_alloc(frame_size);
+    uint8_t * small = framepool_alloc(small_size);
+    uint8_t * planes = framepool_alloc(frame_size * 5 / 3);
+    if (!packed || !small || !planes)
+    {
+        framepool_free(packed);
+        framepool_free(small);
+        framepool_free(planes);
+        return 0;
+    }
+    fill_buffer(packed, frame_size, pattern);
+    fill_buffer(small, small_size, pattern + 1);
+    fill_buffer(planes, frame_size * 5 / 3, pattern + 2);
+    int result = check_buffer(packed, frame_size, pattern) && check_buffer(small, small_size, pattern + 1) &&
+        check_buffer(planes, frame_size * 5 / 3, pattern + 2);
+    framepool_free(planes);
+    framepool_free(packed);
+    framepool_free(small);
+    return result;
+}
+
+static volatile long corrupted = 0;
+
+static void * pool_worker(void * arg)
+{
+    uint8_t pattern = (uint8_t)(uintptr_t)arg * 16;
+    for (int i = 0; i < POOL_ROUNDS; i++)
+    {
+        /* each thread plays back a clip of its own geometry, with a few odd sizes in between */
+        size_t frame_size = (256 + (size_t)pattern) * 1024 + (i % 7 == 0 ? (size_t)i : 0);
+        if (!render_frame(frame_size, 1000 + (size_t)i, pattern))
+        {
+            ATOMIC_INCREMENT(corrupted);
+        }
+    }
+    return NULL;
+}
+
+static void run_pool(int hugepages)
+{
+    const char * name = hugepages ? "hugepages" : "malloc";
+    struct framepool_stats stats;
+    struct framepool_stats before;
+    pthread_t threads[POOL_THREADS];
+
+    mlvfs.pool_size = POOL_SIZE;
+    mlvfs.hugepages = hugepages;
+    framepool_start(&mlvfs);
+    framepool_get_stats(&before);
+
+    /* one clip, so the same three sizes every frame: after the first one everything that fits comes from the pool */
+    int failed = 0;
+    for (int i = 0; i < POOL_FRAMES; i++)
+    {
+        if (!render_frame(3 * 1024 * 1024, 100000, (uint8_t)i)) failed++;
+        framepool_get_stats(&stats);
+        TEST_CHECK(stats.idle_bytes <= stats.limit, "%s: %zu idle bytes exceed the limit of %zu", name, stats.idle_bytes, stats.limit);
+    }
+    TEST_CHECK(failed == 0, "%s: %d frame(s) with corrupted buffers", name, failed);
+
+    framepool_get_stats(&stats);
+    uint64_t hits = stats.hits - before.hits;
+    uint64_t misses = stats.misses - before.misses;
+    printf("framepool: %-9s %llu hits, %llu misses, peak %zu KB\n", name, (unsigned long long)hits, (unsigned long long)misses, stats.peak_bytes / 1024);
+    TEST_CHECK(stats.limit == (size_t)POOL_SIZE * 1024 * 1024, "%s: the limit is %zu, not --pool-size", name, stats.limit);
+    TEST_CHECK(hits + misses == 3 * POOL_FRAMES, "%s: %llu allocations counted, %d made", name, (unsigned long long)(hits + misses), 3 * POOL_FRAMES);
+    /* 3 MB and 5 MB don't both fit in 8 MB, so one of them is allocated again each frame, the small one never is */
+    TEST_CHECK(hits >= 2 * (POOL_FRAMES - 1), "%s: only %llu of %d allocations reused a buffer", name, (unsigned long long)hits, 3 * POOL_FRAMES);
+    TEST_CHECK(stats.used_bytes == 0, "%s: %zu bytes still counted as used", name, stats.used_bytes);
+
+    /* several clips at once: the buffers in use must never be shared between threads */
+    corrupted = 0;
+    for (int i = 0; i < POOL_THREADS; i++)
+    {
+        pthread_create(&threads[i], NULL, pool_worker, (void *)(uintptr_t)(i + 1));
+    }
+    for (int i = 0; i < POOL_THREADS; i++)
+    {
+        pthread_join(threads[i], NULL);
+    }
+    framepool_get_stats(&stats);
+    TEST_CHECK(ATOMIC_LOAD(corrupted) == 0, "%s: %ld frame(s) with corrupted buffers from %d threads", name, ATOMIC_LOAD(corrupted), POOL_THREADS);
+    TEST_CHECK(stats.used_bytes == 0, "%s: %zu bytes still counted as used after the threads", name, stats.used_bytes);
+    TEST_CHECK(stats.idle_bytes <= stats.limit, "%s: %zu idle bytes exceed the limit of %zu", name, stats.idle_bytes, stats.limit);
+    TEST_CHECK(stats.idle_bytes > 0, "%s: nothing kept for reuse", name);
+
+    /* at unmount nothing is kept, not even what is given back afterwards */
+    uint8_t * late = framepool_alloc(100000);
+    framepool_free_all();
+    framepool_free(late);
+    framepool_get_stats(&stats);
+    TEST_CHECK(stats.idle_bytes == 0 && stats.used_bytes == 0, "%s: %zu idle and %zu used bytes left after framepool_free_all()", name, stats.idle_bytes, stats.used_bytes);
+}
+
+int main(int argc, char ** argv)
+{
+    run_pool(0);
+    run_pool(1);
+    printf("framepool: %s\n", test_failures ? "FAILED" : "passed");
+    return test_failures ? 1 : 0;
+}
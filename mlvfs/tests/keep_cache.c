@@ -0,0 +1,90 @@
+/*
+ * Copyright (C) 2014 David Milligan
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the
+ * Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ */
+
+/*
+ * Checks when --immutable lets the kernel keep what it has cached of a DNG or WAV (keep_cache on open): only if the
+ * same file was opened before, and neither the settings nor the clip changed since.
+ */
+
+#include "test.h"
+
+static int open_keep_cache(const char * path)
+{
+    struct fuse_file_info fi;
+    memset(&fi, 0, sizeof(struct fuse_file_info));
+    if (mlvfs_wrap_open(path, &fi))
+    {
+        return -1;
+    }
+    int keep_cache = fi.keep_cache;
+    mlvfs_wrap_release(path, &fi);
+    return keep_cache;
+}
+
+static void republish_settings(int fps)
+{
+    const struct mlvfs_settings * current = settings_get();
+    struct mlvfs_settings settings = *current;
+    settings_release(current);
+    settings.fps = fps;
+    settings_publish(&settings);
+}
+
+int main(int argc, char ** argv)
+{
+    struct mlvgen_options clip = { .frames = 4, .chunks = 1, .width = 96, .height = 40, .audio = 1 };
+    char mlv_filename[1024];
+
+    if (!test_create_dir() || !test_write_clip("K.MLV", &clip) || !test_write_clip("L.MLV", &clip))
+    {
+        fprintf(stderr, "could not write the test clips\n");
+        return 1;
+    }
+    snprintf(mlv_filename, sizeof(mlv_filename), "%s/K.MLV", test_dir);
+    mlvfs.immutable = 1;
+    test_mount();
+
+    TEST_CHECK(open_keep_cache("/K.MLV/K_000001.dng") == 0, "a DNG opened for the first time kept the cache");
+    TEST_CHECK(open_keep_cache("/K.MLV/K_000001.dng") == 1, "a DNG opened again didn't keep the cache");
+    TEST_CHECK(open_keep_cache("/K.MLV/K_000002.dng") == 0, "another DNG of the clip kept the cache");
+    TEST_CHECK(open_keep_cache("/K.MLV/K.wav") == 0, "the WAV opened for the first time kept the cache");
+    TEST_CHECK(open_keep_cache("/K.MLV/K.wav") == 1, "the WAV opened again didn't keep the cache");
+    TEST_CHECK(open_keep_cache("/L.MLV/L_000001.dng") == 0, "the DNG of another clip kept the cache");
+
+    /* new settings: everything is rendered again, a DNG opened since doesn't vouch for the others */
+    republish_settings(25);
+    TEST_CHECK(open_keep_cache("/K.MLV/K_000002.dng") == 0, "a DNG kept the cache across a settings change");
+    TEST_CHECK(open_keep_cache("/K.MLV/K_000001.dng") == 0, "a DNG kept the cache across a settings change");
+    TEST_CHECK(open_keep_cache("/K.MLV/K_000001.dng") == 1, "a DNG opened again after a settings change didn't keep the cache");
+    republish_settings(25);
+    TEST_CHECK(open_keep_cache("/K.MLV/K_000001.dng") == 1, "a DNG didn't keep the cache when the settings were published unchanged");
+
+    /* what the watcher does when the MLV changes, the other clips aren't affected */
+    TEST_CHECK(open_keep_cache("/L.MLV/L_000001.dng") == 0, "the DNG of another clip kept the cache across a settings change");
+    invalidate_clip_cache(mlv_filename);
+    TEST_CHECK(open_keep_cache("/K.MLV/K_000001.dng") == 0, "a DNG kept the cache after its clip changed");
+    TEST_CHECK(open_keep_cache("/K.MLV/K.wav") == 0, "the WAV kept the cache after its clip changed");
+    TEST_CHECK(open_keep_cache("/L.MLV/L_000001.dng") == 1, "the DNG of another clip didn't keep the cache when K.MLV changed");
+
+    test_unmount();
+    test_remove_dir();
+    printf("keep_cache: %s\n", test_failures ? "FAILED" : "passed");
+    return test_failures ? 1 : 0;
+}
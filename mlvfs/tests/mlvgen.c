@@ -0,0 +1,241 @@
+/*
+ * Copyright (C) 2014 David Milligan
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the
+ * Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include "../raw.h"
+#include "../mlv.h"
+#include "mlvgen.h"
+
+#define MLVGEN_MAX_CHUNKS 10
+
+struct mlvgen_state
+{
+    FILE * files[MLVGEN_MAX_CHUNKS];
+    int written;
+};
+
+static void mlvgen_block(struct mlvgen_state * state, int chunk, const void * data, size_t size)
+{
+    if (fwrite(data, size, 1, state->files[chunk]) != 1)
+    {
+        state->written = 0;
+    }
+}
+
+/**
+ * Writes a recording the tests can mount: RAWI, IDNT, RTCI, EXPO, LENS and WBAL headers, then the frames with a fixed pixel pattern
+ * @return 1 if successful, 0 otherwise
+ */
+int mlvgen_write(const char * filename, const struct mlvgen_options * options)
+{
+    struct mlvgen_state state;
+    uint64_t timestamp = 1000;
+    int chunks = options->chunks > 0 ? options->chunks : 1;
+    int width = options->width;
+    int height = options->height;
+
+    if (chunks > MLVGEN_MAX_CHUNKS || strlen(filename) < 4) return 0;
+
+    memset(&state, 0, sizeof(struct mlvgen_state));
+    state.written = 1;
+
+    for (int chunk = 0; chunk < chunks; chunk++)
+    {
+        char * chunk_filename = malloc(strlen(filename) + 1);
+        if (!chunk_filename) break;
+        strcpy(chunk_filename, filename);
+        if (chunk > 0)
+        {
+            sprintf(chunk_filename + strlen(chunk_filename) - 2, "%02d", chunk - 1);
+        }
+        state.files[chunk] = fopen(chunk_filename, "wb");
+        free(chunk_filename);
+        if (!state.files[chunk])
+        {
+            state.written = 0;
+            break;
+        }
+
+        mlv_file_hdr_t file_hdr;
+        memset(&file_hdr, 0, sizeof(mlv_file_hdr_t));
+        memcpy(file_hdr.fileMagic, "MLVI", 4);
+        file_hdr.blockSize = sizeof(mlv_file_hdr_t);
+        memcpy(file_hdr.versionString, "v2.0", 5);
+        file_hdr.fileGuid = 0x1234567890ULL;
+        file_hdr.fileNum = chunk;
+        file_hdr.fileCount = chunks;
+        file_hdr.videoClass = 1;
+        file_hdr.audioClass = options->audio ? 1 : 0;
+        file_hdr.sourceFpsNom = 25000;
+        file_hdr.sourceFpsDenom = 1000;
+        mlvgen_block(&state, chunk, &file_hdr, sizeof(mlv_file_hdr_t));
+    }
+
+    if (state.written)
+    {
+        mlv_rawi_hdr_t rawi;
+        memset(&rawi, 0, sizeof(mlv_rawi_hdr_t));
+        memcpy(rawi.blockType, "RAWI", 4);
+        rawi.blockSize = sizeof(mlv_rawi_hdr_t);
+        rawi.timestamp = timestamp++;
+        rawi.xRes = width;
+        rawi.yRes = height;
+        rawi.raw_info.api_version = 1;
+        rawi.raw_info.height = height;
+        rawi.raw_info.width = width;
+        rawi.raw_info.pitch = width * 14 / 8;
+        rawi.raw_info.frame_size = width * height * 14 / 8;
+        rawi.raw_info.bits_per_pixel = 14;
+        rawi.raw_info.black_level = 2048;
+        rawi.raw_info.white_level = 15000;
+        rawi.raw_info.active_area.y2 = height;
+        rawi.raw_info.active_area.x2 = width;
+        rawi.raw_info.cfa_pattern = 0x02010100;
+        rawi.raw_info.color_matrix1[0] = 1;
+        for (int i = 1; i < 18; i += 2) rawi.raw_info.color_matrix1[i] = 1;
+        mlvgen_block(&state, 0, &rawi, sizeof(mlv_rawi_hdr_t));
+
+        mlv_idnt_hdr_t idnt;
+        memset(&idnt, 0, sizeof(mlv_idnt_hdr_t));
+        memcpy(idnt.blockType, "IDNT", 4);
+        idnt.blockSize = sizeof(mlv_idnt_hdr_t);
+        idnt.timestamp = timestamp++;
+        strcpy((char *)idnt.cameraName, "Canon EOS 5D Mark III");
+        idnt.cameraModel = 0x80000285;
+        strcpy((char *)idnt.cameraSerial, "123");
+        mlvgen_block(&state, 0, &idnt, sizeof(mlv_idnt_hdr_t));
+
+        mlv_rtci_hdr_t rtci;
+        memset(&rtci, 0, sizeof(mlv_rtci_hdr_t));
+        memcpy(rtci.blockType, "RTCI", 4);
+        rtci.blockSize = sizeof(mlv_rtci_hdr_t);
+        rtci.timestamp = timestamp++;
+        rtci.tm_year = 115;
+        rtci.tm_mon = 3;
+        rtci.tm_mday = 7;
+        rtci.tm_hour = 10;
+        rtci.tm_min = 20;
+        rtci.tm_sec = 30;
+        mlvgen_block(&state, 0, &rtci, sizeof(mlv_rtci_hdr_t));
+
+        mlv_expo_hdr_t expo;
+        memset(&expo, 0, sizeof(mlv_expo_hdr_t));
+        memcpy(expo.blockType, "EXPO", 4);
+        expo.blockSize = sizeof(mlv_expo_hdr_t);
+        expo.timestamp = timestamp++;
+        expo.isoValue = 100;
+        expo.shutterValue = 20000;
+        mlvgen_block(&state, 0, &expo, sizeof(mlv_expo_hdr_t));
+
+        mlv_lens_hdr_t lens;
+        memset(&lens, 0, sizeof(mlv_lens_hdr_t));
+        memcpy(lens.blockType, "LENS", 4);
+        lens.blockSize = sizeof(mlv_lens_hdr_t);
+        lens.timestamp = timestamp++;
+        lens.aperture = 280;
+        lens.focalLength = 50;
+        strcpy((char *)lens.lensName, "EF50mm");
+        mlvgen_block(&state, 0, &lens, sizeof(mlv_lens_hdr_t));
+
+        mlv_wbal_hdr_t wbal;
+        memset(&wbal, 0, sizeof(mlv_wbal_hdr_t));
+        memcpy(wbal.blockType, "WBAL", 4);
+        wbal.blockSize = sizeof(mlv_wbal_hdr_t);
+        wbal.timestamp = timestamp++;
+        wbal.wb_mode = 9;
+        wbal.kelvin = 5600;
+        mlvgen_block(&state, 0, &wbal, sizeof(mlv_wbal_hdr_t));
+
+        mlv_wavi_hdr_t wavi;
+        memset(&wavi, 0, sizeof(mlv_wavi_hdr_t));
+        memcpy(wavi.blockType, "WAVI", 4);
+        wavi.blockSize = sizeof(mlv_wavi_hdr_t);
+        wavi.timestamp = timestamp++;
+        wavi.format = 1;
+        wavi.channels = 2;
+        wavi.samplingRate = 48000;
+        wavi.bytesPerSecond = 192000;
+        wavi.blockAlign = 4;
+        wavi.bitsPerSample = 16;
+        if (options->audio) mlvgen_block(&state, 0, &wavi, sizeof(mlv_wavi_hdr_t));
+
+        size_t frame_size = (size_t)width * height * 14 / 8;
+        size_t audio_size = wavi.bytesPerSecond / 5;
+        uint8_t * pixels = malloc(frame_size);
+        uint8_t * samples = malloc(audio_size);
+        int frames_per_chunk = (options->frames + chunks - 1) / chunks;
+        if (!pixels || !samples) state.written = 0;
+
+        for (int frame = 0; frame < options->frames && state.written; frame++)
+        {
+            int chunk = frames_per_chunk ? frame / frames_per_chunk : 0;
+            if (chunk >= chunks) chunk = chunks - 1;
+
+            if (options->exposure_change && frame == options->exposure_change)
+            {
+                expo.timestamp = timestamp++;
+                expo.isoValue = 800;
+                expo.shutterValue = 10000;
+                mlvgen_block(&state, chunk, &expo, sizeof(mlv_expo_hdr_t));
+                wbal.timestamp = timestamp++;
+                wbal.kelvin = 3200;
+                mlvgen_block(&state, chunk, &wbal, sizeof(mlv_wbal_hdr_t));
+            }
+
+            mlv_vidf_hdr_t vidf;
+            uint8_t frame_space[16] = { 0 };
+            memset(&vidf, 0, sizeof(mlv_vidf_hdr_t));
+            memcpy(vidf.blockType, "VIDF", 4);
+            vidf.frameSpace = sizeof(frame_space);
+            vidf.blockSize = sizeof(mlv_vidf_hdr_t) + sizeof(frame_space) + frame_size;
+            vidf.frameNumber = frame;
+            vidf.timestamp = timestamp;
+            timestamp += 40000;
+            for (size_t i = 0; i < frame_size; i++) pixels[i] = (uint8_t)(i * 7 + frame * 13);
+            mlvgen_block(&state, chunk, &vidf, sizeof(mlv_vidf_hdr_t));
+            mlvgen_block(&state, chunk, frame_space, sizeof(frame_space));
+            mlvgen_block(&state, chunk, pixels, frame_size);
+
+            if (options->audio && frame % 5 == 0)
+            {
+                mlv_audf_hdr_t audf;
+                memset(&audf, 0, sizeof(mlv_audf_hdr_t));
+                memcpy(audf.blockType, "AUDF", 4);
+                audf.blockSize = sizeof(mlv_audf_hdr_t) + audio_size;
+                audf.timestamp = timestamp++;
+                audf.frameNumber = frame / 5;
+                for (size_t i = 0; i < audio_size; i++) samples[i] = (uint8_t)(i + frame);
+                mlvgen_block(&state, chunk, &audf, sizeof(mlv_audf_hdr_t));
+                mlvgen_block(&state, chunk, samples, audio_size);
+            }
+        }
+        free(pixels);
+        free(samples);
+    }
+
+    for (int chunk = 0; chunk < chunks; chunk++)
+    {
+        if (state.files[chunk] && fclose(state.files[chunk])) state.written = 0;
+    }
+    return state.written;
+}
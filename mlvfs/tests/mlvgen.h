@@ -0,0 +1,42 @@
+/*
+ * Copyright (C) 2014 David Milligan
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the
+ * Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ */
+
+#ifndef mlvfs_mlvgen_h
+#define mlvfs_mlvgen_h
+
+#include <stdint.h>
+
+//Describes a synthetic recording for the tests (14 bit, 5D3 metadata, no compression)
+struct mlvgen_options
+{
+    int frames;
+    //the .MLV plus chunks - 1 .M00, .M01... files, the frames are spread evenly over them
+    int chunks;
+    int width;
+    int height;
+    //write a WAVI header and an AUDF block every 5 frames
+    int audio;
+    //frame at which ISO, shutter and white balance change (0 for never)
+    int exposure_change;
+};
+
+int mlvgen_write(const char * filename, const struct mlvgen_options * options);
+
+#endif
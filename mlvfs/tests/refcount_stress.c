@@ -0,0 +1,133 @@
+/*
+ * Copyright (C) 2014 David Milligan
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the
+ * Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ */
+
+/*
+ * Stress test for the reference counting of the rendered DNG cache: threads read the same frames at once while
+ * the cache is kept far below one clip (so buffers are evicted while others hold them), the clip is invalidated,
+ * its DNG attribute tables are dropped under the lookups of the other threads and the settings are republished. Every read must match a single threaded reference, and nothing may be left
+ * behind once the cache is freed. Most useful built with `make test SANITIZE=address` or `SANITIZE=thread`.
+ */
+
+#include "test.h"
+
+#define STRESS_FRAMES 40
+#define STRESS_THREADS 8
+#define STRESS_READS 300
+#define STRESS_BUDGET 60000
+
+static uint64_t reference[STRESS_FRAMES];
+static volatile long mismatches = 0;
+
+static uint64_t read_frame(int frame)
+{
+    char path[64];
+    struct FUSE_STAT stbuf;
+    sprintf(path, "/B.MLV/B_%06d.dng", frame);
+    /* the attributes come from the DNG attribute tables, that are dropped and registered again meanwhile */
+    if (mlvfs_wrap_getattr(path, &stbuf) || stbuf.st_size <= 0)
+    {
+        return 0;
+    }
+    return test_read_file(path, NULL);
+}
+
+static void * stress_worker(void * arg)
+{
+    unsigned int seed = (unsigned int)(uintptr_t)arg;
+    char mlv_filename[1024];
+    snprintf(mlv_filename, sizeof(mlv_filename), "%s/B.MLV", test_dir);
+
+    for (int i = 0; i < STRESS_READS; i++)
+    {
+        /* mostly sequential (like playback, with prefetching), sometimes random */
+        int frame = (i % 3) ? (int)((seed + i) % STRESS_FRAMES) : rand_r(&seed) % STRESS_FRAMES;
+        if (read_frame(frame) != reference[frame])
+        {
+            ATOMIC_INCREMENT(mismatches);
+        }
+
+        if (i % 97 == 0)
+        {
+            invalidate_image_buffers(mlv_filename);
+        }
+        if (i % 13 == 0)
+        {
+            invalidate_dng_attr(mlv_filename);
+        }
+        if (i % 41 == 0)
+        {
+            /* a new generation (the clips aren't dual ISO, so the frames come out the same): everything is rendered again */
+            const struct mlvfs_settings * current = settings_get();
+            struct mlvfs_settings settings = *current;
+            settings_release(current);
+            settings.hdr_interpolation_method = !settings.hdr_interpolation_method;
+            settings_publish(&settings);
+        }
+    }
+    return NULL;
+}
+
+int main(int argc, char ** argv)
+{
+    struct mlvgen_options clip = { .frames = STRESS_FRAMES, .chunks = 3, .width = 96, .height = 40, .exposure_change = 17 };
+    pthread_t threads[STRESS_THREADS];
+    struct image_buffer_stats stats;
+
+    if (!test_create_dir() || !test_write_clip("B.MLV", &clip))
+    {
+        fprintf(stderr, "could not write the test clip\n");
+        return 1;
+    }
+
+    mlvfs.prefetch = 4;
+    test_mount();
+
+    for (int frame = 0; frame < STRESS_FRAMES; frame++)
+    {
+        reference[frame] = read_frame(frame);
+        TEST_CHECK(reference[frame] != 0, "frame %d could not be read", frame);
+    }
+
+    image_buffer_set_budget(STRESS_BUDGET);
+    for (int i = 0; i < STRESS_THREADS; i++)
+    {
+        pthread_create(&threads[i], NULL, stress_worker, (void *)(uintptr_t)(i * 7 + 1));
+    }
+    for (int i = 0; i < STRESS_THREADS; i++)
+    {
+        pthread_join(threads[i], NULL);
+    }
+
+    TEST_CHECK(mismatches == 0, "%ld read(s) differ from the reference", mismatches);
+
+    image_buffer_get_stats(&stats);
+    TEST_CHECK(stats.evictions > 0, "nothing was evicted with a %d byte budget", STRESS_BUDGET);
+    /* only a single buffer that is bigger than the whole budget may be kept beyond it */
+    TEST_CHECK(stats.count <= 1 || stats.bytes <= STRESS_BUDGET, "%d buffer(s) with %zu bytes cached, budget %d", stats.count, stats.bytes, STRESS_BUDGET);
+
+    test_unmount();
+
+    image_buffer_get_stats(&stats);
+    TEST_CHECK(stats.count == 0 && stats.bytes == 0, "%d buffer(s) (%zu bytes) left after freeing the cache", stats.count, stats.bytes);
+
+    test_remove_dir();
+    printf("refcount_stress: %s\n", test_failures ? "FAILED" : "passed");
+    return test_failures ? 1 : 0;
+}
@@ -0,0 +1,129 @@
+/*
+ * Copyright (C) 2014 David Milligan
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the
+ * Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ */
+
+/*
+ * Checks that the listing of a spanned clip follows its chunk files while they are written: G.M00 grows (with
+ * G.MLV unchanged) and then G.M01 shows up, and each time the DNGs listed must match what getattr finds, not what
+ * the catalog remembered from before. The watcher is stopped, as where there is none (not Linux) the files
+ * themselves have to tell that they changed.
+ */
+
+#include "test.h"
+
+#define GROWTH_FRAMES 30
+#define GROWTH_CHUNKS 3
+/* longer than the interval the catalog and the index are checked at */
+#define GROWTH_WAIT 2100000
+
+#ifdef MLVFS_LOWLEVEL
+static int count_dng(void * buf, const char * name, const struct FUSE_STAT * stbuf, FUSE_OFF_T off, enum fuse_fill_dir_flags flags)
+#else
+static int count_dng(void * buf, const char * name, const struct FUSE_STAT * stbuf, FUSE_OFF_T off)
+#endif
+{
+    if (string_ends_with(name, ".dng")) (*(int *)buf)++;
+    return 0;
+}
+
+static int list_dng(void)
+{
+    int count = 0;
+    struct fuse_file_info fi;
+    memset(&fi, 0, sizeof(struct fuse_file_info));
+    return mlvfs_wrap_readdir("/G.MLV", &count, count_dng, 0, &fi) ? -1 : count;
+}
+
+/* the DNGs getattr knows about, up to the first one that isn't there */
+static int stat_dng(void)
+{
+    char path[64];
+    struct FUSE_STAT stbuf;
+    int count = 0;
+    for (; count < GROWTH_FRAMES; count++)
+    {
+        sprintf(path, "/G.MLV/G_%06d.dng", count);
+        if (mlvfs_wrap_getattr(path, &stbuf)) break;
+    }
+    return count;
+}
+
+/* copies (the start of) a file, as the camera or a copy in progress would have written it so far */
+static int copy_file(const char * from, const char * to, double fraction)
+{
+    char from_path[1024], to_path[1024];
+    snprintf(from_path, sizeof(from_path), "%s/%s", test_dir, from);
+    snprintf(to_path, sizeof(to_path), "%s/%s", test_dir, to);
+    FILE * in = fopen(from_path, "rb");
+    FILE * out = in ? fopen(to_path, "wb") : NULL;
+    int result = out != NULL;
+    if (result)
+    {
+        fseek(in, 0, SEEK_END);
+        long size = (long)(ftell(in) * fraction);
+        fseek(in, 0, SEEK_SET);
+        char * data = malloc(size);
+        result = data && fread(data, size, 1, in) == 1 && fwrite(data, size, 1, out) == 1;
+        free(data);
+    }
+    if (out) fclose(out);
+    if (in) fclose(in);
+    return result;
+}
+
+int main(int argc, char ** argv)
+{
+    struct mlvgen_options clip = { .frames = GROWTH_FRAMES, .chunks = GROWTH_CHUNKS, .width = 96, .height = 40 };
+    char from_path[1024], to_path[1024];
+
+    /* the whole recording is written aside, and handed over to G.MLV a piece at a time */
+    if (!test_create_dir() || !test_write_clip("F.MLV", &clip) || !copy_file("F.MLV", "G.MLV", 1.0) || !copy_file("F.M00", "G.M00", 0.5))
+    {
+        fprintf(stderr, "could not write the test clip\n");
+        return 1;
+    }
+    test_mount();
+    watch_stop();
+
+    int listed = list_dng();
+    int found = stat_dng();
+    TEST_CHECK(listed > GROWTH_FRAMES / GROWTH_CHUNKS && listed < 2 * GROWTH_FRAMES / GROWTH_CHUNKS, "%d DNG(s) listed with half of G.M00", listed);
+    TEST_CHECK(listed == found, "%d DNG(s) listed, %d found by getattr with half of G.M00", listed, found);
+
+    usleep(GROWTH_WAIT);
+    TEST_CHECK(copy_file("F.M00", "G.M00", 1.0), "could not complete G.M00");
+    listed = list_dng();
+    found = stat_dng();
+    TEST_CHECK(listed == 2 * GROWTH_FRAMES / GROWTH_CHUNKS, "%d DNG(s) listed once G.M00 is complete", listed);
+    TEST_CHECK(listed == found, "%d DNG(s) listed, %d found by getattr once G.M00 is complete", listed, found);
+
+    usleep(GROWTH_WAIT);
+    snprintf(from_path, sizeof(from_path), "%s/F.M01", test_dir);
+    snprintf(to_path, sizeof(to_path), "%s/G.M01", test_dir);
+    TEST_CHECK(rename(from_path, to_path) == 0, "could not add G.M01");
+    listed = list_dng();
+    found = stat_dng();
+    TEST_CHECK(listed == GROWTH_FRAMES, "%d DNG(s) listed once G.M01 is there", listed);
+    TEST_CHECK(listed == found, "%d DNG(s) listed, %d found by getattr once G.M01 is there", listed, found);
+
+    test_unmount();
+    test_remove_dir();
+    printf("spanned_growth: %s\n", test_failures ? "FAILED" : "passed");
+    return test_failures ? 1 : 0;
+}
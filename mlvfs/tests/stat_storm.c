@@ -0,0 +1,168 @@
+/*
+ * Copyright (C) 2014 David Milligan
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the
+ * Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ */
+
+/*
+ * Stat storm benchmark: getattr on every DNG of a clip with 100k frames, the way a file browser or an editor
+ * scanning a card hits the filesystem. Reports the getattr calls per second through the path based callbacks
+ * (what the FUSE 2.6 frontend does for every request), and with `make FUSE3=1` also through the inode decoding
+ * of the low-level frontend, and checks that both give the same attributes.
+ */
+
+#include "test.h"
+
+#define STORM_FRAMES 100000
+#define STORM_THREADS 4
+
+struct storm_result
+{
+    uint32_t done;
+    uint32_t failed;
+    off_t size;
+};
+
+static void storm_path(uint32_t first, struct storm_result * result)
+{
+    char path[64];
+    struct FUSE_STAT stbuf;
+    memset(result, 0, sizeof(struct storm_result));
+    for (uint32_t i = 0; i < STORM_FRAMES; i++)
+    {
+        sprintf(path, "/S.MLV/S_%06u.dng", (first + i) % STORM_FRAMES);
+        if (mlvfs_wrap_getattr(path, &stbuf) || !S_ISREG(stbuf.st_mode) || (result->size && stbuf.st_size != result->size))
+        {
+            result->failed++;
+        }
+        result->size = stbuf.st_size;
+        result->done++;
+    }
+}
+
+#ifdef MLVFS_LOWLEVEL
+static int32_t storm_clip = -1;
+
+/* what ll_getattr does for a DNG inode, short of replying to the kernel */
+static void storm_inode(uint32_t first, struct storm_result * result)
+{
+    struct stat stbuf;
+    memset(result, 0, sizeof(struct storm_result));
+    for (uint32_t i = 0; i < STORM_FRAMES; i++)
+    {
+        fuse_ino_t ino = LL_INO(LL_KIND_DNG, storm_clip, (first + i) % STORM_FRAMES);
+        const struct ll_clip * clip = ll_get_clip(ino);
+        if (!clip || ll_dng_attr(clip, LL_INO_FRAME(ino), &stbuf) || !S_ISREG(stbuf.st_mode) || (result->size && stbuf.st_size != result->size))
+        {
+            result->failed++;
+        }
+        result->size = stbuf.st_size;
+        result->done++;
+    }
+}
+#endif
+
+struct storm_job
+{
+    void (*storm)(uint32_t first, struct storm_result * result);
+    uint32_t first;
+    struct storm_result result;
+};
+
+static void * storm_worker(void * arg)
+{
+    struct storm_job * job = (struct storm_job *)arg;
+    job->storm(job->first, &job->result);
+    return NULL;
+}
+
+/**
+ * Runs a storm on a number of threads at once, each one starting at a different frame
+ * @return getattr calls per second
+ */
+static double storm_run(const char * name, void (*storm)(uint32_t first, struct storm_result * result), int thread_count, off_t * size)
+{
+    struct storm_job jobs[STORM_THREADS];
+    pthread_t threads[STORM_THREADS];
+    uint32_t done = 0, failed = 0;
+
+    double start = test_get_time();
+    for (int i = 0; i < thread_count; i++)
+    {
+        jobs[i].storm = storm;
+        jobs[i].first = (uint32_t)i * (STORM_FRAMES / thread_count);
+        pthread_create(&threads[i], NULL, storm_worker, &jobs[i]);
+    }
+    for (int i = 0; i < thread_count; i++)
+    {
+        pthread_join(threads[i], NULL);
+        done += jobs[i].result.done;
+        failed += jobs[i].result.failed;
+        TEST_CHECK(jobs[i].result.size == jobs[0].result.size, "%s: DNG sizes differ between threads", name);
+    }
+    double elapsed = test_get_time() - start;
+
+    TEST_CHECK(failed == 0, "%s: %u of %u getattr call(s) failed", name, failed, done);
+    *size = jobs[0].result.size;
+
+    double rate = done / elapsed;
+    printf("stat_storm: %-6s %d thread(s): %u getattr in %.3f s, %.0f ops/s\n", name, thread_count, done, elapsed, rate);
+    return rate;
+}
+
+int main(int argc, char ** argv)
+{
+    struct mlvgen_options clip = { .frames = STORM_FRAMES, .chunks = 2, .width = 32, .height = 4 };
+    struct FUSE_STAT stbuf;
+    off_t size = 0;
+
+    if (!test_create_dir() || !test_write_clip("S.MLV", &clip))
+    {
+        fprintf(stderr, "could not write the test clip\n");
+        return 1;
+    }
+    test_mount();
+
+    /* the first lookups index the clip and work out the DNG sizes */
+    TEST_CHECK(test_list_dir("/S.MLV") >= STORM_FRAMES, "listing S.MLV failed");
+    TEST_CHECK(mlvfs_wrap_getattr("/S.MLV/S_000000.dng", &stbuf) == 0, "getattr of the first DNG failed");
+    char path[64];
+    sprintf(path, "/S.MLV/S_%06u.dng", STORM_FRAMES);
+    TEST_CHECK(mlvfs_wrap_getattr(path, &stbuf) == -ENOENT, "getattr past the last DNG didn't fail");
+
+    storm_run("path", storm_path, 1, &size);
+    storm_run("path", storm_path, STORM_THREADS, &size);
+
+#ifdef MLVFS_LOWLEVEL
+    off_t inode_size = 0;
+    storm_clip = ll_register_clip("/S.MLV");
+    TEST_CHECK(storm_clip >= 0, "S.MLV could not be registered with the low-level frontend");
+    if (storm_clip >= 0)
+    {
+        double path_rate = storm_run("path", storm_path, 1, &size);
+        double inode_rate = storm_run("inode", storm_inode, 1, &inode_size);
+        storm_run("inode", storm_inode, STORM_THREADS, &inode_size);
+        TEST_CHECK(inode_size == size, "DNG size %lld through the inode, %lld through the path", (long long)inode_size, (long long)size);
+        printf("stat_storm: inode based getattr is %.1fx the path based one\n", inode_rate / path_rate);
+    }
+#endif
+
+    test_unmount();
+    test_remove_dir();
+    printf("stat_storm: %s\n", test_failures ? "FAILED" : "passed");
+    return test_failures ? 1 : 0;
+}
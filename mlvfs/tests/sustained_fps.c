@@ -0,0 +1,108 @@
+/*
+ * Copyright (C) 2014 David Milligan
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the
+ * Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ */
+
+/*
+ * Sustained playback frame rate, with and without --prefetch: a player reads the DNGs of a clip one after the
+ * other and spends as long on each frame (decoding, display) as MLVFS takes to render one. Without prefetching
+ * the two add up, with it the next frames are rendered while the player is busy, so it should get close to the
+ * rate MLVFS renders at. The frames must be the same either way.
+ */
+
+#include "test.h"
+
+#define FPS_FRAMES 48
+#define FPS_PREFETCH 4
+#define FPS_CALIBRATION_FRAMES 4
+/* prefetching has to make playback at least this much faster */
+#define FPS_MIN_SPEEDUP 1.2
+
+static uint64_t hashes[2][FPS_FRAMES];
+
+static uint64_t read_frame(int frame)
+{
+    char path[64];
+    sprintf(path, "/P.MLV/P_%06d.dng", frame);
+    return test_read_file(path, NULL);
+}
+
+/**
+ * Plays the clip from the start
+ * @param player_time Seconds the player spends on each frame after reading it
+ * @return the frames per second
+ */
+static double play(uint64_t * frame_hashes, double player_time)
+{
+    double start = test_get_time();
+    for (int frame = 0; frame < FPS_FRAMES; frame++)
+    {
+        frame_hashes[frame] = read_frame(frame);
+        usleep((useconds_t)(player_time * 1e6));
+    }
+    return FPS_FRAMES / (test_get_time() - start);
+}
+
+int main(int argc, char ** argv)
+{
+    struct mlvgen_options clip = { .frames = FPS_FRAMES, .chunks = 1, .width = 640, .height = 360 };
+    char mlv_filename[1024];
+
+    if (!test_create_dir() || !test_write_clip("P.MLV", &clip))
+    {
+        fprintf(stderr, "could not write the test clip\n");
+        return 1;
+    }
+    snprintf(mlv_filename, sizeof(mlv_filename), "%s/P.MLV", test_dir);
+
+    /* some processing, so rendering a frame takes a while */
+    mlvfs.chroma_smooth = 3;
+    mlvfs.prefetch = 0;
+    test_mount();
+
+    /* how long a frame takes to render, the cache is dropped afterwards so nothing is reused */
+    read_frame(0);
+    double start = test_get_time();
+    for (int frame = 1; frame <= FPS_CALIBRATION_FRAMES; frame++)
+    {
+        read_frame(frame);
+    }
+    double render_time = (test_get_time() - start) / FPS_CALIBRATION_FRAMES;
+    invalidate_image_buffers(mlv_filename);
+
+    double fps = play(hashes[0], render_time);
+    test_unmount();
+
+    mlvfs.prefetch = FPS_PREFETCH;
+    test_mount();
+    double prefetch_fps = play(hashes[1], render_time);
+    test_unmount();
+
+    for (int frame = 0; frame < FPS_FRAMES; frame++)
+    {
+        TEST_CHECK(hashes[0][frame] && hashes[0][frame] == hashes[1][frame], "frame %d differs with --prefetch=%d", frame, FPS_PREFETCH);
+    }
+    TEST_CHECK(prefetch_fps >= fps * FPS_MIN_SPEEDUP, "%.1f fps with --prefetch=%d, %.1f fps without", prefetch_fps, FPS_PREFETCH, fps);
+
+    printf("sustained_fps: %.1f ms per frame to render, %.1f fps without prefetching, %.1f fps with --prefetch=%d\n",
+           render_time * 1000, fps, prefetch_fps, FPS_PREFETCH);
+
+    test_remove_dir();
+    printf("sustained_fps: %s\n", test_failures ? "FAILED" : "passed");
+    return test_failures ? 1 : 0;
+}
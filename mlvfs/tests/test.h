@@ -0,0 +1,175 @@
+/*
+ * Copyright (C) 2014 David Milligan
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the
+ * Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ */
+
+#ifndef mlvfs_test_h
+#define mlvfs_test_h
+
+/*
+ * Shared by the tests: each one is a single translation unit that drives the FUSE 2.6 callbacks of main.c directly,
+ * on clips written by mlvgen into a scratch directory, without mounting anything
+ */
+
+#define main mlvfs_main
+#include "../main.c"
+#undef main
+
+#ifdef MLVFS_LOWLEVEL
+/* with `make FUSE3=1` the low-level frontend is part of the test too, so its inode based paths can be called without a kernel */
+#include "../lowlevel.c"
+#endif
+
+#include <time.h>
+#include "mlvgen.h"
+
+static int test_failures = 0;
+
+#define TEST_CHECK(condition, ...) do { if (!(condition)) { \
+    fprintf(stderr, "%s:%d: FAILED: ", __FILE__, __LINE__); fprintf(stderr, __VA_ARGS__); fprintf(stderr, "\n"); test_failures++; } } while (0)
+
+static char test_dir[64];
+
+/* creates an empty directory for the clips of the test and points mlvfs at it */
+static inline int test_create_dir(void)
+{
+    strcpy(test_dir, "/tmp/mlvfs-test-XXXXXX");
+    if (!mkdtemp(test_dir))
+    {
+        return 0;
+    }
+    mlvfs.mlv_path = test_dir;
+    return 1;
+}
+
+/* removes the directory and whatever was written into it (clips, IDX files) */
+static inline void test_remove_dir(void)
+{
+    DIR * dir = opendir(test_dir);
+    if (dir)
+    {
+        struct dirent * child;
+        while ((child = readdir(dir)) != NULL)
+        {
+            if (child->d_name[0] == '.') continue;
+            char path[1024];
+            snprintf(path, sizeof(path), "%s/%s", test_dir, child->d_name);
+            unlink(path);
+        }
+        closedir(dir);
+    }
+    rmdir(test_dir);
+}
+
+static inline int test_write_clip(const char * name, const struct mlvgen_options * options)
+{
+    char filename[1024];
+    snprintf(filename, sizeof(filename), "%s/%s", test_dir, name);
+    return mlvgen_write(filename, options);
+}
+
+/* what main() does before handing over to FUSE, followed by the init callback */
+static inline void test_mount(void)
+{
+    get_raw2evf(0);
+    get_raw2ev(0);
+    get_ev2raw();
+    settings_init(&mlvfs);
+#ifdef MLVFS_LOWLEVEL
+    path_ops = &mlvfs_path_operations;
+#endif
+    mlvfs_start();
+}
+
+/* the destroy callback, followed by the cleanup at the end of main() */
+static inline void test_unmount(void)
+{
+    mlvfs_stop();
+    stripes_free_corrections();
+    free_all_image_buffers();
+    settings_free();
+    framepool_free_all();
+    close_all_chunks();
+    free_dng_attr_mappings();
+    free_focus_pixel_maps();
+    free_all_catalogs();
+    free_all_clips();
+    free_all_indexes();
+    free_path_cache();
+}
+
+static inline double test_get_time(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+#ifdef MLVFS_LOWLEVEL
+static int test_count_entry(void * buf, const char * name, const struct FUSE_STAT * stbuf, FUSE_OFF_T off, enum fuse_fill_dir_flags flags)
+#else
+static int test_count_entry(void * buf, const char * name, const struct FUSE_STAT * stbuf, FUSE_OFF_T off)
+#endif
+{
+    (*(int *)buf)++;
+    return 0;
+}
+
+/* lists a directory through the readdir callback, returns the number of entries or -1 on error */
+static inline int test_list_dir(const char * path)
+{
+    int count = 0;
+    struct fuse_file_info fi;
+    memset(&fi, 0, sizeof(struct fuse_file_info));
+    return mlvfs_wrap_readdir(path, &count, test_count_entry, 0, &fi) ? -1 : count;
+}
+
+/**
+ * Reads a whole file the way the kernel would (open, read in 128 kB requests, release)
+ * @param size [out] How many bytes were read (can be NULL)
+ * @return a FNV-1a hash of the contents, 0 if the file could not be opened
+ */
+static inline uint64_t test_read_file(const char * path, size_t * size)
+{
+    static __thread char buffer[128 * 1024];
+    struct fuse_file_info fi;
+    uint64_t hash = 1469598103934665603ULL;
+    FUSE_OFF_T offset = 0;
+    int read;
+
+    memset(&fi, 0, sizeof(struct fuse_file_info));
+    if (mlvfs_wrap_open(path, &fi))
+    {
+        return 0;
+    }
+    while ((read = mlvfs_wrap_read(path, buffer, sizeof(buffer), offset, &fi)) > 0)
+    {
+        for (int i = 0; i < read; i++)
+        {
+            hash ^= (uint8_t)buffer[i];
+            hash *= 1099511628211ULL;
+        }
+        offset += read;
+    }
+    mlvfs_wrap_release(path, &fi);
+
+    if (size) *size = (size_t)offset;
+    return hash;
+}
+
+#endif
@@ -0,0 +1,103 @@
+/*
+ * Copyright (C) 2014 David Milligan
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the
+ * Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ */
+
+/*
+ * Checks that lookups, listings and reads of a clip carry on while the background indexing (--warm-index) is
+ * stuck on another clip: one of the chunks of X.MLV is a FIFO, so indexing it blocks until the test opens the
+ * other end.
+ */
+
+#include "test.h"
+
+#define WARM_TIMEOUT 10.0
+#define WARM_FOREGROUND_LIMIT 5.0
+
+static void wait_for_progress(uint32_t expected_done)
+{
+    uint32_t done = 0, total = 0, failed = 0;
+    double start = test_get_time();
+    while (test_get_time() - start < WARM_TIMEOUT)
+    {
+        warm_get_progress(&done, &total, &failed);
+        if (done >= expected_done) break;
+        usleep(10000);
+    }
+    TEST_CHECK(done >= expected_done, "background indexing got to %u of %u clip(s), expected %u", done, total, expected_done);
+}
+
+int main(int argc, char ** argv)
+{
+    struct mlvgen_options clip = { .frames = 10, .chunks = 1, .width = 96, .height = 40 };
+    char fifo_filename[1024];
+    struct FUSE_STAT stbuf;
+
+    if (!test_create_dir() || !test_write_clip("X.MLV", &clip) || !test_write_clip("Y.MLV", &clip))
+    {
+        fprintf(stderr, "could not write the test clips\n");
+        return 1;
+    }
+    snprintf(fifo_filename, sizeof(fifo_filename), "%s/X.M00", test_dir);
+    if (mkfifo(fifo_filename, 0600))
+    {
+        fprintf(stderr, "could not create '%s'\n", fifo_filename);
+        test_remove_dir();
+        return 1;
+    }
+
+    /* a test that hangs (e.g. on a lock held by the stuck indexing) fails as well */
+    alarm(60);
+
+    mlvfs.warm_threads = 2;
+    test_mount();
+
+    /* Y gets indexed, X never finishes */
+    wait_for_progress(1);
+
+    double start = test_get_time();
+    TEST_CHECK(mlvfs_wrap_getattr("/", &stbuf) == 0, "getattr of the root failed");
+    TEST_CHECK(mlvfs_wrap_getattr("/Y.MLV", &stbuf) == 0 && S_ISDIR(stbuf.st_mode), "getattr of Y.MLV failed");
+    TEST_CHECK(test_list_dir("/Y.MLV") >= clip.frames, "listing Y.MLV failed");
+    TEST_CHECK(mlvfs_wrap_getattr("/Y.MLV/Y_000003.dng", &stbuf) == 0 && stbuf.st_size > 0, "getattr of a DNG failed");
+    TEST_CHECK(test_read_file("/Y.MLV/Y_000003.dng", NULL) != 0, "reading a DNG failed");
+    double elapsed = test_get_time() - start;
+    TEST_CHECK(elapsed < WARM_FOREGROUND_LIMIT, "foreground operations took %.3f s while X.MLV was being indexed", elapsed);
+
+    uint32_t done = 0, total = 0, failed = 0;
+    warm_get_progress(&done, &total, &failed);
+    TEST_CHECK(done < total, "X.MLV was indexed before the FIFO was opened");
+
+    /* let the indexing of X go on: the blocked open returns once a writer shows up, later ones find no chunk */
+    int fifo = -1;
+    start = test_get_time();
+    while ((fifo = open(fifo_filename, O_WRONLY | O_NONBLOCK)) < 0 && test_get_time() - start < WARM_TIMEOUT)
+    {
+        usleep(10000);
+    }
+    TEST_CHECK(fifo >= 0, "nothing was reading X.M00");
+    unlink(fifo_filename);
+    if (fifo >= 0) close(fifo);
+
+    wait_for_progress(2);
+
+    test_unmount();
+    test_remove_dir();
+    printf("warm_foreground: %s (foreground operations took %.3f s)\n", test_failures ? "FAILED" : "passed", elapsed);
+    return test_failures ? 1 : 0;
+}
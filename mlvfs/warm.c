@@ -0,0 +1,257 @@
+/*
+ * Copyright (C) 2014 David Milligan
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the
+ * Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include "raw.h"
+#include "mlv.h"
+#include "mlvfs.h"
+#include "catalog.h"
+#include "scheduler.h"
+#include "warm.h"
+
+#define CREATE_MUTEX(x) static pthread_mutex_t x = PTHREAD_MUTEX_INITIALIZER;
+#define RELOCK(x) pthread_mutex_lock(&(x));
+#define UNLOCK(x) pthread_mutex_unlock(&(x));
+
+#define MAX_WARM_THREADS 16
+
+/*
+ * Indexes every MLV below mlv_path in the background right after mounting, so the first access
+ * to a clip (e.g. an editor opening a bin) doesn't have to build the IDX and frame directory itself.
+ * A clip is only started while the scheduler would let a RENDER_BACKGROUND render in, i.e. a CPU is idle and no
+ * foreground read or prefetching is waiting for one
+ */
+
+CREATE_MUTEX(warm_mutex)
+
+static struct mlvfs * mlvfs_config = NULL;
+static char ** warm_queue = NULL;
+static uint32_t warm_total = 0;
+static uint32_t warm_next = 0;
+static uint32_t warm_done = 0;
+static uint32_t warm_failed = 0;
+static volatile int halt_warm = 0;
+static time_t warm_started = 0;
+
+static pthread_t warm_thread;
+static int warm_running = 0;
+
+//warm_mutex has to be held
+static int warm_queue_add(const char * path)
+{
+    char ** queue = realloc(warm_queue, (warm_total + 1) * sizeof(char *));
+    if(!queue) return 0;
+    warm_queue = queue;
+    warm_queue[warm_total] = malloc(strlen(path) + 1);
+    if(!warm_queue[warm_total]) return 0;
+    strcpy(warm_queue[warm_total], path);
+    warm_total++;
+    return 1;
+}
+
+/**
+ * Collects the MLVs in a directory and its subdirectories (skipping .MLD directories)
+ */
+static void warm_scan_dir(const char * dir_path, int depth)
+{
+    if(depth > 16 || halt_warm) return;
+
+    DIR * dir = opendir(dir_path);
+    if(!dir) return;
+
+    struct dirent * child;
+    while((child = readdir(dir)) != NULL && !halt_warm)
+    {
+        if(child->d_name[0] == '.' || string_ends_with(child->d_name, ".MLD")) continue;
+
+        char * child_path = malloc(strlen(dir_path) + strlen(DIR_SEP_STR) + strlen(child->d_name) + 1);
+        if(!child_path) break;
+        //same form as the paths resolved by the filesystem, so the clips end up in the same catalog
+        int has_separator = string_ends_with(dir_path, "/") || string_ends_with(dir_path, "\\");
+        sprintf(child_path, "%s%s%s", dir_path, has_separator ? "" : DIR_SEP_STR, child->d_name);
+
+        if(string_ends_with(child->d_name, ".MLV") || string_ends_with(child->d_name, ".mlv"))
+        {
+            RELOCK(warm_mutex)
+            {
+                warm_queue_add(child_path);
+            }
+            UNLOCK(warm_mutex)
+        }
+        else
+        {
+            struct stat file_stat;
+            if(stat(child_path, &file_stat) == 0 && S_ISDIR(file_stat.st_mode))
+            {
+                warm_scan_dir(child_path, depth + 1);
+            }
+        }
+        free(child_path);
+    }
+    closedir(dir);
+}
+
+static void *warm_run(void *unused)
+{
+    while(!halt_warm)
+    {
+        char * path = NULL;
+
+        RELOCK(warm_mutex)
+        {
+            if(!halt_warm && warm_next < warm_total)
+            {
+                path = warm_queue[warm_next++];
+            }
+        }
+        UNLOCK(warm_mutex)
+
+        if(!path) break;
+
+        //this builds (or validates and extends) the IDX, the frame directory and the catalog entry
+        struct clip_info info;
+        scheduler_wait_idle(RENDER_BACKGROUND);
+        int indexed = catalog_get_clip_info(path, &info);
+
+        uint32_t done = 0;
+        uint32_t failed = 0;
+        uint32_t total = 0;
+        RELOCK(warm_mutex)
+        {
+            if(!indexed) warm_failed++;
+            done = ++warm_done;
+            failed = warm_failed;
+            total = warm_total;
+        }
+        UNLOCK(warm_mutex)
+
+        catalog_save_all(0);
+
+        //the progress is served by the web GUI, only the outcome goes to stderr
+        if(done == total)
+        {
+            catalog_save_all(1);
+            fprintf(stderr, "warm: %u clip(s) indexed in %d s, %u could not be indexed\n", done - failed, (int)(time(NULL) - warm_started), failed);
+        }
+    }
+    return NULL;
+}
+
+/* lists the clips, then runs the workers and waits for them */
+static void *warm_main(void *unused)
+{
+    pthread_t threads[MAX_WARM_THREADS];
+    int thread_count = 0;
+
+    warm_scan_dir(mlvfs_config->mlv_path, 0);
+
+    uint32_t total = 0;
+    RELOCK(warm_mutex)
+    {
+        total = warm_total;
+    }
+    UNLOCK(warm_mutex)
+
+    int max_threads = MIN(MIN(mlvfs_config->warm_threads, MAX_WARM_THREADS), (int)total);
+    for(int i = 0; i < max_threads && !halt_warm; i++)
+    {
+        if(pthread_create(&threads[thread_count], NULL, warm_run, NULL))
+        {
+            int err = errno;
+            err_printf("pthread_create error: %s\n", strerror(err));
+            break;
+        }
+        thread_count++;
+    }
+
+    for(int i = 0; i < thread_count; i++)
+    {
+        pthread_join(threads[i], NULL);
+    }
+    return NULL;
+}
+
+/**
+ * Starts indexing all the MLVs on mlvfs->warm_threads background threads
+ */
+void warm_start(struct mlvfs * mlvfs)
+{
+    mlvfs_config = mlvfs;
+    if(mlvfs_config->warm_threads <= 0 || !mlvfs_config->mlv_path) return;
+
+    halt_warm = 0;
+    warm_started = time(NULL);
+    warm_running = !pthread_create(&warm_thread, NULL, warm_main, NULL);
+}
+
+/**
+ * Stops the background indexing (the clips being indexed right now are finished first)
+ */
+void warm_stop(void)
+{
+    RELOCK(warm_mutex)
+    {
+        halt_warm = 1;
+    }
+    UNLOCK(warm_mutex)
+
+    if(warm_running)
+    {
+        pthread_join(warm_thread, NULL);
+        warm_running = 0;
+    }
+
+    for(uint32_t i = 0; i < warm_total; i++)
+    {
+        free(warm_queue[i]);
+    }
+    free(warm_queue);
+    warm_queue = NULL;
+    warm_total = 0;
+    warm_next = 0;
+    warm_done = 0;
+    warm_failed = 0;
+}
+
+/**
+ * Reports how far the background indexing got (the web GUI serves it at /warm_stats)
+ * @param done [out] The clips indexed so far, including the ones that could not be indexed
+ * @param total [out] The clips found so far (the list grows while the directories are scanned)
+ * @param failed [out] The clips that could not be indexed
+ */
+void warm_get_progress(uint32_t * done, uint32_t * total, uint32_t * failed)
+{
+    RELOCK(warm_mutex)
+    {
+        *done = warm_done;
+        *total = warm_total;
+        *failed = warm_failed;
+    }
+    UNLOCK(warm_mutex)
+}
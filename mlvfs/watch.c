@@ -0,0 +1,412 @@
+/*
+ * Copyright (C) 2014 David Milligan
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the
+ * Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include "raw.h"
+#include "mlv.h"
+#include "mlvfs.h"
+#include "index.h"
+#include "clip.h"
+#include "catalog.h"
+#include "cs.h"
+#include "stripes.h"
+#include "resource_manager.h"
+#include "watch.h"
+#ifdef MLVFS_LOWLEVEL
+#include "lowlevel.h"
+#endif
+
+/*
+ * Watches mlv_path for MLVs (or their chunks or IDX files) being replaced, re-copied or deleted, and throws away
+ * everything cached for the affected clip only, so a changed clip doesn't take a remount to show up
+ */
+
+#if defined(__linux__)
+
+#include <dirent.h>
+#include <poll.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/inotify.h>
+
+#define WATCH_MASK (IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | IN_DELETE | IN_CREATE)
+
+//a watched directory
+struct watch_dir
+{
+    int wd;
+    char * path;
+};
+
+static struct mlvfs * mlvfs_config = NULL;
+static struct watch_dir * watch_dirs = NULL;
+static uint32_t watch_dir_count = 0;
+static uint32_t watch_dir_allocated = 0;
+static int watch_fd = -1;
+static int watch_wakeup[2] = { -1, -1 };
+static volatile long halt_watch = 0;
+
+static pthread_t watch_thread;
+static int watch_running = 0;
+
+/**
+ * Discards everything that was cached for a MLV, it is all rebuilt from the files on the next access
+ */
+static void watch_invalidate(const char * mlv_filename)
+{
+    dbg_printf("watch: %s changed\n", mlv_filename);
+
+    //the index goes first, so anything rebuilt from here on uses the new one
+    invalidate_index(mlv_filename);
+    invalidate_bad_pixel_map(invalidate_clip(mlv_filename));
+    catalog_invalidate(mlv_filename);
+    invalidate_dng_attr(mlv_filename);
+    stripes_invalidate_correction(mlv_filename);
+    invalidate_image_buffers(mlv_filename);
+    //don't let the kernel keep the old contents of the clip's files (see --immutable)
+    invalidate_clip_cache(mlv_filename);
+#ifdef MLVFS_LOWLEVEL
+    //nor their old names and attributes, --cache-timeout can be long
+    mlvfs_lowlevel_invalidate(mlv_filename);
+#endif
+}
+
+//Make sure you free() the result!!!
+static char * watch_child_path(const char * dir_path, const char * name)
+{
+    char * path = malloc(strlen(dir_path) + strlen(DIR_SEP_STR) + strlen(name) + 1);
+    if(path)
+    {
+        //same form as the paths resolved by the filesystem, so they match the keys of the caches
+        int has_separator = string_ends_with(dir_path, "/") || string_ends_with(dir_path, "\\");
+        sprintf(path, "%s%s%s", dir_path, has_separator ? "" : DIR_SEP_STR, name);
+    }
+    return path;
+}
+
+static struct watch_dir * watch_find_dir(int wd)
+{
+    for(uint32_t i = 0; i < watch_dir_count; i++)
+    {
+        if(watch_dirs[i].wd == wd) return &watch_dirs[i];
+    }
+    return NULL;
+}
+
+static void watch_remove_dir(int wd)
+{
+    for(uint32_t i = 0; i < watch_dir_count; i++)
+    {
+        if(watch_dirs[i].wd == wd)
+        {
+            free(watch_dirs[i].path);
+            watch_dirs[i] = watch_dirs[--watch_dir_count];
+            return;
+        }
+    }
+}
+
+/**
+ * Watches a directory and its subdirectories (skipping .MLD directories)
+ * @param invalidate Nonzero to also throw away what is cached for every MLV found (when events were lost)
+ */
+static void watch_add_dir(const char * dir_path, int depth, int invalidate)
+{
+    if(depth > 16 || ATOMIC_LOAD(halt_watch)) return;
+
+    int wd = inotify_add_watch(watch_fd, dir_path, WATCH_MASK);
+    if(wd < 0)
+    {
+        int err = errno;
+        err_printf("inotify_add_watch('%s') error: %s\n", dir_path, strerror(err));
+        return;
+    }
+
+    //the same directory may be reported twice (e.g. created while it was being scanned)
+    struct watch_dir * dir = watch_find_dir(wd);
+    if(!dir)
+    {
+        if(watch_dir_count >= watch_dir_allocated)
+        {
+            uint32_t new_allocated = watch_dir_allocated ? watch_dir_allocated * 2 : 16;
+            struct watch_dir * dirs = realloc(watch_dirs, new_allocated * sizeof(struct watch_dir));
+            if(!dirs) return;
+            watch_dirs = dirs;
+            watch_dir_allocated = new_allocated;
+        }
+        dir = &watch_dirs[watch_dir_count++];
+        dir->wd = wd;
+        dir->path = NULL;
+    }
+    free(dir->path);
+    dir->path = malloc(strlen(dir_path) + 1);
+    if(dir->path) strcpy(dir->path, dir_path);
+
+    DIR * listing = opendir(dir_path);
+    if(!listing) return;
+
+    struct dirent * child;
+    while((child = readdir(listing)) != NULL && !ATOMIC_LOAD(halt_watch))
+    {
+        if(child->d_name[0] == '.' || string_ends_with(child->d_name, ".MLD")) continue;
+
+        char * child_path = watch_child_path(dir_path, child->d_name);
+        if(!child_path) break;
+        struct stat file_stat;
+        if(stat(child_path, &file_stat) == 0 && S_ISDIR(file_stat.st_mode))
+        {
+            watch_add_dir(child_path, depth + 1, invalidate);
+        }
+        else if(invalidate && (string_ends_with(child_path, ".MLV") || string_ends_with(child_path, ".mlv")))
+        {
+            watch_invalidate(child_path);
+        }
+        free(child_path);
+    }
+    closedir(listing);
+}
+
+/**
+ * Stops watching a directory that was moved away, along with its subdirectories
+ */
+static void watch_remove_tree(const char * dir_path)
+{
+    size_t length = strlen(dir_path);
+    uint32_t i = 0;
+    while(i < watch_dir_count)
+    {
+        const char * path = watch_dirs[i].path;
+        if(path && !strncmp(path, dir_path, length) && (path[length] == 0 || path[length] == DIR_SEP_STR[0]))
+        {
+            inotify_rm_watch(watch_fd, watch_dirs[i].wd);
+            watch_remove_dir(watch_dirs[i].wd);
+        }
+        else
+        {
+            i++;
+        }
+    }
+}
+
+/**
+ * Works out which MLV a changed file belongs to: the MLV itself, one of its chunks (.M00 - .M99) or its IDX
+ */
+static void watch_file_changed(const char * path, uint32_t mask)
+{
+    size_t length = strlen(path);
+    if(length < 4 || path[length - 4] != '.') return;
+
+    const char * ext = path + length - 3;
+    char * mlv_filename = malloc(length + 1);
+    if(!mlv_filename) return;
+    strcpy(mlv_filename, path);
+
+    if(!strcmp(ext, "MLV") || !strcmp(ext, "mlv"))
+    {
+        watch_invalidate(mlv_filename);
+    }
+    else if((ext[0] == 'M' || ext[0] == 'm') && ext[1] >= '0' && ext[1] <= '9' && ext[2] >= '0' && ext[2] <= '9')
+    {
+        //chunk names are made by replacing the last two characters of the MLV name
+        strcpy(&mlv_filename[length - 2], ext[0] == 'M' ? "LV" : "lv");
+        watch_invalidate(mlv_filename);
+    }
+    else if((!strcmp(ext, "IDX") || !strcmp(ext, "idx")) && !string_ends_with(path, ".tmp.IDX"))
+    {
+        //ignore the IDX files written here (they are renamed into place, so that shows up as a move)
+        strcpy(&mlv_filename[length - 3], "MLV");
+        if(!(mask & IN_MOVED_TO) || !index_file_is_own_write(mlv_filename))
+        {
+            //the IDX has the same name whatever the case of the MLV extension
+            const char * mlv_exts[] = { "MLV", "mlv" };
+            for(int i = 0; i < 2; i++)
+            {
+                strcpy(&mlv_filename[length - 3], mlv_exts[i]);
+                watch_invalidate(mlv_filename);
+            }
+        }
+    }
+
+    free(mlv_filename);
+}
+
+static void watch_handle_event(const struct inotify_event * event)
+{
+    if(event->mask & IN_IGNORED)
+    {
+        watch_remove_dir(event->wd);
+        return;
+    }
+    if(event->mask & IN_Q_OVERFLOW)
+    {
+        //no telling which clips changed, so none of them is trusted (and directories created meanwhile are watched)
+        err_printf("watch: event queue overflow, throwing away everything cached\n");
+        watch_add_dir(mlvfs_config->mlv_path, 0, 1);
+        return;
+    }
+
+    struct watch_dir * dir = watch_find_dir(event->wd);
+    if(!dir || !dir->path || !event->len || event->name[0] == '.') return;
+
+    char * path = watch_child_path(dir->path, event->name);
+    if(!path) return;
+
+    if(event->mask & IN_ISDIR)
+    {
+        if(event->mask & (IN_CREATE | IN_MOVED_TO))
+        {
+            if(!string_ends_with(event->name, ".MLD")) watch_add_dir(path, 0, 0);
+        }
+        else if(event->mask & IN_MOVED_FROM)
+        {
+            watch_remove_tree(path);
+        }
+    }
+    else if(!(event->mask & IN_CREATE))
+    {
+        //a new file only matters once it has been written (IN_CLOSE_WRITE) or moved into place
+        watch_file_changed(path, event->mask);
+    }
+
+    free(path);
+}
+
+static void *watch_run(void *unused)
+{
+    //inotify_event is variable length, this holds several of the largest kind
+    char buffer[16 * (sizeof(struct inotify_event) + 256)] __attribute__((aligned(__alignof__(struct inotify_event))));
+
+    watch_add_dir(mlvfs_config->mlv_path, 0, 0);
+
+    while(!ATOMIC_LOAD(halt_watch))
+    {
+        struct pollfd fds[2];
+        fds[0].fd = watch_fd;
+        fds[0].events = POLLIN;
+        fds[1].fd = watch_wakeup[0];
+        fds[1].events = POLLIN;
+
+        if(poll(fds, 2, -1) < 0)
+        {
+            if(errno == EINTR) continue;
+            int err = errno;
+            err_printf("poll error: %s\n", strerror(err));
+            break;
+        }
+        if(ATOMIC_LOAD(halt_watch) || (fds[1].revents & POLLIN)) break;
+        if(!(fds[0].revents & POLLIN)) continue;
+
+        ssize_t length = read(watch_fd, buffer, sizeof(buffer));
+        if(length <= 0) continue;
+
+        for(char * position = buffer; position < buffer + length; )
+        {
+            const struct inotify_event * event = (const struct inotify_event *)position;
+            watch_handle_event(event);
+            position += sizeof(struct inotify_event) + event->len;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Starts watching mlv_path (and its subdirectories) for changes to the MLVs on a background thread
+ */
+void watch_start(struct mlvfs * mlvfs)
+{
+    mlvfs_config = mlvfs;
+    if(!mlvfs_config->mlv_path) return;
+
+    watch_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if(watch_fd < 0)
+    {
+        int err = errno;
+        err_printf("inotify_init1 error: %s\n", strerror(err));
+        return;
+    }
+    if(pipe(watch_wakeup))
+    {
+        int err = errno;
+        err_printf("pipe error: %s\n", strerror(err));
+        close(watch_fd);
+        watch_fd = -1;
+        return;
+    }
+
+    halt_watch = 0;
+    watch_running = !pthread_create(&watch_thread, NULL, watch_run, NULL);
+}
+
+/**
+ * Stops watching for changes
+ */
+void watch_stop(void)
+{
+    ATOMIC_INCREMENT(halt_watch);
+    if(watch_running)
+    {
+        //wake the thread up from poll()
+        if(write(watch_wakeup[1], "", 1) < 0)
+        {
+            int err = errno;
+            err_printf("write error: %s\n", strerror(err));
+        }
+        pthread_join(watch_thread, NULL);
+        watch_running = 0;
+    }
+
+    for(int i = 0; i < 2; i++)
+    {
+        if(watch_wakeup[i] >= 0) close(watch_wakeup[i]);
+        watch_wakeup[i] = -1;
+    }
+    if(watch_fd >= 0) close(watch_fd);
+    watch_fd = -1;
+
+    for(uint32_t i = 0; i < watch_dir_count; i++)
+    {
+        free(watch_dirs[i].path);
+    }
+    free(watch_dirs);
+    watch_dirs = NULL;
+    watch_dir_count = 0;
+    watch_dir_allocated = 0;
+}
+
+#else
+
+//there is no watcher on other platforms (see the README)
+
+void watch_start(struct mlvfs * mlvfs)
+{
+}
+
+void watch_stop(void)
+{
+}
+
+#endif
@@ -22,6 +22,7 @@
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <pthread.h>
 #include "raw.h"
 #include "mlv.h"
 #include "index.h"
@@ -99,24 +100,25 @@ struct wav_header {
 
 #pragma pack(pop)
 
-int wav_get_headers(const char *path, mlv_file_hdr_t * file_hdr, mlv_wavi_hdr_t * wavi_hdr, mlv_rtci_hdr_t * rtci_hdr, mlv_idnt_hdr_t * idnt_hdr)
+//a WAV opened for reading, its chunk files and index stay open until wav_close()
+struct wav_file
 {
-    FILE **chunk_files = NULL;
-    uint32_t chunk_count = 0;
-    
-    chunk_files = load_chunks(path, &chunk_count);
-    if(!chunk_files || !chunk_count)
-    {
-        return 0;
-    }
-    
-    mlv_xref_hdr_t *block_xref = get_index(path);
-    if (!block_xref)
-    {
-        close_chunks(chunk_files, chunk_count);
-        return 0;
-    }
-    mlv_xref_t *xrefs = (mlv_xref_t *)&(((uint8_t*)block_xref)[sizeof(mlv_xref_hdr_t)]);
+    FILE **chunk_files;
+    uint32_t chunk_count;
+    struct mlv_index *index;
+    mlv_file_hdr_t file_hdr;
+    mlv_wavi_hdr_t wavi_hdr;
+    mlv_rtci_hdr_t rtci_hdr;
+    mlv_idnt_hdr_t idnt_hdr;
+    size_t size;
+    //the chunk files are seeked, so only one read at a time
+    pthread_mutex_t mutex;
+};
+
+static int wav_find_headers(FILE **chunk_files, struct mlv_index *index, mlv_file_hdr_t * file_hdr, mlv_wavi_hdr_t * wavi_hdr, mlv_rtci_hdr_t * rtci_hdr, mlv_idnt_hdr_t * idnt_hdr)
+{
+    mlv_xref_hdr_t *block_xref = index->xref;
+    mlv_xref_t *xrefs = index->xrefs;
     
     int found_file = 0;
     int found_wavi = 0;
@@ -164,10 +166,43 @@ int wav_get_headers(const char *path, mlv_file_hdr_t * file_hdr, mlv_wavi_hdr_t
         if(found_file && found_wavi && found_rtci && found_idnt) break;
     }
     
-    free(block_xref);
+    return found_wavi;
+}
+
+static size_t wav_compute_size(const char *path, mlv_file_hdr_t * mlv_file_hdr, mlv_wavi_hdr_t * mlv_wavi_hdr)
+{
+    //prevent divide by zero errors
+    if(mlv_file_hdr->sourceFpsNom == 0)
+    {
+        return 0;
+    }
+    return sizeof(struct wav_header) + (uint64_t)mlv_wavi_hdr->bytesPerSecond * (uint64_t)mlv_file_hdr->sourceFpsDenom * (uint64_t)mlv_get_frame_count(path) / (uint64_t)mlv_file_hdr->sourceFpsNom;
+}
+
+int wav_get_headers(const char *path, mlv_file_hdr_t * file_hdr, mlv_wavi_hdr_t * wavi_hdr, mlv_rtci_hdr_t * rtci_hdr, mlv_idnt_hdr_t * idnt_hdr)
+{
+    FILE **chunk_files = NULL;
+    uint32_t chunk_count = 0;
+    
+    chunk_files = load_chunks(path, &chunk_count);
+    if(!chunk_files || !chunk_count)
+    {
+        return 0;
+    }
+    
+    struct mlv_index *index = acquire_index(path);
+    if (!index)
+    {
+        close_chunks(chunk_files, chunk_count);
+        return 0;
+    }
+    
+    int result = wav_find_headers(chunk_files, index, file_hdr, wavi_hdr, rtci_hdr, idnt_hdr);
+    
+    release_index(index);
     close_chunks(chunk_files, chunk_count);
     
-    return found_wavi;
+    return result;
 }
 
 int has_audio(const char *path)
@@ -186,41 +221,69 @@ int has_audio(const char *path)
     return result;
 }
 
-size_t wav_get_data(const char *path, uint8_t * output_buffer, off_t offset, size_t max_size)
+/**
+ * Opens the WAV of a MLV for reading, the headers are found and the size is worked out only once
+ * @param path The path to the MLV file
+ * @return the open WAV (close it with wav_close), NULL if the MLV has no audio
+ */
+struct wav_file * wav_open(const char *path)
 {
-    mlv_file_hdr_t file_hdr;
-    mlv_wavi_hdr_t wavi_hdr;
-    mlv_rtci_hdr_t rcti_hdr;
-    mlv_idnt_hdr_t idnt_hdr;
-    size_t size = wav_get_size(path);
-    size_t read = 0;
-    if(wav_get_headers(path, &file_hdr, &wavi_hdr, &rcti_hdr, &idnt_hdr))
+    struct wav_file * wav = calloc(1, sizeof(struct wav_file));
+    if(!wav) return NULL;
+    
+    wav->chunk_files = load_chunks(path, &wav->chunk_count);
+    if(wav->chunk_files && wav->chunk_count)
     {
-        FILE **chunk_files = NULL;
-        uint32_t chunk_count = 0;
-        
-        chunk_files = load_chunks(path, &chunk_count);
-        if(!chunk_files || !chunk_count)
+        wav->index = acquire_index(path);
+        if(wav->index && wav_find_headers(wav->chunk_files, wav->index, &wav->file_hdr, &wav->wavi_hdr, &wav->rtci_hdr, &wav->idnt_hdr))
         {
-            return 0;
-        }
-        mlv_xref_hdr_t *block_xref = get_index(path);
-        if (!block_xref)
-        {
-            close_chunks(chunk_files, chunk_count);
-            return 0;
+            wav->size = wav_compute_size(path, &wav->file_hdr, &wav->wavi_hdr);
+            pthread_mutex_init(&wav->mutex, NULL);
+            return wav;
         }
+    }
+    
+    if(wav->index) release_index(wav->index);
+    if(wav->chunk_files) close_chunks(wav->chunk_files, wav->chunk_count);
+    free(wav);
+    return NULL;
+}
 
-        long read_offset = MAX(0, MIN(offset, size));
-        long read_size = MAX(0, MIN(max_size, size - read_offset));
-        read = wav_get_data_direct(chunk_files, block_xref, &file_hdr, &wavi_hdr, &rcti_hdr, &idnt_hdr, size, output_buffer, read_offset, read_size);
+/**
+ * Reads from a WAV opened with wav_open
+ * @return the number of bytes read
+ */
+size_t wav_read(struct wav_file * wav, uint8_t * output_buffer, off_t offset, size_t max_size)
+{
+    long read_offset = MAX(0, MIN(offset, wav->size));
+    long read_size = MAX(0, MIN(max_size, wav->size - read_offset));
+    
+    pthread_mutex_lock(&wav->mutex);
+    size_t read = wav_get_data_direct(wav->chunk_files, wav->index->xref, &wav->file_hdr, &wav->wavi_hdr, &wav->rtci_hdr, &wav->idnt_hdr, wav->size, output_buffer, read_offset, read_size);
+    pthread_mutex_unlock(&wav->mutex);
+    
+    return read;
+}
 
-        free(block_xref);
-        close_chunks(chunk_files, chunk_count);
-        
-        return read;
+void wav_close(struct wav_file * wav)
+{
+    if(!wav) return;
+    pthread_mutex_destroy(&wav->mutex);
+    release_index(wav->index);
+    close_chunks(wav->chunk_files, wav->chunk_count);
+    free(wav);
+}
+
+size_t wav_get_data(const char *path, uint8_t * output_buffer, off_t offset, size_t max_size)
+{
+    size_t read = 0;
+    struct wav_file * wav = wav_open(path);
+    if(wav)
+    {
+        read = wav_read(wav, output_buffer, offset, max_size);
+        wav_close(wav);
     }
-    return 0;
+    return read;
 }
 
 size_t wav_get_data_direct(FILE ** chunk_files, mlv_xref_hdr_t * block_xref, mlv_file_hdr_t * mlv_hdr, mlv_wavi_hdr_t * wavi_hdr, mlv_rtci_hdr_t * rtci_hdr, mlv_idnt_hdr_t * idnt_hdr, size_t file_size, uint8_t * output_buffer, off_t offset, size_t length)
@@ -247,7 +310,7 @@ size_t wav_get_data_direct(FILE ** chunk_files, mlv_xref_hdr_t * block_xref, mlv
         .subchunk2_size = (uint32_t)(file_size - sizeof(struct wav_header) + 8),
     };
     
-    char temp[33];
+    char temp[33] = { 0 };
     snprintf(temp, sizeof(temp), "%s", idnt_hdr->cameraName);
     memcpy(header.bext.originator, temp, 32);
     snprintf(temp, sizeof(temp), "JPCAN%04d%.8s%02d%02d%02d%09d", idnt_hdr->cameraModel, idnt_hdr->cameraSerial , rtci_hdr->tm_hour, rtci_hdr->tm_min, rtci_hdr->tm_sec, rand());
@@ -357,15 +420,7 @@ size_t wav_get_size(const char *path)
     {
         if(fread(&mlv_file_hdr, sizeof(mlv_file_hdr_t), 1, mlv_file) && !memcmp(mlv_file_hdr.fileMagic, "MLVI", 4) && wav_get_headers(path, &mlv_file_hdr, &mlv_wavi_hdr, &rcti_hdr, &idnt_hdr))
         {
-            //prevent divide by zero errors
-            if(mlv_file_hdr.sourceFpsNom == 0)
-            {
-                result = 0;
-            }
-            else
-            {
-                result = sizeof(struct wav_header) + (uint64_t)mlv_wavi_hdr.bytesPerSecond * (uint64_t)mlv_file_hdr.sourceFpsDenom * (uint64_t)mlv_get_frame_count(path) / (uint64_t)mlv_file_hdr.sourceFpsNom;
-            }
+            result = wav_compute_size(path, &mlv_file_hdr, &mlv_wavi_hdr);
         }
         fclose(mlv_file);
     }
@@ -33,11 +33,18 @@
 #include "dng.h"
 #include "index.h"
 #include "resource_manager.h"
+#include "catalog.h"
+#include "pathcache.h"
+#include "settings.h"
+#include "framepool.h"
+#include "warm.h"
 #include "webgui.h"
 #include "mongoose/mongoose.h"
 
 static int halt_webgui = 0;
 static struct mlvfs * mlvfs_config = NULL;
+//from reading the current settings to publishing the changed ones, so overlapping posts don't lose one of the changes
+static pthread_mutex_t set_value_mutex = PTHREAD_MUTEX_INITIALIZER;
 #define HTML_SIZE 65535
 
 static char * JQUERY = NULL;
@@ -144,38 +151,43 @@ static void webgui_generate_mlv_html(char * html, const char * path)
     char * temp = malloc(sizeof(char) * HTML_SIZE);
     sprintf(real_path, "%s%s", mlvfs_config->mlv_path, path);
     fprintf(stderr, "webgui: analyzing %s...\n", real_path);
-    int frame_count = mlv_get_frame_count(real_path);
+    struct clip_info info;
+    if(!catalog_get_clip_info(real_path, &info))
+    {
+        memset(&info, 0, sizeof(struct clip_info));
+    }
+    int frame_count = info.frame_count;
     snprintf(temp, HTML_SIZE, "<td>%d</td>", frame_count);
     strncat(html, temp, HTML_SIZE);
-    snprintf(temp, HTML_SIZE, "<td>%s</td>", has_audio(real_path) ? "yes" : "no");
+    snprintf(temp, HTML_SIZE, "<td>%s</td>", info.has_audio ? "yes" : "no");
     strncat(html, temp, HTML_SIZE);
-    struct frame_headers frame_headers;
-    if(mlv_get_frame_headers(real_path, 0, &frame_headers))
+    if(info.has_headers)
     {
-        int duration = frame_headers.file_hdr.sourceFpsNom == 0 ? 0 : frame_count * frame_headers.file_hdr.sourceFpsDenom / frame_headers.file_hdr.sourceFpsNom;
-        float frame_rate = frame_headers.file_hdr.sourceFpsDenom == 0 ? 0 : (float)frame_headers.file_hdr.sourceFpsNom / (float)frame_headers.file_hdr.sourceFpsDenom;
-        snprintf(temp, HTML_SIZE, "<td>%d x %d</td>", frame_headers.rawi_hdr.xRes, frame_headers.rawi_hdr.yRes);
+        int duration = info.fps_nom == 0 ? 0 : frame_count * info.fps_denom / info.fps_nom;
+        float frame_rate = info.fps_denom == 0 ? 0 : (float)info.fps_nom / (float)info.fps_denom;
+        snprintf(temp, HTML_SIZE, "<td>%d x %d</td>", info.xres, info.yres);
         strncat(html, temp, HTML_SIZE);
         snprintf(temp, HTML_SIZE, "<td>%.3f</td>", frame_rate);
         strncat(html, temp, HTML_SIZE);
         snprintf(temp, HTML_SIZE, "<td>%02d:%02d</td>", duration / 60, duration % 60);
         strncat(html, temp, HTML_SIZE);
-        snprintf(temp, HTML_SIZE, "<td>%s</td>", frame_headers.idnt_hdr.cameraName);
+        snprintf(temp, HTML_SIZE, "<td>%s</td>", info.camera_name);
         strncat(html, temp, HTML_SIZE);
-        snprintf(temp, HTML_SIZE, "<td>%s</td>", frame_headers.idnt_hdr.cameraSerial);
+        snprintf(temp, HTML_SIZE, "<td>%s</td>", info.camera_serial);
         strncat(html, temp, HTML_SIZE);
-        snprintf(temp, HTML_SIZE, "<td>%s</td>", frame_headers.lens_hdr.lensName);
+        snprintf(temp, HTML_SIZE, "<td>%s</td>", info.lens_name);
         strncat(html, temp, HTML_SIZE);
-        snprintf(temp, HTML_SIZE, "<td>%d-%d-%d %02d:%02d:%02d</td>", 1900 + frame_headers.rtci_hdr.tm_year, frame_headers.rtci_hdr.tm_mon + 1, frame_headers.rtci_hdr.tm_mday, frame_headers.rtci_hdr.tm_hour, frame_headers.rtci_hdr.tm_min, frame_headers.rtci_hdr.tm_sec);
+        snprintf(temp, HTML_SIZE, "<td>%d-%d-%d %02d:%02d:%02d</td>", 1900 + info.rtc_year, info.rtc_mon + 1, info.rtc_mday, info.rtc_hour, info.rtc_min, info.rtc_sec);
         strncat(html, temp, HTML_SIZE);
-        snprintf(temp, HTML_SIZE, "<td>%dms</td>", (int)frame_headers.expo_hdr.shutterValue/1000);
+        snprintf(temp, HTML_SIZE, "<td>%dms</td>", (int)info.shutter/1000);
         strncat(html, temp, HTML_SIZE);
-        snprintf(temp, HTML_SIZE, "<td>%d</td>", frame_headers.expo_hdr.isoValue);
+        snprintf(temp, HTML_SIZE, "<td>%d</td>", info.iso);
         strncat(html, temp, HTML_SIZE);
-        snprintf(temp, HTML_SIZE, "<td>f/%.1f</td>", frame_headers.lens_hdr.aperture / 100.0);
+        snprintf(temp, HTML_SIZE, "<td>f/%.1f</td>", info.aperture / 100.0);
         strncat(html, temp, HTML_SIZE);
     }
     free(temp);
+    catalog_save_all(0);
 }
 
 static char * webgui_generate_row_html(const char * path)
@@ -280,60 +292,115 @@ static int webgui_handler(struct mg_connection *conn, enum mg_event ev)
     {
         if (strcmp(conn->uri, "/get_value") == 0)
         {
+            const struct mlvfs_settings * settings = settings_get();
 			mg_send_header(conn, "Content-Type", "application/json");
             mg_printf_data(conn,
                            "{\"fps\": \"%f\", \"deflicker\": \"%d\", \"name_scheme\": %d, \"badpix\": %d, \"chroma_smooth\": %d, \"stripes\": %d, \"fix_pattern_noise\": %d, \"dual_iso\": %d, \"hdr_interpolation_method\": %d, \"hdr_no_alias_map\": %d, \"hdr_no_fullres\": %d}",
-                           mlvfs_config->fps,
-                           mlvfs_config->deflicker,
-                           mlvfs_config->name_scheme,
-                           mlvfs_config->fix_bad_pixels,
-                           mlvfs_config->chroma_smooth,
-                           mlvfs_config->fix_stripes,
-                           mlvfs_config->fix_pattern_noise,
-                           mlvfs_config->dual_iso,
-                           mlvfs_config->hdr_interpolation_method,
-                           mlvfs_config->hdr_no_alias_map,
-                           mlvfs_config->hdr_no_fullres);
+                           settings->fps,
+                           settings->deflicker,
+                           settings->name_scheme,
+                           settings->fix_bad_pixels,
+                           settings->chroma_smooth,
+                           settings->fix_stripes,
+                           settings->fix_pattern_noise,
+                           settings->dual_iso,
+                           settings->hdr_interpolation_method,
+                           settings->hdr_no_alias_map,
+                           settings->hdr_no_fullres);
+            settings_release(settings);
         }
         else if (strcmp(conn->uri, "/set_value") == 0)
         {
             // This Ajax endpoint sets the new value for the device variable
+            // the settings in use are never changed, a modified copy replaces them instead (see settings.h)
+            pthread_mutex_lock(&set_value_mutex);
+            const struct mlvfs_settings * current_settings = settings_get();
+            struct mlvfs_settings settings = *current_settings;
             char buf[100] = "";
             mg_get_var(conn, "fps", buf, sizeof(buf));
-            if(strlen(buf) > 0) mlvfs_config->fps = atof(buf);
+            if(strlen(buf) > 0) settings.fps = atof(buf);
             
             mg_get_var(conn, "deflicker", buf, sizeof(buf));
-            if(strlen(buf) > 0) mlvfs_config->deflicker = atof(buf);
+            if(strlen(buf) > 0) settings.deflicker = atof(buf);
             
             mg_get_var(conn, "name_scheme", buf, sizeof(buf));
-            if(strlen(buf) > 0) mlvfs_config->name_scheme = atoi(buf);
+            if(strlen(buf) > 0) settings.name_scheme = atoi(buf);
             
             mg_get_var(conn, "badpix", buf, sizeof(buf));
-            if(strlen(buf) > 0) mlvfs_config->fix_bad_pixels = atoi(buf);
+            if(strlen(buf) > 0) settings.fix_bad_pixels = atoi(buf);
             
             mg_get_var(conn, "chroma_smooth", buf, sizeof(buf));
-            if(strlen(buf) > 0) mlvfs_config->chroma_smooth = atoi(buf);
+            if(strlen(buf) > 0) settings.chroma_smooth = atoi(buf);
             
             mg_get_var(conn, "stripes", buf, sizeof(buf));
-            if(strlen(buf) > 0) mlvfs_config->fix_stripes = atoi(buf);
+            if(strlen(buf) > 0) settings.fix_stripes = atoi(buf);
             
             mg_get_var(conn, "fix_pattern_noise", buf, sizeof(buf));
-            if(strlen(buf) > 0) mlvfs_config->fix_pattern_noise = atoi(buf);
+            if(strlen(buf) > 0) settings.fix_pattern_noise = atoi(buf);
             
             mg_get_var(conn, "dual_iso", buf, sizeof(buf));
-            if(strlen(buf) > 0) mlvfs_config->dual_iso = atoi(buf);
+            if(strlen(buf) > 0) settings.dual_iso = atoi(buf);
             
             mg_get_var(conn, "hdr_interpolation_method", buf, sizeof(buf));
-            if(strlen(buf) > 0) mlvfs_config->hdr_interpolation_method = atoi(buf);
+            if(strlen(buf) > 0) settings.hdr_interpolation_method = atoi(buf);
             
             mg_get_var(conn, "hdr_no_alias_map", buf, sizeof(buf));
-            if(strlen(buf) > 0) mlvfs_config->hdr_no_alias_map = atoi(buf);
+            if(strlen(buf) > 0) settings.hdr_no_alias_map = atoi(buf);
             
             mg_get_var(conn, "hdr_no_fullres", buf, sizeof(buf));
-            if(strlen(buf) > 0) mlvfs_config->hdr_no_fullres = atoi(buf);
+            if(strlen(buf) > 0) settings.hdr_no_fullres = atoi(buf);
+            
+            //the page posts every value on any click, most of the time nothing changed
+            int name_scheme_changed = settings.name_scheme != current_settings->name_scheme;
+            if(name_scheme_changed || !settings_same_render(&settings, current_settings))
+            {
+                //only what was rendered with the old settings is rendered again, nothing is if just the names changed
+                settings_publish(&settings);
+                //the virtual paths mean something else now (cleared after publishing, so they are resolved again with the new scheme)
+                if(name_scheme_changed) path_cache_clear();
+            }
+            settings_release(current_settings);
+            pthread_mutex_unlock(&set_value_mutex);
             
             mg_printf_data(conn, "%s", "{\"success\": true}");
         }
+        else if (strcmp(conn->uri, "/cache_stats") == 0)
+        {
+            struct image_buffer_stats stats;
+            image_buffer_get_stats(&stats);
+            mg_send_header(conn, "Content-Type", "application/json");
+            mg_printf_data(conn, "{\"budget\": %llu, \"bytes\": %llu, \"count\": %d, \"hits\": %llu, \"misses\": %llu, \"evictions\": %llu}",
+                           (unsigned long long)stats.budget, (unsigned long long)stats.bytes, stats.count,
+                           (unsigned long long)stats.hits, (unsigned long long)stats.misses, (unsigned long long)stats.evictions);
+        }
+        else if (strcmp(conn->uri, "/pool_stats") == 0)
+        {
+            struct framepool_stats stats;
+            framepool_get_stats(&stats);
+            mg_send_header(conn, "Content-Type", "application/json");
+            mg_printf_data(conn, "{\"limit\": %llu, \"idle_bytes\": %llu, \"used_bytes\": %llu, \"peak_bytes\": %llu, \"hits\": %llu, \"misses\": %llu, \"peak_rss\": %llu}",
+                           (unsigned long long)stats.limit, (unsigned long long)stats.idle_bytes, (unsigned long long)stats.used_bytes,
+                           (unsigned long long)stats.peak_bytes, (unsigned long long)stats.hits, (unsigned long long)stats.misses,
+                           (unsigned long long)stats.peak_rss);
+        }
+        else if (strcmp(conn->uri, "/warm_stats") == 0)
+        {
+            uint32_t done = 0, total = 0, failed = 0;
+            warm_get_progress(&done, &total, &failed);
+            mg_send_header(conn, "Content-Type", "application/json");
+            mg_printf_data(conn, "{\"done\": %u, \"total\": %u, \"failed\": %u}", done, total, failed);
+        }
+        else if (strcmp(conn->uri, "/index_stats") == 0)
+        {
+            struct index_stats stats;
+            index_get_stats(&stats);
+            mg_send_header(conn, "Content-Type", "application/json");
+            mg_printf_data(conn, "{\"scans\": %llu, \"blocks\": %llu, \"headers_read\": %llu, \"scan_seconds\": %.3f, \"sort_seconds\": %.3f, \"appends\": %llu, \"appended_blocks\": %llu, "
+                           "\"last_blocks\": %u, \"last_files\": %u, \"last_scan_seconds\": %.3f, \"last_sort_seconds\": %.3f}",
+                           (unsigned long long)stats.scans, (unsigned long long)stats.blocks, (unsigned long long)stats.headers_read,
+                           stats.scan_seconds, stats.sort_seconds, (unsigned long long)stats.appends, (unsigned long long)stats.appended_blocks,
+                           stats.last_blocks, stats.last_files, stats.last_scan_seconds, stats.last_sort_seconds);
+        }
         else if (strcmp(conn->uri, "/jquery-1.12.0.min.js") == 0)
         {
             if (load_resource(&JQUERY, "jquery-1.12.0.min.js"))
@@ -362,7 +429,7 @@ static int webgui_handler(struct mg_connection *conn, enum mg_event ev)
         else if(string_ends_with(conn->uri, "_PREVIEW.gif"))
         {
             int was_created;
-            struct image_buffer * image_buffer = get_or_create_image_buffer(conn->uri, &create_preview, &was_created);
+            struct image_buffer * image_buffer = get_or_create_image_buffer(conn->uri, NULL, &create_preview, RENDER_BACKGROUND, &was_created);
             mg_send_header(conn, "Content-Type", "image/gif");
             mg_send_data(conn, image_buffer->data, (int)image_buffer->size);
             release_image_buffer(image_buffer);
@@ -173,6 +173,7 @@ struct Volume: PfmFormatterOps
 
     wchar_t *mlvBaseFileName;
     wchar_t *mappedDirectory;
+    struct mlv_index *mlvIndex;
     mlv_xref_hdr_t *index;
     uint32_t videoFrameCount, audioFrameCount;
     FILE **chunks;
@@ -1422,6 +1423,7 @@ Volume::Volume(void)
 
     mlvBaseFileName = NULL;
     mappedDirectory = NULL;
+    mlvIndex = NULL;
     index = NULL;
     videoFrameCount = 0;
     audioFrameCount = 0;
@@ -1456,7 +1458,7 @@ Volume::~Volume(void)
     if(mlvBaseFileName) free(mlvBaseFileName);
     if(mappedDirectory) free(mappedDirectory);
     if(chunks) close_chunks(chunks, chunkCount);
-    if(index) free(index);
+    release_index(mlvIndex);
     if(frameHeaders) free(frameHeaders);
 }
 
@@ -1493,8 +1495,9 @@ int/*systemError*/ Volume::Init(const wchar_t* mlvFileName)
         size_t count;
         wcstombs_s(&count, mlvFileName_mbs, 1024, mlvFileName, _TRUNCATE);
 
-        // Retrieve the index (does not generate IDX file)
-        index = get_new_index(mlvFileName_mbs);
+        // Retrieve the index (generates the IDX file if necessary)
+        mlvIndex = acquire_index(mlvFileName_mbs);
+        index = mlvIndex ? mlvIndex->xref : NULL;
 
         // Count the number of VIDF frames    
         mlv_xref_t *xrefs = (mlv_xref_t *)&(((uint8_t*)index)[sizeof(mlv_xref_hdr_t)]);